@@ -0,0 +1,485 @@
+//
+//  BatchedFileReader.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Reads the headers of many files at once, keeping a large number of reads in flight from a couple of threads.
+
+ Scanning metadata one file per thread with small blocking reads leaves fast storage (NVMe, network volumes) mostly
+ idle, because each thread waits for one read at a time. Instead, this reader queues up header reads for all files,
+ keeps up to `queueDepth` of them outstanding, and as each completes, asks a planner which further ranges the file
+ needs (typically IFDs the header points to), queuing those as follow-up reads.
+
+ Each file's reads are collected into a `RangeReadableByteSource`, which can then be handed to an `ImageLoader` so
+ that metadata parsing is served from memory. Ranges of one round closer to each other than `gapThreshold` are read
+ together (see `ReadPlan`), as are any ranges later prefetched from the source, with one `preadv` each.
+
+ */
+public final class BatchedFileReader {
+    public enum Backend {
+        /** Asynchronous reads using `DispatchIO` random access channels. */
+        case dispatchIO
+        /** Blocking `pread` calls from a pool of `threadCount` threads. */
+        case pread(threadCount: Int)
+    }
+
+    /**
+     Given a source with the bytes read so far resident, return further ranges to read from it.
+     Returning an empty array completes the file.
+     */
+    public typealias ReadPlanner = (_ source: RangeReadableByteSource) throws -> [Range<Int>]
+
+    public typealias CompletionHandler = (_ url: URL, _ result: Result<RangeReadableByteSource, Swift.Error>) -> Void
+
+    public let backend: Backend
+    public let queueDepth: Int
+    public let headerLength: Int
+    public let blockSize: Int
+    public let gapThreshold: Int
+
+    /** Hint applied to each file's header when it is opened, e.g. `.dontNeed` for cold archive scans. */
+    public let accessHint: ReadAccessHint
+
+    /** Upper bound on planning rounds per file, as protection against malformed files with cyclic structure. */
+    public var maximumRoundCount = 8
+
+    public init(backend: Backend = .dispatchIO, queueDepth: Int = 128, headerLength: Int = 64 * 1024, blockSize: Int = 64 * 1024,
+                gapThreshold: Int = 128 * 1024, accessHint: ReadAccessHint = .normal) {
+        self.backend = backend
+        self.accessHint = accessHint
+        self.queueDepth = max(1, queueDepth)
+        self.headerLength = headerLength
+        self.blockSize = blockSize
+        self.gapThreshold = gapThreshold
+    }
+
+    /** A planner following the IFD chain, SubIFDs and EXIF IFD of TIFF based files. */
+    public static let tiffPlanner: ReadPlanner = { source in
+        // Files that are not TIFF based (JPEG, PNG…) have their metadata in the header, and are done after one read
+        let structure = try? TIFFStructure(fetch: { source.cachedBytes(in: $0) })
+        return structure?.unresolvedRanges ?? []
+    }
+
+    /** A planner reading only the header. */
+    public static let headerOnlyPlanner: ReadPlanner = { _ in
+        return []
+    }
+
+    /**
+     Read the given files, calling `completion` for each file (on an arbitrary queue) as soon as its reads are done,
+     then `finished` once all files are done.
+     */
+    public func read(_ urls: [URL], planner: @escaping ReadPlanner = BatchedFileReader.tiffPlanner, completion: @escaping CompletionHandler, finished: @escaping () -> Void) {
+        let batch = Batch(reader: self, planner: planner, completion: completion, finished: finished)
+        batch.start(urls)
+    }
+
+    /** Synchronous variant of `read(_:planner:completion:finished:)`, returning results in input order. */
+    public func readAndWait(_ urls: [URL], planner: @escaping ReadPlanner = BatchedFileReader.tiffPlanner) -> [Result<RangeReadableByteSource, Swift.Error>] {
+        var results = [URL: Result<RangeReadableByteSource, Swift.Error>]()
+        let lock = DispatchQueue(label: "com.sashimiapp.BatchedFileReader.results")
+        let done = DispatchSemaphore(value: 0)
+
+        read(urls, planner: planner, completion: { url, result in
+            lock.sync { results[url] = result }
+        }, finished: {
+            done.signal()
+        })
+        done.wait()
+
+        return urls.map { results[$0] ?? .failure(ImageByteSourceError.failedToRead(url: $0, range: 0 ..< 0, message: "No result")) }
+    }
+
+    // MARK: - Batch state
+
+    private final class FileState {
+        let url: URL
+        let fd: Int32
+        let source: RangeReadableByteSource
+        let channel: DispatchIO?
+        var outstandingReads = 0
+        var round = 0
+        var error: Swift.Error?
+
+        init(url: URL, fd: Int32, count: Int, blockSize: Int, gapThreshold: Int, channel: DispatchIO?) {
+            self.url = url
+            self.fd = fd
+            self.channel = channel
+            // Reads made after the batch (say, prefetching a preview) share one descriptor, kept for the source's lifetime
+            let descriptor = LazyFileDescriptor(url: url)
+            self.source = RangeReadableByteSource(url: url, count: count, blockSize: blockSize, maximumCachedBlockCount: Int.max,
+                                                  readRange: BatchedFileReader.preadReader(for: descriptor),
+                                                  readRanges: BatchedFileReader.preadvReader(for: descriptor, gapThreshold: gapThreshold))
+        }
+    }
+
+    private struct ReadTask {
+        let file: FileState
+        let range: Range<Int>
+    }
+
+    private final class Batch {
+        let reader: BatchedFileReader
+        let planner: ReadPlanner
+        let completion: CompletionHandler
+        let finished: () -> Void
+
+        private let stateQueue = DispatchQueue(label: "com.sashimiapp.BatchedFileReader.state")
+        private let ioQueue = DispatchQueue(label: "com.sashimiapp.BatchedFileReader.io")
+        private let preadQueue: OperationQueue?
+
+        private var pendingURLs = [URL]()
+        private var pendingTasks = [ReadTask]()
+        private var inFlight = 0
+        private var openFiles = 0
+
+        init(reader: BatchedFileReader, planner: @escaping ReadPlanner, completion: @escaping CompletionHandler, finished: @escaping () -> Void) {
+            self.reader = reader
+            self.planner = planner
+            self.completion = completion
+            self.finished = finished
+
+            if case .pread(let threadCount) = reader.backend {
+                let queue = OperationQueue()
+                queue.name = "com.sashimiapp.BatchedFileReader.pread"
+                queue.maxConcurrentOperationCount = max(1, threadCount)
+                preadQueue = queue
+            } else {
+                preadQueue = nil
+            }
+        }
+
+        func start(_ urls: [URL]) {
+            stateQueue.async {
+                self.pendingURLs = urls.reversed()
+                self.pump()
+            }
+        }
+
+        // All of the below are called on `stateQueue`.
+
+        private func pump() {
+            // Prefer follow-up reads for files already open, so that files complete (and close) in a steady stream
+            while inFlight < reader.queueDepth {
+                if !pendingTasks.isEmpty {
+                    issue(pendingTasks.removeFirst())
+                } else if let url = pendingURLs.popLast() {
+                    open(url)
+                } else {
+                    break
+                }
+            }
+
+            if inFlight == 0 && openFiles == 0 && pendingURLs.isEmpty && pendingTasks.isEmpty {
+                finished()
+            }
+        }
+
+        private func open(_ url: URL) {
+            let fd = Darwin.open(url.path, O_RDONLY)
+            guard fd >= 0 else {
+                completion(url, .failure(ImageByteSourceError.failedToOpen(url: url, errno: errno)))
+                return
+            }
+            var fileStat = stat()
+            guard fstat(fd, &fileStat) == 0 else {
+                let error = errno
+                close(fd)
+                completion(url, .failure(ImageByteSourceError.failedToOpen(url: url, errno: error)))
+                return
+            }
+
+            reader.accessHint.apply(to: fd, range: 0 ..< min(Int(fileStat.st_size), reader.headerLength))
+
+            let channel: DispatchIO?
+            if case .dispatchIO = reader.backend {
+                // With a channel, the descriptor may only be closed once the channel is done with it
+                channel = DispatchIO(type: .random, fileDescriptor: fd, queue: ioQueue, cleanupHandler: { _ in
+                    close(fd)
+                })
+            } else {
+                channel = nil
+            }
+
+            let file = FileState(url: url, fd: fd, count: Int(fileStat.st_size), blockSize: reader.blockSize, gapThreshold: reader.gapThreshold, channel: channel)
+            openFiles += 1
+
+            let header = file.source.blockAligned(0 ..< reader.headerLength)
+            guard !header.isEmpty else {
+                finish(file)
+                return
+            }
+            file.outstandingReads += 1
+            issue(ReadTask(file: file, range: header))
+        }
+
+        private func issue(_ task: ReadTask) {
+            inFlight += 1
+
+            let handle: (Data?, Int32) -> Void = { data, error in
+                self.stateQueue.async {
+                    self.inFlight -= 1
+                    self.complete(task, data: data, errorCode: error)
+                    self.pump()
+                }
+            }
+
+            if let channel = task.file.channel {
+                var accumulated = DispatchData.empty
+                channel.read(offset: off_t(task.range.lowerBound), length: task.range.count, queue: ioQueue) { done, data, error in
+                    if let data = data {
+                        accumulated.append(data)
+                    }
+                    if done || error != 0 {
+                        handle(error == 0 ? Data(accumulated) : nil, error)
+                    }
+                }
+            } else {
+                preadQueue?.addOperation {
+                    let result = BatchedFileReader.pread(task.file.fd, range: task.range)
+                    handle(result.data, result.errorCode)
+                }
+            }
+        }
+
+        private func complete(_ task: ReadTask, data: Data?, errorCode: Int32) {
+            let file = task.file
+            file.outstandingReads -= 1
+
+            if let data = data, data.count == task.range.count {
+                file.source.prime(data, at: task.range.lowerBound)
+            } else if file.error == nil {
+                file.error = ImageByteSourceError.failedToRead(url: file.url, range: task.range, message: errorCode != 0 ? String(cString: strerror(errorCode)) : "Short read")
+            }
+
+            guard file.outstandingReads == 0 else {
+                return
+            }
+
+            // Plan the next round once everything from the previous one has arrived
+            if file.error == nil && file.round < reader.maximumRoundCount {
+                file.round += 1
+                do {
+                    let ranges = try planner(file.source).map { file.source.blockAligned($0) }.filter { !$0.isEmpty && file.source.cachedBytes(in: $0) == nil }
+                    // Each read spans ranges close to each other, gaps included; its blocks are all primed
+                    for read in ReadPlan(ranges, gapThreshold: reader.gapThreshold).reads {
+                        file.outstandingReads += 1
+                        pendingTasks.append(ReadTask(file: file, range: read.span))
+                    }
+                } catch {
+                    file.error = error
+                }
+            }
+
+            if file.outstandingReads == 0 {
+                finish(file)
+            }
+        }
+
+        private func finish(_ file: FileState) {
+            openFiles -= 1
+            reader.accessHint.applyAfterReading(to: file.fd, range: 0 ..< file.source.count)
+            if let channel = file.channel {
+                channel.close(flags: [])
+            } else {
+                close(file.fd)
+            }
+
+            if let error = file.error {
+                completion(file.url, .failure(error))
+            } else {
+                completion(file.url, .success(file.source))
+            }
+        }
+    }
+
+    // MARK: - Reading
+
+    static func pread(_ fd: Int32, range: Range<Int>) -> (data: Data?, errorCode: Int32) {
+        var data = Data(count: range.count)
+        let result = data.withUnsafeMutableBytes { buffer in
+            BatchedFileReader.pread(fd, into: buffer, at: range.lowerBound)
+        }
+        guard result.errorCode == 0 else {
+            return (nil, result.errorCode)
+        }
+        return (data.prefix(result.count), 0)
+    }
+
+    /** Fill `buffer` from `offset` of the file open as `fd`. Returns how many bytes were read, fewer at the end of the file. */
+    static func pread(_ fd: Int32, into buffer: UnsafeMutableRawBufferPointer, at offset: Int) -> (count: Int, errorCode: Int32) {
+        var total = 0
+        while total < buffer.count {
+            let n = Darwin.pread(fd, buffer.baseAddress! + total, buffer.count - total, off_t(offset + total))
+            if n < 0 {
+                if errno == EINTR {
+                    continue
+                }
+                return (total, errno)
+            }
+            if n == 0 {
+                break
+            }
+            total += n
+        }
+        return (total, 0)
+    }
+
+    /** A reader for ranges of a file open as `fd`, which must stay open for as long as the reader is used. */
+    static func preadReader(for fd: Int32, url: URL) -> RangeReadableByteSource.RangeReader {
+        return { range in
+            let result = BatchedFileReader.pread(fd, range: range)
+            guard let data = result.data else {
+                throw ImageByteSourceError.failedToRead(url: url, range: range, message: String(cString: strerror(result.errorCode)))
+            }
+            return data
+        }
+    }
+
+    /**
+     A descriptor for the file at `url`, opened when first needed and then kept open until the descriptor is
+     released, so that the readers of a source do not open the file again for every read.
+     */
+    final class LazyFileDescriptor {
+        let url: URL
+        private var fd: Int32 = -1
+        private let lock = NSLock()
+
+        init(url: URL) {
+            self.url = url
+        }
+
+        deinit {
+            if fd >= 0 {
+                close(fd)
+            }
+        }
+
+        func descriptor() throws -> Int32 {
+            lock.lock()
+            defer {
+                lock.unlock()
+            }
+            if fd < 0 {
+                fd = Darwin.open(url.path, O_RDONLY)
+                guard fd >= 0 else {
+                    throw ImageByteSourceError.failedToOpen(url: url, errno: errno)
+                }
+            }
+            return fd
+        }
+    }
+
+    /** A reader for ranges not read during the batch, opening the file on demand. */
+    static func preadReader(for url: URL) -> RangeReadableByteSource.RangeReader {
+        return preadReader(for: LazyFileDescriptor(url: url))
+    }
+
+    static func preadReader(for descriptor: LazyFileDescriptor) -> RangeReadableByteSource.RangeReader {
+        return { range in
+            let fd = try descriptor.descriptor()
+            let result = BatchedFileReader.pread(fd, range: range)
+            guard let data = result.data else {
+                throw ImageByteSourceError.failedToRead(url: descriptor.url, range: range, message: String(cString: strerror(result.errorCode)))
+            }
+            return data
+        }
+    }
+
+    /**
+     A reader for several ranges at once, opening the file on demand. Ranges within `gapThreshold` of each other are
+     read with one `preadv`, which scatters the wanted bytes into the result and the gaps into a scratch buffer.
+     */
+    static func preadvReader(for url: URL, gapThreshold: Int) -> RangeReadableByteSource.VectoredRangeReader {
+        return preadvReader(for: LazyFileDescriptor(url: url), gapThreshold: gapThreshold)
+    }
+
+    static func preadvReader(for descriptor: LazyFileDescriptor, gapThreshold: Int) -> RangeReadableByteSource.VectoredRangeReader {
+        return { ranges in
+            let fd = try descriptor.descriptor()
+            let url = descriptor.url
+
+            let plan = ReadPlan(ranges, gapThreshold: gapThreshold)
+            let spanData = try plan.reads.map { read -> Data in
+                let result = BatchedFileReader.preadv(fd, read)
+                guard let data = result.data, data.count == read.span.count else {
+                    throw ImageByteSourceError.failedToRead(url: url, range: read.span, message: result.errorCode != 0 ? String(cString: strerror(result.errorCode)) : "Short read")
+                }
+                return data
+            }
+            guard let data = plan.slice(spanData, into: ranges) else {
+                throw ImageByteSourceError.failedToRead(url: url, range: ranges.first ?? 0 ..< 0, message: "Ranges do not match the read plan")
+            }
+            return data
+        }
+    }
+
+    /** Read the span of `read`, with the bytes of its gaps left unset. */
+    static func preadv(_ fd: Int32, _ read: ReadPlan.Read) -> (data: Data?, errorCode: Int32) {
+        guard #available(macOS 11.0, iOS 14.0, *) else {
+            return pread(fd, range: read.span)
+        }
+
+        let gaps = read.gaps
+        let segments = (read.ranges.map { (range: $0, isWanted: true) } + gaps.map { (range: $0, isWanted: false) })
+            .sorted { $0.range.lowerBound < $1.range.lowerBound }
+        var data = Data(count: read.span.count)
+        var scratch = [UInt8](repeating: 0, count: max(1, gaps.map { $0.count }.max() ?? 0))
+        var total = 0
+
+        let errorCode = data.withUnsafeMutableBytes { (spanBuffer: UnsafeMutableRawBufferPointer) -> Int32 in
+            scratch.withUnsafeMutableBytes { (scratchBuffer: UnsafeMutableRawBufferPointer) -> Int32 in
+                var segmentIndex = 0
+                var segmentOffset = 0
+
+                while segmentIndex < segments.count {
+                    var vectors = [iovec]()
+                    for (i, segment) in segments[segmentIndex...].prefix(Int(IOV_MAX)).enumerated() {
+                        let skipped = i == 0 ? segmentOffset : 0
+                        let base = segment.isWanted ? spanBuffer.baseAddress! + (segment.range.lowerBound - read.span.lowerBound) + skipped : scratchBuffer.baseAddress!
+                        vectors.append(iovec(iov_base: base, iov_len: segment.range.count - skipped))
+                    }
+
+                    let n = Darwin.preadv(fd, vectors, Int32(vectors.count), off_t(read.span.lowerBound + total))
+                    if n < 0 {
+                        if errno == EINTR {
+                            continue
+                        }
+                        return errno
+                    }
+                    if n == 0 {
+                        break
+                    }
+                    total += n
+
+                    // Advance past the segments filled, which a short read may leave partially so
+                    var remaining = n
+                    while remaining > 0 {
+                        let left = segments[segmentIndex].range.count - segmentOffset
+                        if remaining >= left {
+                            remaining -= left
+                            segmentIndex += 1
+                            segmentOffset = 0
+                        } else {
+                            segmentOffset += remaining
+                            remaining = 0
+                        }
+                    }
+                }
+                return 0
+            }
+        }
+
+        guard errorCode == 0 else {
+            return (nil, errorCode)
+        }
+        return (data.prefix(total), 0)
+    }
+}
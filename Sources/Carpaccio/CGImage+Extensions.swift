@@ -120,12 +120,7 @@ public extension CGImage {
         colorSpace: CGColorSpace? = nil
     ) throws -> CGImage {
 
-        let options = [kCGImageSourceShouldCache as String: false as NSNumber] as CFDictionary
-
-        guard let source: CGImageSource = CGImageSourceCreateWithURL(url as CFURL, options) else {
-            throw CGImageExtensionError.failedToOpenCGImage(url: url)
-        }
-
+        let source = try ImageByteSourcePool.shared.byteSource(for: url).imageSource()
         let metadata = try ImageMetadata.loadImageMetadataIfNeeded(from: source, having: inputMetadata)
         let cgImage = try loadCGImage(from: source, metadata: metadata, constrainingToSize: constrainedSize, thumbnailScheme: thumbnailScheme, colorSpace: colorSpace)
         return cgImage
@@ -157,6 +152,70 @@ public extension CGImage {
         return pngData
     }
 
+    /**
+     The image turned and mirrored for display, given the orientation of its pixel data. Returns `self` for `.up`, and
+     `nil` if a bitmap context could not be created.
+     */
+    func oriented(_ orientation: ImageOrientation) -> CGImage? {
+        guard orientation != .up else {
+            return self
+        }
+
+        let width = CGFloat(self.width), height = CGFloat(self.height)
+        let displayedSize = orientation.dimensionsSwapped ? CGSize(width: height, height: width) : CGSize(width: width, height: height)
+        let colorSpace = self.colorSpace.flatMap { $0.model == .rgb ? $0 : nil } ?? CGColorSpaceCreateDeviceRGB()
+
+        guard let context = CGContext(data: nil, width: Int(displayedSize.width), height: Int(displayedSize.height),
+                                      bitsPerComponent: 8, bytesPerRow: 0, space: colorSpace,
+                                      bitmapInfo: CGImageAlphaInfo.premultipliedLast.rawValue) else {
+            return nil
+        }
+
+        var transform = CGAffineTransform.identity
+        switch orientation {
+        case .down, .downMirrored:
+            transform = transform.translatedBy(x: displayedSize.width, y: displayedSize.height).rotated(by: .pi)
+        case .left, .leftMirrored:
+            transform = transform.translatedBy(x: displayedSize.width, y: 0).rotated(by: .pi / 2)
+        case .right, .rightMirrored:
+            transform = transform.translatedBy(x: 0, y: displayedSize.height).rotated(by: -.pi / 2)
+        case .up, .upMirrored:
+            break
+        }
+        switch orientation {
+        case .upMirrored, .downMirrored:
+            transform = transform.translatedBy(x: displayedSize.width, y: 0).scaledBy(x: -1, y: 1)
+        case .leftMirrored, .rightMirrored:
+            transform = transform.translatedBy(x: displayedSize.height, y: 0).scaledBy(x: -1, y: 1)
+        case .up, .down, .left, .right:
+            break
+        }
+
+        context.concatenate(transform)
+        context.draw(self, in: CGRect(x: 0, y: 0, width: width, height: height))
+        return context.makeImage()
+    }
+
+    /** The image scaled down to fit `maximumPixelDimension` on its longer side. Returns `self` if it already fits. */
+    func scaled(toMaximumPixelDimension maximumPixelDimension: Int) -> CGImage? {
+        let longerSide = max(width, height)
+        guard longerSide > maximumPixelDimension, maximumPixelDimension > 0 else {
+            return self
+        }
+        let scale = CGFloat(maximumPixelDimension) / CGFloat(longerSide)
+        let scaledWidth = max(1, Int((CGFloat(width) * scale).rounded())), scaledHeight = max(1, Int((CGFloat(height) * scale).rounded()))
+        let colorSpace = self.colorSpace.flatMap { $0.model == .rgb ? $0 : nil } ?? CGColorSpaceCreateDeviceRGB()
+
+        guard let context = CGContext(data: nil, width: scaledWidth, height: scaledHeight,
+                                      bitsPerComponent: 8, bytesPerRow: 0, space: colorSpace,
+                                      bitmapInfo: CGImageAlphaInfo.premultipliedLast.rawValue) else {
+            return nil
+        }
+        context.interpolationQuality = .high
+        context.draw(self, in: CGRect(x: 0, y: 0, width: scaledWidth, height: scaledHeight))
+        return context.makeImage()
+    }
+
     func convertedToColorSpace(_ colorSpace: CGColorSpace) throws -> CGImage {
         guard let convertedImage = self.copy(colorSpace: colorSpace) else {
             throw CGImageExtensionError.failedToConvertColorSpace
@@ -8,13 +8,45 @@
 
 import Foundation
 import CoreImage
+import ImageIO
 
 public extension CIImage {
     static func loadCIImage(from url: URL, imageMetadata: ImageMetadata?, options: ImageLoadingOptions) throws -> CIImage {
         guard let rawFilter = CIFilter(imageURL: url, options: nil) else {
             throw ImageLoadingError.failedToInitializeDecoder(URL: url, message: "Failed to load full-size RAW image at \(url.path)")
         }
+        return try loadCIImage(using: rawFilter, url: url, imageMetadata: imageMetadata, options: options)
+    }
+
+    /**
+     Load from a byte source. Sources with contiguous bytes (memory mapped files included) are handed to the RAW
+     filter as data, with the type identifier ImageIO detected for the source as a hint, so the file is not opened
+     and sniffed a second time.
+     */
+    static func loadCIImage(from byteSource: ImageByteSource, imageMetadata: ImageMetadata?, options: ImageLoadingOptions) throws -> CIImage {
+        let url = byteSource.url
+
+        guard let data = byteSource.contiguousBytes else {
+            // Remote objects and deflated archive members have no file of their own for the filter to open
+            guard url.isFileURL, FileManager.default.fileExists(atPath: url.path) else {
+                let data = try byteSource.allBytes()
+                return try loadCIImage(from: InMemoryByteSource(data: data, url: url), imageMetadata: imageMetadata, options: options)
+            }
+            return try loadCIImage(from: url, imageMetadata: imageMetadata, options: options)
+        }
+
+        var filterOptions = [CIRAWFilterOption: Any]()
+        if let typeIdentifier = CGImageSourceGetType(try byteSource.imageSource()) {
+            filterOptions[CIRAWFilterOption(rawValue: kCGImageSourceTypeIdentifierHint as String)] = typeIdentifier
+        }
+
+        guard let rawFilter = CIFilter(imageData: data, options: filterOptions) else {
+            throw ImageLoadingError.failedToInitializeDecoder(URL: url, message: "Failed to load full-size RAW image from \(url)")
+        }
+        return try loadCIImage(using: rawFilter, url: url, imageMetadata: imageMetadata, options: options)
+    }
 
+    private static func loadCIImage(using rawFilter: CIFilter, url: URL, imageMetadata: ImageMetadata?, options: ImageLoadingOptions) throws -> CIImage {
         // Determine scale to load image at
         let scale: Double
 
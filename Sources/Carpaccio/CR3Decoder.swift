@@ -0,0 +1,901 @@
+//
+//  CR3Decoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Canon CR3 files, coded with Canon's CRX codec.
+
+ The sensor data is split into four planes, one per position of the 2×2 colour filter array cell, and the planes
+ into tiles. Each plane of a tile is coded as one or more subbands: the plane itself (RAW), or up to three levels of
+ the reversible 5/3 wavelet transform (C-RAW). Each subband is a bit stream of its own, of lines coded with adaptive
+ Golomb-Rice codes and run lengths, so all subbands of all tiles and planes are decoded concurrently, and then the
+ wavelet transform of each plane of each tile is inverted concurrently.
+
+ Wavelet coded files can be decoded at 1/2, 1/4 or 1/8 of full resolution by leaving out the finest levels, whose
+ subbands are then neither read, decoded nor transformed.
+
+ Not supported: subbands with quantization steps per line (the 0xFF13 subband header), wavelet coded files of more
+ than one tile, and the single plane YCbCr tracks of small RAW files.
+
+ */
+public struct CR3Decoder: RAWDecoder {
+    public enum Tag {
+        /** Dimensions and borders of the sensor, in the maker note. */
+        public static let sensorInfo: UInt16 = 0x00E0
+        public static let colorData: UInt16 = 0x4001
+    }
+
+    /** The coding parameters of a RAW track, from its `CMP1` box. */
+    public struct Header {
+        public let version: Int
+        public let width: Int
+        public let height: Int
+        public let tileWidth: Int
+        public let tileHeight: Int
+        public let bitsPerSample: Int
+        public let planeCount: Int
+        /** Colour filter array layout: RGGB, GRBG, GBRG or BGGR. */
+        public let cfaLayout: Int
+        public let encodingType: Int
+        /** Number of wavelet levels, 0 for planes coded as such. */
+        public let levels: Int
+        /** Length of the header of a sample, which lays out its tiles, planes and subbands. */
+        public let sampleHeaderLength: Int
+
+        init(data: Data) throws {
+            guard let version = data.uint16(at: 0, .bigEndian), let width = data.uint32(at: 4, .bigEndian), let height = data.uint32(at: 8, .bigEndian),
+                  let tileWidth = data.uint32(at: 12, .bigEndian), let tileHeight = data.uint32(at: 16, .bigEndian),
+                  let bitsPerSample = data.uint8(at: 20), let planes = data.uint8(at: 21), let coding = data.uint8(at: 22),
+                  let sampleHeaderLength = data.uint32(at: 24, .bigEndian) else {
+                throw RAWDecodingError.unsupportedLayout("CR3 RAW track without coding parameters")
+            }
+            self.version = Int(version)
+            self.width = Int(width)
+            self.height = Int(height)
+            self.tileWidth = Int(tileWidth)
+            self.tileHeight = Int(tileHeight)
+            self.bitsPerSample = Int(bitsPerSample)
+            self.planeCount = Int(planes >> 4)
+            self.cfaLayout = Int(planes & 0xF)
+            self.encodingType = Int(coding >> 4)
+            self.levels = Int(coding & 0xF)
+            self.sampleHeaderLength = Int(sampleHeaderLength)
+
+            guard self.version == 0x100 || self.version == 0x200, self.sampleHeaderLength > 0 else {
+                throw RAWDecodingError.unsupportedLayout("CR3 coding version \(self.version)")
+            }
+            guard planeCount == 4, encodingType == 0 else {
+                throw RAWDecodingError.unsupportedLayout("CR3 with \(planeCount) planes, encoding type \(encodingType)")
+            }
+            guard self.bitsPerSample > 8, self.bitsPerSample <= 14, self.levels <= 3, cfaLayout <= 3,
+                  self.width > 0, self.height > 0, self.tileWidth > 0, self.tileHeight > 0,
+                  (self.width | self.height | self.tileWidth | self.tileHeight) & 1 == 0,
+                  self.tileWidth <= self.width, self.tileHeight <= self.height else {
+                throw RAWDecodingError.unsupportedLayout("CR3 coding parameters are inconsistent")
+            }
+        }
+
+        public var planeWidth: Int {
+            return width / 2
+        }
+
+        public var planeHeight: Int {
+            return height / 2
+        }
+    }
+
+    /** A subband of a plane of a tile: where its bit stream lies in the sample, its dimensions, and how it is coded. */
+    struct Subband {
+        let tile: Int
+        let plane: Int
+        /** 0 for the low pass subband, then three detail subbands per wavelet level from the coarsest. */
+        let index: Int
+        /** Range of the coded data, relative to the start of the sample. */
+        let range: Range<Int>
+        let width: Int
+        let height: Int
+        /** Whether each line is predicted from the one above, and with wavelets, has its quantization adjusted. */
+        let isPredictive: Bool
+        let quantization: Int
+    }
+
+    /** A tile: its position and size in each plane, and the subbands of each plane. */
+    struct Tile {
+        let x: Int
+        let y: Int
+        let width: Int
+        let height: Int
+        let planes: [[Subband]]
+    }
+
+    public let source: ImageByteSource
+    public let header: Header
+    public let cfaPattern: CFAPattern
+    let sampleRange: Range<Int>
+    let tiles: [Tile]
+    /** Columns on the left of the sensor masked from light, from which the black level is measured. */
+    let maskedColumns: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource, structure: ISOBMFFStructure) throws {
+        guard let track = structure.rawTrack else {
+            throw RAWDecodingError.noRAWData
+        }
+        let header = try Header(data: track.compressionParameters)
+        guard track.sampleRange.upperBound <= source.count, header.sampleHeaderLength < track.sampleRange.count else {
+            throw RAWDecodingError.truncatedData
+        }
+        let sampleHeader = try source.bytes(in: track.sampleRange.lowerBound ..< (track.sampleRange.lowerBound + header.sampleHeaderLength))
+        let tiles = try CR3Decoder.tiles(in: sampleHeader, header: header)
+        guard tiles.allSatisfy({ $0.planes.joined().allSatisfy { $0.range.upperBound <= track.sampleRange.count } }) else {
+            throw RAWDecodingError.truncatedData
+        }
+        self.source = source
+        self.header = header
+        self.cfaPattern = [CFAPattern.rggb, .grbg, .gbrg, .bggr][header.cfaLayout]
+        self.sampleRange = track.sampleRange
+        self.tiles = tiles
+
+        let makerNote = structure.makerNoteTIFFOffset.flatMap { try? TIFFStructure.read(from: source, baseOffset: $0) }
+        func makerNoteValues(_ tag: UInt16) -> [Int] {
+            guard let makerNote = makerNote, let entry = makerNote.mainIFDs.first?.entry(tag),
+                  let values = try? makerNote.intValues(of: entry, in: source) else {
+                return []
+            }
+            return values
+        }
+
+        // Sensor width and height at 1 and 2, then from 5 the left, top, right and bottom borders of the area exposed to light
+        let sensorInfo = makerNoteValues(Tag.sensorInfo)
+        self.maskedColumns = sensorInfo.count > 8 ? min(sensorInfo[5], header.width) : 0
+
+        let colorData = makerNoteValues(Tag.colorData)
+        if let index = CR3Decoder.whiteBalanceIndex(colorDataCount: colorData.count), index + 4 <= colorData.count,
+           colorData[index ..< (index + 4)].allSatisfy({ $0 > 0 }) {
+            let green = Double(colorData[index + 1] + colorData[index + 2]) / 2
+            self.whiteBalance = [Double(colorData[index]) / green, 1, Double(colorData[index + 3]) / green]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    /**
+     Index of the as shot red, green, green and blue white balance levels in the maker note's colour data, whose layout
+     is told apart by its length.
+     */
+    static func whiteBalanceIndex(colorDataCount: Int) -> Int? {
+        switch colorDataCount {
+        case 1273, 1275, 1312, 1313, 1316, 1506, 1353, 1560, 1592, 1602:
+            return 0x3F
+        case 1816, 1820, 1824:
+            return 0x47
+        case 2024, 3656:
+            return 0x55
+        case 3778, 3973:
+            return 0x69
+        default:
+            return nil
+        }
+    }
+
+    /**
+     The tiles of a sample from its header: for each tile, a tile header, then for each plane a plane header followed by
+     the headers of its subbands. Each header gives the length of the data it describes, which is laid out in the same
+     order after the sample header.
+     */
+    static func tiles(in data: Data, header: Header) throws -> [Tile] {
+        let tileWidth = header.tileWidth / 2, tileHeight = header.tileHeight / 2
+        let columns = (header.planeWidth + tileWidth - 1) / tileWidth, rows = (header.planeHeight + tileHeight - 1) / tileHeight
+        guard header.levels == 0 || columns * rows == 1 else {
+            throw RAWDecodingError.unsupportedLayout("CR3 with wavelet coded tiles")
+        }
+
+        var offset = 0
+        var tileOffset = header.sampleHeaderLength
+        var tiles = [Tile]()
+        for index in 0 ..< columns * rows {
+            guard data.uint16(at: offset, .bigEndian) == 0xFF01, let headerLength = data.uint16(at: offset + 2, .bigEndian),
+                  let tileLength = data.uint32(at: offset + 4, .bigEndian), data.uint16(at: offset + 8, .bigEndian) == UInt16(truncatingIfNeeded: index) else {
+                throw RAWDecodingError.unsupportedLayout("CR3 tile header \(index) is invalid")
+            }
+            offset += 4 + Int(headerLength)
+
+            let column = index % columns, row = index / columns
+            let x = column * tileWidth, y = row * tileHeight
+            let width = column == columns - 1 ? header.planeWidth - x : tileWidth
+            let height = row == rows - 1 ? header.planeHeight - y : tileHeight
+            let sizes = levelSizes(width: width, height: height, levels: header.levels)
+
+            var planes = [[Subband]]()
+            var planeOffset = tileOffset
+            for plane in 0 ..< header.planeCount {
+                guard data.uint16(at: offset, .bigEndian) == 0xFF02, let headerLength = data.uint16(at: offset + 2, .bigEndian),
+                      let planeLength = data.uint32(at: offset + 4, .bigEndian), let flags = data.uint8(at: offset + 8), Int(flags >> 4) == plane else {
+                    throw RAWDecodingError.unsupportedLayout("CR3 plane header \(plane) of tile \(index) is invalid")
+                }
+                guard (flags >> 1) & 3 == 0 else {
+                    throw RAWDecodingError.unsupportedLayout("CR3 with rounded bits")
+                }
+                offset += 4 + Int(headerLength)
+
+                var subbands = [Subband]()
+                var subbandOffset = planeOffset
+                for subband in 0 ..< 3 * header.levels + 1 {
+                    guard let signature = data.uint16(at: offset, .bigEndian), let headerLength = data.uint16(at: offset + 2, .bigEndian),
+                          let subbandLength = data.uint32(at: offset + 4, .bigEndian).map({ Int($0) }), let bits = data.uint32(at: offset + 8, .bigEndian) else {
+                        throw RAWDecodingError.truncatedData
+                    }
+                    guard signature != 0xFF13 else {
+                        throw RAWDecodingError.unsupportedLayout("CR3 with quantization steps per line")
+                    }
+                    // Subband number, padding bit count, flag for predicted lines, quantization
+                    let padding = Int(bits & 0x7FFFF)
+                    guard signature == 0xFF03, headerLength == 8, Int(bits >> 28) == subband, padding <= subbandLength else {
+                        throw RAWDecodingError.unsupportedLayout("CR3 subband header \(subband) of tile \(index) is invalid")
+                    }
+                    let size = subbandSize(subband, sizes: sizes, levels: header.levels)
+                    subbands.append(Subband(tile: index, plane: plane, index: subband,
+                                            range: subbandOffset ..< (subbandOffset + subbandLength - padding),
+                                            width: size.width, height: size.height,
+                                            isPredictive: bits & 0x800_0000 != 0, quantization: Int((bits >> 19) & 0xFF)))
+                    subbandOffset += subbandLength
+                    offset += 4 + Int(headerLength)
+                }
+                planes.append(subbands)
+                planeOffset += Int(planeLength)
+            }
+            tiles.append(Tile(x: x, y: y, width: width, height: height, planes: planes))
+            tileOffset += Int(tileLength)
+        }
+        return tiles
+    }
+
+    /** Dimensions of a plane at each wavelet level: level 0 is the plane itself, each further level half, rounded up. */
+    static func levelSizes(width: Int, height: Int, levels: Int) -> [(width: Int, height: Int)] {
+        var sizes = [(width: width, height: height)]
+        for _ in 0 ..< levels {
+            let last = sizes[sizes.count - 1]
+            sizes.append(((last.width + 1) / 2, (last.height + 1) / 2))
+        }
+        return sizes
+    }
+
+    /**
+     Dimensions of a subband: the low pass one is the size of the coarsest level; detail subbands at a level are high
+     pass across columns, across rows, or both, of the level above.
+     */
+    static func subbandSize(_ index: Int, sizes: [(width: Int, height: Int)], levels: Int) -> (width: Int, height: Int) {
+        guard index > 0 else {
+            return sizes[levels]
+        }
+        let level = levels - (index - 1) / 3
+        let parent = sizes[level - 1], low = sizes[level]
+        switch (index - 1) % 3 {
+        case 0:
+            return (parent.width / 2, low.height)
+        case 1:
+            return (low.width, parent.height / 2)
+        default:
+            return (parent.width / 2, parent.height / 2)
+        }
+    }
+
+    public var size: CGSize {
+        return CGSize(width: header.width, height: header.height)
+    }
+
+    // MARK: Decoding
+
+    public func decode() throws -> RAWSensorImage {
+        return try decode(skippingLevels: 0)
+    }
+
+    /**
+     Decode the sensor data leaving out the finest `skippedLevels` wavelet levels, at half the resolution for each one
+     left out. Files without wavelet levels are decoded at full resolution.
+     */
+    public func decode(skippingLevels skippedLevels: Int) throws -> RAWSensorImage {
+        let skippedLevels = min(max(skippedLevels, 0), header.levels)
+        let levels = header.levels
+        let subbands = tiles.flatMap { $0.planes.flatMap { $0.prefix(1 + 3 * (levels - skippedLevels)) } }
+
+        var firstError: Swift.Error? = nil
+        let errorLock = NSLock()
+        func record(_ error: Swift.Error) {
+            errorLock.lock()
+            firstError = firstError ?? error
+            errorLock.unlock()
+        }
+
+        // Every subband needed is a bit stream of its own
+        var coefficients = [Coefficients?](repeating: nil, count: subbands.count)
+        coefficients.withUnsafeMutableBufferPointer { coefficients in
+            DispatchQueue.concurrentPerform(iterations: subbands.count) { i in
+                do {
+                    coefficients[i] = try readSubband(subbands[i])
+                } catch {
+                    record(error)
+                }
+            }
+        }
+        if let error = firstError {
+            throw error
+        }
+
+        // Then the wavelet transform of each plane of each tile is inverted
+        let subbandsPerPlane = 1 + 3 * (levels - skippedLevels)
+        let planeCount = header.planeCount
+        var planes = [Coefficients?](repeating: nil, count: tiles.count * planeCount)
+        planes.withUnsafeMutableBufferPointer { planes in
+            DispatchQueue.concurrentPerform(iterations: planes.count) { i in
+                let tile = tiles[i / planeCount]
+                let planeSubbands = coefficients[(i * subbandsPerPlane) ..< ((i + 1) * subbandsPerPlane)].compactMap { $0 }
+                let sizes = CR3Decoder.levelSizes(width: tile.width, height: tile.height, levels: levels)
+                planes[i] = CR3Decoder.reconstruct(planeSubbands, sizes: sizes, levels: levels, skippedLevels: skippedLevels)
+            }
+        }
+
+        // Samples are coded relative to the middle of their range
+        let median = 1 << (header.bitsPerSample - 1), maximum = (1 << header.bitsPerSample) - 1
+        let planeSize = CR3Decoder.levelSizes(width: header.planeWidth, height: header.planeHeight, levels: skippedLevels)[skippedLevels]
+        let image = try RAWSensorImage(width: planeSize.width * 2, height: planeSize.height * 2, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel(of: planes.compactMap { $0 }, median: median, maximum: maximum, skippedLevels: skippedLevels),
+                                       whiteLevel: maximum, whiteBalance: whiteBalance)
+
+        // Plane 0 holds the top left position of each 2×2 cell, 1 the top right, 2 and 3 those below
+        DispatchQueue.concurrentPerform(iterations: planes.count) { i in
+            guard let plane = planes[i] else {
+                return
+            }
+            let tile = tiles[i / planeCount], position = i % planeCount
+            let x = tile.x >> skippedLevels, y = tile.y >> skippedLevels
+            plane.values.withUnsafeBufferPointer { values in
+                for row in 0 ..< plane.height {
+                    let output = image.row(2 * (y + row) + (position >> 1)) + 2 * x + (position & 1)
+                    let input = values.baseAddress! + row * plane.width
+                    for column in 0 ..< plane.width {
+                        output[2 * column] = UInt16(min(max(median + Int(input[column]), 0), maximum))
+                    }
+                }
+            }
+        }
+        return image
+    }
+
+    /** Leave out as many wavelet levels as possible while binning the result still gives `maximumPixelDimension`. */
+    public func decode(maximumPixelDimension: Int?) throws -> RAWSensorImage {
+        guard let maximum = maximumPixelDimension, maximum > 0 else {
+            return try decode()
+        }
+        var skippedLevels = 0
+        while skippedLevels < header.levels && max(header.width, header.height) >> (skippedLevels + 2) >= maximum {
+            skippedLevels += 1
+        }
+        return try decode(skippingLevels: skippedLevels)
+    }
+
+    /** The average of the masked columns on the left, leaving out a column at both sides, or 0 if there are none. */
+    private func blackLevel(of planes: [Coefficients], median: Int, maximum: Int, skippedLevels: Int) -> Int {
+        let columns = 1 ..< max(1, ((maskedColumns / 2) >> skippedLevels) - 1)
+        var sum = 0, count = 0
+        for (i, plane) in planes.enumerated() where tiles[i / header.planeCount].x == 0 {
+            for row in 0 ..< plane.height {
+                for column in columns where column < plane.width {
+                    sum += min(max(median + Int(plane.values[row * plane.width + column]), 0), maximum)
+                    count += 1
+                }
+            }
+        }
+        return count > 0 ? sum / count : 0
+    }
+
+    /** Read and decode a subband from its bit stream in the file. */
+    private func readSubband(_ subband: Subband) throws -> Coefficients {
+        let data = try source.bytes(in: (sampleRange.lowerBound + subband.range.lowerBound) ..< (sampleRange.lowerBound + subband.range.upperBound))
+        return try data.withUnsafeBytes { bytes in
+            var reader = BitReader(bytes)
+            let coefficients = try CR3Decoder.decodeSubband(subband, isWaveletCoded: header.levels > 0, bits: &reader)
+            if reader.isOverrun {
+                throw RAWDecodingError.truncatedData
+            }
+            return coefficients
+        }
+    }
+
+    // MARK: Subbands
+
+    /** Coefficients of a subband, or samples of a plane, row by row. Never empty, for its base address to be valid. */
+    struct Coefficients {
+        let width: Int
+        let height: Int
+        var values: [Int32]
+
+        init(width: Int, height: Int) {
+            self.width = width
+            self.height = height
+            self.values = [Int32](repeating: 0, count: max(1, width * height))
+        }
+    }
+
+    /** Quantization step of each quantization value modulo 6, in 1/64ths, doubling with every 6 further. */
+    static let quantizationSteps: [Int32] = [0x28, 0x2D, 0x33, 0x39, 0x40, 0x48]
+
+    static func quantizationStep(_ quantization: Int) -> Int32 {
+        let step = quantizationSteps[quantization % 6], scale = quantization / 6
+        return scale >= 6 ? step << (scale - 6) : step >> (6 - scale)
+    }
+
+    /** Decode the lines of a subband, each scaled by its quantization step for wavelet coded planes. */
+    static func decodeSubband(_ subband: Subband, isWaveletCoded: Bool, bits: inout BitReader) throws -> Coefficients {
+        var coefficients = Coefficients(width: subband.width, height: subband.height)
+        // A subband without data is all zero
+        guard !subband.range.isEmpty, subband.width > 0 else {
+            return coefficients
+        }
+        let decoder = LineDecoder(width: subband.width, isPredictive: subband.isPredictive)
+        var quantization = subband.quantization
+        var quantizationParameter = 0
+
+        try coefficients.values.withUnsafeMutableBufferPointer { values in
+            for y in 0 ..< subband.height {
+                if isWaveletCoded && subband.isPredictive {
+                    // Quantization changes line by line, by a Golomb-Rice coded difference
+                    let zeros = bits.readZeroRun()
+                    let code = zeros >= 23 ? bits.readBits(8) : (zeros << quantizationParameter) | bits.readBits(quantizationParameter)
+                    quantization += LineDecoder.signed(code)
+                    quantizationParameter = min(LineDecoder.parameter(after: quantizationParameter, code: code), 15)
+                    guard quantization >= 0 else {
+                        throw RAWDecodingError.corruptData
+                    }
+                }
+                let line = values.baseAddress! + y * subband.width
+                guard decoder.decodeLine(&bits, into: line) else {
+                    throw RAWDecodingError.corruptData
+                }
+                if isWaveletCoded {
+                    let step = quantizationStep(quantization)
+                    if step != 1 {
+                        for x in 0 ..< subband.width {
+                            line[x] = line[x] &* step
+                        }
+                    }
+                }
+            }
+        }
+        return coefficients
+    }
+
+    // MARK: Wavelets
+
+    /**
+     Invert the wavelet transform of a plane of a tile from its subbands, the low pass one first, down to level
+     `skippedLevels`.
+     */
+    static func reconstruct(_ subbands: [Coefficients], sizes: [(width: Int, height: Int)], levels: Int, skippedLevels: Int) -> Coefficients {
+        var plane = subbands[0]
+        for level in stride(from: levels, to: skippedLevels, by: -1) {
+            let first = 1 + 3 * (levels - level)
+            plane = inverseTransform(ll: plane, hl: subbands[first], lh: subbands[first + 1], hh: subbands[first + 2],
+                                     width: sizes[level - 1].width, height: sizes[level - 1].height)
+        }
+        return plane
+    }
+
+    /**
+     One level of the inverse 5/3 wavelet transform: a `width` × `height` plane from its low pass subband, and the
+     subbands high pass across columns (`hl`), across rows (`lh`) and both (`hh`). Rows are transformed first, then
+     columns.
+     */
+    static func inverseTransform(ll: Coefficients, hl: Coefficients, lh: Coefficients, hh: Coefficients, width: Int, height: Int) -> Coefficients {
+        let lowRows = (height + 1) / 2, highRows = height / 2
+        var lowLines = [Int32](repeating: 0, count: max(1, lowRows * width))
+        var highLines = [Int32](repeating: 0, count: max(1, highRows * width))
+        var output = Coefficients(width: width, height: height)
+
+        lift(rows: lowRows, of: ll, and: hl, into: &lowLines, width: width)
+        lift(rows: highRows, of: lh, and: hh, into: &highLines, width: width)
+        // Columns side by side, a row of each at a time
+        lowLines.withUnsafeBufferPointer { low in
+            highLines.withUnsafeBufferPointer { high in
+                output.values.withUnsafeMutableBufferPointer { values in
+                    inverseLift(low: low.baseAddress!, high: high.baseAddress!, into: values.baseAddress!,
+                                count: height, stride: width, lanes: width)
+                }
+            }
+        }
+        return output
+    }
+
+    /** Invert the transform across the columns of the first `rows` rows of a pair of subbands, into `width` wide lines. */
+    private static func lift(rows: Int, of low: Coefficients, and high: Coefficients, into lines: inout [Int32], width: Int) {
+        low.values.withUnsafeBufferPointer { lowValues in
+            high.values.withUnsafeBufferPointer { highValues in
+                lines.withUnsafeMutableBufferPointer { lines in
+                    for y in 0 ..< rows {
+                        inverseLift(low: lowValues.baseAddress! + y * low.width, high: highValues.baseAddress! + y * high.width,
+                                    into: lines.baseAddress! + y * width, count: width, stride: 1, lanes: 1)
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     The inverse 5/3 lifting steps along one dimension, for `lanes` signals side by side, sample `n` of lane `j` being
+     at `n * stride + j`: `count` samples from `(count + 1) / 2` low pass and `count / 2` high pass coefficients, the
+     signal being extended symmetrically at both ends.
+     */
+    @inline(__always)
+    static func inverseLift(low: UnsafePointer<Int32>, high: UnsafePointer<Int32>, into output: UnsafeMutablePointer<Int32>,
+                            count: Int, stride: Int, lanes: Int) {
+        let highCount = count / 2
+        guard highCount > 0 else {
+            output.assign(from: low, count: lanes)
+            return
+        }
+        // Even samples from the low pass coefficients and the high pass ones on both sides
+        for n in 0 ..< (count + 1) / 2 {
+            let before = high + max(n - 1, 0) * stride, after = high + min(n, highCount - 1) * stride
+            let lowRow = low + n * stride, even = output + 2 * n * stride
+            for j in 0 ..< lanes {
+                even[j] = lowRow[j] &- ((before[j] &+ after[j] &+ 2) >> 2)
+            }
+        }
+        // Odd samples from the high pass coefficients and the even samples on both sides
+        for n in 0 ..< highCount {
+            let even = output + 2 * n * stride, next = 2 * n + 2 < count ? even + 2 * stride : even
+            let highRow = high + n * stride, odd = output + (2 * n + 1) * stride
+            for j in 0 ..< lanes {
+                odd[j] = highRow[j] &+ ((even[j] &+ next[j]) >> 1)
+            }
+        }
+    }
+}
+
+// MARK: - Line decoding
+
+extension BitReader {
+    /** The next `count` bits (at most 21) as an integer. */
+    @inline(__always)
+    fileprivate mutating func readBits(_ count: Int) -> Int {
+        return Int(read(count))
+    }
+}
+
+extension CR3Decoder {
+    /** Run lengths added by each one bit of a run, by run length parameter, and the bits of the remainder. */
+    static let runLengthBits = [0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15]
+    static let runLengths = runLengthBits.map { 1 << $0 }
+
+    /**
+     Decodes the lines of a subband, one after another. Each sample is a Golomb-Rice code with an adaptive parameter,
+     and runs of samples equal to the previous one (in predictive subbands) or of zeros (otherwise) are run length
+     coded.
+
+     - Predictive subbands, those of planes without wavelets and low pass ones: each sample is coded as a difference
+       from a prediction made from its neighbours to the left, above and above left (the median edge detector of
+       LOCO-I), the parameter adapting to the differences, looking ahead to the gradient above to the right.
+     - Other subbands: samples are coded as such, the parameter adapting also to that of the sample above to the right.
+
+     Lines are kept with a border sample on both sides.
+     */
+    final class LineDecoder {
+        let width: Int
+        let isPredictive: Bool
+        private var previous: UnsafeMutablePointer<Int>
+        private var current: UnsafeMutablePointer<Int>
+        /** The Golomb-Rice parameter after each sample of the previous line, for non predictive subbands. */
+        private let parameters: UnsafeMutablePointer<Int>
+        private var parameter = 0
+        private var runParameter = 0
+        private var line = 0
+
+        init(width: Int, isPredictive: Bool) {
+            self.width = width
+            self.isPredictive = isPredictive
+            self.previous = UnsafeMutablePointer<Int>.allocate(capacity: width + 2)
+            self.previous.initialize(repeating: 0, count: width + 2)
+            self.current = UnsafeMutablePointer<Int>.allocate(capacity: width + 2)
+            self.current.initialize(repeating: 0, count: width + 2)
+            self.parameters = UnsafeMutablePointer<Int>.allocate(capacity: width + 1)
+            self.parameters.initialize(repeating: 0, count: width + 1)
+        }
+
+        deinit {
+            previous.deallocate()
+            current.deallocate()
+            parameters.deallocate()
+        }
+
+        /** Decode the next line into `output`. Returns false if the stream gives a run past the end of the line. */
+        func decodeLine(_ bits: inout BitReader, into output: UnsafeMutablePointer<Int32>) -> Bool {
+            (previous, current) = (current, previous)
+            let decoded: Bool
+            switch (isPredictive, line == 0) {
+            case (true, true):
+                decoded = decodePredictiveTopLine(&bits)
+            case (true, false):
+                decoded = decodePredictiveLine(&bits)
+            case (false, true):
+                decoded = decodeNonPredictiveTopLine(&bits)
+            case (false, false):
+                decoded = decodeNonPredictiveLine(&bits)
+            }
+            line += 1
+            for x in 0 ..< width {
+                output[x] = Int32(truncatingIfNeeded: current[x + 1])
+            }
+            return decoded
+        }
+
+        /** Maps codes 0, 1, 2, 3 ... to 0, -1, 1, -2 ... */
+        @inline(__always)
+        static func signed(_ code: Int) -> Int {
+            return -(code & 1) ^ (code >> 1)
+        }
+
+        /** The Golomb-Rice parameter after a code: lowered for codes under half its range, raised for large ones. */
+        @inline(__always)
+        static func parameter(after parameter: Int, code: Int) -> Int {
+            return parameter - (code < (1 << parameter) >> 1 ? 1 : 0) + (code >> parameter > 2 ? 1 : 0) + (code >> parameter > 5 ? 1 : 0)
+        }
+
+        /** A Golomb-Rice code: a unary count of its high bits, then `parameter` low bits, or 21 bits after 41 zeros. */
+        @inline(__always)
+        private func readCode(_ bits: inout BitReader) -> Int {
+            let zeros = bits.readZeroRun()
+            if zeros >= 41 {
+                return bits.readBits(21)
+            }
+            return parameter > 0 ? (zeros << parameter) | bits.readBits(parameter) : zeros
+        }
+
+        /**
+         The length of a run, at most `remaining`: none after a zero bit, otherwise one, then a length growing with
+         the run length parameter for each further one bit, then after a zero bit a remainder. `nil` if the run would
+         go past `remaining`.
+         */
+        private func readRunLength(_ bits: inout BitReader, remaining: Int) -> Int? {
+            guard bits.readBits(1) == 1 else {
+                return 0
+            }
+            var length = 1
+            while bits.readBits(1) == 1 {
+                length += CR3Decoder.runLengths[runParameter]
+                if length > remaining {
+                    length = remaining
+                    break
+                }
+                if runParameter < 31 {
+                    runParameter += 1
+                }
+                if length == remaining {
+                    break
+                }
+            }
+            if length < remaining {
+                let remainderBits = CR3Decoder.runLengthBits[runParameter]
+                if remainderBits > 0 {
+                    length += bits.readBits(remainderBits)
+                }
+                if runParameter > 0 {
+                    runParameter -= 1
+                }
+                if length > remaining {
+                    return nil
+                }
+            }
+            return length
+        }
+
+        // MARK: Predictive subbands
+
+        /** A first line, predicted from the left only, with runs of zeros. */
+        private func decodePredictiveTopLine(_ bits: inout BitReader) -> Bool {
+            current[0] = 0
+            var p = 0, remaining = width
+            while remaining > 1 {
+                if current[p] != 0 {
+                    current[p + 1] = current[p]
+                } else {
+                    guard let run = readRunLength(&bits, remaining: remaining) else {
+                        return false
+                    }
+                    if run > 0 {
+                        for i in 1 ... run {
+                            current[p + i] = 0
+                        }
+                        p += run
+                        remaining -= run
+                        if remaining <= 0 {
+                            break
+                        }
+                    }
+                    current[p + 1] = 0
+                }
+                let code = readCode(&bits)
+                current[p + 1] += LineDecoder.signed(code)
+                parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                p += 1
+                remaining -= 1
+            }
+            if remaining == 1 {
+                let code = readCode(&bits)
+                current[p + 1] = current[p] + LineDecoder.signed(code)
+                parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                p += 1
+            }
+            current[p + 1] = current[p] + 1
+            return true
+        }
+
+        /** A line predicted from the one above, with runs of the sample to the left where it matches those above. */
+        private func decodePredictiveLine(_ bits: inout BitReader) -> Bool {
+            current[0] = previous[1]
+            var p = 0, remaining = width
+            while remaining > 1 {
+                if current[p] != previous[p + 1] || current[p] != previous[p + 2] {
+                    decodePredictedSample(&bits, at: p, median: true, lookAhead: true)
+                    p += 1
+                } else {
+                    guard let run = readRunLength(&bits, remaining: remaining) else {
+                        return false
+                    }
+                    if run > 0 {
+                        for i in 1 ... run {
+                            current[p + i] = current[p]
+                        }
+                        p += run
+                        remaining -= run
+                        if remaining <= 0 {
+                            break
+                        }
+                    }
+                    // The sample ending a run is predicted from the one above
+                    decodePredictedSample(&bits, at: p, median: false, lookAhead: true)
+                    p += 1
+                }
+                remaining -= 1
+            }
+            if remaining == 1 {
+                decodePredictedSample(&bits, at: p, median: true, lookAhead: false)
+                p += 1
+            }
+            current[p + 1] = current[p] + 1
+            return true
+        }
+
+        @inline(__always)
+        private func decodePredictedSample(_ bits: inout BitReader, at p: Int, median: Bool, lookAhead: Bool) {
+            let left = current[p], above = previous[p + 1]
+            var prediction = above
+            if median {
+                // The smaller or larger of left and above at an edge, otherwise the gradient from above left
+                let delta = above - previous[p]
+                let falling = delta < 0
+                if (previous[p] < left) == falling {
+                    prediction = left + delta
+                } else {
+                    prediction = (left < above) == falling ? left : above
+                }
+            }
+            let code = readCode(&bits)
+            current[p + 1] = prediction + LineDecoder.signed(code)
+
+            var context = code
+            if lookAhead {
+                context = (code + abs((previous[p + 2] - previous[p + 1]) << 1)) >> 1
+            }
+            parameter = min(LineDecoder.parameter(after: parameter, code: context), 15)
+        }
+
+        // MARK: Other subbands
+
+        /** A first line, with runs of zeros after zeros. */
+        private func decodeNonPredictiveTopLine(_ bits: inout BitReader) -> Bool {
+            previous[0] = 0
+            current[0] = 0
+            var p = 0, remaining = width
+            while remaining > 1 {
+                if current[p] != 0 {
+                    let code = readCode(&bits)
+                    current[p + 1] = LineDecoder.signed(code)
+                    parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                } else {
+                    guard let run = readRunLength(&bits, remaining: remaining) else {
+                        return false
+                    }
+                    if run > 0 {
+                        for i in 0 ..< run {
+                            parameters[p + i] = 0
+                            current[p + 1 + i] = 0
+                        }
+                        p += run
+                        remaining -= run
+                        if remaining <= 0 {
+                            break
+                        }
+                    }
+                    // The sample ending a run is not zero, and coded one less
+                    let code = readCode(&bits)
+                    current[p + 1] = LineDecoder.signed(code + 1)
+                    parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                }
+                parameters[p] = parameter
+                p += 1
+                remaining -= 1
+            }
+            if remaining == 1 {
+                let code = readCode(&bits)
+                current[p + 1] = LineDecoder.signed(code)
+                parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                parameters[p] = parameter
+                p += 1
+            }
+            current[p + 1] = 0
+            return true
+        }
+
+        /** A line with runs of zeros where the samples to the left, above and above right are all zero. */
+        private func decodeNonPredictiveLine(_ bits: inout BitReader) -> Bool {
+            var i = 0
+            while i < width - 1 {
+                if previous[i + 2] | previous[i + 1] | current[i] != 0 {
+                    let code = readCode(&bits)
+                    current[i + 1] = LineDecoder.signed(code)
+                    adaptParameter(after: code, above: parameters[i + 1])
+                } else {
+                    guard let run = readRunLength(&bits, remaining: width - i) else {
+                        return false
+                    }
+                    for j in 0 ..< run {
+                        current[i + 1 + j] = 0
+                        parameters[i + j] = 0
+                    }
+                    i += run
+                    if i >= width - 1 {
+                        if i == width - 1 {
+                            let code = readCode(&bits)
+                            current[i + 1] = LineDecoder.signed(code + 1)
+                            parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                            parameters[i] = parameter
+                        }
+                        i += 1
+                        break
+                    }
+                    let code = readCode(&bits)
+                    current[i + 1] = LineDecoder.signed(code + 1)
+                    adaptParameter(after: code, above: parameters[i + 1])
+                }
+                parameters[i] = parameter
+                i += 1
+            }
+            if i == width - 1 {
+                let code = readCode(&bits)
+                current[i + 1] = LineDecoder.signed(code)
+                parameter = min(LineDecoder.parameter(after: parameter, code: code), 15)
+                parameters[i] = parameter
+            }
+            return true
+        }
+
+        /** Adapt the parameter to a code, then raise it towards `above`, that of the sample above to the right. */
+        @inline(__always)
+        private func adaptParameter(after code: Int, above: Int) {
+            parameter = LineDecoder.parameter(after: parameter, code: code)
+            if above - parameter <= 1 {
+                parameter = min(parameter, 15)
+            } else {
+                parameter += 1
+            }
+        }
+    }
+}
@@ -0,0 +1,294 @@
+//
+//  CardImporter.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import CommonCrypto
+
+public enum CardImportError: Swift.Error, LocalizedError {
+    case destinationExists(URL)
+    case failedToWrite(url: URL, errno: Int32)
+
+    public var errorDescription: String? {
+        switch self {
+        case .destinationExists(let url):
+            return "Not importing over existing file at \(url.path)"
+        case .failedToWrite(let url, let code):
+            return "Failed to write \(url.path): \(String(cString: strerror(code)))"
+        }
+    }
+}
+
+/**
+
+ Imports image files from a memory card (or any other source) reading every byte only once.
+
+ Copying files and then loading them into a collection reads each file at least twice: once to copy, and again for
+ metadata and thumbnails. `CardImporter` streams each source file through memory in chunks, writing the copy and
+ updating its SHA-256 checksum as it goes, and then parses metadata and makes a preview from the very same bytes.
+
+ Copying is sequential, which is what card readers are fastest at, while parsing and preview decoding of files
+ already copied proceed in parallel with it. At most `maximumBufferedFileCount` files, and `maximumBufferedByteCount`
+ bytes, are held in memory at once; a file larger than that is still imported, while no other file is held.
+
+ Copies are written to a temporary file next to the destination, flushed, given the source's modification time, and
+ only then linked into place, so an interrupted import never leaves a partial file under the final name.
+
+ */
+public final class CardImporter {
+    public struct ImportedFile {
+        public let sourceURL: URL
+        public let destinationURL: URL
+        public let byteCount: Int
+        /** Lowercase hexadecimal SHA-256 digest of the file contents. */
+        public let sha256: String
+        /** An image for the copy, with its metadata filled in if it could be read. */
+        public let image: Image
+        public let metadata: ImageMetadata?
+        public let preview: CGImage?
+    }
+
+    public typealias FileHandler = (_ sourceURL: URL, _ result: Result<ImportedFile, Swift.Error>) -> Void
+
+    public let chunkSize: Int
+    public let maximumBufferedFileCount: Int
+    public let maximumBufferedByteCount: Int
+    /** Maximum width and height of previews. `nil` for no previews. */
+    public let previewMaximumPixelDimensions: CGSize?
+
+    private let copyQueue = DispatchQueue(label: "com.sashimiapp.CardImporterCopyQueue")
+    private let parseQueue = OperationQueue()
+
+    public init(chunkSize: Int = 4 * 1024 * 1024, maximumBufferedFileCount: Int = 4, maximumBufferedByteCount: Int = 256 * 1024 * 1024,
+                previewMaximumPixelDimensions: CGSize? = CGSize(width: 512, height: 512)) {
+        self.chunkSize = max(64 * 1024, chunkSize)
+        self.maximumBufferedFileCount = max(1, maximumBufferedFileCount)
+        self.maximumBufferedByteCount = max(0, maximumBufferedByteCount)
+        self.previewMaximumPixelDimensions = previewMaximumPixelDimensions
+        parseQueue.name = "com.sashimiapp.CardImporterParseQueue"
+        parseQueue.maxConcurrentOperationCount = ProcessInfo.processInfo.activeProcessorCount
+    }
+
+    /**
+     Import `sourceURLs` into `destinationDirectory`, in order. `fileHandler` is called for every file, and `finished`
+     once all files are done, both on `handlerQueue`.
+     */
+    public func importFiles(
+        _ sourceURLs: [URL],
+        to destinationDirectory: URL,
+        handlerQueue: DispatchQueue = .main,
+        fileHandler: @escaping FileHandler,
+        finished: @escaping () -> Void
+    ) {
+        copyQueue.async {
+            let buffered = DispatchSemaphore(value: self.maximumBufferedFileCount)
+            let bufferedBytes = ByteBudget(limit: self.maximumBufferedByteCount)
+            let group = DispatchGroup()
+
+            for sourceURL in sourceURLs {
+                buffered.wait()
+                let byteCount = FileAttributes(path: sourceURL.path).map { Int(clamping: $0.size) } ?? 0
+                bufferedBytes.reserve(byteCount)
+                let destinationURL = destinationDirectory.appendingPathComponent(sourceURL.lastPathComponent)
+
+                let copy: (data: Data, sha256: String)
+                do {
+                    copy = try self.copy(sourceURL, to: destinationURL)
+                } catch {
+                    bufferedBytes.release(byteCount)
+                    buffered.signal()
+                    handlerQueue.async(group: group) {
+                        fileHandler(sourceURL, .failure(error))
+                    }
+                    continue
+                }
+
+                group.enter()
+                self.parseQueue.addOperation {
+                    let importedFile = self.parse(copy.data, sha256: copy.sha256, sourceURL: sourceURL, destinationURL: destinationURL)
+                    bufferedBytes.release(byteCount)
+                    buffered.signal()
+                    handlerQueue.async {
+                        fileHandler(sourceURL, .success(importedFile))
+                        group.leave()
+                    }
+                }
+            }
+
+            group.notify(queue: handlerQueue, execute: finished)
+        }
+    }
+
+    /** Import files synchronously, returning results in the order of `sourceURLs`. Do not call from the main queue. */
+    public func importFilesAndWait(_ sourceURLs: [URL], to destinationDirectory: URL) -> [Result<ImportedFile, Swift.Error>] {
+        var results = [URL: Result<ImportedFile, Swift.Error>]()
+        let resultsQueue = DispatchQueue(label: "com.sashimiapp.CardImporterResultsQueue")
+        let done = DispatchSemaphore(value: 0)
+
+        importFiles(sourceURLs, to: destinationDirectory, handlerQueue: resultsQueue, fileHandler: { url, result in
+            results[url] = result
+        }, finished: {
+            done.signal()
+        })
+        done.wait()
+
+        return resultsQueue.sync {
+            sourceURLs.map { results[$0] ?? .failure(ImageByteSourceError.failedToRead(url: $0, range: 0 ..< 0, message: "Not imported")) }
+        }
+    }
+
+    // MARK: Copying
+
+    /** Copy a file in chunks, hashing as it goes. Returns the file's contents, which are read only once. */
+    private func copy(_ sourceURL: URL, to destinationURL: URL) throws -> (data: Data, sha256: String) {
+        guard !FileManager.default.fileExists(atPath: destinationURL.path) else {
+            throw CardImportError.destinationExists(destinationURL)
+        }
+
+        let input = open(sourceURL.path, O_RDONLY)
+        guard input >= 0 else {
+            throw ImageByteSourceError.failedToOpen(url: sourceURL, errno: errno)
+        }
+        defer {
+            close(input)
+        }
+        var sourceStat = stat()
+        guard fstat(input, &sourceStat) == 0 else {
+            throw ImageByteSourceError.failedToOpen(url: sourceURL, errno: errno)
+        }
+        // The whole file is read once, front to back
+        ReadAccessHint.sequential.apply(to: input, range: 0 ..< Int(sourceStat.st_size))
+
+        let temporaryURL = destinationURL.deletingLastPathComponent().appendingPathComponent(".\(destinationURL.lastPathComponent).\(UUID().uuidString).partial")
+        let output = open(temporaryURL.path, O_WRONLY | O_CREAT | O_EXCL, 0o644)
+        guard output >= 0 else {
+            throw CardImportError.failedToWrite(url: temporaryURL, errno: errno)
+        }
+        var isOutputOpen = true
+        defer {
+            if isOutputOpen {
+                close(output)
+                unlink(temporaryURL.path)
+            }
+        }
+
+        let size = Int(sourceStat.st_size)
+        var data = Data(count: size)
+        var hash = CC_SHA256_CTX()
+        CC_SHA256_Init(&hash)
+
+        // Each chunk is read straight into the buffer which is kept for parsing, and written and hashed from there
+        try data.withUnsafeMutableBytes { (buffer: UnsafeMutableRawBufferPointer) in
+            var offset = 0
+            while offset < size {
+                let range = offset ..< min(size, offset + chunkSize)
+                let chunk = UnsafeMutableRawBufferPointer(rebasing: buffer[range])
+                let read = BatchedFileReader.pread(input, into: chunk, at: range.lowerBound)
+                guard read.errorCode == 0, read.count == range.count else {
+                    throw ImageByteSourceError.failedToRead(url: sourceURL, range: range, message: read.errorCode != 0 ? String(cString: strerror(read.errorCode)) : "File shrank while being read")
+                }
+
+                _ = CC_SHA256_Update(&hash, chunk.baseAddress, CC_LONG(chunk.count))
+                var written = 0
+                while written < chunk.count {
+                    let n = write(output, chunk.baseAddress! + written, chunk.count - written)
+                    if n < 0 {
+                        if errno == EINTR {
+                            continue
+                        }
+                        throw CardImportError.failedToWrite(url: temporaryURL, errno: errno)
+                    }
+                    written += n
+                }
+                offset = range.upperBound
+            }
+        }
+
+        // Keep the source's modification time, and make sure the copy is on disk before it takes the final name
+        #if os(Linux)
+        var times = [sourceStat.st_atim, sourceStat.st_mtim]
+        #else
+        var times = [sourceStat.st_atimespec, sourceStat.st_mtimespec]
+        #endif
+        futimens(output, &times)
+        guard fsync(output) == 0 else {
+            throw CardImportError.failedToWrite(url: temporaryURL, errno: errno)
+        }
+        close(output)
+        isOutputOpen = false
+
+        // Unlike rename(), link() never replaces a file which appeared at the destination during the copy
+        let linked = link(temporaryURL.path, destinationURL.path) == 0
+        let code = errno
+        unlink(temporaryURL.path)
+        guard linked else {
+            throw code == EEXIST ? CardImportError.destinationExists(destinationURL) : CardImportError.failedToWrite(url: destinationURL, errno: code)
+        }
+
+        var digest = [UInt8](repeating: 0, count: Int(CC_SHA256_DIGEST_LENGTH))
+        CC_SHA256_Final(&digest, &hash)
+        return (data, digest.map { String(format: "%02x", $0) }.joined())
+    }
+
+    // MARK: Parsing
+
+    private func parse(_ data: Data, sha256: String, sourceURL: URL, destinationURL: URL) -> ImportedFile {
+        // The loader reads the copy's bytes from memory, not from either file
+        let source = InMemoryByteSource(data: data, url: destinationURL)
+        let loader = ImageLoader(byteSource: source, thumbnailScheme: .decodeFullImageIfEmbeddedThumbnailTooSmall)
+        let image = Image(URL: destinationURL)
+        image.updateFormat(sniffedFrom: source)
+
+        var metadata: ImageMetadata?
+        var preview: CGImage?
+        if let maximumPixelDimensions = previewMaximumPixelDimensions,
+           let loaded = try? loader.loadCGImage(maximumPixelDimensions: maximumPixelDimensions, colorSpace: nil, cancelled: nil) {
+            preview = loaded.0
+            metadata = loaded.1
+        } else {
+            metadata = try? loader.loadImageMetadata()
+        }
+
+        if let metadata = metadata {
+            image.updateMetadata(metadata)
+        }
+        FileAttributeCache.shared.refreshAttributes(for: destinationURL)
+
+        return ImportedFile(sourceURL: sourceURL, destinationURL: destinationURL, byteCount: data.count, sha256: sha256, image: image, metadata: metadata, preview: preview)
+    }
+
+    // MARK: Buffering
+
+    /** Bytes of copied files held for parsing, which the copying queue waits on to stay within a limit. */
+    private final class ByteBudget {
+        private let limit: Int
+        private var reserved = 0
+        private let condition = NSCondition()
+
+        init(limit: Int) {
+            self.limit = limit
+        }
+
+        /** Wait until `count` more bytes fit within the limit, or until nothing else is reserved. */
+        func reserve(_ count: Int) {
+            condition.lock()
+            while reserved > 0 && count > limit - reserved {
+                condition.wait()
+            }
+            reserved += count
+            condition.unlock()
+        }
+
+        func release(_ count: Int) {
+            condition.lock()
+            reserved -= count
+            condition.broadcast()
+            condition.unlock()
+        }
+    }
+}
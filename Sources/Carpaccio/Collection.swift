@@ -20,88 +20,138 @@ public protocol ImageCollection: class {
 
 open class Collection: ImageCollection {
     private(set) open var displayTitle: String
-    private(set) open var images: AnyCollection<Image>
     private(set) open var URL: Foundation.URL?
 
+    /// The images of this collection, materialized once, so that every traversal sees the same `Image` objects.
+    public private(set) var imageStore: ImageStore
+
     public init(displayTitle: String, URL: Foundation.URL, images: AnyCollection<Image>) {
         self.displayTitle = displayTitle
         self.URL = URL
-        self.images = images
+        self.imageStore = ImageStore(images)
     }
 
     public init(contentsOf url: Foundation.URL) throws {
         self.URL = url
         self.displayTitle = url.lastPathComponent
-        self.images = try Collection.load(contentsOfURL: url)
+        self.imageStore = ImageStore(try Collection.load(contentsOfURL: url))
+    }
+
+    open var images: AnyCollection<Image> {
+        return AnyCollection(imageStore)
     }
 
     open func contains(image: Image) -> Bool {
-        return images.contains(image)
+        return imageStore.contains(image)
     }
 
     open var imageCount: Int {
-        return images.count
+        return imageStore.count
     }
 
     open var imageURLs: AnyCollection<URL> {
-        return AnyCollection<URL>(self.images.lazy.compactMap { image in
+        return AnyCollection<URL>(imageStore.lazy.compactMap { image in
             return image.URL
         })
     }
 
     open func updateImages(_ images: AnyCollection<Image>) {
-        self.images = images
+        self.imageStore = ImageStore(images)
     }
 
     /**
-     Return images found in this collection whose URL is included in given input array or URLs.
+     Apply changes to image files to this collection, without rebuilding it: new images are appended, images of removed
+     files removed, renamed images keep their `Image` objects under their new URLs, and modified images drop their
+     metadata and cached loaders. Returns the affected images.
      */
-    public func images(forURLs urls: [Foundation.URL]) -> [Image] {
-        return images.filter {
-            if let url = $0.URL {
-                return urls.contains(url)
+    @discardableResult
+    open func applyFileChanges(_ fileChanges: CollectionWatcher.FileChanges) -> CollectionWatcher.Changes {
+        var changes = CollectionWatcher.Changes()
+
+        for (previousURL, url) in fileChanges.renamed {
+            for index in imageStore.indices(of: previousURL) {
+                let image = imageStore[index]
+                imageStore.updateURL(of: image, to: url)
+                changes.renamed.append((image, previousURL))
             }
-            return false
         }
+
+        for url in fileChanges.modified {
+            for index in imageStore.indices(of: url) {
+                imageStore[index].fileContentsDidChange()
+                changes.modified.append(imageStore[index])
+            }
+        }
+
+        var removedIndices = IndexSet()
+        for url in fileChanges.removed {
+            removedIndices.formUnion(IndexSet(imageStore.indices(of: url)))
+        }
+        changes.removed = removedIndices.map { imageStore[$0] }
+        imageStore.remove(at: removedIndices)
+
+        changes.added = fileChanges.added.map { Image(URL: $0) }
+        imageStore.append(contentsOf: changes.added)
+
+        return changes
+    }
+
+    /// Rebuild the URL index of `imageStore`, after URLs of images in this collection have been changed with `Image.updateURL(_:)`.
+    public func imageURLsDidChange() {
+        imageStore.reindexURLs()
+    }
+
+    /**
+     Return images found in this collection whose URL is included in given input array or URLs.
+     */
+    public func images(forURLs urls: [Foundation.URL]) -> [Image] {
+        let indices = Set(urls.flatMap { imageStore.indices(of: $0) })
+        return indices.sorted().map { imageStore[$0] }
     }
 
     public typealias URLFilter = (URL) -> Bool
 
     // MARK: - Loading images from the local filesystem
+
+    /**
+     Return URLs of image files under `directoryURL`, sorted by path. Use `DirectoryWalker` directly to receive
+     URLs as they are found, rather than once the whole tree has been walked.
+
+     If `directoryURL` is a ZIP or TAR archive, its image members are listed from the archive's index instead,
+     with URLs which `ImageLoader` reads straight out of the archive. See `ImageArchive`.
+     */
     public class func imageURLs(
         at directoryURL: URL,
         filteringSubdirectoriesWith subdirectoryFilter: URLFilter? = nil
     ) throws -> [URL] {
-
-        guard let enumerator = FileManager.default.enumerator(atPath: directoryURL.path) else {
-            throw Image.Error.locationNotEnumerable(directoryURL)
-        }
-        
-        let urls: [URL] = enumerator.compactMap({
-            guard let relativePath = $0 as? String else {
-                return nil
-            }
-
-            let url = directoryURL.appendingPathComponent(relativePath).absoluteURL
-
-            if let attributes = enumerator.fileAttributes {
-                let type = attributes[.type] as! FileAttributeType
-                if type == .typeDirectory {
-                    if let filter = subdirectoryFilter, !filter(url) {
-                        enumerator.skipDescendants()
-                    }
-                } else if type == .typeRegular {
-                    let isImage = Image.imageFileExtensions.contains(url.pathExtension.lowercased())
-                    if isImage {
-                        return url
+        if ImageArchive.isArchive(at: directoryURL) {
+            return try ImageArchive.open(at: directoryURL).imageURLs().filter { url in
+                guard let filter = subdirectoryFilter else {
+                    return true
+                }
+                // Apply the filter to every directory between the archive and the member, as a walk would
+                var parentURL = url.deletingLastPathComponent()
+                while parentURL.path.count > directoryURL.standardizedFileURL.path.count {
+                    if !filter(parentURL) {
+                        return false
                     }
+                    parentURL = parentURL.deletingLastPathComponent()
                 }
+                return true
             }
+        }
 
-            return nil
-        })
+        var urls = [URL]()
+        let lock = NSLock()
+
+        try DirectoryWalker().walk(directoryURL, filteringSubdirectoriesWith: subdirectoryFilter) { url in
+            lock.lock()
+            urls.append(url)
+            lock.unlock()
+        }
 
-        return urls
+        // The walk is parallel, so sort for results that do not vary from one call to the next
+        return urls.sorted { $0.path < $1.path }
     }
 
     public typealias ImageLoadHandler = (_ index: Int, _ image: Image) -> Void
@@ -115,11 +165,12 @@ open class Collection: ImageCollection {
     }
 
     public class func loadImages(at imageURLs: [URL], loadHandler: ImageLoadHandler? = nil) throws -> AnyCollection<Image> {
-        let lazyImages = imageURLs.lazy.enumerated().compactMap { i, imageURL -> Image? in
-            let pathExtension = imageURL.pathExtension
-            
-            guard pathExtension.utf8.count > 0 else {
-                return nil
+        let images = imageURLs.enumerated().compactMap { i, imageURL -> Image? in
+            // Without an extension to go by, a file is an image if its content says so
+            if imageURL.pathExtension.isEmpty {
+                guard let source = try? ImageLoader.byteSource(for: imageURL), (try? ImageFormat(source: source)) != nil else {
+                    return nil
+                }
             }
             
             let image = Image(URL: imageURL)
@@ -128,17 +179,20 @@ open class Collection: ImageCollection {
             return image
         }
         
-        let images = AnyCollection<Image>(lazyImages)
-        return images
+        return AnyCollection<Image>(images)
     }
     
+    public typealias ImagesLoadedHandler = (_ images: AnyCollection<Image>) -> Void
+
     public class func loadAsynchronously(contentsOfURL URL:Foundation.URL,
                                          queue:DispatchQueue = DispatchQueue.global(),
                                          loadHandler: ImageLoadHandler? = nil,
+                                         completionHandler: ImagesLoadedHandler? = nil,
                                          errorHandler:@escaping ImageLoadErrorHandler) {
         queue.async {
             do {
-                _ = try load(contentsOfURL: URL, loadHandler: loadHandler)
+                let images = try load(contentsOfURL: URL, loadHandler: loadHandler)
+                completionHandler?(images)
             }
             catch {
                 errorHandler(Image.Error.loadingFailed(underlyingError: error))
@@ -146,11 +200,124 @@ open class Collection: ImageCollection {
         }
     }
 
+    /**
+     Load images under `URL` incrementally, reporting each image as soon as it is discovered and again once its
+     metadata has been loaded in the background. See `IncrementalCollectionLoader`.
+     */
+    @discardableResult
+    public class func loadIncrementally(contentsOfURL URL: Foundation.URL,
+                                        filteringSubdirectoriesWith subdirectoryFilter: URLFilter? = nil,
+                                        eventQueue: DispatchQueue = .main,
+                                        eventHandler: @escaping IncrementalCollectionLoader.EventHandler,
+                                        completion: IncrementalCollectionLoader.CompletionHandler? = nil) -> IncrementalCollectionLoader {
+        let loader = IncrementalCollectionLoader(contentsOf: URL, filteringSubdirectoriesWith: subdirectoryFilter)
+        loader.start(eventQueue: eventQueue, eventHandler: eventHandler, completion: completion)
+        return loader
+    }
+
+    private func imagesIndexedByURL() -> ([Image], [Foundation.URL: [Int]]) {
+        let images = Array(imageStore)
+        var indicesByURL = [Foundation.URL: [Int]]()
+        for (i, image) in images.enumerated() {
+            if let url = image.URL {
+                indicesByURL[url, default: []].append(i)
+            }
+        }
+        return (images, indicesByURL)
+    }
+
+    /**
+     Load metadata for all images in this collection, reading file headers and the IFDs they point to in large
+     batches with `reader`, then parsing metadata from memory. Returns once all images have been processed.
+     */
+    public func fetchMetadata(
+        using reader: BatchedFileReader = BatchedFileReader(),
+        loadHandler: ImageLoadHandler? = nil,
+        errorHandler: ImageLoadErrorHandler? = nil
+    ) {
+        let (images, indicesByURL) = imagesIndexedByURL()
+
+        let urls = Array(indicesByURL.keys)
+        let parseGroup = DispatchGroup()
+        let done = DispatchSemaphore(value: 0)
+
+        reader.read(urls, completion: { url, result in
+            // Parse off the reader's queue, so that it can keep reads in flight meanwhile
+            DispatchQueue.global().async(group: parseGroup) {
+                for i in indicesByURL[url] ?? [] {
+                    do {
+                        _ = try images[i].fetchMetadata(from: result.get())
+                        loadHandler?(i, images[i])
+                    } catch {
+                        errorHandler?(Image.Error.loadingFailed(underlyingError: error))
+                    }
+                }
+            }
+        }, finished: {
+            done.signal()
+        })
+
+        done.wait()
+        parseGroup.wait()
+    }
+
+    /**
+     Load metadata for all images in this collection one file at a time per device, in the order `scheduler` finds
+     the files to be laid out on disk. Intended for archives on spinning disks, where seeking dominates.
+     */
+    public func fetchMetadata(
+        scheduledBy scheduler: PhysicalOrderScheduler,
+        loadHandler: ImageLoadHandler? = nil,
+        errorHandler: ImageLoadErrorHandler? = nil
+    ) {
+        let (images, indicesByURL) = imagesIndexedByURL()
+
+        scheduler.perform(Array(indicesByURL.keys)) { url in
+            do {
+                if scheduler.accessHint == .dontNeed {
+                    // Read through a descriptor: pages of a mapping go through the page cache, whatever they are advised
+                    let fd = open(url.path, O_RDONLY)
+                    guard fd >= 0 else {
+                        throw ImageByteSourceError.failedToOpen(url: url, errno: errno)
+                    }
+                    var fileStat = stat()
+                    guard fstat(fd, &fileStat) == 0 else {
+                        let error = errno
+                        close(fd)
+                        throw ImageByteSourceError.failedToOpen(url: url, errno: error)
+                    }
+                    let fileRange = 0 ..< Int(fileStat.st_size)
+                    scheduler.accessHint.apply(to: fd, range: fileRange)
+                    defer {
+                        scheduler.accessHint.applyAfterReading(to: fd, range: fileRange)
+                        close(fd)
+                    }
+                    let source = RangeReadableByteSource(url: url, count: fileRange.count, readRange: BatchedFileReader.preadReader(for: fd, url: url))
+                    try fetchMetadata(at: indicesByURL[url] ?? [], of: images, from: source, loadHandler: loadHandler)
+                } else {
+                    // A private mapping rather than one from the shared pool, so that it is gone as soon as we are done
+                    let source = try MappedFileByteSource(fileURL: url)
+                    source.advise(scheduler.accessHint, range: nil)
+                    try fetchMetadata(at: indicesByURL[url] ?? [], of: images, from: source, loadHandler: loadHandler)
+                }
+            } catch {
+                errorHandler?(Image.Error.loadingFailed(underlyingError: error))
+            }
+        }
+    }
+
+    private func fetchMetadata(at indices: [Int], of images: [Image], from source: ImageByteSource, loadHandler: ImageLoadHandler?) throws {
+        for i in indices {
+            _ = try images[i].fetchMetadata(from: source)
+            loadHandler?(i, images[i])
+        }
+    }
+
     // TODO: Create a specific type for a sparse distance matrix.
     public func distanceMatrix(_ distance:Image.DistanceFunction) -> [[Double]] {
-        return images.indices.lazy.compactMap { i in
+        return imageStore.indices.lazy.compactMap { i in
             var row = [Double]()
-            for e in images.indices {
+            for e in imageStore.indices {
                 if e == i {
                     row.append(0)
                 }
@@ -159,10 +326,10 @@ open class Collection: ImageCollection {
                 }
             }
             
-            let iSuccessor = self.images.indices.index(after: i)
-            for j in (self.images.indices.suffix(from: iSuccessor)) {
-                let col = self.images.indices.distance(from: self.images.indices.startIndex, to: j)
-                row[col] = distance(images[i], images[j])
+            let iSuccessor = self.imageStore.indices.index(after: i)
+            for j in (self.imageStore.indices.suffix(from: iSuccessor)) {
+                let col = self.imageStore.indices.distance(from: self.imageStore.indices.startIndex, to: j)
+                row[col] = distance(imageStore[i], imageStore[j])
             }
 
             return row
@@ -175,11 +342,11 @@ open class Collection: ImageCollection {
         
         if (distMatrix.count == 0) { return [[Double]]() }
         
-        return images.indices.map { i in
-            let iDist = images.indices.distance(from: images.indices.startIndex, to: i)
+        return imageStore.indices.map { i in
+            let iDist = imageStore.indices.distance(from: imageStore.indices.startIndex, to: i)
             
-            return images.indices.map { j in
-                let jDist = images.indices.distance(from: images.indices.startIndex, to: j)
+            return imageStore.indices.map { j in
+                let jDist = imageStore.indices.distance(from: imageStore.indices.startIndex, to: j)
             
                 if j < i {
                     return distMatrix[jDist][iDist]
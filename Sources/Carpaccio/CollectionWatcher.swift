@@ -0,0 +1,651 @@
+//
+//  CollectionWatcher.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+#if os(macOS)
+import CoreServices
+#endif
+
+/**
+
+ Keeps a `Collection` in sync with the directory tree it was loaded from, applying additions, removals, renames and
+ modifications of image files incrementally, rather than reloading the whole collection.
+
+ On macOS, changes are received as file level FSEvents. Elsewhere, each watched directory is watched with a kqueue
+ vnode source, which reports files being added, removed and renamed in it; files modified in place are caught by a
+ rescan of the tree, made at an interval which backs off while nothing changes. With `Mode.polling`, the tree is only
+ rescanned, at a fixed interval. Either way, the watcher keeps a snapshot of the size, modification time and inode
+ of every image file, and only rechecks the files and directories events point at, so keeping a large folder current
+ costs next to nothing while it is idle. Files which disappear and reappear elsewhere with the same inode are reported as renames,
+ and keep their `Image` objects (and with them, loaded metadata).
+
+ Only what changed is invalidated: the byte source pool entries and cached attributes of changed files, and the
+ metadata and loaders of modified images.
+
+ */
+public final class CollectionWatcher {
+    public enum Mode {
+        /**
+         File system events: FSEvents on macOS, otherwise kqueue directory events, with a rescan for files modified in
+         place backing off from every `minimumPollInterval` to every `maximumPollInterval` seconds while idle.
+         */
+        case automatic
+        /** Rescan the tree every `interval` seconds. */
+        case polling(interval: TimeInterval)
+    }
+
+    /** Changes to files, as found by the watcher. */
+    public struct FileChanges {
+        public var added = [URL]()
+        public var removed = [URL]()
+        public var renamed = [(from: URL, to: URL)]()
+        public var modified = [URL]()
+
+        public init() {
+        }
+
+        public var isEmpty: Bool {
+            return added.isEmpty && removed.isEmpty && renamed.isEmpty && modified.isEmpty
+        }
+    }
+
+    /** Changes to images of a collection, as applied by `Collection.applyFileChanges(_:)`. */
+    public struct Changes {
+        public var added = [Image]()
+        public var removed = [Image]()
+        public var renamed = [(image: Image, previousURL: URL)]()
+        public var modified = [Image]()
+
+        public init() {
+        }
+
+        public var isEmpty: Bool {
+            return added.isEmpty && removed.isEmpty && renamed.isEmpty && modified.isEmpty
+        }
+    }
+
+    public typealias ChangeHandler = (_ changes: Changes) -> Void
+
+    /** Rescan intervals of `Mode.automatic` without FSEvents, after a change and when idle for long. */
+    public static let minimumPollInterval: TimeInterval = 2
+    public static let maximumPollInterval: TimeInterval = 120
+
+    public let directoryURL: URL
+    public let subdirectoryFilter: Collection.URLFilter?
+    public let mode: Mode
+
+    /** How long events are gathered for before being applied, so that a burst of writes is applied at once. */
+    public let latency: TimeInterval
+
+    private weak var collection: Collection?
+    private let extensions: Set<String>
+    private let rootPath: String
+    private let watchQueue = DispatchQueue(label: "com.sashimiapp.CollectionWatcherQueue")
+
+    private var snapshot = Snapshot()
+    private var isRunning = false
+    private var handlerQueue = DispatchQueue.main
+    private var changeHandler: ChangeHandler?
+    private var pollTimer: DispatchSourceTimer?
+    private var pollInterval: TimeInterval = 0
+
+    /** kqueue sources of watched directories, by path, where FSEvents is not used. */
+    private var directorySources = [String: DispatchSourceFileSystemObject]()
+    private var isWatchingDirectories = false
+    /** Directories with events not yet rechecked, gathered for `latency`. */
+    private var pendingDirectories = Set<String>()
+
+    #if os(macOS)
+    private var eventStream: FSEventStreamRef?
+    /** FSEvents reports paths with symbolic links resolved, which may differ from `rootPath`. */
+    private var resolvedRootPath: String
+    #endif
+
+    /** Image files and subdirectories per directory, by path. Every directory known to the watcher has an entry. */
+    private struct Snapshot {
+        var files = [String: FileAttributes]()
+        var fileNames = [String: Set<String>]()
+        var subdirectoryNames = [String: Set<String>]()
+
+        func isKnownDirectory(_ path: String) -> Bool {
+            return subdirectoryNames[path] != nil
+        }
+    }
+
+    /** Differences found by one round of rechecks, by path. */
+    private struct Diff {
+        var added = [String: FileAttributes]()
+        var removed = [String: FileAttributes]()
+        var modified = [String: FileAttributes]()
+    }
+
+    /**
+     - parameter collection: The collection to keep current. It is not retained.
+     - parameter directoryURL: The directory to watch. Defaults to the collection's URL.
+     */
+    public init(
+        collection: Collection,
+        directoryURL: URL? = nil,
+        filteringSubdirectoriesWith subdirectoryFilter: Collection.URLFilter? = nil,
+        mode: Mode = .automatic,
+        latency: TimeInterval = 0.25,
+        matchingExtensions extensions: Set<String> = Image.imageFileExtensions
+    ) throws {
+        guard let directoryURL = directoryURL ?? collection.URL, directoryURL.isFileURL else {
+            throw Image.Error.locationNotEnumerable(directoryURL ?? collection.URL ?? Foundation.URL(fileURLWithPath: "/"))
+        }
+        self.collection = collection
+        self.directoryURL = directoryURL
+        self.subdirectoryFilter = subdirectoryFilter
+        self.mode = mode
+        self.latency = latency
+        self.extensions = Set(extensions.map { $0.lowercased() })
+        self.rootPath = directoryURL.standardizedFileURL.path
+        #if os(macOS)
+        self.resolvedRootPath = directoryURL.standardizedFileURL.resolvingSymlinksInPath().path
+        #endif
+    }
+
+    deinit {
+        // Nothing else can be using the watcher, so no need to go through `watchQueue` (which this may be running on)
+        tearDown()
+    }
+
+    /**
+     Start watching. The tree is scanned first, and any differences from the collection's current images are applied
+     straight away. Call from the thread or queue which owns the collection: changes are applied to the collection,
+     and `changeHandler` called, on `queue`.
+     */
+    public func start(queue: DispatchQueue = .main, changeHandler: ChangeHandler? = nil) throws {
+        guard let collection = collection else {
+            return
+        }
+        let collectionPaths = Set(collection.imageURLs.lazy.map { $0.standardizedFileURL.path }.filter { $0.hasPrefix(self.rootPath + "/") })
+
+        let initialChanges: FileChanges = try watchQueue.sync {
+            guard !isRunning else {
+                return FileChanges()
+            }
+            guard CollectionWatcher.isDirectory(rootPath) else {
+                throw Image.Error.locationNotEnumerable(directoryURL)
+            }
+
+            handlerQueue = queue
+            self.changeHandler = changeHandler
+            snapshot = Snapshot()
+            snapshot.subdirectoryNames[rootPath] = []
+            var diff = Diff()
+            rescan(rootPath, recursive: true, into: &diff)
+
+            // Reconcile with the collection, which may have been loaded a while ago
+            var changes = FileChanges()
+            let snapshotPaths = Set(snapshot.files.keys)
+            changes.added = snapshotPaths.subtracting(collectionPaths).sorted().map { Foundation.URL(fileURLWithPath: $0) }
+            changes.removed = collectionPaths.subtracting(snapshotPaths).sorted().map { Foundation.URL(fileURLWithPath: $0) }
+
+            isRunning = true
+            startObserving()
+            return changes
+        }
+
+        if !initialChanges.isEmpty {
+            deliver(initialChanges)
+        }
+    }
+
+    public func stop() {
+        watchQueue.sync {
+            guard isRunning else {
+                return
+            }
+            tearDown()
+        }
+    }
+
+    private func tearDown() {
+        isRunning = false
+        pollTimer?.cancel()
+        pollTimer = nil
+        isWatchingDirectories = false
+        for source in directorySources.values {
+            source.cancel()
+        }
+        directorySources.removeAll()
+        pendingDirectories.removeAll()
+        #if os(macOS)
+        if let stream = eventStream {
+            FSEventStreamStop(stream)
+            FSEventStreamInvalidate(stream)
+            FSEventStreamRelease(stream)
+            eventStream = nil
+        }
+        #endif
+    }
+
+    // MARK: Observing
+
+    // Called on `watchQueue`.
+    private func startObserving() {
+        switch mode {
+        case .polling(let interval):
+            startPolling(interval: interval, backingOffTo: interval)
+        case .automatic:
+            #if os(macOS)
+            if startEventStream() {
+                return
+            }
+            #endif
+            // Directory events cover additions, removals and renames; only modifications in place are left to rescans
+            isWatchingDirectories = true
+            updateDirectorySources()
+            startPolling(interval: CollectionWatcher.minimumPollInterval, backingOffTo: CollectionWatcher.maximumPollInterval)
+        }
+    }
+
+    /** Rescan the tree after `interval`, doubling it up to `maximumInterval` for as long as rescans find nothing. */
+    private func startPolling(interval: TimeInterval, backingOffTo maximumInterval: TimeInterval) {
+        let timer = DispatchSource.makeTimerSource(queue: watchQueue)
+        let leeway = DispatchTimeInterval.milliseconds(Int(latency * 1000))
+        timer.setEventHandler { [weak self, unowned timer] in
+            guard let self = self else {
+                return
+            }
+            let changed = self.recheck(files: [], directories: [], subtrees: [self.rootPath])
+            self.pollInterval = changed ? interval : min(self.pollInterval * 2, maximumInterval)
+            timer.schedule(deadline: .now() + self.pollInterval, leeway: leeway)
+        }
+        pollInterval = interval
+        timer.schedule(deadline: .now() + interval, leeway: leeway)
+        timer.resume()
+        pollTimer = timer
+    }
+
+    /** Watch every directory in the snapshot, and no others, with a kqueue source. */
+    private func updateDirectorySources() {
+        guard isWatchingDirectories else {
+            return
+        }
+        for (path, source) in directorySources where !snapshot.isKnownDirectory(path) {
+            source.cancel()
+            directorySources[path] = nil
+        }
+        for path in snapshot.subdirectoryNames.keys where directorySources[path] == nil {
+            let fd = open(path, O_EVTONLY)
+            guard fd >= 0 else {
+                continue
+            }
+            let source = DispatchSource.makeFileSystemObjectSource(fileDescriptor: fd, eventMask: [.write, .delete, .rename], queue: watchQueue)
+            source.setEventHandler { [weak self] in
+                self?.directoryChanged(path)
+            }
+            source.setCancelHandler {
+                close(fd)
+            }
+            source.resume()
+            directorySources[path] = source
+        }
+    }
+
+    /** Gather events from directories for `latency`, then recheck all of them at once. */
+    private func directoryChanged(_ path: String) {
+        let isFirst = pendingDirectories.isEmpty
+        pendingDirectories.insert(path)
+        guard isFirst else {
+            return
+        }
+        watchQueue.asyncAfter(deadline: .now() + latency) { [weak self] in
+            guard let self = self else {
+                return
+            }
+            let directories = self.pendingDirectories
+            self.pendingDirectories.removeAll()
+            self.recheck(files: [], directories: directories, subtrees: [])
+        }
+    }
+
+    #if os(macOS)
+    private func startEventStream() -> Bool {
+        var context = FSEventStreamContext(version: 0, info: Unmanaged.passUnretained(self).toOpaque(), retain: nil, release: nil, copyDescription: nil)
+        let callback: FSEventStreamCallback = { _, info, eventCount, eventPaths, eventFlags, _ in
+            guard let info = info else {
+                return
+            }
+            let watcher = Unmanaged<CollectionWatcher>.fromOpaque(info).takeUnretainedValue()
+            let paths = unsafeBitCast(eventPaths, to: NSArray.self) as? [String] ?? []
+            let flags = UnsafeBufferPointer(start: eventFlags, count: eventCount).map { $0 }
+            watcher.received(paths: paths, flags: flags)
+        }
+
+        let flags = FSEventStreamCreateFlags(kFSEventStreamCreateFlagUseCFTypes | kFSEventStreamCreateFlagFileEvents | kFSEventStreamCreateFlagWatchRoot)
+        guard let stream = FSEventStreamCreate(kCFAllocatorDefault, callback, &context, [rootPath] as CFArray,
+                                               FSEventStreamEventId(kFSEventStreamEventIdSinceNow), latency, flags) else {
+            return false
+        }
+        FSEventStreamSetDispatchQueue(stream, watchQueue)
+        guard FSEventStreamStart(stream) else {
+            FSEventStreamInvalidate(stream)
+            FSEventStreamRelease(stream)
+            return false
+        }
+        eventStream = stream
+        return true
+    }
+
+    // Called on `watchQueue`.
+    private func received(paths: [String], flags: [FSEventStreamEventFlags]) {
+        var files = Set<String>(), directories = Set<String>(), subtrees = Set<String>()
+
+        for (eventPath, eventFlags) in zip(paths, flags) {
+            if eventFlags & FSEventStreamEventFlags(kFSEventStreamEventFlagRootChanged) != 0 {
+                subtrees.insert(rootPath)
+                continue
+            }
+            guard let path = watchedPath(forEventPath: eventPath) else {
+                continue
+            }
+            if eventFlags & FSEventStreamEventFlags(kFSEventStreamEventFlagMustScanSubDirs) != 0 {
+                subtrees.insert(path)
+            } else if eventFlags & FSEventStreamEventFlags(kFSEventStreamEventFlagItemIsDir) != 0 {
+                // A directory was created, removed or renamed: its parent lists the change
+                directories.insert(path == rootPath ? path : CollectionWatcher.parentPath(of: path))
+            } else {
+                files.insert(path)
+            }
+        }
+
+        recheck(files: files, directories: directories, subtrees: subtrees)
+    }
+
+    private func watchedPath(forEventPath eventPath: String) -> String? {
+        let path = eventPath.count > 1 && eventPath.hasSuffix("/") ? String(eventPath.dropLast()) : eventPath
+        for root in [rootPath, resolvedRootPath] {
+            if path == root {
+                return rootPath
+            }
+            if path.hasPrefix(root + "/") {
+                return rootPath + path.dropFirst(root.count)
+            }
+        }
+        return nil
+    }
+    #endif
+
+    // MARK: Rechecking
+
+    /** Recheck what events point at, delivering any changes found. Returns whether there were any. Called on `watchQueue`. */
+    @discardableResult
+    private func recheck(files: Set<String>, directories: Set<String>, subtrees: Set<String>) -> Bool {
+        guard isRunning else {
+            return false
+        }
+
+        var diff = Diff()
+        for path in subtrees {
+            rescan(path, recursive: true, into: &diff)
+        }
+        for path in directories.subtracting(subtrees) {
+            rescan(path, recursive: false, into: &diff)
+        }
+        for path in files {
+            recheckFile(path, into: &diff)
+        }
+
+        updateDirectorySources()
+
+        let changes = fileChanges(from: diff)
+        if !changes.isEmpty {
+            deliver(changes)
+        }
+        return !changes.isEmpty
+    }
+
+    /** Compare a directory's current contents with the snapshot, descending into new subdirectories (and, if `recursive`, all of them). */
+    private func rescan(_ directory: String, recursive: Bool, into diff: inout Diff) {
+        guard directory == rootPath || directory.hasPrefix(rootPath + "/") else {
+            return
+        }
+        guard snapshot.isKnownDirectory(directory) else {
+            if directory != rootPath {
+                // New, or filtered out: rescanning the parent finds it, if it is to be watched
+                rescan(CollectionWatcher.parentPath(of: directory), recursive: false, into: &diff)
+            } else if CollectionWatcher.isDirectory(rootPath) {
+                // The root was removed, and has come back
+                snapshot.subdirectoryNames[rootPath] = []
+                rescan(rootPath, recursive: true, into: &diff)
+            }
+            return
+        }
+        guard let listing = list(directory) else {
+            removeTree(directory, into: &diff)
+            return
+        }
+
+        let prefix = directory == "/" ? "/" : directory + "/"
+
+        let oldNames = snapshot.fileNames[directory] ?? []
+        for name in oldNames.subtracting(listing.files.keys) {
+            let path = prefix + name
+            if let attributes = snapshot.files.removeValue(forKey: path) {
+                diff.removed[path] = attributes
+            }
+        }
+        for (name, attributes) in listing.files {
+            let path = prefix + name
+            if let old = snapshot.files[path] {
+                if old != attributes {
+                    diff.modified[path] = attributes
+                }
+            } else {
+                diff.added[path] = attributes
+            }
+            snapshot.files[path] = attributes
+        }
+        snapshot.fileNames[directory] = Set(listing.files.keys)
+
+        let oldSubdirectories = snapshot.subdirectoryNames[directory] ?? []
+        var subdirectories = Set<String>()
+        for name in oldSubdirectories.subtracting(listing.subdirectories) {
+            removeTree(prefix + name, into: &diff)
+        }
+        for name in listing.subdirectories {
+            let path = prefix + name
+            if oldSubdirectories.contains(name) {
+                subdirectories.insert(name)
+                if recursive {
+                    rescan(path, recursive: true, into: &diff)
+                }
+            } else if subdirectoryFilter?(Foundation.URL(fileURLWithPath: path, isDirectory: true)) ?? true {
+                subdirectories.insert(name)
+                snapshot.subdirectoryNames[path] = []
+                rescan(path, recursive: true, into: &diff)
+            }
+        }
+        snapshot.subdirectoryNames[directory] = subdirectories
+    }
+
+    private func recheckFile(_ path: String, into diff: inout Diff) {
+        let directory = CollectionWatcher.parentPath(of: path)
+        guard snapshot.isKnownDirectory(directory) else {
+            rescan(directory, recursive: false, into: &diff)
+            return
+        }
+        let name = CollectionWatcher.lastPathComponent(of: path)
+        guard matchesExtension(name) else {
+            return
+        }
+
+        let attributes = CollectionWatcher.regularFileAttributes(atPath: path)
+        switch (snapshot.files[path], attributes) {
+        case (let old?, nil):
+            diff.removed[path] = old
+            snapshot.files[path] = nil
+            snapshot.fileNames[directory]?.remove(name)
+        case (nil, let new?):
+            diff.added[path] = new
+            snapshot.files[path] = new
+            snapshot.fileNames[directory, default: []].insert(name)
+        case (let old?, let new?) where old != new:
+            diff.modified[path] = new
+            snapshot.files[path] = new
+        default:
+            break
+        }
+    }
+
+    private func removeTree(_ directory: String, into diff: inout Diff) {
+        let prefix = directory == "/" ? "/" : directory + "/"
+        for name in snapshot.fileNames.removeValue(forKey: directory) ?? [] {
+            if let attributes = snapshot.files.removeValue(forKey: prefix + name) {
+                diff.removed[prefix + name] = attributes
+            }
+        }
+        for name in snapshot.subdirectoryNames.removeValue(forKey: directory) ?? [] {
+            removeTree(prefix + name, into: &diff)
+        }
+        if directory != rootPath {
+            snapshot.subdirectoryNames[CollectionWatcher.parentPath(of: directory)]?.remove(CollectionWatcher.lastPathComponent(of: directory))
+        }
+    }
+
+    /** Pair removals and additions of the same file (by device and inode) into renames, and invalidate caches of changed files. */
+    private func fileChanges(from diff: Diff) -> FileChanges {
+        var removedByInode = [FileID: String]()
+        for (path, attributes) in diff.removed {
+            removedByInode[FileID(attributes)] = path
+        }
+
+        var changes = FileChanges()
+        var renamedFrom = Set<String>()
+        for (path, attributes) in diff.added.sorted(by: { $0.key < $1.key }) {
+            if let previousPath = removedByInode[FileID(attributes)], !renamedFrom.contains(previousPath) {
+                renamedFrom.insert(previousPath)
+                changes.renamed.append((Foundation.URL(fileURLWithPath: previousPath), Foundation.URL(fileURLWithPath: path)))
+            } else {
+                changes.added.append(Foundation.URL(fileURLWithPath: path))
+            }
+        }
+        changes.removed = diff.removed.keys.filter { !renamedFrom.contains($0) }.sorted().map { Foundation.URL(fileURLWithPath: $0) }
+        changes.modified = diff.modified.keys.sorted().map { Foundation.URL(fileURLWithPath: $0) }
+
+        let attributeCache = FileAttributeCache.shared
+        for (path, attributes) in diff.added.merging(diff.modified, uniquingKeysWith: { $1 }) {
+            attributeCache.store(attributes, forPath: path)
+        }
+        for url in changes.modified {
+            ImageByteSourcePool.shared.invalidate(url)
+        }
+        for url in changes.removed + changes.renamed.map({ $0.from }) {
+            ImageByteSourcePool.shared.invalidate(url)
+            attributeCache.invalidate(url)
+        }
+        return changes
+    }
+
+    private func deliver(_ changes: FileChanges) {
+        handlerQueue.async { [weak self] in
+            guard let self = self, let collection = self.collection else {
+                return
+            }
+            let applied = collection.applyFileChanges(changes)
+            if !applied.isEmpty {
+                self.changeHandler?(applied)
+            }
+        }
+    }
+
+    // MARK: File system
+
+    private struct FileID: Hashable {
+        let device: UInt64
+        let inode: UInt64
+
+        init(_ attributes: FileAttributes) {
+            self.device = attributes.device
+            self.inode = attributes.inode
+        }
+    }
+
+    private struct Listing {
+        var files = [String: FileAttributes]()
+        var subdirectories = Set<String>()
+    }
+
+    private func matchesExtension(_ name: String) -> Bool {
+        guard let dot = name.lastIndex(of: "."), dot != name.startIndex else {
+            return false
+        }
+        return extensions.contains(name[name.index(after: dot)...].lowercased())
+    }
+
+    /** Matching regular files, with their attributes, and subdirectories of `directory`. `nil` if it cannot be read. */
+    private func list(_ directory: String) -> Listing? {
+        let directoryFD = open(directory, O_RDONLY | O_DIRECTORY)
+        guard directoryFD >= 0 else {
+            return nil
+        }
+        guard let stream = fdopendir(directoryFD) else {
+            close(directoryFD)
+            return nil
+        }
+        defer {
+            closedir(stream)
+        }
+
+        var listing = Listing()
+        while let entry = readdir(stream) {
+            let nameCapacity = MemoryLayout.size(ofValue: entry.pointee.d_name)
+            let name = withUnsafeMutablePointer(to: &entry.pointee.d_name) { tuple in
+                tuple.withMemoryRebound(to: CChar.self, capacity: nameCapacity) { String(cString: $0) }
+            }
+            guard name != ".", name != ".." else {
+                continue
+            }
+
+            var fileStat = stat()
+            guard fstatat(directoryFD, name, &fileStat, AT_SYMLINK_NOFOLLOW) == 0 else {
+                continue
+            }
+            switch fileStat.st_mode & S_IFMT {
+            case S_IFDIR:
+                listing.subdirectories.insert(name)
+            case S_IFREG where matchesExtension(name):
+                listing.files[name] = FileAttributes(fileStat)
+            default:
+                break
+            }
+        }
+        return listing
+    }
+
+    private static func regularFileAttributes(atPath path: String) -> FileAttributes? {
+        var fileStat = stat()
+        guard lstat(path, &fileStat) == 0, fileStat.st_mode & S_IFMT == S_IFREG else {
+            return nil
+        }
+        return FileAttributes(fileStat)
+    }
+
+    private static func isDirectory(_ path: String) -> Bool {
+        var fileStat = stat()
+        return stat(path, &fileStat) == 0 && fileStat.st_mode & S_IFMT == S_IFDIR
+    }
+
+    private static func lastPathComponent(of path: String) -> String {
+        guard let slash = path.lastIndex(of: "/") else {
+            return path
+        }
+        return String(path[path.index(after: slash)...])
+    }
+
+    private static func parentPath(of path: String) -> String {
+        guard let slash = path.lastIndex(of: "/") else {
+            return path
+        }
+        return slash == path.startIndex ? "/" : String(path[..<slash])
+    }
+}
@@ -0,0 +1,242 @@
+//
+//  DNGLayout.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+public enum DNGLayoutError: Swift.Error, LocalizedError {
+    case notDNG
+    case invalidRendition(ifdOffset: Int)
+
+    public var errorDescription: String? {
+        switch self {
+        case .notDNG:
+            return "TIFF structure has no DNGVersion tag"
+        case .invalidRendition(let offset):
+            return "Directory at offset \(offset) has tiles or strips beyond the addressable range"
+        }
+    }
+}
+
+/**
+
+ The renditions of a DNG file: the main image (usually the full size RAW data, in IFD0 or a SubIFD), reduced
+ resolution previews and transparency masks, each with its encoding and the location of its strips or tiles.
+
+ Previews are listed for thumbnails to be decoded from the cheapest one that is large enough, rather than from the
+ RAW data; RAW data tiles are listed for decoding them in parallel.
+
+ */
+public struct DNGLayout {
+    public enum Compression {
+        public static let none = 1
+        public static let oldJPEG = 6
+        public static let jpeg = 7
+        public static let deflate = 8
+        public static let lossyJPEG = 34892
+    }
+
+    public enum PhotometricInterpretation {
+        public static let rgb = 2
+        public static let yCbCr = 6
+        public static let colorFilterArray = 32803
+        public static let linearRaw = 34892
+    }
+
+    /** A strip or tile of a rendition: where it lies in the image, and where its encoded bytes lie in the file. */
+    public struct Tile: Equatable {
+        public let x: Int
+        public let y: Int
+        public let width: Int
+        public let height: Int
+        public let range: Range<Int>
+    }
+
+    public struct Rendition {
+        public let ifd: TIFFIFD
+        /** Bit 0: reduced resolution version of another image; bit 2: transparency mask. */
+        public let newSubfileType: Int
+        public let compression: Int
+        public let photometricInterpretation: Int
+        public let width: Int
+        public let height: Int
+        public let bitsPerSample: Int
+        public let samplesPerPixel: Int
+        /** Tile dimensions, or `nil` if the rendition is stored in strips. */
+        public let tileSize: CGSize?
+        /** Strips or tiles, in the order they are listed in the directory. */
+        public let tiles: [Tile]
+
+        public var size: CGSize {
+            return CGSize(width: width, height: height)
+        }
+
+        public var isReducedResolution: Bool {
+            return newSubfileType & 1 != 0
+        }
+
+        public var isTransparencyMask: Bool {
+            return newSubfileType & 4 != 0
+        }
+
+        /** Sensor data, as opposed to a rendered preview or a mask. */
+        public var isRAW: Bool {
+            return !isTransparencyMask
+                && (photometricInterpretation == PhotometricInterpretation.colorFilterArray || photometricInterpretation == PhotometricInterpretation.linearRaw)
+        }
+
+        public var byteCount: Int {
+            return tiles.reduce(0) { $0 + $1.range.count }
+        }
+
+        /**
+         The range of a rendered preview stored as one complete 8-bit JPEG stream, which ImageIO decodes as is. `nil`
+         for renditions needing a TIFF reader, such as tiled or uncompressed ones.
+         */
+        public var standaloneJPEGRange: Range<Int>? {
+            guard !isRAW, !isTransparencyMask, compression == Compression.jpeg || compression == Compression.oldJPEG || compression == Compression.lossyJPEG,
+                  bitsPerSample == 8, tiles.count == 1 else {
+                return nil
+            }
+            return tiles[0].range
+        }
+    }
+
+    public let structure: TIFFStructure
+    /** The DNGVersion tag, such as [1, 4, 0, 0]. */
+    public let version: [Int]
+    public let renditions: [Rendition]
+
+    public init(structure: TIFFStructure, in source: ImageByteSource) throws {
+        guard let ifd0 = structure.mainIFDs.first, let versionEntry = ifd0.entry(TIFFStructure.Tag.dngVersion) else {
+            throw DNGLayoutError.notDNG
+        }
+        self.structure = structure
+        self.version = try structure.intValues(of: versionEntry, in: source)
+        self.renditions = structure.ifds.filter { $0.kind != .exif }.compactMap { try? DNGLayout.rendition(of: $0, in: structure, source: source) }
+    }
+
+    /** The layout of a byte source, parsed once and cached in the source's container cache. */
+    public static func read(from source: ImageByteSource) throws -> DNGLayout {
+        let structure = try TIFFStructure.read(from: source)
+        return try source.containerCache.value(forKey: "com.sashimiapp.DNG.layout") {
+            try DNGLayout(structure: structure, in: source)
+        }
+    }
+
+    /** Whether a TIFF structure is that of a DNG file. */
+    public static func isDNG(_ structure: TIFFStructure) -> Bool {
+        return structure.mainIFDs.first?.entry(TIFFStructure.Tag.dngVersion) != nil
+    }
+
+    /** The full resolution RAW data. */
+    public var raw: Rendition? {
+        return renditions.filter { $0.isRAW && !$0.isReducedResolution }.max { Double($0.width) * Double($0.height) < Double($1.width) * Double($1.height) }
+    }
+
+    /** Rendered previews ImageIO can decode on their own, smallest first; between equal sizes, fewest bytes first. */
+    public var previews: [EmbeddedPreview] {
+        return renditions.compactMap { rendition in
+            rendition.standaloneJPEGRange.map { EmbeddedPreview(range: $0, size: rendition.size) }
+        }.sorted { ($0.pixelCount, $0.range.count) < ($1.pixelCount, $1.range.count) }
+    }
+
+    /**
+     Read each tile of `rendition` and pass its bytes to `body`, with tiles read and handled concurrently. Bytes of
+     memory mapped sources are not copied. Rethrows the first error thrown by a read or by `body`.
+     */
+    public func forEachTile(of rendition: Rendition, in source: ImageByteSource, _ body: (Tile, Data) throws -> Void) throws {
+        var firstError: Swift.Error? = nil
+        let errorLock = NSLock()
+        DispatchQueue.concurrentPerform(iterations: rendition.tiles.count) { i in
+            do {
+                let tile = rendition.tiles[i]
+                try body(tile, source.bytes(in: tile.range))
+            } catch {
+                errorLock.lock()
+                firstError = firstError ?? error
+                errorLock.unlock()
+            }
+        }
+        if let error = firstError {
+            throw error
+        }
+    }
+
+    // MARK: Reading directories
+
+    /**
+     The layout of the image of a directory. Used for the RAW data directories of other TIFF based formats, too.
+     Throws if the positions of its tiles or strips overflow.
+     */
+    static func rendition(of ifd: TIFFIFD, in structure: TIFFStructure, source: ImageByteSource) throws -> Rendition? {
+        typealias Tag = TIFFStructure.Tag
+
+        func checked(_ result: (partialValue: Int, overflow: Bool)) throws -> Int {
+            guard !result.overflow else {
+                throw DNGLayoutError.invalidRendition(ifdOffset: ifd.offset)
+            }
+            return result.partialValue
+        }
+
+        func integers(_ tag: UInt16) -> [Int] {
+            guard let entry = ifd.entry(tag), let values = try? structure.integerValues(of: entry, in: source) else {
+                return []
+            }
+            return values.map { Int(clamping: $0) }
+        }
+
+        guard let width = integers(Tag.imageWidth).first, let height = integers(Tag.imageLength).first, width > 0, height > 0 else {
+            return nil
+        }
+
+        var tiles = [Tile]()
+        var tileSize: CGSize? = nil
+        if let tileWidth = integers(Tag.tileWidth).first, let tileLength = integers(Tag.tileLength).first, tileWidth > 0, tileLength > 0 {
+            tileSize = CGSize(width: tileWidth, height: tileLength)
+            let tilesAcross = try checked(width.addingReportingOverflow(tileWidth - 1)) / tileWidth
+            for (i, (offset, byteCount)) in zip(integers(Tag.tileOffsets), integers(Tag.tileByteCounts)).enumerated() {
+                let x = (i % tilesAcross) * tileWidth, y = try checked((i / tilesAcross).multipliedReportingOverflow(by: tileLength))
+                guard y < height else {
+                    break
+                }
+                let start = try checked(structure.baseOffset.addingReportingOverflow(offset))
+                let end = try checked(start.addingReportingOverflow(byteCount))
+                tiles.append(Tile(x: x, y: y, width: min(tileWidth, width - x), height: min(tileLength, height - y), range: start ..< end))
+            }
+        } else {
+            let rowsPerStrip = integers(Tag.rowsPerStrip).first.flatMap { $0 > 0 ? $0 : nil } ?? height
+            for (i, (offset, byteCount)) in zip(integers(Tag.stripOffsets), integers(Tag.stripByteCounts)).enumerated() {
+                let y = try checked(i.multipliedReportingOverflow(by: rowsPerStrip))
+                guard y < height else {
+                    break
+                }
+                let start = try checked(structure.baseOffset.addingReportingOverflow(offset))
+                let end = try checked(start.addingReportingOverflow(byteCount))
+                tiles.append(Tile(x: 0, y: y, width: width, height: min(rowsPerStrip, height - y), range: start ..< end))
+            }
+        }
+        tiles = tiles.filter { $0.range.lowerBound >= 0 && $0.range.upperBound <= source.count }
+
+        return Rendition(
+            ifd: ifd,
+            newSubfileType: integers(Tag.newSubfileType).first ?? 0,
+            compression: integers(Tag.compression).first ?? Compression.none,
+            photometricInterpretation: integers(Tag.photometricInterpretation).first ?? -1,
+            width: width,
+            height: height,
+            bitsPerSample: integers(Tag.bitsPerSample).first ?? 1,
+            samplesPerPixel: integers(Tag.samplesPerPixel).first ?? 1,
+            tileSize: tileSize,
+            tiles: tiles
+        )
+    }
+}
+
+extension DNGLayout: EmbeddedPreviewContainer {
+}
@@ -0,0 +1,84 @@
+//
+//  Data+BinaryReading.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+public enum ByteOrder {
+    case littleEndian
+    case bigEndian
+}
+
+/**
+ Bounds checked integer reads for container parsers. Offsets are relative to the start of the data (not to
+ `startIndex`), and all reads return `nil` rather than trap when out of bounds, as truncated and malformed
+ files are a fact of life.
+ */
+extension Data {
+    func uint8(at offset: Int) -> UInt8? {
+        guard offset >= 0, offset < count else {
+            return nil
+        }
+        return self[startIndex + offset]
+    }
+
+    func uint16(at offset: Int, _ byteOrder: ByteOrder) -> UInt16? {
+        return unsignedInteger(at: offset, byteCount: 2, byteOrder).map { UInt16(truncatingIfNeeded: $0) }
+    }
+
+    func uint32(at offset: Int, _ byteOrder: ByteOrder) -> UInt32? {
+        return unsignedInteger(at: offset, byteCount: 4, byteOrder).map { UInt32(truncatingIfNeeded: $0) }
+    }
+
+    func uint64(at offset: Int, _ byteOrder: ByteOrder) -> UInt64? {
+        return unsignedInteger(at: offset, byteCount: 8, byteOrder)
+    }
+
+    func fourCC(at offset: Int) -> String? {
+        guard offset >= 0, offset + 4 <= count else {
+            return nil
+        }
+        let start = startIndex + offset
+        return String(bytes: self[start ..< (start + 4)], encoding: .ascii)
+    }
+
+    func hasPrefix(_ bytes: [UInt8], at offset: Int = 0) -> Bool {
+        guard offset >= 0, offset + bytes.count <= count else {
+            return false
+        }
+        let start = startIndex + offset
+        return self[start ..< (start + bytes.count)].elementsEqual(bytes)
+    }
+
+    /** A copy of the given subrange, re-indexed from zero. */
+    func subdata(from offset: Int, count length: Int) -> Data? {
+        guard offset >= 0, length >= 0, offset + length <= count else {
+            return nil
+        }
+        let start = startIndex + offset
+        return Data(self[start ..< (start + length)])
+    }
+
+    private func unsignedInteger(at offset: Int, byteCount: Int, _ byteOrder: ByteOrder) -> UInt64? {
+        guard offset >= 0, offset + byteCount <= count else {
+            return nil
+        }
+        let start = startIndex + offset
+        var value: UInt64 = 0
+        switch byteOrder {
+        case .littleEndian:
+            for i in (0 ..< byteCount).reversed() {
+                value = (value << 8) | UInt64(self[start + i])
+            }
+        case .bigEndian:
+            for i in 0 ..< byteCount {
+                value = (value << 8) | UInt64(self[start + i])
+            }
+        }
+        return value
+    }
+}
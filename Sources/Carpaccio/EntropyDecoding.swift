@@ -0,0 +1,206 @@
+//
+//  EntropyDecoding.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Reads a bit stream most significant bit first, the order used by the Huffman coded RAW formats.
+
+ Bits are kept left aligned in a 64-bit buffer, refilled eight bytes at a time while that many remain, so that after
+ `refill()` at least 56 bits can be peeked and skipped without checks. Reading past the end yields zero bits rather
+ than failing; decoders check `isOverrun` once per row or strip instead of on every read.
+
+ */
+struct BitReader {
+    private let bytes: UnsafePointer<UInt8>?
+    private let count: Int
+    private var position = 0
+    private var buffer: UInt64 = 0
+    private var bitCount = 0
+
+    init(_ buffer: UnsafeRawBufferPointer) {
+        self.bytes = buffer.baseAddress?.assumingMemoryBound(to: UInt8.self)
+        self.count = buffer.count
+    }
+
+    /** Number of bits consumed so far. */
+    var bitPosition: Int {
+        return position * 8 - bitCount
+    }
+
+    /** Whether more bits have been consumed than the stream holds. */
+    var isOverrun: Bool {
+        return bitPosition > count * 8
+    }
+
+    /** Make at least 56 bits available to `peek` and `skip`. */
+    @inline(__always)
+    mutating func refill() {
+        guard bitCount <= 56 else {
+            return
+        }
+        if let bytes = bytes, position + 8 <= count {
+            // Load eight bytes, keep the whole ones that fit. The partial byte ORed in below them is loaded again,
+            // at the same position, by the next refill.
+            var word: UInt64 = 0
+            memcpy(&word, bytes + position, 8)
+            buffer |= UInt64(bigEndian: word) >> UInt64(bitCount)
+            position += (63 - bitCount) >> 3
+            bitCount |= 56
+        } else {
+            while bitCount <= 56 {
+                let byte = position < count ? UInt64(bytes?[position] ?? 0) : 0
+                buffer |= byte << UInt64(56 - bitCount)
+                position += 1
+                bitCount += 8
+            }
+        }
+    }
+
+    /** The next `count` bits (at most 32), without consuming them. Requires a preceding `refill()`. */
+    @inline(__always)
+    func peek(_ count: Int) -> UInt32 {
+        return UInt32(truncatingIfNeeded: buffer >> UInt64(64 - count))
+    }
+
+    /** Consume `count` bits (at most 32). Requires a preceding `refill()`. */
+    @inline(__always)
+    mutating func skip(_ count: Int) {
+        buffer <<= UInt64(count)
+        bitCount -= count
+    }
+
+    /** Read the next `count` bits (at most 32) as an unsigned integer. */
+    @inline(__always)
+    mutating func read(_ count: Int) -> UInt32 {
+        refill()
+        let value = peek(count)
+        skip(count)
+        return value
+    }
+
+    /**
+     Count the zero bits before the next one bit, consuming both: a unary code. Runs are counted with one
+     count-leading-zeros per refill, not bit by bit, and end at the end of the stream.
+     */
+    @inline(__always)
+    mutating func readZeroRun() -> Int {
+        var count = 0
+        while true {
+            refill()
+            // Bits below the first `bitCount` may be loaded already, but are not yet in use
+            let zeros = buffer.leadingZeroBitCount
+            if zeros < bitCount {
+                skip(zeros + 1)
+                return count + zeros
+            }
+            count += bitCount
+            skip(bitCount)
+            if isOverrun {
+                return count
+            }
+        }
+    }
+}
+
+/**
+
+ A Huffman code, either canonical, as given by the number of codes of each length from 1 to 16 bits followed by the
+ symbols in code order (the layout of a JPEG DHT segment, which Nikon and others also use for their tables), or given
+ code by code, as Pentax files do.
+
+ Decoding is a single table lookup: the table has an entry for every value of the next `maximumLength` bits, giving
+ the symbol and the length of its code, so no code is walked bit by bit. Bit patterns which are not a valid code
+ decode as symbol 0 and consume `maximumLength` bits, leaving the stream to be detected as corrupt by its length.
+
+ */
+struct HuffmanTable {
+    let maximumLength: Int
+    /** (code length << 16) | symbol, for each value of the next `maximumLength` bits. */
+    private let lookup: [UInt32]
+
+    init(counts: [UInt8], symbols: [UInt8]) throws {
+        guard counts.count == 16 else {
+            throw RAWDecodingError.invalidHuffmanTable
+        }
+        var codes = [Int](), lengths = [Int]()
+        var code = 0
+        for length in 1 ... 16 {
+            for _ in 0 ..< Int(counts[length - 1]) {
+                guard code < 1 << length else {
+                    throw RAWDecodingError.invalidHuffmanTable
+                }
+                codes.append(code)
+                lengths.append(length)
+                code += 1
+            }
+            code <<= 1
+        }
+        guard codes.count <= symbols.count else {
+            throw RAWDecodingError.invalidHuffmanTable
+        }
+        try self.init(codes: codes, lengths: lengths, symbols: symbols.prefix(codes.count).map { Int($0) })
+    }
+
+    /** A code given as the value of each code (in its low `length` bits), its length and its symbol. Later codes win where codes overlap. */
+    init(codes: [Int], lengths: [Int], symbols: [Int]) throws {
+        guard !codes.isEmpty, codes.count == lengths.count, codes.count == symbols.count,
+              let maximumLength = lengths.max(), maximumLength <= 16,
+              zip(codes, lengths).allSatisfy({ $1 > 0 && $0 >= 0 && $0 < 1 << $1 }),
+              symbols.allSatisfy({ $0 >= 0 && $0 <= 0xFFFF }) else {
+            throw RAWDecodingError.invalidHuffmanTable
+        }
+        var lookup = [UInt32](repeating: UInt32(maximumLength) << 16, count: 1 << maximumLength)
+        for ((code, length), symbol) in zip(zip(codes, lengths), symbols) {
+            let shift = maximumLength - length
+            let entry = UInt32(length) << 16 | UInt32(symbol)
+            for suffix in 0 ..< (1 << shift) {
+                lookup[(code << shift) | suffix] = entry
+            }
+        }
+        self.maximumLength = maximumLength
+        self.lookup = lookup
+    }
+
+    /** Decode the next symbol from `reader`. */
+    @inline(__always)
+    func decodeSymbol(_ reader: inout BitReader) -> Int {
+        reader.refill()
+        let entry = lookup[Int(reader.peek(maximumLength))]
+        reader.skip(Int(entry >> 16))
+        return Int(entry & 0xFFFF)
+    }
+
+    /**
+     Decode a difference coded as in lossless JPEG: a symbol giving its length in bits, then those bits. Length 16
+     stands for -32768, without any bits following.
+     */
+    @inline(__always)
+    func decodeDifference(_ reader: inout BitReader) -> Int {
+        let length = decodeSymbol(&reader)
+        guard length < 16 else {
+            return -32768
+        }
+        return HuffmanTable.difference(bits: reader.read(length), length: length)
+    }
+
+    /**
+     The signed difference coded by `length` bits following a Huffman symbol, as in lossless JPEG: values with the
+     top bit clear are negative. Computed from the top bit without a branch, differences having no predictable sign.
+     */
+    @inline(__always)
+    static func difference(bits: UInt32, length: Int) -> Int {
+        guard length > 0 else {
+            return 0
+        }
+        let value = Int(bits)
+        let negative = (value >> (length - 1)) ^ 1
+        return value - ((negative << length) - negative)
+    }
+}
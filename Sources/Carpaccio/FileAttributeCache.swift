@@ -0,0 +1,163 @@
+//
+//  FileAttributeCache.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/** The attributes of a file needed to identify and order it: size, modification time and inode. */
+public struct FileAttributes: Equatable, Hashable {
+    public let signature: FileSignature
+    public let device: UInt64
+    public let inode: UInt64
+
+    public init(signature: FileSignature, device: UInt64, inode: UInt64) {
+        self.signature = signature
+        self.device = device
+        self.inode = inode
+    }
+
+    public init(_ fileStat: stat) {
+        self.init(signature: FileSignature(fileStat), device: UInt64(truncatingIfNeeded: fileStat.st_dev), inode: UInt64(fileStat.st_ino))
+    }
+
+    /** Attributes of the file at `path`, following symbolic links. */
+    public init?(path: String) {
+        var fileStat = stat()
+        guard stat(path, &fileStat) == 0 else {
+            return nil
+        }
+        self.init(fileStat)
+    }
+
+    public var size: Int64 {
+        return signature.size
+    }
+
+    public var modificationDate: Date {
+        return signature.modificationDate
+    }
+}
+
+/**
+
+ Caches file attributes by path, so that looking up an image's size, modification time or inode is a hash lookup
+ rather than a system call.
+
+ `DirectoryWalker` fills the cache as it enumerates directories, with an `fstatat` relative to the already open
+ directory for every matching file, so a walked collection needs no further `stat`s for timestamp fallbacks or
+ for ordering files. Attributes are a snapshot: `refreshAttributes(for:)` or `invalidate(_:)` should be used when
+ a file is known to have changed.
+
+ The cache holds at most about `maximumCount` files. Entries are kept in two generations: when the current one fills
+ up, it replaces the previous one, whose entries not used since are dropped. Looking up an entry of the previous
+ generation moves it to the current one, so the files in use survive while those of walks long past are evicted.
+
+ */
+public final class FileAttributeCache {
+    public static let shared = FileAttributeCache()
+
+    public let maximumCount: Int
+
+    private var attributesByPath = [String: FileAttributes]()
+    private var previousAttributesByPath = [String: FileAttributes]()
+    private let lock = NSLock()
+
+    public init(maximumCount: Int = 1_000_000) {
+        self.maximumCount = max(2, maximumCount)
+    }
+
+    public var count: Int {
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        return attributesByPath.count + previousAttributesByPath.count
+    }
+
+    /** Cached attributes of the file at `url`, or if there are none, its current attributes, which are then cached. */
+    public func attributes(for url: URL) -> FileAttributes? {
+        if let attributes = cachedAttributes(for: url) {
+            return attributes
+        }
+        return refreshAttributes(for: url)
+    }
+
+    /** Cached attributes of the file at `url`. Never touches the file system. */
+    public func cachedAttributes(for url: URL) -> FileAttributes? {
+        guard url.isFileURL else {
+            return nil
+        }
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        if let attributes = attributesByPath[url.path] {
+            return attributes
+        }
+        guard let attributes = previousAttributesByPath.removeValue(forKey: url.path) else {
+            return nil
+        }
+        insert(attributes, forPath: url.path)
+        return attributes
+    }
+
+    /** Read the current attributes of the file at `url`, replacing any cached ones. */
+    @discardableResult
+    public func refreshAttributes(for url: URL) -> FileAttributes? {
+        guard url.isFileURL else {
+            return nil
+        }
+        let attributes = FileAttributes(path: url.path)
+        store(attributes, forPath: url.path)
+        return attributes
+    }
+
+    public func store(_ attributes: FileAttributes?, forPath path: String) {
+        lock.lock()
+        update(attributes, forPath: path)
+        lock.unlock()
+    }
+
+    /** Store attributes of many files at once, taking the lock once. */
+    public func store<S: Sequence>(contentsOf entries: S) where S.Element == (path: String, attributes: FileAttributes) {
+        lock.lock()
+        for entry in entries {
+            update(entry.attributes, forPath: entry.path)
+        }
+        lock.unlock()
+    }
+
+    public func invalidate(_ url: URL) {
+        store(nil, forPath: url.path)
+    }
+
+    public func removeAll() {
+        lock.lock()
+        attributesByPath.removeAll()
+        previousAttributesByPath.removeAll()
+        lock.unlock()
+    }
+
+    /** Replace or remove the entry for `path`, in whichever generation holds it. Call with `lock` held. */
+    private func update(_ attributes: FileAttributes?, forPath path: String) {
+        previousAttributesByPath[path] = nil
+        if let attributes = attributes {
+            insert(attributes, forPath: path)
+        } else {
+            attributesByPath[path] = nil
+        }
+    }
+
+    /** Insert into the current generation, starting a new one when it is full. Call with `lock` held. */
+    private func insert(_ attributes: FileAttributes, forPath path: String) {
+        if attributesByPath[path] == nil && attributesByPath.count >= maximumCount / 2 {
+            previousAttributesByPath = attributesByPath
+            attributesByPath.removeAll()
+        }
+        attributesByPath[path] = attributes
+    }
+}
@@ -0,0 +1,491 @@
+//
+//  HTTPRangeReader.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import ImageIO
+
+public enum HTTPRangeReaderError: Swift.Error, LocalizedError {
+    case notHTTP(URL)
+    case requestFailed(url: URL, range: Range<Int>, message: String)
+    case unexpectedStatus(url: URL, range: Range<Int>, statusCode: Int)
+    case unknownLength(URL)
+
+    public var errorDescription: String? {
+        switch self {
+        case .notHTTP(let url):
+            return "Not an HTTP URL: \(url)"
+        case .requestFailed(let url, let range, let message):
+            return "Failed to read bytes \(range) of \(url): \(message)"
+        case .unexpectedStatus(let url, let range, let statusCode):
+            return "Unexpected HTTP status \(statusCode) reading bytes \(range) of \(url)"
+        case .unknownLength(let url):
+            return "Server did not tell the length of \(url)"
+        }
+    }
+}
+
+/**
+
+ Reads remote image files with HTTP range requests, as served by S3 compatible object stores and most web servers.
+
+ `byteSource(for:)` returns a `RangeReadableByteSource`, so remote files get the same block cache, prefetching and
+ TIFF parsing as local ones, and only the blocks actually needed are transferred. The first request for a file is
+ already a range request for its header, whose `Content-Range` tells the file's length: no `HEAD` request is made.
+
+ `loadPreview(of:maximumPixelDimensions:)` goes further, and reads a file's metadata and embedded preview only,
+ following IFD pointers one coalesced batch of range requests at a time. Thumbnailing a RAW file this way transfers
+ its directories and preview JPEG, not the tens of megabytes of sensor data.
+
+ Ranges needed at the same time (say, a RAW file's directory values and its preview) are fetched with one request:
+ ranges within `gapThreshold` of each other are merged into one, and the rest are asked for together in a multi-range
+ request, answered with a `multipart/byteranges` response. Servers which ignore multi-range requests (S3 among them)
+ are remembered by host, and sent parallel single range requests instead. So are servers which ignore even a single
+ range and send the whole file; a file sent whole in answer to its first request is then read from that copy.
+
+ Requests are synchronous, made from the calling thread, and at most `maximumConcurrentRequestCount` of them are in
+ flight at once across all files read through the reader.
+
+ */
+public final class HTTPRangeReader {
+    public struct Preview {
+        public let url: URL
+        public let metadata: ImageMetadata?
+        /** The embedded preview, scaled down if requested. `nil` if the file has none. */
+        public let image: CGImage?
+    }
+
+    public let session: URLSession
+    /** Headers added to every request, e.g. for authorization. */
+    public let additionalHeaders: [String: String]
+    public let blockSize: Int
+    /** Ranges this close to each other are fetched as one, the bytes in between transferred and discarded. */
+    public let gapThreshold: Int
+    /** Whether to ask for several ranges in one request. */
+    public let allowsMultipleRanges: Bool
+    public let timeout: TimeInterval
+
+    private let requestSlots: DispatchSemaphore
+    private let statisticsLock = NSLock()
+    private var transferredByteCount = 0
+    private var completedRequestCount = 0
+    private var hostsIgnoringMultipleRanges = Set<String>()
+
+    public init(
+        session: URLSession = .shared,
+        additionalHeaders: [String: String] = [:],
+        blockSize: Int = 32 * 1024,
+        gapThreshold: Int = 64 * 1024,
+        allowsMultipleRanges: Bool = true,
+        maximumConcurrentRequestCount: Int = 8,
+        timeout: TimeInterval = 30
+    ) {
+        precondition(blockSize > 0)
+        self.session = session
+        self.additionalHeaders = additionalHeaders
+        self.blockSize = blockSize
+        self.gapThreshold = gapThreshold
+        self.allowsMultipleRanges = allowsMultipleRanges
+        self.timeout = timeout
+        self.requestSlots = DispatchSemaphore(value: max(1, maximumConcurrentRequestCount))
+    }
+
+    /** Number of response body bytes received so far. */
+    public var bytesTransferred: Int {
+        statisticsLock.lock()
+        defer {
+            statisticsLock.unlock()
+        }
+        return transferredByteCount
+    }
+
+    public var requestCount: Int {
+        statisticsLock.lock()
+        defer {
+            statisticsLock.unlock()
+        }
+        return completedRequestCount
+    }
+
+    /** A block cached byte source for the remote file at `url`, with its first block already read. */
+    public func byteSource(for url: URL, maximumCachedBlockCount: Int = 256) throws -> RangeReadableByteSource {
+        guard let scheme = url.scheme?.lowercased(), scheme == "http" || scheme == "https" else {
+            throw HTTPRangeReaderError.notHTTP(url)
+        }
+        let header = try fetch(url, range: 0 ..< blockSize)
+        if let wholeFile = header.wholeFile {
+            // Read from the copy already transferred, rather than transfer the whole file again for every block
+            let source = RangeReadableByteSource(url: url, count: wholeFile.count, blockSize: blockSize, maximumCachedBlockCount: maximumCachedBlockCount, readRange: { range in
+                guard let data = wholeFile.subdata(from: range.lowerBound, count: range.count) else {
+                    throw HTTPRangeReaderError.requestFailed(url: url, range: range, message: "Range beyond the end of the file")
+                }
+                return data
+            })
+            source.prime(header.data, at: 0)
+            return source
+        }
+        guard let count = header.totalCount else {
+            throw HTTPRangeReaderError.unknownLength(url)
+        }
+
+        let source = RangeReadableByteSource(url: url, count: count, blockSize: blockSize, maximumCachedBlockCount: maximumCachedBlockCount, readRange: { range in
+            try self.fetch(url, range: range).data
+        }, readRanges: { ranges in
+            try self.fetch(url, ranges: ranges)
+        })
+        source.prime(header.data, at: 0)
+        return source
+    }
+
+    /**
+     Read the metadata and embedded preview of the remote file at `url`, and nothing else. The preview is the EXIF
+     thumbnail of a JPEG, or the largest JPEG preview of a TIFF based RAW file.
+     */
+    public func loadPreview(of url: URL, maximumPixelDimensions: CGSize? = nil) throws -> Preview {
+        let source = try byteSource(for: url)
+        let previewRange = try source.prefetchMetadataAndPreview()
+
+        let metadata = try? source.metadata()
+        let image = previewRange.flatMap { range -> CGImage? in
+            guard let data = source.cachedBytes(in: range), let imageSource = CGImageSourceCreateWithData(data as CFData, nil) else {
+                return nil
+            }
+            return try? CGImage.loadCGImage(from: imageSource, constrainingToSize: maximumPixelDimensions, thumbnailScheme: .decodeFullImage)
+        }
+        return Preview(url: url, metadata: metadata, image: image)
+    }
+
+    // MARK: Requests
+
+    /** Fetch one range. `wholeFile` is the response body if the server ignored the range and sent the whole file. */
+    private func fetch(_ url: URL, range: Range<Int>) throws -> (data: Data, totalCount: Int?, wholeFile: Data?) {
+        let (data, httpResponse) = try send(url, ranges: [range])
+
+        let contentRange = HTTPRangeReader.contentRange(of: httpResponse)
+        switch httpResponse.statusCode {
+        case 206:
+            guard let contentRange = contentRange, contentRange.start == range.lowerBound else {
+                throw HTTPRangeReaderError.requestFailed(url: url, range: range, message: "Response is for a different range")
+            }
+            return (data, contentRange.totalCount, nil)
+        case 200:
+            // The server ignored the range and sent the whole file; it will not do better with several
+            setIgnoringMultipleRanges(url.host ?? "")
+            let lower = min(range.lowerBound, data.count)
+            let upper = min(range.upperBound, data.count)
+            return (data.subdata(in: (data.startIndex + lower) ..< (data.startIndex + upper)), data.count, data)
+        case 416:
+            // Requesting the first block of an empty file
+            return (Data(), contentRange?.totalCount, nil)
+        default:
+            throw HTTPRangeReaderError.unexpectedStatus(url: url, range: range, statusCode: httpResponse.statusCode)
+        }
+    }
+
+    /** Fetch several ranges, given in ascending order, with as few requests as `gapThreshold` and the server allow. */
+    private func fetch(_ url: URL, ranges: [Range<Int>]) throws -> [Data] {
+        let plan = ReadPlan(ranges, gapThreshold: gapThreshold)
+        let spans = plan.reads.map { $0.span }
+        let host = url.host ?? ""
+
+        var spanData: [Data]
+        if spans.count > 1 && allowsMultipleRanges && !isIgnoringMultipleRanges(host) {
+            spanData = try fetchMultipleRanges(url, spans: spans)
+        } else {
+            spanData = Array(repeating: Data(), count: spans.count)
+            var firstError: Swift.Error? = nil
+            let lock = NSLock()
+            DispatchQueue.concurrentPerform(iterations: spans.count) { i in
+                do {
+                    let data = try fetch(url, range: spans[i]).data
+                    lock.lock()
+                    spanData[i] = data
+                    lock.unlock()
+                } catch {
+                    lock.lock()
+                    firstError = firstError ?? error
+                    lock.unlock()
+                }
+            }
+            if let error = firstError {
+                throw error
+            }
+        }
+
+        guard let data = plan.slice(spanData, into: ranges) else {
+            throw HTTPRangeReaderError.requestFailed(url: url, range: spans[0].lowerBound ..< spans[spans.count - 1].upperBound, message: "Response does not cover the requested ranges")
+        }
+        return data
+    }
+
+    /** One multi-range request for `spans`, returning the bytes of each span. */
+    private func fetchMultipleRanges(_ url: URL, spans: [Range<Int>]) throws -> [Data] {
+        let (body, httpResponse) = try send(url, ranges: spans)
+        let requestedRange = spans[0].lowerBound ..< spans[spans.count - 1].upperBound
+
+        // Servers may send any ranges covering those asked for: coalesced into fewer parts, or as a single part
+        let parts: [(start: Int, data: Data)]
+        switch httpResponse.statusCode {
+        case 206:
+            if let boundary = HTTPRangeReader.multipartBoundary(of: httpResponse) {
+                guard let multipartParts = HTTPRangeReader.byteRangeParts(of: body, boundary: boundary) else {
+                    throw HTTPRangeReaderError.requestFailed(url: url, range: requestedRange, message: "Malformed multipart/byteranges response")
+                }
+                parts = multipartParts
+            } else {
+                guard let start = HTTPRangeReader.contentRange(of: httpResponse)?.start else {
+                    throw HTTPRangeReaderError.requestFailed(url: url, range: requestedRange, message: "No Content-Range in partial response")
+                }
+                parts = [(start, body)]
+            }
+        case 200:
+            // The whole file; ask for one range at a time from now on
+            setIgnoringMultipleRanges(url.host ?? "")
+            parts = [(0, body)]
+        default:
+            throw HTTPRangeReaderError.unexpectedStatus(url: url, range: requestedRange, statusCode: httpResponse.statusCode)
+        }
+
+        return try spans.map { span in
+            guard let part = parts.first(where: { $0.start <= span.lowerBound && span.upperBound <= $0.start + $0.data.count }) else {
+                throw HTTPRangeReaderError.requestFailed(url: url, range: span, message: "Range missing from multipart response")
+            }
+            let start = part.data.startIndex + (span.lowerBound - part.start)
+            return part.data[start ..< (start + span.count)]
+        }
+    }
+
+    private func isIgnoringMultipleRanges(_ host: String) -> Bool {
+        statisticsLock.lock()
+        defer {
+            statisticsLock.unlock()
+        }
+        return hostsIgnoringMultipleRanges.contains(host)
+    }
+
+    private func setIgnoringMultipleRanges(_ host: String) {
+        statisticsLock.lock()
+        hostsIgnoringMultipleRanges.insert(host)
+        statisticsLock.unlock()
+    }
+
+    private func send(_ url: URL, ranges: [Range<Int>]) throws -> (body: Data, response: HTTPURLResponse) {
+        let requestedRange = ranges[0].lowerBound ..< ranges[ranges.count - 1].upperBound
+        var request = URLRequest(url: url, cachePolicy: .reloadIgnoringLocalCacheData, timeoutInterval: timeout)
+        for (field, value) in additionalHeaders {
+            request.setValue(value, forHTTPHeaderField: field)
+        }
+        let rangeSpecifiers = ranges.map { "\($0.lowerBound)-\($0.upperBound - 1)" }
+        request.setValue("bytes=" + rangeSpecifiers.joined(separator: ","), forHTTPHeaderField: "Range")
+
+        var body: Data?
+        var response: URLResponse?
+        var requestError: Swift.Error?
+        let done = DispatchSemaphore(value: 0)
+
+        requestSlots.wait()
+        session.dataTask(with: request) {
+            body = $0
+            response = $1
+            requestError = $2
+            done.signal()
+        }.resume()
+        done.wait()
+        requestSlots.signal()
+
+        if let error = requestError {
+            throw HTTPRangeReaderError.requestFailed(url: url, range: requestedRange, message: error.localizedDescription)
+        }
+        guard let httpResponse = response as? HTTPURLResponse else {
+            throw HTTPRangeReaderError.requestFailed(url: url, range: requestedRange, message: "No HTTP response")
+        }
+        let data = body ?? Data()
+
+        statisticsLock.lock()
+        transferredByteCount += data.count
+        completedRequestCount += 1
+        statisticsLock.unlock()
+
+        return (data, httpResponse)
+    }
+
+    private static func headerValue(_ field: String, of response: HTTPURLResponse) -> String? {
+        return response.allHeaderFields.first(where: { ($0.key as? String)?.lowercased() == field })?.value as? String
+    }
+
+    /** The offsets and total length in a `Content-Range: bytes start-end/total` (or `bytes */total`) header. */
+    static func contentRange(of response: HTTPURLResponse) -> (start: Int?, end: Int?, totalCount: Int?)? {
+        return headerValue("content-range", of: response).flatMap { contentRange(in: $0) }
+    }
+
+    /** Parse a `Content-Range` header value. `end` is inclusive, as in the header. */
+    static func contentRange(in value: String) -> (start: Int?, end: Int?, totalCount: Int?)? {
+        let parts = value.trimmingCharacters(in: .whitespaces).split(separator: " ", maxSplits: 1)
+        guard parts.count == 2, parts[0].lowercased() == "bytes" else {
+            return nil
+        }
+        let rangeAndTotal = parts[1].split(separator: "/", maxSplits: 1)
+        guard rangeAndTotal.count == 2 else {
+            return nil
+        }
+        let startAndEnd = rangeAndTotal[0].split(separator: "-")
+        let start = startAndEnd.first.flatMap { Int($0) }
+        let end = startAndEnd.count == 2 ? Int(startAndEnd[1]) : nil
+        return (start, end, Int(rangeAndTotal[1]))
+    }
+
+    /** The boundary of a `multipart/byteranges` response, or `nil` for other content types. */
+    static func multipartBoundary(of response: HTTPURLResponse) -> String? {
+        guard let contentType = headerValue("content-type", of: response), contentType.lowercased().hasPrefix("multipart/byteranges") else {
+            return nil
+        }
+        let parameter = contentType.components(separatedBy: ";")
+            .map { $0.trimmingCharacters(in: .whitespaces) }
+            .first { $0.lowercased().hasPrefix("boundary=") }
+        return parameter.map { String($0.dropFirst("boundary=".count)).trimmingCharacters(in: CharacterSet(charactersIn: "\"")) }
+    }
+
+    /**
+     The parts of a `multipart/byteranges` body, each with the offset its `Content-Range` header gives. Part bodies
+     are taken by the length of their range rather than by searching for the next boundary, as they are binary.
+     */
+    static func byteRangeParts(of body: Data, boundary: String) -> [(start: Int, data: Data)]? {
+        let delimiter = Data("--\(boundary)".utf8)
+        let headerTerminator = Data("\r\n\r\n".utf8)
+        var parts = [(start: Int, data: Data)]()
+        var position = body.startIndex
+
+        // The closing delimiter, "--boundary--", has no headers after it
+        while let delimiterRange = body.range(of: delimiter, in: position ..< body.endIndex),
+              let headerEnd = body.range(of: headerTerminator, in: delimiterRange.upperBound ..< body.endIndex) {
+            let headers = String(decoding: body[delimiterRange.upperBound ..< headerEnd.lowerBound], as: UTF8.self).components(separatedBy: "\r\n")
+            guard let contentRangeHeader = headers.first(where: { $0.lowercased().hasPrefix("content-range:") }),
+                  let range = contentRange(in: String(contentRangeHeader.dropFirst("content-range:".count))),
+                  let start = range.start, let end = range.end, end >= start else {
+                return nil
+            }
+            // The range comes from the server: a part claiming more than the body holds is malformed, not a trap
+            let (span, spanOverflow) = end.subtractingReportingOverflow(start)
+            let (length, lengthOverflow) = span.addingReportingOverflow(1)
+            let (dataEnd, endOverflow) = headerEnd.upperBound.addingReportingOverflow(length)
+            guard !spanOverflow, !lengthOverflow, !endOverflow, dataEnd <= body.endIndex else {
+                return nil
+            }
+            parts.append((start, body[headerEnd.upperBound ..< dataEnd]))
+            position = dataEnd
+        }
+        return parts
+    }
+}
+
+// MARK: - Metadata and preview prefetching
+
+extension RangeReadableByteSource {
+    enum Container {
+        case jpeg(header: Data, analysis: PartialFileAnalysis)
+        case tiff(TIFFStructure)
+    }
+
+    /**
+     Make the metadata of a JPEG or TIFF based file resident, reading as few blocks as its structure allows, and return
+     the range of its embedded JPEG preview, if any, without reading the preview itself.
+
+     JPEG headers are read until the start of scan. TIFF directories are read one level of the directory tree at a
+     time: each round coalesces the ranges of all directories discovered by the previous one into a single prefetch.
+     */
+    @discardableResult
+    public func prefetchMetadata(maximumRoundCount: Int = 8) throws -> Range<Int>? {
+        try prefetch([0 ..< min(count, blockSize)])
+
+        if cachedBytes(in: 0 ..< min(count, 2)) == Data([0xFF, 0xD8]) {
+            var length = blockSize
+            for _ in 0 ..< maximumRoundCount {
+                guard let header = cachedBytes(in: 0 ..< min(count, length)) else {
+                    break
+                }
+                let analysis = PartialFileAnalysis(data: header)
+                if analysis.isMetadataAvailable || length >= count {
+                    break
+                }
+                length *= 2
+                try prefetch([0 ..< min(count, length)])
+            }
+        } else {
+            for _ in 0 ..< maximumRoundCount {
+                let ranges = try BatchedFileReader.tiffPlanner(self)
+                if ranges.isEmpty {
+                    break
+                }
+                try prefetch(ranges)
+            }
+        }
+
+        switch try container() {
+        case .jpeg(_, let analysis)?:
+            return analysis.previewRange
+        case .tiff(let structure)?:
+            return PartialFileAnalysis.largestPreviewRange(in: structure) { range in
+                guard range.upperBound <= self.count else {
+                    return nil
+                }
+                return try self.bytes(in: range)
+            }
+        case nil:
+            return nil
+        }
+    }
+
+    /**
+     Make the metadata and embedded preview of a JPEG or TIFF based file resident: its directories as by
+     `prefetchMetadata`, then the preview in the same prefetch as any directory values outside the blocks already read.
+     Returns the range of the preview, if any.
+     */
+    @discardableResult
+    public func prefetchMetadataAndPreview(maximumRoundCount: Int = 8) throws -> Range<Int>? {
+        let previewRange = try prefetchMetadata(maximumRoundCount: maximumRoundCount)
+        var ranges = previewRange.map { [$0] } ?? []
+        if case .tiff(let structure)? = try container() {
+            ranges += structure.metadataValueRanges()
+        }
+        try prefetch(ranges.filter { $0.lowerBound >= 0 && $0.upperBound <= count })
+        return previewRange
+    }
+
+    /** The container of the file as far as it is resident, or `nil` if it is neither JPEG nor TIFF based. */
+    func container() throws -> Container? {
+        guard let signature = cachedBytes(in: 0 ..< min(count, 2)), !signature.isEmpty else {
+            return nil
+        }
+        if signature == Data([0xFF, 0xD8]) {
+            var length = blockSize
+            while length < count, cachedBytes(in: 0 ..< min(count, length * 2)) != nil {
+                length *= 2
+            }
+            return cachedBytes(in: 0 ..< min(count, length)).map { .jpeg(header: $0, analysis: PartialFileAnalysis(data: $0)) }
+        }
+        guard let structure = try? TIFFStructure(fetch: { self.cachedBytes(in: $0) }), !structure.ifds.isEmpty else {
+            return nil
+        }
+        return .tiff(structure)
+    }
+
+    /** Metadata parsed from resident bytes: with ImageIO from a JPEG header, or from the tags of a TIFF based file. */
+    func metadata() throws -> ImageMetadata? {
+        switch try container() {
+        case .jpeg(let header, _)?:
+            guard let imageSource = CGImageSourceCreateWithData(header as CFData, [kCGImageSourceShouldCache: false] as CFDictionary) else {
+                return nil
+            }
+            return try ImageMetadata(imageSource: imageSource)
+        case .tiff(let structure)?:
+            return try ImageMetadata(tiffStructure: structure, in: self)
+        case nil:
+            return nil
+        }
+    }
+}
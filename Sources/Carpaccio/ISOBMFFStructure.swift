@@ -0,0 +1,533 @@
+//
+//  ISOBMFFStructure.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+public enum ISOBMFFStructureError: Swift.Error, LocalizedError {
+    case notISOBMFF
+    case noMetadata
+
+    public var errorDescription: String? {
+        switch self {
+        case .notISOBMFF:
+            return "Data does not begin with an ISO base media file type box"
+        case .noMetadata:
+            return "ISO base media file contains neither Exif metadata nor image dimensions"
+        }
+    }
+}
+
+/** A box (atom) of an ISO base media file. */
+public struct ISOBMFFBox {
+    public let type: String
+    /** Absolute range of the whole box, header included. */
+    public let range: Range<Int>
+    public let headerSize: Int
+    /** The 16 byte extended type of a "uuid" box. */
+    public let userType: Data?
+
+    public var payloadRange: Range<Int> {
+        return (range.lowerBound + headerSize) ..< range.upperBound
+    }
+}
+
+/** A CR3 track of RAW sensor data: its dimensions, the coding parameters of its `CMP1` box, and its first sample. */
+public struct CanonRawTrack {
+    public let size: CGSize
+    /** Payload of the `CMP1` box of the track's `CRAW` sample entry. */
+    public let compressionParameters: Data
+    public let sampleRange: Range<Int>
+}
+
+/**
+
+ The parts of an ISO base media file (HEIF / HEIC, AVIF, Canon CR3) needed for metadata and previews.
+
+ Boxes are located by following their sizes, reading only box headers and the few small boxes of interest, never
+ the media data. What is read:
+
+ - HEIF: the primary item (`pitm`), its dimensions (`ispe`) and rotation (`irot`) from the item properties, and the
+   location of the Exif item (`iinf`, `iloc`), whose payload is a TIFF structure.
+ - CR3: the TIFF structures of Canon's `CMT1` (IFD0), `CMT2` (EXIF) and `CMT3` (maker note) boxes, the dimensions,
+   coding parameters and sample location of the RAW tracks, and the embedded JPEG previews: `THMB` (in `moov`),
+   `PRVW` (in a top level box) and the full size JPEG track.
+
+ */
+public struct ISOBMFFStructure {
+    public typealias Fetch = TIFFStructure.Fetch
+
+    public let majorBrand: String
+    public let compatibleBrands: [String]
+    public let boxes: [ISOBMFFBox]
+
+    /** Dimensions of the coded primary image (HEIF) or of the largest RAW track (CR3). */
+    public let primaryImageSize: CGSize?
+
+    /** Anticlockwise quarter turns to apply to the primary image for display, if given by an `irot` property. */
+    public let rotation: Int?
+
+    /** Offset of the TIFF header holding IFD0, and usually the EXIF directory too. */
+    public let tiffOffset: Int?
+
+    /** Offset of a TIFF header whose first directory is the EXIF directory, for CR3. */
+    public let exifTIFFOffset: Int?
+
+    /** Offset of a TIFF header whose first directory is the Canon maker note, for CR3. */
+    public let makerNoteTIFFOffset: Int?
+
+    /** The largest RAW track of a CR3 file, whose coding parameters were found. */
+    public let rawTrack: CanonRawTrack?
+
+    public let previews: [EmbeddedPreview]
+
+    public var isCR3: Bool {
+        return majorBrand == "crx "
+    }
+
+    private static let maximumBoxCount = 4096
+    private static let canonMetadataUUID = Data([0x85, 0xC0, 0xB6, 0x87, 0x82, 0x0F, 0x11, 0xE0, 0x81, 0x11, 0xF4, 0xCE, 0x46, 0x2B, 0x6A, 0x48])
+    private static let canonPreviewUUID = Data([0xEA, 0xF4, 0x2B, 0x5E, 0x1C, 0x98, 0x4B, 0x88, 0xB9, 0xFB, 0xB7, 0xDC, 0x40, 0x6E, 0x4D, 0x16])
+
+    public init(count: Int, fetch: Fetch) throws {
+        let boxes = try ISOBMFFStructure.boxes(in: 0 ..< count, fetch: fetch)
+        guard let ftyp = boxes.first, ftyp.type == "ftyp",
+              let ftypData = try fetch(ftyp.payloadRange.prefix(256)), let majorBrand = ftypData.fourCC(at: 0) else {
+            throw ISOBMFFStructureError.notISOBMFF
+        }
+        self.majorBrand = majorBrand
+        self.compatibleBrands = stride(from: 8, to: ftypData.count, by: 4).compactMap { ftypData.fourCC(at: $0) }
+        self.boxes = boxes
+
+        var primaryImageSize: CGSize? = nil
+        var rotation: Int? = nil
+        var tiffOffset: Int? = nil
+        var exifTIFFOffset: Int? = nil
+        var makerNoteTIFFOffset: Int? = nil
+        var rawTrack: CanonRawTrack? = nil
+        var previews = [EmbeddedPreview]()
+
+        if let meta = boxes.first(where: { $0.type == "meta" }) {
+            let items = try ISOBMFFStructure.ItemInfo(meta: meta, fetch: fetch)
+            primaryImageSize = items.primaryImageSize
+            rotation = items.rotation
+            tiffOffset = items.exifTIFFOffset
+        }
+
+        if let moov = boxes.first(where: { $0.type == "moov" }) {
+            let moovBoxes = try ISOBMFFStructure.boxes(in: moov.payloadRange, fetch: fetch)
+
+            if let canon = moovBoxes.first(where: { $0.type == "uuid" && $0.userType == ISOBMFFStructure.canonMetadataUUID }) {
+                for box in try ISOBMFFStructure.boxes(in: canon.payloadRange, fetch: fetch) {
+                    switch box.type {
+                    case "CMT1":
+                        tiffOffset = box.payloadRange.lowerBound
+                    case "CMT2":
+                        exifTIFFOffset = box.payloadRange.lowerBound
+                    case "CMT3":
+                        makerNoteTIFFOffset = box.payloadRange.lowerBound
+                    case "THMB":
+                        // Version, flags; width, height; JPEG byte count; reserved
+                        if let preview = try ISOBMFFStructure.jpegPreview(in: box, dimensionsAt: 4, byteCountAt: 8, fetch: fetch) {
+                            previews.append(preview)
+                        }
+                    default:
+                        break
+                    }
+                }
+            }
+
+            for trak in moovBoxes where trak.type == "trak" {
+                guard let track = try ISOBMFFStructure.canonTrack(trak, fetch: fetch) else {
+                    continue
+                }
+                if track.isJPEG, let jpegRange = track.sampleRange {
+                    previews.append(EmbeddedPreview(range: jpegRange, size: track.size))
+                    continue
+                }
+                if track.size.width * track.size.height > (primaryImageSize.map { $0.width * $0.height } ?? 0) {
+                    primaryImageSize = track.size
+                }
+                if let parameters = track.compressionParameters, let sampleRange = track.sampleRange,
+                   track.size.width * track.size.height > (rawTrack.map { $0.size.width * $0.size.height } ?? 0) {
+                    rawTrack = CanonRawTrack(size: track.size, compressionParameters: parameters, sampleRange: sampleRange)
+                }
+            }
+        }
+
+        if let previewBox = boxes.first(where: { $0.type == "uuid" && $0.userType == ISOBMFFStructure.canonPreviewUUID }) {
+            // Eight bytes of unknown purpose precede the PRVW box
+            let range = min(previewBox.payloadRange.lowerBound + 8, previewBox.range.upperBound) ..< previewBox.range.upperBound
+            for box in try ISOBMFFStructure.boxes(in: range, fetch: fetch) where box.type == "PRVW" {
+                // Reserved; a short; width, height; a short; JPEG byte count
+                if let preview = try ISOBMFFStructure.jpegPreview(in: box, dimensionsAt: 6, byteCountAt: 12, fetch: fetch) {
+                    previews.append(preview)
+                }
+            }
+        }
+
+        self.primaryImageSize = primaryImageSize
+        self.rotation = rotation
+        self.tiffOffset = tiffOffset
+        self.exifTIFFOffset = exifTIFFOffset
+        self.makerNoteTIFFOffset = makerNoteTIFFOffset
+        self.rawTrack = rawTrack
+        self.previews = previews.sorted { $0.pixelCount < $1.pixelCount }
+    }
+
+    /** The structure of a byte source, parsed once and cached in the source's container cache. */
+    public static func read(from source: ImageByteSource) throws -> ISOBMFFStructure {
+        return try source.containerCache.value(forKey: "com.sashimiapp.ISOBMFF.structure") {
+            try ISOBMFFStructure(count: source.count) { range in
+                guard range.lowerBound >= 0, range.upperBound <= source.count else {
+                    return nil
+                }
+                return try source.bytes(in: range)
+            }
+        }
+    }
+
+    /**
+     Metadata from the Exif TIFF structures of the file, with dimensions and rotation given by the container taking
+     precedence. Files without Exif metadata get dimensions and orientation only.
+     */
+    public func metadata(in source: ImageByteSource) throws -> ImageMetadata {
+        let orientation = rotation.map { ISOBMFFStructure.orientation(forRotation: $0) }
+
+        guard let tiffOffset = tiffOffset, let structure = try? TIFFStructure.read(from: source, baseOffset: tiffOffset), !structure.ifds.isEmpty else {
+            guard let size = primaryImageSize else {
+                throw ISOBMFFStructureError.noMetadata
+            }
+            return ImageMetadata(nativeSize: size, nativeOrientation: orientation ?? .up)
+        }
+        let exifStructure = exifTIFFOffset.flatMap { try? TIFFStructure.read(from: source, baseOffset: $0) }
+        return try ImageMetadata(tiffStructure: structure, exifStructure: exifStructure, nativeSize: primaryImageSize, nativeOrientation: orientation, in: source)
+    }
+
+    /** `irot` turns the image anticlockwise for display; the equivalent EXIF orientation. */
+    static func orientation(forRotation rotation: Int) -> ImageOrientation {
+        switch rotation & 3 {
+        case 1:
+            return .left
+        case 2:
+            return .down
+        case 3:
+            return .right
+        default:
+            return .up
+        }
+    }
+
+    // MARK: Boxes
+
+    /** The boxes laid out one after another within `range`, reading their headers only. */
+    public static func boxes(in range: Range<Int>, fetch: Fetch) throws -> [ISOBMFFBox] {
+        var boxes = [ISOBMFFBox]()
+        var offset = range.lowerBound
+
+        // Sizes come from the file and may be anything up to Int.max, so bounds are checked by subtraction
+        while range.upperBound - offset >= 8 && boxes.count < maximumBoxCount {
+            guard let header = try fetch(offset ..< (offset + min(32, range.upperBound - offset))),
+                  let size32 = header.uint32(at: 0, .bigEndian), let type = header.fourCC(at: 4) else {
+                break
+            }
+
+            var headerSize = 8
+            var size = Int(size32)
+            if size32 == 1 {
+                guard let size64 = header.uint64(at: 8, .bigEndian), size64 <= UInt64(Int.max) else {
+                    break
+                }
+                size = Int(size64)
+                headerSize = 16
+            } else if size32 == 0 {
+                size = range.upperBound - offset
+            }
+
+            var userType: Data? = nil
+            if type == "uuid" {
+                userType = header.subdata(from: headerSize, count: 16)
+                headerSize += 16
+            }
+            guard size >= headerSize, size <= range.upperBound - offset else {
+                break
+            }
+
+            boxes.append(ISOBMFFBox(type: type, range: offset ..< (offset + size), headerSize: headerSize, userType: userType))
+            offset += size
+        }
+        return boxes
+    }
+
+    /** The boxes of a container box, following `path` down from it; those of the last path component are returned. */
+    static func boxes(along path: [String], from box: ISOBMFFBox, fetch: Fetch) throws -> [ISOBMFFBox] {
+        var current = try boxes(in: box.payloadRange, fetch: fetch)
+        for type in path {
+            guard let next = current.first(where: { $0.type == type }) else {
+                return []
+            }
+            current = try boxes(in: next.payloadRange, fetch: fetch)
+        }
+        return current
+    }
+
+    // MARK: Canon CR3
+
+    /**
+     A JPEG stored in a THMB or PRVW box: the byte count field is trusted only if it fits in the box, and the JPEG is
+     otherwise taken to extend to the end of the box.
+     */
+    private static func jpegPreview(in box: ISOBMFFBox, dimensionsAt dimensionsOffset: Int, byteCountAt byteCountOffset: Int, fetch: Fetch) throws -> EmbeddedPreview? {
+        let payload = box.payloadRange
+        guard let header = try fetch(payload.prefix(32)) else {
+            return nil
+        }
+        guard let start = (0 ..< max(0, header.count - 2)).first(where: { header.hasPrefix([0xFF, 0xD8, 0xFF], at: $0) }) else {
+            return nil
+        }
+        let available = payload.count - start
+        let byteCount = header.uint32(at: byteCountOffset, .bigEndian).map { Int($0) }.flatMap { $0 > 0 && $0 <= available ? $0 : nil } ?? available
+
+        let size: CGSize?
+        if let width = header.uint16(at: dimensionsOffset, .bigEndian), let height = header.uint16(at: dimensionsOffset + 2, .bigEndian), width > 0, height > 0 {
+            size = CGSize(width: Int(width), height: Int(height))
+        } else {
+            size = nil
+        }
+        let lowerBound = payload.lowerBound + start
+        return EmbeddedPreview(range: lowerBound ..< (lowerBound + byteCount), size: size)
+    }
+
+    /**
+     The dimensions of a CR3 track from its `CRAW` sample entry, the location of its first sample, whether that is a
+     JPEG image (the full size preview track) rather than RAW data, and the RAW coding parameters from the entry's
+     `CMP1` box, which follows the 82 bytes of the entry itself.
+     */
+    private static func canonTrack(_ trak: ISOBMFFBox, fetch: Fetch) throws -> (size: CGSize, sampleRange: Range<Int>?, isJPEG: Bool, compressionParameters: Data?)? {
+        let sampleTable = try boxes(along: ["mdia", "minf", "stbl"], from: trak, fetch: fetch)
+        guard let stsd = sampleTable.first(where: { $0.type == "stsd" }),
+              let entry = try boxes(in: min(stsd.payloadRange.lowerBound + 8, stsd.range.upperBound) ..< stsd.range.upperBound, fetch: fetch).first,
+              entry.type == "CRAW",
+              let entryData = try fetch(entry.payloadRange.prefix(28)),
+              let width = entryData.uint16(at: 24, .bigEndian), let height = entryData.uint16(at: 26, .bigEndian), width > 0, height > 0 else {
+            return nil
+        }
+        let size = CGSize(width: Int(width), height: Int(height))
+
+        let entryBoxes = try boxes(in: min(entry.payloadRange.lowerBound + 82, entry.range.upperBound) ..< entry.range.upperBound, fetch: fetch)
+        let compressionParameters = try entryBoxes.first(where: { $0.type == "CMP1" }).flatMap { try fetch($0.payloadRange.prefix(256)) }
+
+        // First chunk offset, and the first sample's size (a constant sample size, or the first of the table)
+        var chunkOffset: Int? = nil
+        if let stco = sampleTable.first(where: { $0.type == "stco" }), let data = try fetch(stco.payloadRange.prefix(12)) {
+            chunkOffset = data.uint32(at: 8, .bigEndian).map { Int($0) }
+        } else if let co64 = sampleTable.first(where: { $0.type == "co64" }), let data = try fetch(co64.payloadRange.prefix(16)) {
+            chunkOffset = data.uint64(at: 8, .bigEndian).flatMap { $0 <= UInt64(Int.max) ? Int($0) : nil }
+        }
+        var sampleSize: Int? = nil
+        if let stsz = sampleTable.first(where: { $0.type == "stsz" }), let data = try fetch(stsz.payloadRange.prefix(16)) {
+            let constantSize = data.uint32(at: 4, .bigEndian) ?? 0
+            sampleSize = (constantSize > 0 ? constantSize : data.uint32(at: 12, .bigEndian)).map { Int($0) }
+        }
+
+        // A co64 offset may be anything up to Int.max
+        guard let offset = chunkOffset, let byteCount = sampleSize, byteCount > 3, !offset.addingReportingOverflow(byteCount).overflow else {
+            return (size, nil, false, compressionParameters)
+        }
+        let isJPEG = try fetch(offset ..< (offset + 3))?.hasPrefix([0xFF, 0xD8, 0xFF]) ?? false
+        return (size, offset ..< (offset + byteCount), isJPEG, compressionParameters)
+    }
+
+    // MARK: HEIF items
+
+    /** The primary item's properties and the Exif item's location, from a `meta` box. */
+    private struct ItemInfo {
+        var primaryImageSize: CGSize? = nil
+        var rotation: Int? = nil
+        var exifTIFFOffset: Int? = nil
+
+        init(meta: ISOBMFFBox, fetch: Fetch) throws {
+            // `meta` is a full box: version and flags precede its children
+            let children = try ISOBMFFStructure.boxes(in: min(meta.payloadRange.lowerBound + 4, meta.range.upperBound) ..< meta.range.upperBound, fetch: fetch)
+            func payload(_ type: String, limit: Int = 64 * 1024) throws -> Data? {
+                guard let box = children.first(where: { $0.type == type }), box.payloadRange.count <= limit else {
+                    return nil
+                }
+                return try fetch(box.payloadRange)
+            }
+
+            guard let pitm = try payload("pitm"), let version = pitm.uint8(at: 0) else {
+                return
+            }
+            guard let primaryID = (version == 0 ? pitm.uint16(at: 4, .bigEndian).map { Int($0) } : pitm.uint32(at: 4, .bigEndian).map { Int($0) }) else {
+                return
+            }
+
+            if let iprp = children.first(where: { $0.type == "iprp" }) {
+                let iprpChildren = try ISOBMFFStructure.boxes(in: iprp.payloadRange, fetch: fetch)
+                if let ipco = iprpChildren.first(where: { $0.type == "ipco" }), let ipma = iprpChildren.first(where: { $0.type == "ipma" }),
+                   let ipmaData = try fetch(ipma.payloadRange) {
+                    let properties = try ISOBMFFStructure.boxes(in: ipco.payloadRange, fetch: fetch)
+                    for index in ItemInfo.propertyIndices(of: primaryID, in: ipmaData) where index > 0 && index <= properties.count {
+                        let property = properties[index - 1]
+                        switch property.type {
+                        case "ispe":
+                            if let data = try fetch(property.payloadRange.prefix(12)),
+                               let width = data.uint32(at: 4, .bigEndian), let height = data.uint32(at: 8, .bigEndian), width > 0, height > 0 {
+                                primaryImageSize = CGSize(width: Int(width), height: Int(height))
+                            }
+                        case "irot":
+                            if let data = try fetch(property.payloadRange.prefix(1)), let angle = data.uint8(at: 0) {
+                                rotation = Int(angle & 3)
+                            }
+                        default:
+                            break
+                        }
+                    }
+                }
+            }
+
+            guard let iinf = children.first(where: { $0.type == "iinf" }),
+                  let iinfHeader = try fetch(iinf.payloadRange.prefix(8)), let iinfVersion = iinfHeader.uint8(at: 0) else {
+                return
+            }
+            let entriesStart = iinf.payloadRange.lowerBound + (iinfVersion == 0 ? 6 : 8)
+            var exifID: Int? = nil
+            for infe in try ISOBMFFStructure.boxes(in: min(entriesStart, iinf.range.upperBound) ..< iinf.range.upperBound, fetch: fetch) where infe.type == "infe" {
+                guard let data = try fetch(infe.payloadRange.prefix(16)), let infeVersion = data.uint8(at: 0), infeVersion >= 2 else {
+                    continue
+                }
+                let itemID = infeVersion == 2 ? data.uint16(at: 4, .bigEndian).map { Int($0) } : data.uint32(at: 4, .bigEndian).map { Int($0) }
+                let itemType = data.fourCC(at: infeVersion == 2 ? 8 : 10)
+                if itemType == "Exif", let itemID = itemID {
+                    exifID = itemID
+                    break
+                }
+            }
+
+            guard let exifItemID = exifID, let iloc = try payload("iloc", limit: 1024 * 1024),
+                  let location = ItemInfo.location(of: exifItemID, in: iloc) else {
+                return
+            }
+            var exifOffset = location.offset
+            if location.constructionMethod == 1 {
+                guard let idat = children.first(where: { $0.type == "idat" }) else {
+                    return
+                }
+                let (offset, overflow) = exifOffset.addingReportingOverflow(idat.payloadRange.lowerBound)
+                guard !overflow else {
+                    return
+                }
+                exifOffset = offset
+            } else if location.constructionMethod != 0 {
+                return
+            }
+            // The Exif item begins with the offset of the TIFF header from the end of the offset field itself
+            guard exifOffset <= Int.max - 4, let headerOffset = try fetch(exifOffset ..< (exifOffset + 4))?.uint32(at: 0, .bigEndian) else {
+                return
+            }
+            let (tiffOffset, overflow) = (exifOffset + 4).addingReportingOverflow(Int(headerOffset))
+            exifTIFFOffset = overflow ? nil : tiffOffset
+        }
+
+        /** One-based indices into `ipco` of the properties associated with an item. */
+        static func propertyIndices(of itemID: Int, in ipma: Data) -> [Int] {
+            guard let version = ipma.uint8(at: 0), let flags = ipma.uint8(at: 3), let entryCount = ipma.uint32(at: 4, .bigEndian) else {
+                return []
+            }
+            var offset = 8
+            for _ in 0 ..< min(Int(entryCount), 65536) {
+                let id: Int?
+                if version < 1 {
+                    id = ipma.uint16(at: offset, .bigEndian).map { Int($0) }
+                    offset += 2
+                } else {
+                    id = ipma.uint32(at: offset, .bigEndian).map { Int($0) }
+                    offset += 4
+                }
+                guard let entryID = id, let associationCount = ipma.uint8(at: offset) else {
+                    return []
+                }
+                offset += 1
+
+                var indices = [Int]()
+                for _ in 0 ..< Int(associationCount) {
+                    if flags & 1 != 0 {
+                        guard let value = ipma.uint16(at: offset, .bigEndian) else {
+                            return []
+                        }
+                        indices.append(Int(value & 0x7FFF))
+                        offset += 2
+                    } else {
+                        guard let value = ipma.uint8(at: offset) else {
+                            return []
+                        }
+                        indices.append(Int(value & 0x7F))
+                        offset += 1
+                    }
+                }
+                if entryID == itemID {
+                    return indices
+                }
+            }
+            return []
+        }
+
+        /** The start of an item's first extent, from the `iloc` box payload. */
+        static func location(of itemID: Int, in iloc: Data) -> (offset: Int, constructionMethod: Int)? {
+            guard let version = iloc.uint8(at: 0), let sizes = iloc.uint8(at: 4), let sizes2 = iloc.uint8(at: 5) else {
+                return nil
+            }
+            let offsetSize = Int(sizes >> 4), lengthSize = Int(sizes & 0xF)
+            let baseOffsetSize = Int(sizes2 >> 4), indexSize = version >= 1 ? Int(sizes2 & 0xF) : 0
+
+            var position = 6
+            func read(_ byteCount: Int) -> Int? {
+                defer { position += byteCount }
+                switch byteCount {
+                case 0: return 0
+                case 2: return iloc.uint16(at: position, .bigEndian).map { Int($0) }
+                case 4: return iloc.uint32(at: position, .bigEndian).map { Int($0) }
+                case 8: return iloc.uint64(at: position, .bigEndian).flatMap { $0 <= UInt64(Int.max) ? Int($0) : nil }
+                default: return nil
+                }
+            }
+
+            guard let itemCount = read(version < 2 ? 2 : 4) else {
+                return nil
+            }
+            for _ in 0 ..< min(itemCount, 65536) {
+                guard let id = read(version < 2 ? 2 : 4) else {
+                    return nil
+                }
+                var constructionMethod = 0
+                if version >= 1 {
+                    guard let value = read(2) else {
+                        return nil
+                    }
+                    constructionMethod = value & 0xF
+                }
+                guard read(2) != nil, let baseOffset = read(baseOffsetSize), let extentCount = read(2) else {
+                    return nil
+                }
+                var firstExtentOffset: Int? = nil
+                for _ in 0 ..< extentCount {
+                    guard read(indexSize) != nil, let extentOffset = read(offsetSize), read(lengthSize) != nil else {
+                        return nil
+                    }
+                    firstExtentOffset = firstExtentOffset ?? extentOffset
+                }
+                if id == itemID, let extentOffset = firstExtentOffset {
+                    let (offset, overflow) = baseOffset.addingReportingOverflow(extentOffset)
+                    return overflow ? nil : (offset, constructionMethod)
+                }
+            }
+            return nil
+        }
+    }
+}
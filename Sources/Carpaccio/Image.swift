@@ -34,7 +34,7 @@ public enum ImageMetadataState {
 open class Image: Equatable, Hashable, CustomStringConvertible {
     public enum Error: Swift.Error, LocalizedError {
         case noLoader(Image)
-        case noFileExtension // FIXME: lift this restriction.
+        case noFileExtension // No longer thrown: files without an extension are identified by their content.
         case urlMissing
         case locationNotEnumerable(URL)
         case loadingFailed(underlyingError: Swift.Error)
@@ -88,39 +88,60 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
         return size
     }
     
-    public private(set) var URL: Foundation.URL?
+    /** Guards the mutable state of the image, which is loaded and updated from several queues at once. */
+    private let lock = NSLock()
+
+    private func synchronized<T>(_ body: () throws -> T) rethrows -> T {
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        return try body()
+    }
+
+    private var _URL: Foundation.URL?
+
+    public var URL: Foundation.URL? {
+        return synchronized { _URL }
+    }
 
     public func updateURL(_ url: Foundation.URL) {
-        self.URL = url
+        synchronized {
+            _URL = url
+            _directoryPath = nil
+        }
     }
     
     private var _directoryPath: String?
 
     public var directoryPath: String? {
-        if let url = URL {
+        return synchronized {
+            guard let url = _URL else {
+                return nil
+            }
             if _directoryPath == nil {
                 _directoryPath = url.deletingLastPathComponent().path
             }
             return _directoryPath
         }
-        return nil
     }
     
     public typealias MetadataHandler = (_ metadata: ImageMetadata) -> Void
     public typealias ErrorHandler = (_ error: Image.Error) -> Void
     public typealias DistanceFunction = (_ a:Image, _ b:Image)-> Double
     
-    /// Set the value for this to alter the type of object used by default for image and metadata loading.
+    /// Set the value for this to alter the type of object used by default for image and metadata loading, by the
+    /// ImageIO format handler and for files whose format is not recognised from their content.
     internal static var defaultImageLoaderType: URLBackedImageLoaderProtocol.Type = ImageLoader.self
     
     public init(image: BitmapImage, imageLoader: ImageLoaderProtocol) {
         self.cachedImageLoader = imageLoader
-        self.URL = imageLoader.imageURL
+        self._URL = imageLoader.imageURL
         self.name = image.nameString ?? "Untitled"
     }
     
     public init(URL: Foundation.URL, imageLoader: ImageLoaderProtocol? = nil) {
-        self.URL = URL
+        self._URL = URL
         self.cachedImageLoader = imageLoader
         self.name = URL.lastPathComponent
     }
@@ -132,8 +153,12 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
         return isBakedImage
     }
     
-    /// Determine if this `Image` represents an image file stored in a baked, non-RAW format.
+    /// Determine if this `Image` represents an image file stored in a baked, non-RAW format. Once the file's content
+    /// has been sniffed by `imageLoader()`, a conclusive `format` takes precedence over the file extension.
     open var isBaked: Bool {
+        if let isRAW = format?.isRAW {
+            return !isRAW
+        }
         guard let pathExtension = URL?.pathExtension else {
             return false
         }
@@ -145,8 +170,12 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
         return isRAW
     }
 
-    /// Determine if this `Image` represents an image file stored in a RAW format.
+    /// Determine if this `Image` represents an image file stored in a RAW format. Once the file's content has been
+    /// sniffed by `imageLoader()`, a conclusive `format` takes precedence over the file extension.
     open var isRAW: Bool {
+        if let isRAW = format?.isRAW {
+            return isRAW
+        }
         guard let pathExtension = URL?.pathExtension else {
             return false
         }
@@ -158,28 +187,84 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
         return isImage
     }
 
+    private var _format: ImageFormat?
+
+    /// The format of the image file as identified from its content, by `imageLoader()` or from the byte source given
+    /// to `fetchMetadata(from:)`. `nil` until then, or when the content matches no known signature.
+    public var format: ImageFormat? {
+        return synchronized { _format }
+    }
+
+    /** Note the format of the file, sniffed from a byte source of it already at hand, so that the file need not be opened for it. */
+    func updateFormat(sniffedFrom source: ImageByteSource) {
+        guard let sniffedFormat = try? ImageFormat(source: source) else {
+            return
+        }
+        synchronized {
+            _format = sniffedFormat
+        }
+    }
+
     public func clearCachedResources() {
-        self.cachedImageLoader = nil
-        self.fileModificationTimestamp = nil
+        synchronized {
+            cachedImageLoader = nil
+            _format = nil
+            fileModificationTimestamp = nil
+        }
+    }
+
+    /** Forget everything loaded from the image file (metadata, and the loader with its cached thumbnail), after the file has changed. */
+    public func fileContentsDidChange() {
+        synchronized {
+            _metadata = nil
+        }
+        clearCachedResources()
     }
     
     //
     // Return an image loader for this image. If one has previously been created, that matches the
     // requested color space, a cached instance is returned.
     //
+    // The loader is created by the handler in `ImageFormatRegistry.shared` best able to read the format sniffed from
+    // the file's first bytes, whatever its extension says. `nil` is returned for a recognised format which no
+    // handler reads. Files which cannot be read yet, or whose format is not recognised, get the default loader.
+    // A format already known, say from `fetchMetadata(from:)`, is not sniffed again.
+    //
     // @param `colorSpace` color space to convert thumbnail and full-sized image data into. If `nil`,
     //         color space is assumed to not matter, and no conversion will not be performed. Has no
     //         effect for fetching image metadata.
     //
     open func imageLoader() -> ImageLoaderProtocol? {
-        if let cachedLoader = cachedImageLoader {
+        let (cachedLoader, url, knownFormat) = synchronized { (cachedImageLoader, _URL, _format) }
+        if let cachedLoader = cachedLoader {
             return cachedLoader
         }
-        guard let url = self.URL else {
+        guard let imageURL = url else {
             return nil
         }
-        cachedImageLoader = Image.defaultImageLoaderType.init(imageURL: url, thumbnailScheme: .decodeFullImageIfEmbeddedThumbnailTooSmall)
-        return cachedImageLoader
+        let thumbnailScheme = ImageLoader.ThumbnailScheme.decodeFullImageIfEmbeddedThumbnailTooSmall
+
+        // The file is only opened if its format is not known already. Sniffing happens outside the lock, as it reads.
+        let loader: ImageLoaderProtocol?
+        let sniffedFormat = knownFormat ?? (try? ImageLoader.byteSource(for: imageURL)).flatMap { try? ImageFormat(source: $0) }
+        if let sniffedFormat = sniffedFormat {
+            loader = ImageFormatRegistry.shared.handler(for: sniffedFormat, requiring: .metadata)?.makeLoader(imageURL: imageURL, format: sniffedFormat, thumbnailScheme: thumbnailScheme)
+        } else {
+            loader = Image.defaultImageLoaderType.init(imageURL: imageURL, thumbnailScheme: thumbnailScheme)
+        }
+
+        return synchronized {
+            // Another thread may have got here first
+            if let existing = cachedImageLoader {
+                return existing
+            }
+            _format = sniffedFormat
+            cachedImageLoader = loader
+            if let metadata = _metadata {
+                loader?.updateCachedMetadata(metadata)
+            }
+            return loader
+        }
     }
     
     /**
@@ -190,10 +275,18 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
      Code depending on the details of that should consult `imageLoader.imageMetadataState` for the current state of affairs.
 
      */
-    public private(set) var metadata: ImageMetadata?
+    public var metadata: ImageMetadata? {
+        return synchronized { _metadata }
+    }
+
+    private var _metadata: ImageMetadata?
 
     public var metadataState: ImageMetadataState {
-        return imageLoader()?.imageMetadataState ?? .initialized
+        guard let loader = imageLoader() else {
+            // A format recognised from the file's content, which no handler reads, will not load
+            return format == nil ? .initialized : .failed
+        }
+        return loader.imageMetadataState
     }
     
     public func fetchMetadata() throws -> ImageMetadata {
@@ -201,29 +294,51 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
             throw Error.noLoader(self)
         }
         let metadata = try loader.loadImageMetadata()
-        self.metadata = metadata
+        synchronized {
+            _metadata = metadata
+        }
+        return metadata
+    }
+
+    /// Load metadata from the given byte source, such as one already read into memory by a `BatchedFileReader`,
+    /// rather than from the file at `URL`. The file's format is sniffed from the source too, so that neither is
+    /// read from the file again.
+    public func fetchMetadata(from byteSource: ImageByteSource) throws -> ImageMetadata {
+        let loader = ImageLoader(byteSource: byteSource, thumbnailScheme: .decodeEmbeddedThumbnail)
+        let metadata = try loader.loadImageMetadata()
+        updateFormat(sniffedFrom: byteSource)
+        updateMetadata(metadata)
         return metadata
     }
 
+    /// Set the image's metadata. A loader created later, by `imageLoader()`, starts out with it too, so setting
+    /// metadata does not itself create a loader or open the file.
     public func updateMetadata(_ metadata: ImageMetadata) {
-        self.metadata = metadata
-        self.imageLoader()?.updateCachedMetadata(metadata)
+        let loader = synchronized { () -> ImageLoaderProtocol? in
+            _metadata = metadata
+            return cachedImageLoader
+        }
+        loader?.updateCachedMetadata(metadata)
     }
 
     private var fileModificationTimestamp: Date?
 
     open var fileTimestamp: Date? {
-        if let fileModificationTimestamp = fileModificationTimestamp {
-            return fileModificationTimestamp
+        let (timestamp, url) = synchronized { (fileModificationTimestamp, _URL) }
+        if let timestamp = timestamp {
+            return timestamp
         }
 
-        guard let url = self.URL, url.isFileURL else {
+        guard let fileURL = url, fileURL.isFileURL else {
             return nil
         }
 
-        if let fileTimestamp = try? FileManager.default.attributesOfFileSystem(forPath: url.path)[.modificationDate] as? Date {
-            fileModificationTimestamp = fileTimestamp
-            return fileModificationTimestamp
+        // Usually cached already, by the directory walk which found the image
+        if let attributes = FileAttributeCache.shared.attributes(for: fileURL) {
+            synchronized {
+                fileModificationTimestamp = attributes.modificationDate
+            }
+            return attributes.modificationDate
         }
 
         return nil
@@ -254,8 +369,10 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
         let maxDimensions = CGSize(constrainHeight: presentedHeight ?? CGFloat.unconstrained)
         let (thumbnailImage, metadata) = try loader.loadBitmapImage(maximumPixelDimensions: maxDimensions, colorSpace: colorSpace, allowCropping: true, cancelled: cancelled)
         
-        if self.metadata == nil {
-            self.metadata = metadata
+        synchronized {
+            if _metadata == nil {
+                _metadata = metadata
+            }
         }
 
         return thumbnailImage
@@ -291,8 +408,10 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
             }
         }()
 
-        if self.metadata == nil {
-            self.metadata = metadata
+        synchronized {
+            if _metadata == nil {
+                _metadata = metadata
+            }
         }
 
         return ciImage
@@ -309,6 +428,7 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
             "3fr", // Hasselblad 3F RAW Image https://fileinfo.com/extension/3fr
             "arw", // Sony Digital Camera Image https://fileinfo.com/extension/arw
             "cr2", // Canon Raw Image File https://fileinfo.com/extension/cr2
+            "cr3", // Canon Raw 3 Image File https://fileinfo.com/extension/cr3
             "crw", // Canon Raw CIFF Image File https://fileinfo.com/extension/crw
             "dcr", // Kodak https://fileinfo.com/extension/dcr
             "dng", // Adobe Digital Negative Image https://fileinfo.com/extension/dng
@@ -350,7 +470,8 @@ open class Image: Equatable, Hashable, CustomStringConvertible {
     // UUID for equality and hashing. This will be refactored in:
     //   https://gitlab.com/sashimiapp-public/Carpaccio/-/issues/12
 
-    private lazy var identity = UUID()
+    // Not lazy: images are hashed from several queues at once
+    private let identity = UUID()
 
     public static func == (lhs:Image, rhs:Image) -> Bool {
         return lhs.identity == rhs.identity
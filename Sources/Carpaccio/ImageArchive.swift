@@ -0,0 +1,869 @@
+//
+//  ImageArchive.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import Compression
+
+public enum ImageArchiveError: Swift.Error, LocalizedError {
+    case unrecognizedFormat(URL)
+    case malformed(url: URL, message: String)
+    case notAnArchiveMember(URL)
+    case noSuchMember(archiveURL: URL, path: String)
+    case unsupportedMember(archiveURL: URL, path: String, reason: String)
+    case failedToInflate(url: URL, message: String)
+
+    public var errorDescription: String? {
+        switch self {
+        case .unrecognizedFormat(let url):
+            return "\(url) is neither a ZIP nor a TAR archive"
+        case .malformed(let url, let message):
+            return "Malformed archive \(url): \(message)"
+        case .notAnArchiveMember(let url):
+            return "\(url) does not point inside an archive"
+        case .noSuchMember(let archiveURL, let path):
+            return "No member \(path) in archive \(archiveURL)"
+        case .unsupportedMember(let archiveURL, let path, let reason):
+            return "Cannot read member \(path) of archive \(archiveURL): \(reason)"
+        case .failedToInflate(let url, let message):
+            return "Failed to inflate \(url): \(message)"
+        }
+    }
+}
+
+/**
+
+ Image files inside a ZIP or TAR archive, readable without extracting them.
+
+ Members are found through the archive's index: the central directory at the end of a ZIP file, or the chain of
+ 512 byte headers of a TAR file. The index is parsed once per mapping of the archive, and kept in the archive byte
+ source's `containerCache`, so opening the same archive again through `ImageByteSourcePool` costs a hash lookup.
+
+ Every member is exposed as a byte source of its own. Stored ZIP entries and TAR members are windows onto the
+ memory mapped archive (`SubrangeByteSource`), so reading them copies nothing. Deflated ZIP entries are inflated
+ on demand (`InflatingByteSource`), only as far as the furthest byte read so far: parsing the metadata of a
+ deflated JPEG or RAW file inflates its first few blocks, not the whole member.
+
+ Members are identified by URLs which treat the archive as a directory, such as
+ `file:///Deliveries/job.zip/DCIM/IMG_0001.CR2`. `ImageLoader` resolves such URLs through `byteSource(forMemberAt:)`,
+ so an `Image` made from a member URL loads metadata and thumbnails like any other.
+
+ */
+public final class ImageArchive {
+    public enum Format {
+        case zip
+        case tar
+    }
+
+    /** A regular file in the archive. Directories, links and other special members are not listed. */
+    public struct Member {
+        public enum Encoding: Equatable {
+            case stored
+            case deflated
+            /** Encrypted, or compressed with a method other than deflate. */
+            case unsupported(reason: String)
+        }
+
+        /** Path within the archive, with no leading `/` or `./` components. */
+        public let path: String
+        public let encoding: Encoding
+        public let compressedSize: Int
+        /** Size of the member's contents, once inflated. */
+        public let size: Int
+        public let modificationDate: Date?
+
+        /** Offset of the member's local (ZIP) or ustar (TAR) header in the archive. */
+        public let headerOffset: Int
+
+        public var isImage: Bool {
+            return Image.imageFileExtensions.contains((path as NSString).pathExtension.lowercased())
+        }
+
+        public var isReadable: Bool {
+            if case .unsupported = encoding {
+                return false
+            }
+            return true
+        }
+    }
+
+    public static let fileExtensions: Set<String> = ["zip", "tar"]
+
+    public let source: ImageByteSource
+    public let format: Format
+    private let index: Index
+
+    /** Open the archive at `url`, mapping it through `pool`. */
+    public static func open(at url: URL, pool: ImageByteSourcePool = .shared) throws -> ImageArchive {
+        return try ImageArchive(source: pool.byteSource(for: url))
+    }
+
+    public init(source: ImageByteSource) throws {
+        let index = try source.containerCache.value(forKey: ImageArchive.indexKey) {
+            return try Index(source: source)
+        }
+        self.source = source
+        self.index = index
+        self.format = index.format
+    }
+
+    public var url: URL {
+        return source.url
+    }
+
+    /** Members in the order they are stored in the archive. */
+    public var members: [Member] {
+        return index.members
+    }
+
+    public func member(at path: String) -> Member? {
+        guard let path = ImageArchive.normalizedPath(path), let i = index.memberIndicesByPath[path] else {
+            return nil
+        }
+        return index.members[i]
+    }
+
+    /** A URL for `member`, which treats the archive as a directory. */
+    public func url(for member: Member) -> URL {
+        return url.appendingPathComponent(member.path, isDirectory: false)
+    }
+
+    /**
+     URLs of image members which can be read, sorted by path. Their sizes and modification times are stored into
+     `attributeCache`, with the device and inode of the archive, so that `Image.fileTimestamp` needs no file access.
+     */
+    public func imageURLs(attributeCache: FileAttributeCache? = .shared) -> [URL] {
+        let sorted = members.filter { $0.isImage && $0.isReadable }.sorted { $0.path < $1.path }
+        let urls = sorted.map { url(for: $0) }
+
+        if let cache = attributeCache, let archiveAttributes = cache.attributes(for: url) {
+            cache.store(contentsOf: zip(sorted, urls).map { member, url in
+                // A pax mtime can be any decimal number, beyond the range of file timestamps
+                var timestamp = member.modificationDate?.timeIntervalSince1970 ?? archiveAttributes.modificationDate.timeIntervalSince1970
+                if Int(exactly: timestamp.rounded(.down)) == nil {
+                    timestamp = archiveAttributes.modificationDate.timeIntervalSince1970
+                }
+                let seconds = timestamp.rounded(.down)
+                let signature = FileSignature(size: Int64(member.size), modificationSeconds: Int(seconds),
+                                              modificationNanoseconds: Int((timestamp - seconds) * 1_000_000_000))
+                return (path: url.path, attributes: FileAttributes(signature: signature, device: archiveAttributes.device, inode: archiveAttributes.inode))
+            })
+        }
+        return urls
+    }
+
+    public func byteSource(forMemberAt path: String) throws -> ImageByteSource {
+        guard let member = member(at: path) else {
+            throw ImageArchiveError.noSuchMember(archiveURL: url, path: path)
+        }
+        return try byteSource(for: member)
+    }
+
+    /**
+     A byte source for the contents of `member`. Recently used member sources are kept, so that loading metadata
+     and then a thumbnail from a deflated member inflates it once, and parses its container structure once.
+     */
+    public func byteSource(for member: Member) throws -> ImageByteSource {
+        let memberURL = url(for: member)
+        if let existing = ImageArchive.memberSources.source(for: memberURL, in: source) {
+            return existing
+        }
+
+        let memberSource: ImageByteSource
+        switch member.encoding {
+        case .stored:
+            memberSource = try SubrangeByteSource(parent: source, range: dataRange(of: member), url: memberURL)
+        case .deflated:
+            memberSource = try InflatingByteSource(parent: source, compressedRange: dataRange(of: member), count: member.size, url: memberURL)
+        case .unsupported(let reason):
+            throw ImageArchiveError.unsupportedMember(archiveURL: url, path: member.path, reason: reason)
+        }
+        return ImageArchive.memberSources.store(memberSource, for: memberURL, in: source)
+    }
+
+    /** Where the contents of `member` are stored. For ZIP members, this reads the member's local header. */
+    public func dataRange(of member: Member) throws -> Range<Int> {
+        let dataOffset: Int
+        switch format {
+        case .tar:
+            dataOffset = member.headerOffset + ImageArchive.tarBlockSize
+        case .zip:
+            let header = try source.bytes(from: member.headerOffset, upTo: 30)
+            guard header.uint32(at: 0, .littleEndian) == ImageArchive.zipLocalHeaderSignature,
+                  let nameLength = header.uint16(at: 26, .littleEndian),
+                  let extraLength = header.uint16(at: 28, .littleEndian) else {
+                throw ImageArchiveError.malformed(url: url, message: "No local header for \(member.path) at offset \(member.headerOffset)")
+            }
+            dataOffset = member.headerOffset + 30 + Int(nameLength) + Int(extraLength)
+        }
+
+        // Sizes come from the archive's directory, and may be anything up to Int.max
+        guard dataOffset <= source.count, member.compressedSize <= source.count - dataOffset else {
+            throw ImageArchiveError.malformed(url: url, message: "Member \(member.path) extends past the end of the archive")
+        }
+        return dataOffset ..< (dataOffset + member.compressedSize)
+    }
+
+    // MARK: - Resolving member URLs
+
+    /** Whether `url` names a regular file with an archive extension. */
+    public static func isArchive(at url: URL) -> Bool {
+        guard url.isFileURL, fileExtensions.contains(url.pathExtension.lowercased()) else {
+            return false
+        }
+        var fileStat = stat()
+        return stat(url.path, &fileStat) == 0 && (fileStat.st_mode & S_IFMT) == S_IFREG
+    }
+
+    /**
+     Split a member URL such as `file:///Deliveries/job.zip/DCIM/IMG_0001.CR2` into the URL of the archive and the
+     member's path in it. The archive is the deepest existing ancestor of `url`, if it is a regular file.
+     */
+    public static func archiveURLAndMemberPath(for url: URL) -> (archiveURL: URL, path: String)? {
+        guard url.isFileURL else {
+            return nil
+        }
+        let components = url.standardizedFileURL.pathComponents
+        var fileStat = stat()
+        for count in stride(from: components.count - 1, to: 1, by: -1) {
+            let archivePath = NSString.path(withComponents: Array(components[0 ..< count]))
+            guard stat(archivePath, &fileStat) == 0 else {
+                continue
+            }
+            guard (fileStat.st_mode & S_IFMT) == S_IFREG else {
+                return nil
+            }
+            return (URL(fileURLWithPath: archivePath, isDirectory: false), components[count...].joined(separator: "/"))
+        }
+        return nil
+    }
+
+    /** A byte source for the archive member named by `url`. See `archiveURLAndMemberPath(for:)`. */
+    public static func byteSource(forMemberAt url: URL, pool: ImageByteSourcePool = .shared) throws -> ImageByteSource {
+        guard let (archiveURL, path) = archiveURLAndMemberPath(for: url) else {
+            throw ImageArchiveError.notAnArchiveMember(url)
+        }
+        return try open(at: archiveURL, pool: pool).byteSource(forMemberAt: path)
+    }
+
+    // MARK: - Index
+
+    private static let indexKey = "com.sashimiapp.ImageArchive.index"
+
+    /** Kept in the archive source's container cache, so must not reference the source. */
+    private final class Index {
+        let format: Format
+        let members: [Member]
+        let memberIndicesByPath: [String: Int]
+
+        init(source: ImageByteSource) throws {
+            guard let format = ImageArchive.format(of: source) else {
+                throw ImageArchiveError.unrecognizedFormat(source.url)
+            }
+            self.format = format
+
+            switch format {
+            case .zip:
+                members = try ImageArchive.zipMembers(in: source)
+            case .tar:
+                members = try ImageArchive.tarMembers(in: source)
+            }
+
+            // Should a path occur more than once, the last one wins, as it would when extracting
+            var indices = [String: Int](minimumCapacity: members.count)
+            for (i, member) in members.enumerated() {
+                indices[member.path] = i
+            }
+            memberIndicesByPath = indices
+        }
+    }
+
+    public static func format(of source: ImageByteSource) -> Format? {
+        guard let head = try? source.bytes(from: 0, upTo: tarBlockSize) else {
+            return nil
+        }
+        if head.uint32(at: 0, .littleEndian) == zipLocalHeaderSignature || head.uint32(at: 0, .littleEndian) == zipEndOfDirectorySignature {
+            return .zip
+        }
+        if head.count == tarBlockSize && hasValidTARChecksum(head) {
+            return .tar
+        }
+        return nil
+    }
+
+    /** Strip leading `/` and `.` components. Paths escaping the archive with `..` are rejected. */
+    static func normalizedPath(_ path: String) -> String? {
+        let components = path.split(separator: "/").filter { !$0.isEmpty && $0 != "." }
+        guard !components.isEmpty, !components.contains("..") else {
+            return nil
+        }
+        return components.joined(separator: "/")
+    }
+
+    // MARK: ZIP
+
+    private static let zipLocalHeaderSignature: UInt32 = 0x04034b50
+    private static let zipCentralHeaderSignature: UInt32 = 0x02014b50
+    private static let zipEndOfDirectorySignature: UInt32 = 0x06054b50
+    private static let zip64EndOfDirectorySignature: UInt32 = 0x06064b50
+    private static let zip64LocatorSignature: UInt32 = 0x07064b50
+
+    private static func zipMembers(in source: ImageByteSource) throws -> [Member] {
+        // The end of central directory record is followed by a comment of up to 64 KiB
+        let tailOffset = max(0, source.count - (22 + 0xFFFF))
+        let tail = try source.bytes(in: tailOffset ..< source.count)
+
+        var recordOffset: Int? = nil
+        for candidate in stride(from: tail.count - 22, through: 0, by: -1) {
+            if tail.uint32(at: candidate, .littleEndian) == zipEndOfDirectorySignature,
+               let commentLength = tail.uint16(at: candidate + 20, .littleEndian), candidate + 22 + Int(commentLength) <= tail.count {
+                recordOffset = candidate
+                break
+            }
+        }
+        guard let record = recordOffset,
+              var entryCount = tail.uint16(at: record + 10, .littleEndian).map { Int($0) },
+              var directorySize = tail.uint32(at: record + 12, .littleEndian).map { Int($0) },
+              var directoryOffset = tail.uint32(at: record + 16, .littleEndian).map { Int($0) } else {
+            throw ImageArchiveError.malformed(url: source.url, message: "No end of central directory record")
+        }
+
+        if entryCount == 0xFFFF || directorySize == 0xFFFF_FFFF || directoryOffset == 0xFFFF_FFFF,
+           tail.uint32(at: record - 20, .littleEndian) == zip64LocatorSignature,
+           let zip64RecordOffset = tail.uint64(at: record - 12, .littleEndian) {
+            let zip64Record = try source.bytes(from: Int(clamping: zip64RecordOffset), upTo: 56)
+            guard zip64Record.uint32(at: 0, .littleEndian) == zip64EndOfDirectorySignature,
+                  let count = zip64Record.uint64(at: 32, .littleEndian),
+                  let size = zip64Record.uint64(at: 40, .littleEndian),
+                  let offset = zip64Record.uint64(at: 48, .littleEndian) else {
+                throw ImageArchiveError.malformed(url: source.url, message: "Invalid ZIP64 end of central directory record")
+            }
+            entryCount = Int(clamping: count)
+            directorySize = Int(clamping: size)
+            directoryOffset = Int(clamping: offset)
+        }
+
+        guard directoryOffset <= source.count, directorySize <= source.count - directoryOffset else {
+            throw ImageArchiveError.malformed(url: source.url, message: "Central directory extends past the end of the archive")
+        }
+        let directory = try source.bytes(in: directoryOffset ..< (directoryOffset + directorySize))
+
+        var members = [Member]()
+        members.reserveCapacity(min(entryCount, directorySize / 46))
+        var offset = 0
+        for _ in 0 ..< entryCount {
+            guard directory.uint32(at: offset, .littleEndian) == zipCentralHeaderSignature,
+                  let flags = directory.uint16(at: offset + 8, .littleEndian),
+                  let method = directory.uint16(at: offset + 10, .littleEndian),
+                  let dosTime = directory.uint16(at: offset + 12, .littleEndian),
+                  let dosDate = directory.uint16(at: offset + 14, .littleEndian),
+                  let compressedSize32 = directory.uint32(at: offset + 20, .littleEndian),
+                  let size32 = directory.uint32(at: offset + 24, .littleEndian),
+                  let nameLength = directory.uint16(at: offset + 28, .littleEndian).map { Int($0) },
+                  let extraLength = directory.uint16(at: offset + 30, .littleEndian).map { Int($0) },
+                  let commentLength = directory.uint16(at: offset + 32, .littleEndian).map { Int($0) },
+                  let headerOffset32 = directory.uint32(at: offset + 42, .littleEndian),
+                  let nameData = directory.subdata(from: offset + 46, count: nameLength),
+                  let extra = directory.subdata(from: offset + 46 + nameLength, count: extraLength) else {
+                throw ImageArchiveError.malformed(url: source.url, message: "Truncated central directory entry at offset \(directoryOffset + offset)")
+            }
+            offset += 46 + nameLength + extraLength + commentLength
+
+            // Bit 11 marks UTF-8 names; others are nominally CP437, which in practice is usually UTF-8 or Latin-1 too
+            let name = String(data: nameData, encoding: .utf8) ?? String(data: nameData, encoding: .isoLatin1) ?? ""
+            guard !name.hasSuffix("/"), let path = normalizedPath(name) else {
+                continue
+            }
+
+            var compressedSize = Int(compressedSize32)
+            var size = Int(size32)
+            var headerOffset = Int(headerOffset32)
+            var modificationDate = date(dosDate: dosDate, dosTime: dosTime)
+
+            var fieldOffset = 0
+            while let fieldID = extra.uint16(at: fieldOffset, .littleEndian), let fieldLength = extra.uint16(at: fieldOffset + 2, .littleEndian) {
+                let valueOffset = fieldOffset + 4
+                switch fieldID {
+                case 0x0001:
+                    // ZIP64 extended information: 64 bit values, present only for those saturated in the entry itself
+                    var position = valueOffset
+                    if size32 == 0xFFFF_FFFF, let value = extra.uint64(at: position, .littleEndian) {
+                        size = Int(clamping: value)
+                        position += 8
+                    }
+                    if compressedSize32 == 0xFFFF_FFFF, let value = extra.uint64(at: position, .littleEndian) {
+                        compressedSize = Int(clamping: value)
+                        position += 8
+                    }
+                    if headerOffset32 == 0xFFFF_FFFF, let value = extra.uint64(at: position, .littleEndian) {
+                        headerOffset = Int(clamping: value)
+                    }
+                case 0x5455:
+                    // Extended timestamp, with a UTC modification time when flag bit 0 is set
+                    if let timestampFlags = extra.uint8(at: valueOffset), timestampFlags & 1 != 0, fieldLength >= 5,
+                       let seconds = extra.uint32(at: valueOffset + 1, .littleEndian) {
+                        modificationDate = Date(timeIntervalSince1970: TimeInterval(Int32(bitPattern: seconds)))
+                    }
+                default:
+                    break
+                }
+                fieldOffset = valueOffset + Int(fieldLength)
+            }
+
+            let encoding: Member.Encoding
+            if flags & 1 != 0 {
+                encoding = .unsupported(reason: "encrypted")
+            } else if method == 0 {
+                encoding = .stored
+            } else if method == 8 {
+                encoding = .deflated
+            } else {
+                encoding = .unsupported(reason: "compression method \(method)")
+            }
+
+            members.append(Member(path: path, encoding: encoding, compressedSize: compressedSize, size: size,
+                                  modificationDate: modificationDate, headerOffset: headerOffset))
+        }
+        return members
+    }
+
+    /** MS-DOS timestamps are in local time, with a two second resolution. */
+    private static func date(dosDate: UInt16, dosTime: UInt16) -> Date? {
+        guard dosDate != 0 else {
+            return nil
+        }
+        var components = DateComponents()
+        components.year = 1980 + Int(dosDate >> 9)
+        components.month = Int((dosDate >> 5) & 0x0F)
+        components.day = Int(dosDate & 0x1F)
+        components.hour = Int(dosTime >> 11)
+        components.minute = Int((dosTime >> 5) & 0x3F)
+        components.second = Int(dosTime & 0x1F) * 2
+        return Calendar(identifier: .gregorian).date(from: components)
+    }
+
+    // MARK: TAR
+
+    private static let tarBlockSize = 512
+
+    /**
+     Walk the TAR header chain. Reading it touches one block per member, rather than the whole archive.
+     Supports ustar, POSIX pax (`path`, `size` and `mtime` records) and GNU long name headers.
+     */
+    private static func tarMembers(in source: ImageByteSource) throws -> [Member] {
+        var members = [Member]()
+        var offset = 0
+        var paxRecords = [String: String]()
+        var longName: String? = nil
+
+        while offset + tarBlockSize <= source.count {
+            let header = try source.bytes(in: offset ..< (offset + tarBlockSize))
+            // The archive ends with two zero blocks, the first of which is enough to stop at
+            if header.allSatisfy({ $0 == 0 }) {
+                break
+            }
+            guard hasValidTARChecksum(header), let headerSize = tarNumber(in: header, at: 124, length: 12) else {
+                throw ImageArchiveError.malformed(url: source.url, message: "Invalid header at offset \(offset)")
+            }
+
+            let type = header.uint8(at: 156) ?? 0
+            let dataOffset = offset + tarBlockSize
+            let isExtensionHeader = type == UInt8(ascii: "x") || type == UInt8(ascii: "g") || type == UInt8(ascii: "L") || type == UInt8(ascii: "K")
+            let size = isExtensionHeader ? headerSize : (paxRecords["size"].flatMap { Int($0) } ?? headerSize)
+            guard size >= 0, size <= source.count - dataOffset else {
+                throw ImageArchiveError.malformed(url: source.url, message: "Member at offset \(offset) extends past the end of the archive")
+            }
+
+            switch type {
+            case UInt8(ascii: "x"):
+                paxRecords.merge(parsePAXRecords(try source.bytes(in: dataOffset ..< (dataOffset + size)))) { $1 }
+            case UInt8(ascii: "L"):
+                longName = cString(in: try source.bytes(in: dataOffset ..< (dataOffset + size)))
+            case UInt8(ascii: "g"), UInt8(ascii: "K"):
+                break
+            default:
+                // Regular files: '0', '7' (contiguous), and NUL from pre-POSIX archives
+                if type == 0 || type == UInt8(ascii: "0") || type == UInt8(ascii: "7"),
+                   let path = normalizedPath(paxRecords["path"] ?? longName ?? ustarName(in: header)) {
+                    let modificationDate = paxRecords["mtime"].flatMap { TimeInterval($0) }.flatMap { $0.isFinite ? $0 : nil }.map { Date(timeIntervalSince1970: $0) }
+                        ?? tarNumber(in: header, at: 136, length: 12).map { Date(timeIntervalSince1970: TimeInterval($0)) }
+                    members.append(Member(path: path, encoding: .stored, compressedSize: size, size: size,
+                                          modificationDate: modificationDate, headerOffset: offset))
+                }
+                paxRecords.removeAll()
+                longName = nil
+            }
+
+            offset = dataOffset + (size + tarBlockSize - 1) / tarBlockSize * tarBlockSize
+        }
+        return members
+    }
+
+    private static func ustarName(in header: Data) -> String {
+        let name = cString(in: header[header.startIndex ..< (header.startIndex + 100)])
+        guard header.hasPrefix(Array("ustar".utf8), at: 257) else {
+            return name
+        }
+        let prefix = cString(in: header[(header.startIndex + 345) ..< (header.startIndex + 500)])
+        return prefix.isEmpty ? name : prefix + "/" + name
+    }
+
+    private static func cString(in data: Data) -> String {
+        let bytes = data.prefix { $0 != 0 }
+        return String(data: bytes, encoding: .utf8) ?? String(data: bytes, encoding: .isoLatin1) ?? ""
+    }
+
+    /** A numeric header field: octal digits, or for large values, big-endian base-256 flagged by the high bit. */
+    private static func tarNumber(in header: Data, at offset: Int, length: Int) -> Int? {
+        guard let first = header.uint8(at: offset), offset + length <= header.count else {
+            return nil
+        }
+        var value = 0
+        if first & 0x80 != 0 {
+            for i in 0 ..< length {
+                let byte = header.uint8(at: offset + i)! & (i == 0 ? 0x7F : 0xFF)
+                guard value <= (Int.max >> 8) else {
+                    return nil
+                }
+                value = (value << 8) | Int(byte)
+            }
+            return value
+        }
+
+        var hasDigits = false
+        for i in 0 ..< length {
+            let byte = header.uint8(at: offset + i)!
+            if byte == 0 || byte == UInt8(ascii: " ") {
+                if hasDigits {
+                    break
+                }
+                continue
+            }
+            guard byte >= UInt8(ascii: "0"), byte <= UInt8(ascii: "7") else {
+                return nil
+            }
+            value = value * 8 + Int(byte - UInt8(ascii: "0"))
+            hasDigits = true
+        }
+        return value
+    }
+
+    /** The checksum is the sum of the header's bytes, with the checksum field itself counted as spaces. */
+    private static func hasValidTARChecksum(_ header: Data) -> Bool {
+        guard header.count >= tarBlockSize, let expected = tarNumber(in: header, at: 148, length: 8) else {
+            return false
+        }
+        var unsignedSum = 0
+        var signedSum = 0
+        for (i, byte) in header.prefix(tarBlockSize).enumerated() {
+            let value = (148 ..< 156).contains(i) ? UInt8(ascii: " ") : byte
+            unsignedSum += Int(value)
+            signedSum += Int(Int8(bitPattern: value))
+        }
+        // Some historic implementations summed signed bytes
+        return expected == unsignedSum || expected == signedSum
+    }
+
+    /** Parse pax extended header records, each of the form "<length> <key>=<value>\n". */
+    private static func parsePAXRecords(_ data: Data) -> [String: String] {
+        var records = [String: String]()
+        var position = data.startIndex
+        while position < data.endIndex {
+            guard let space = data[position...].firstIndex(of: UInt8(ascii: " ")),
+                  let length = Int(String(decoding: data[position ..< space], as: UTF8.self)),
+                  length > 0, length <= data.endIndex - position, position + length > space + 1 else {
+                break
+            }
+            let record = data[(space + 1) ..< (position + length)]
+            if let equals = record.firstIndex(of: UInt8(ascii: "=")) {
+                let key = String(decoding: record[record.startIndex ..< equals], as: UTF8.self)
+                let value = String(decoding: record[(equals + 1)...].dropLast(), as: UTF8.self)
+                records[key] = value
+            }
+            position += length
+        }
+        return records
+    }
+
+    // MARK: - Member source cache
+
+    private static let memberSources = MemberSourceCache(capacity: 16)
+
+    /**
+     Member sources by URL. The most recently used ones are held strongly; older ones are reused for as long as
+     somebody else still holds them. Sources over a previous mapping of a modified archive are not reused.
+     */
+    private final class MemberSourceCache {
+        private let capacity: Int
+        private let liveSources = NSMapTable<NSURL, AnyObject>.strongToWeakObjects()
+        private var recentSources = [ImageByteSource]()
+        private let lock = NSLock()
+
+        init(capacity: Int) {
+            self.capacity = capacity
+        }
+
+        func source(for url: URL, in archiveSource: ImageByteSource) -> ImageByteSource? {
+            lock.lock()
+            defer {
+                lock.unlock()
+            }
+            guard let source = liveSources.object(forKey: url as NSURL) as? ImageByteSource,
+                  ImageArchive.parent(of: source) === archiveSource else {
+                return nil
+            }
+            touch(source)
+            return source
+        }
+
+        /** Store `source`, unless another thread stored one for the same member meanwhile, in which case that one is returned. */
+        func store(_ source: ImageByteSource, for url: URL, in archiveSource: ImageByteSource) -> ImageByteSource {
+            lock.lock()
+            defer {
+                lock.unlock()
+            }
+            if let raced = liveSources.object(forKey: url as NSURL) as? ImageByteSource, ImageArchive.parent(of: raced) === archiveSource {
+                touch(raced)
+                return raced
+            }
+            liveSources.setObject(source, forKey: url as NSURL)
+            touch(source)
+            return source
+        }
+
+        // Called with `lock` held.
+        private func touch(_ source: ImageByteSource) {
+            if let position = recentSources.lastIndex(where: { $0 === source }) {
+                recentSources.remove(at: position)
+            }
+            recentSources.append(source)
+            if recentSources.count > capacity {
+                recentSources.removeFirst()
+            }
+        }
+    }
+
+    private static func parent(of memberSource: ImageByteSource) -> ImageByteSource? {
+        return (memberSource as? SubrangeByteSource)?.parent ?? (memberSource as? InflatingByteSource)?.parent
+    }
+}
+
+// MARK: - Subrange byte source
+
+/**
+ A window onto part of another byte source, such as a member stored uncompressed in an archive. Reads are passed
+ through to the parent, so a subrange of a memory mapped file is read without copying.
+ */
+public final class SubrangeByteSource: ImageByteSource {
+    public let url: URL
+    public let parent: ImageByteSource
+    public let range: Range<Int>
+    public let containerCache = ImageContainerCache()
+
+    public init(parent: ImageByteSource, range: Range<Int>, url: URL) throws {
+        try parent.checkBounds(range)
+        self.parent = parent
+        self.range = range
+        self.url = url
+    }
+
+    public var count: Int {
+        return range.count
+    }
+
+    public var contiguousBytes: Data? {
+        guard parent.contiguousBytes != nil else {
+            return nil
+        }
+        return try? parent.bytes(in: range)
+    }
+
+    public func bytes(in range: Range<Int>) throws -> Data {
+        try checkBounds(range)
+        return try parent.bytes(in: (self.range.lowerBound + range.lowerBound) ..< (self.range.lowerBound + range.upperBound))
+    }
+
+    public func advise(_ hint: ReadAccessHint, range: Range<Int>? = nil) {
+        let range = range?.clamped(to: 0 ..< count) ?? 0 ..< count
+        parent.advise(hint, range: (self.range.lowerBound + range.lowerBound) ..< (self.range.lowerBound + range.upperBound))
+    }
+}
+
+// MARK: - Inflating byte source
+
+/**
+
+ The inflated contents of a raw DEFLATE stream (RFC 1951) stored in part of another byte source, such as a deflated
+ ZIP member.
+
+ Deflate streams can only be decoded from the start, so the source inflates progressively: a read inflates up to
+ the end of the requested range (rounded up to `chunkSize`), and everything inflated so far is kept for later reads.
+ Reading a file's header and metadata thus costs the inflation of its first few chunks only. Data returned by
+ `bytes(in:)` points directly into the inflated buffer, which is never modified once written.
+
+ The buffer is an anonymous mapping of the size the archive declares, so memory is only committed as far as the
+ stream has been inflated. Declared sizes beyond what the compressed data could possibly inflate to are rejected.
+
+ */
+public final class InflatingByteSource: ImageByteSource {
+    public let url: URL
+    public let count: Int
+    public let parent: ImageByteSource
+    public let compressedRange: Range<Int>
+    public let chunkSize: Int
+    public let containerCache = ImageContainerCache()
+
+    /** DEFLATE's largest possible compression ratio: a back reference copies at most 258 bytes, and takes at least two bits. */
+    static let maximumCompressionRatio = 1032
+
+    private let storage: UnsafeMutableRawPointer
+    private var stream: UnsafeMutablePointer<compression_stream>? = nil
+    private var compressedBytes: Data? = nil
+    private var consumedCount = 0
+    private var inflatedCount = 0
+    private var failure: Swift.Error? = nil
+    private let lock = NSLock()
+
+    public init(parent: ImageByteSource, compressedRange: Range<Int>, count: Int, url: URL, chunkSize: Int = 256 * 1024) throws {
+        try parent.checkBounds(compressedRange)
+        precondition(count >= 0 && chunkSize > 0)
+        let maximumCount = compressedRange.count.multipliedReportingOverflow(by: InflatingByteSource.maximumCompressionRatio)
+        guard maximumCount.overflow || count <= maximumCount.partialValue else {
+            throw ImageArchiveError.failedToInflate(url: url, message: "\(compressedRange.count) compressed bytes cannot inflate to the declared \(count)")
+        }
+        self.parent = parent
+        self.compressedRange = compressedRange
+        self.count = count
+        self.url = url
+        self.chunkSize = chunkSize
+        // Pages are only committed once inflated into; mmap() refuses zero length mappings
+        guard let storage = mmap(nil, max(1, count), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0),
+              storage != UnsafeMutableRawPointer(bitPattern: -1) else {
+            throw ImageArchiveError.failedToInflate(url: url, message: "Cannot reserve \(count) bytes: \(String(cString: strerror(errno)))")
+        }
+        self.storage = storage
+    }
+
+    deinit {
+        finishStream()
+        munmap(storage, max(1, count))
+    }
+
+    /** Number of bytes inflated so far. */
+    public var inflatedByteCount: Int {
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        return inflatedCount
+    }
+
+    public var contiguousBytes: Data? {
+        guard inflatedByteCount == count else {
+            return nil
+        }
+        return try? bytes(in: 0 ..< count)
+    }
+
+    public func bytes(in range: Range<Int>) throws -> Data {
+        try checkBounds(range)
+        guard !range.isEmpty else {
+            return Data()
+        }
+        try inflate(through: range.upperBound)
+        // The deallocator captures `self`, so the buffer outlives every Data handed out from it
+        return Data(bytesNoCopy: storage + range.lowerBound, count: range.count, deallocator: .custom({ _, _ in
+            withExtendedLifetime(self) {}
+        }))
+    }
+
+    public func advise(_ hint: ReadAccessHint, range: Range<Int>? = nil) {
+        // Inflation reads the compressed bytes front to back, whichever part of the output is asked for
+        parent.advise(hint == .normal ? .sequential : hint, range: compressedRange)
+    }
+
+    private func inflate(through offset: Int) throws {
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        if let failure = failure {
+            throw failure
+        }
+        guard inflatedCount < offset else {
+            return
+        }
+
+        do {
+            if stream == nil {
+                try startStream()
+            }
+            guard let stream = stream, let compressedBytes = compressedBytes else {
+                return
+            }
+            let target = min(count, max(offset, inflatedCount + chunkSize))
+
+            try compressedBytes.withUnsafeBytes { (input: UnsafeRawBufferPointer) in
+                guard let inputBase = input.baseAddress?.assumingMemoryBound(to: UInt8.self) else {
+                    throw ImageArchiveError.failedToInflate(url: url, message: "No compressed data")
+                }
+                while inflatedCount < target {
+                    stream.pointee.src_ptr = inputBase + consumedCount
+                    stream.pointee.src_size = input.count - consumedCount
+                    stream.pointee.dst_ptr = (storage + inflatedCount).assumingMemoryBound(to: UInt8.self)
+                    stream.pointee.dst_size = target - inflatedCount
+
+                    let status = compression_stream_process(stream, Int32(COMPRESSION_STREAM_FINALIZE.rawValue))
+                    let previouslyInflatedCount = inflatedCount
+                    consumedCount = input.count - stream.pointee.src_size
+                    inflatedCount = target - stream.pointee.dst_size
+
+                    switch status {
+                    case COMPRESSION_STATUS_OK where inflatedCount > previouslyInflatedCount:
+                        continue
+                    case COMPRESSION_STATUS_END where inflatedCount == count:
+                        return
+                    case COMPRESSION_STATUS_END:
+                        throw ImageArchiveError.failedToInflate(url: url, message: "Stream ended after \(inflatedCount) of \(count) bytes")
+                    default:
+                        throw ImageArchiveError.failedToInflate(url: url, message: "Invalid or truncated deflate stream at \(inflatedCount) bytes")
+                    }
+                }
+            }
+        } catch {
+            failure = error
+            finishStream()
+            throw error
+        }
+
+        if inflatedCount == count {
+            finishStream()
+        }
+    }
+
+    // Called with `lock` held.
+    private func startStream() throws {
+        compressedBytes = try parent.bytes(in: compressedRange)
+        let stream = UnsafeMutablePointer<compression_stream>.allocate(capacity: 1)
+        // COMPRESSION_ZLIB is raw DEFLATE, without a zlib header, as stored in ZIP files
+        guard compression_stream_init(stream, COMPRESSION_STREAM_DECODE, COMPRESSION_ZLIB) == COMPRESSION_STATUS_OK else {
+            stream.deallocate()
+            throw ImageArchiveError.failedToInflate(url: url, message: "Failed to initialize decoder")
+        }
+        self.stream = stream
+    }
+
+    // Called with `lock` held, or from `deinit`.
+    private func finishStream() {
+        if let stream = stream {
+            compression_stream_destroy(stream)
+            stream.deallocate()
+        }
+        stream = nil
+        compressedBytes = nil
+    }
+}
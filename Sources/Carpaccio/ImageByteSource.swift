@@ -0,0 +1,477 @@
+//
+//  ImageByteSource.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import ImageIO
+
+public enum ImageByteSourceError: Swift.Error, LocalizedError {
+    case notAFileURL(URL)
+    case failedToOpen(url: URL, errno: Int32)
+    case failedToMap(url: URL, errno: Int32)
+    case rangeOutOfBounds(url: URL, range: Range<Int>, count: Int)
+    case failedToRead(url: URL, range: Range<Int>, message: String)
+
+    public var errorDescription: String? {
+        switch self {
+        case .notAFileURL(let url):
+            return "Cannot open a file backed byte source for non-file URL \(url)"
+        case .failedToOpen(let url, let errno):
+            return "Failed to open file at \(url.path): \(String(cString: strerror(errno)))"
+        case .failedToMap(let url, let errno):
+            return "Failed to memory map file at \(url.path): \(String(cString: strerror(errno)))"
+        case .rangeOutOfBounds(let url, let range, let count):
+            return "Byte range \(range) is out of bounds for \(url) of \(count) bytes"
+        case .failedToRead(let url, let range, let message):
+            return "Failed to read bytes \(range) of \(url): \(message)"
+        }
+    }
+}
+
+/**
+
+ Random access to the bytes of an image file, regardless of where they are stored.
+
+ Every parser and decoder in Carpaccio reads image data through a byte source, rather than
+ opening files by URL on its own. This allows repeated operations on the same file (say, a
+ metadata load followed by a thumbnail load) to reuse both the underlying bytes and any
+ container structure already parsed from them, via `containerCache`.
+
+ Implementations must be safe to read from several threads concurrently.
+
+ */
+public protocol ImageByteSource: AnyObject {
+    /** URL identifying the bytes. Used as a cache key and in error messages; need not be a file URL. */
+    var url: URL { get }
+
+    /** Total length of the image data, in bytes. */
+    var count: Int { get }
+
+    /**
+     All of the bytes as one contiguous `Data`, if they are available without further I/O (e.g. in memory
+     or memory mapped). `nil` for sources which need to fetch ranges on demand.
+     */
+    var contiguousBytes: Data? { get }
+
+    /** Storage for container structure parsed from this source, shared by all readers of it. */
+    var containerCache: ImageContainerCache { get }
+
+    /**
+     Return the bytes in `range`. Implementations should avoid copying where possible, so callers should
+     not assume the returned `Data` owns its storage.
+     */
+    func bytes(in range: Range<Int>) throws -> Data
+
+    /** Tell the storage how `range` (by default, the whole source) is about to be read. */
+    func advise(_ hint: ReadAccessHint, range: Range<Int>?)
+}
+
+public extension ImageByteSource {
+    func advise(_ hint: ReadAccessHint, range: Range<Int>?) {
+        // Nothing to advise by default: in-memory data, remote objects…
+    }
+
+    func checkBounds(_ range: Range<Int>) throws {
+        guard range.lowerBound >= 0, range.upperBound <= count else {
+            throw ImageByteSourceError.rangeOutOfBounds(url: url, range: range, count: count)
+        }
+    }
+
+    /** Return bytes in `range`, clamped to the end of the source. */
+    func bytes(from offset: Int, upTo length: Int) throws -> Data {
+        let lower = max(0, min(offset, count))
+        let upper = min(count, lower + max(0, length))
+        return try bytes(in: lower ..< upper)
+    }
+
+    /**
+     An ImageIO image source reading from this byte source. The image source, along with whatever container
+     structure ImageIO has parsed into it, is created once and kept in `containerCache` for later callers.
+     */
+    func imageSource() throws -> CGImageSource {
+        return try containerCache.value(forKey: ImageContainerCache.imageIOSourceKey) {
+            let options = [kCGImageSourceShouldCache: false] as CFDictionary
+
+            if let data = contiguousBytes {
+                guard let imageSource = CGImageSourceCreateWithData(data as CFData, options) else {
+                    throw CGImageExtensionError.failedToOpenCGImage(url: url)
+                }
+                return imageSource
+            }
+
+            guard let provider = ImageByteSourceDataProvider.makeDataProvider(for: self),
+                  let imageSource = CGImageSourceCreateWithDataProvider(provider, options) else {
+                throw CGImageExtensionError.failedToOpenCGImage(url: url)
+            }
+            return imageSource
+        }
+    }
+
+    /** All bytes of the source, copied into memory if the source is not already contiguous. */
+    func allBytes() throws -> Data {
+        if let data = contiguousBytes {
+            return data
+        }
+        return try bytes(in: 0 ..< count)
+    }
+}
+
+/**
+ A small thread-safe store for values parsed from an `ImageByteSource`, so that container structure (TIFF IFD chains,
+ box trees, ImageIO image sources…) is parsed once per source, rather than once per operation.
+ */
+public final class ImageContainerCache {
+    public static let imageIOSourceKey = "com.sashimiapp.ImageIO.CGImageSource"
+
+    private var values = [String: Any]()
+    private let queue = DispatchQueue(label: "com.sashimiapp.ImageContainerCacheQueue")
+
+    public init() {
+    }
+
+    public func value<T>(forKey key: String, orCreate create: () throws -> T) throws -> T {
+        if let existing = queue.sync(execute: { values[key] }) as? T {
+            return existing
+        }
+        // Created outside the queue, so that slow parsing does not block readers of other keys.
+        // Should two threads race here, the first stored value wins.
+        let created = try create()
+        return queue.sync {
+            if let existing = values[key] as? T {
+                return existing
+            }
+            values[key] = created
+            return created
+        }
+    }
+
+    public func cachedValue<T>(forKey key: String) -> T? {
+        return queue.sync { values[key] as? T }
+    }
+
+    public func removeAll() {
+        queue.sync { values.removeAll() }
+    }
+}
+
+// MARK: - In-memory byte source
+
+/** A byte source over image data already in memory. */
+public final class InMemoryByteSource: ImageByteSource {
+    public let url: URL
+    public let data: Data
+    public let containerCache = ImageContainerCache()
+
+    /**
+     - parameter url: Identifier for the data. If the data did not come from a file, any URL unique to it will do,
+       such as one with a custom scheme.
+     */
+    public init(data: Data, url: URL) {
+        self.data = data
+        self.url = url
+    }
+
+    public var count: Int {
+        return data.count
+    }
+
+    public var contiguousBytes: Data? {
+        return data
+    }
+
+    public func bytes(in range: Range<Int>) throws -> Data {
+        try checkBounds(range)
+        let start = data.startIndex
+        return data[(start + range.lowerBound) ..< (start + range.upperBound)]
+    }
+}
+
+// MARK: - Range-readable byte source
+
+/**
+
+ A byte source for storage which can only be read a range at a time, such as a remote object or a file read
+ with `pread`. Reads are made in aligned blocks of `blockSize` bytes, and the most recently used blocks are kept
+ in memory, so that the many small reads made by container parsers turn into a handful of larger ones.
+
+ Storage which can serve several ranges in one operation (`preadv`, HTTP multi-range requests) can be given a
+ `VectoredRangeReader`, which `prefetch(_:)` then uses to fetch all missing ranges at once.
+
+ */
+public final class RangeReadableByteSource: ImageByteSource {
+    public typealias RangeReader = (_ range: Range<Int>) throws -> Data
+
+    /** Read several disjoint ranges, given in ascending order, returning their bytes in the same order. */
+    public typealias VectoredRangeReader = (_ ranges: [Range<Int>]) throws -> [Data]
+
+    public let url: URL
+    public let count: Int
+    public let blockSize: Int
+    public let maximumCachedBlockCount: Int
+    public let containerCache = ImageContainerCache()
+
+    private let readRange: RangeReader
+    private let readRanges: VectoredRangeReader?
+    private var blocks = [Int: Data]()
+    private var blockRecency = [Int]()
+    private let queue = DispatchQueue(label: "com.sashimiapp.RangeReadableByteSourceQueue")
+
+    public init(url: URL, count: Int, blockSize: Int = 64 * 1024, maximumCachedBlockCount: Int = 64,
+                readRange: @escaping RangeReader, readRanges: VectoredRangeReader? = nil) {
+        precondition(blockSize > 0)
+        self.url = url
+        self.count = count
+        self.blockSize = blockSize
+        self.maximumCachedBlockCount = max(1, maximumCachedBlockCount)
+        self.readRange = readRange
+        self.readRanges = readRanges
+    }
+
+    public var contiguousBytes: Data? {
+        return nil
+    }
+
+    public func bytes(in range: Range<Int>) throws -> Data {
+        try checkBounds(range)
+        guard !range.isEmpty else {
+            return Data()
+        }
+
+        let firstBlock = range.lowerBound / blockSize
+        let lastBlock = (range.upperBound - 1) / blockSize
+
+        if firstBlock == lastBlock {
+            let block = try self.block(at: firstBlock)
+            let offset = range.lowerBound - firstBlock * blockSize
+            let start = block.startIndex + offset
+            return block[start ..< (start + range.count)]
+        }
+
+        var result = Data(capacity: range.count)
+        for index in firstBlock ... lastBlock {
+            let block = try self.block(at: index)
+            let blockStart = index * blockSize
+            let lower = max(range.lowerBound, blockStart) - blockStart
+            let upper = min(range.upperBound, blockStart + block.count) - blockStart
+            result.append(block[(block.startIndex + lower) ..< (block.startIndex + upper)])
+        }
+        return result
+    }
+
+    /**
+     Make blocks covering `ranges` resident, fetching all missing ones with one read per contiguous run. With a
+     vectored reader, all runs are fetched with one call to it; otherwise separate runs are fetched in parallel.
+     Either way, remote sources make one round trip for all of them, instead of one each.
+     */
+    public func prefetch(_ ranges: [Range<Int>]) throws {
+        var missing = Set<Int>()
+        for range in ranges where !range.isEmpty {
+            let clamped = max(0, range.lowerBound) ..< min(count, range.upperBound)
+            guard !clamped.isEmpty else {
+                continue
+            }
+            for index in (clamped.lowerBound / blockSize) ... ((clamped.upperBound - 1) / blockSize) {
+                missing.insert(index)
+            }
+        }
+        let resident = queue.sync { Set(blocks.keys) }
+        let sortedMissing = missing.subtracting(resident).sorted()
+
+        var runs = [ClosedRange<Int>]()
+        var runStart: Int? = nil
+        var previous = -2
+        for index in sortedMissing + [Int.max] {
+            if index != previous + 1 {
+                if let start = runStart {
+                    runs.append(start ... previous)
+                }
+                runStart = index
+            }
+            previous = index
+        }
+
+        guard runs.count > 1 else {
+            try runs.forEach(fetchBlocks)
+            return
+        }
+        if let readRanges = readRanges {
+            let byteRanges = runs.map { ($0.lowerBound * blockSize) ..< min(count, ($0.upperBound + 1) * blockSize) }
+            let results = try readRanges(byteRanges)
+            guard results.count == runs.count else {
+                throw ImageByteSourceError.failedToRead(url: url, range: byteRanges[0].lowerBound ..< byteRanges[byteRanges.count - 1].upperBound,
+                                                        message: "Expected \(runs.count) ranges, got \(results.count)")
+            }
+            for (run, data) in zip(runs, results) {
+                try storeBlocks(run, data: data)
+            }
+            return
+        }
+        var firstError: Swift.Error? = nil
+        let errorLock = NSLock()
+        DispatchQueue.concurrentPerform(iterations: runs.count) { i in
+            do {
+                try fetchBlocks(runs[i])
+            } catch {
+                errorLock.lock()
+                firstError = firstError ?? error
+                errorLock.unlock()
+            }
+        }
+        if let error = firstError {
+            throw error
+        }
+    }
+
+    /** Bytes in `range` if every block covering it is resident, without performing any reads; otherwise `nil`. */
+    public func cachedBytes(in range: Range<Int>) -> Data? {
+        guard range.lowerBound >= 0, range.upperBound <= count else {
+            return nil
+        }
+        guard !range.isEmpty else {
+            return Data()
+        }
+        return queue.sync { () -> Data? in
+            var result = Data(capacity: range.count)
+            for index in (range.lowerBound / blockSize) ... ((range.upperBound - 1) / blockSize) {
+                guard let block = cachedBlock(at: index) else {
+                    return nil
+                }
+                let blockStart = index * blockSize
+                let lower = max(range.lowerBound, blockStart) - blockStart
+                let upper = min(range.upperBound, blockStart + block.count) - blockStart
+                result.append(block[(block.startIndex + lower) ..< (block.startIndex + upper)])
+            }
+            return result
+        }
+    }
+
+    /**
+     Store bytes read elsewhere, starting at `offset`, as resident blocks. Only whole blocks (and the final, short
+     block of the source) are kept, so callers should read in multiples of `blockSize`, aligned to it.
+     */
+    public func prime(_ data: Data, at offset: Int) {
+        queue.sync {
+            var index = (offset + blockSize - 1) / blockSize
+            while true {
+                let blockStart = index * blockSize
+                let blockEnd = min(count, blockStart + blockSize)
+                guard blockStart < blockEnd, blockEnd - offset <= data.count else {
+                    break
+                }
+                let start = data.startIndex + (blockStart - offset)
+                store(Data(data[start ..< (start + blockEnd - blockStart)]), at: index)
+                index += 1
+            }
+        }
+    }
+
+    /** Round `range` outwards to block boundaries, clamped to the source. */
+    public func blockAligned(_ range: Range<Int>) -> Range<Int> {
+        let lower = max(0, (range.lowerBound / blockSize) * blockSize)
+        let upper = min(count, ((range.upperBound + blockSize - 1) / blockSize) * blockSize)
+        return lower ..< max(lower, upper)
+    }
+
+    private func block(at index: Int) throws -> Data {
+        if let block = queue.sync(execute: { cachedBlock(at: index) }) {
+            return block
+        }
+        try fetchBlocks(index ... index)
+        guard let block = queue.sync(execute: { cachedBlock(at: index) }) else {
+            throw ImageByteSourceError.failedToRead(url: url, range: (index * blockSize) ..< min(count, (index + 1) * blockSize), message: "Block was evicted before it could be read")
+        }
+        return block
+    }
+
+    private func fetchBlocks(_ indices: ClosedRange<Int>) throws {
+        let lower = indices.lowerBound * blockSize
+        let upper = min(count, (indices.upperBound + 1) * blockSize)
+        try storeBlocks(indices, data: readRange(lower ..< upper))
+    }
+
+    private func storeBlocks(_ indices: ClosedRange<Int>, data: Data) throws {
+        let lower = indices.lowerBound * blockSize
+        let upper = min(count, (indices.upperBound + 1) * blockSize)
+        guard data.count == upper - lower else {
+            throw ImageByteSourceError.failedToRead(url: url, range: lower ..< upper, message: "Expected \(upper - lower) bytes, got \(data.count)")
+        }
+
+        queue.sync {
+            for index in indices {
+                let start = data.startIndex + (index * blockSize - lower)
+                let end = min(data.endIndex, start + blockSize)
+                store(Data(data[start ..< end]), at: index)
+            }
+        }
+    }
+
+    // Called on `queue`.
+    private func cachedBlock(at index: Int) -> Data? {
+        guard let block = blocks[index] else {
+            return nil
+        }
+        if let position = blockRecency.lastIndex(of: index), position != blockRecency.count - 1 {
+            blockRecency.remove(at: position)
+            blockRecency.append(index)
+        }
+        return block
+    }
+
+    // Called on `queue`.
+    private func store(_ block: Data, at index: Int) {
+        if blocks.updateValue(block, forKey: index) == nil {
+            blockRecency.append(index)
+        }
+        while blockRecency.count > maximumCachedBlockCount {
+            blocks[blockRecency.removeFirst()] = nil
+        }
+    }
+}
+
+// MARK: - ImageIO bridging
+
+/** Exposes a non-contiguous byte source to ImageIO through a direct access `CGDataProvider`. */
+fileprivate final class ImageByteSourceDataProvider {
+    let source: ImageByteSource
+
+    private init(source: ImageByteSource) {
+        self.source = source
+    }
+
+    static func makeDataProvider(for source: ImageByteSource) -> CGDataProvider? {
+        let info = Unmanaged.passRetained(ImageByteSourceDataProvider(source: source)).toOpaque()
+
+        var callbacks = CGDataProviderDirectCallbacks(
+            version: 0,
+            getBytePointer: nil,
+            releaseBytePointer: nil,
+            getBytesAtPosition: { info, buffer, position, count in
+                guard let info = info else {
+                    return 0
+                }
+                let source = Unmanaged<ImageByteSourceDataProvider>.fromOpaque(info).takeUnretainedValue().source
+                guard let data = try? source.bytes(from: Int(position), upTo: count) else {
+                    return 0
+                }
+                data.copyBytes(to: buffer.assumingMemoryBound(to: UInt8.self), count: data.count)
+                return data.count
+            },
+            releaseInfo: { info in
+                if let info = info {
+                    Unmanaged<ImageByteSourceDataProvider>.fromOpaque(info).release()
+                }
+            }
+        )
+
+        guard let provider = CGDataProvider(directInfo: info, size: off_t(source.count), callbacks: &callbacks) else {
+            Unmanaged<ImageByteSourceDataProvider>.fromOpaque(info).release()
+            return nil
+        }
+        return provider
+    }
+}
@@ -0,0 +1,116 @@
+//
+//  ImageByteSourcePool.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ A shared pool of memory mapped files, so that repeated access to one file reuses both its mapping and the
+ container structure parsed from it.
+
+ The pool keeps the most recently used sources open, up to `maximumOpenFileCount` files and `maximumMappedByteCount`
+ bytes in total. Sources are reference counted: one evicted from the pool stays open for as long as somebody still
+ holds it, and is handed out again on request, rather than being mapped a second time.
+
+ */
+public final class ImageByteSourcePool {
+    public static let shared = ImageByteSourcePool()
+
+    public let maximumOpenFileCount: Int
+    public let maximumMappedByteCount: Int
+
+    private var retainedSources = [URL: MappedFileByteSource]()
+    private var recency = [URL]()
+    private var retainedByteCount = 0
+    private let liveSources = NSMapTable<NSURL, MappedFileByteSource>.strongToWeakObjects()
+    private let queue = DispatchQueue(label: "com.sashimiapp.ImageByteSourcePoolQueue")
+
+    public init(maximumOpenFileCount: Int = 64, maximumMappedByteCount: Int = 2 * 1024 * 1024 * 1024) {
+        self.maximumOpenFileCount = max(1, maximumOpenFileCount)
+        self.maximumMappedByteCount = maximumMappedByteCount
+    }
+
+    /**
+     Return a byte source for the file at `url`, mapping the file if it is not open already, or if it has changed
+     since it was mapped.
+     */
+    public func byteSource(for url: URL) throws -> MappedFileByteSource {
+        let key = url.standardizedFileURL
+
+        if let existing = queue.sync(execute: { liveSources.object(forKey: key as NSURL) }) {
+            if existing.isCurrent {
+                queue.sync { retain(existing, for: key) }
+                return existing
+            }
+            invalidate(key)
+        }
+
+        let source = try MappedFileByteSource(fileURL: key)
+
+        return queue.sync {
+            // Another thread may have mapped the same file meanwhile; prefer theirs, so that parsed structure is shared
+            if let raced = liveSources.object(forKey: key as NSURL), raced.fileSignature == source.fileSignature {
+                retain(raced, for: key)
+                return raced
+            }
+            liveSources.setObject(source, forKey: key as NSURL)
+            retain(source, for: key)
+            return source
+        }
+    }
+
+    /** Drop the pool's reference to the file at `url`, for example after the file has been modified or removed. */
+    public func invalidate(_ url: URL) {
+        let key = url.standardizedFileURL
+        queue.sync {
+            liveSources.removeObject(forKey: key as NSURL)
+            release(key)
+        }
+    }
+
+    /** Drop all of the pool's references. Sources still referenced elsewhere remain usable. */
+    public func removeAll() {
+        queue.sync {
+            liveSources.removeAllObjects()
+            retainedSources.removeAll()
+            recency.removeAll()
+            retainedByteCount = 0
+        }
+    }
+
+    public var openFileCount: Int {
+        return queue.sync { retainedSources.count }
+    }
+
+    // MARK: LRU bookkeeping, called on `queue`
+
+    private func retain(_ source: MappedFileByteSource, for key: URL) {
+        if let previous = retainedSources.updateValue(source, forKey: key) {
+            retainedByteCount -= previous.count
+            if let position = recency.lastIndex(of: key) {
+                recency.remove(at: position)
+            }
+        }
+        retainedByteCount += source.count
+        recency.append(key)
+
+        while recency.count > 1 && (recency.count > maximumOpenFileCount || retainedByteCount > maximumMappedByteCount) {
+            release(recency[0])
+        }
+    }
+
+    private func release(_ key: URL) {
+        guard let source = retainedSources.removeValue(forKey: key) else {
+            return
+        }
+        retainedByteCount -= source.count
+        if let position = recency.firstIndex(of: key) {
+            recency.remove(at: position)
+        }
+    }
+}
@@ -0,0 +1,339 @@
+//
+//  ImageCatalog.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import ImageIO
+
+/**
+
+ A compact representation of a very large number of images and their metadata.
+
+ Every `Image` is a class instance with its own URL, name, loader and metadata; at a million images, that is gigabytes
+ of small allocations, and sorting or filtering them means chasing a pointer per image per field. An `ImageCatalog`
+ instead stores images as columns ("struct of arrays"):
+
+ - Directory paths are interned, and file names are packed into a single byte buffer.
+ - Numeric metadata is kept in fixed width columns, with a validity bitmap per column standing in for optionals.
+ - Camera maker, model, lens and colour space names are interned, as they repeat across a catalog.
+
+ That comes to well under a hundred bytes per image. Individual images are accessed through lightweight
+ `ImageCatalog.Handle` values, from which full `Image` and `ImageMetadata` objects can be made on demand.
+
+ Note that fractional metadata values (f-number, focal lengths, ISO) are stored at single precision.
+
+ A catalog is not thread safe for mutation. Concurrent reads are fine.
+
+ */
+public final class ImageCatalog {
+    // MARK: Columns
+
+    public private(set) var directories = StringInterner()
+    private var directoryIsFileURL = [Bool]()
+
+    public private(set) var directoryIDs = ContiguousArray<UInt32>()
+    private var nameBytes = ContiguousArray<UInt8>()
+    private var nameEnds = ContiguousArray<UInt32>()
+
+    public private(set) var widths = NullableColumn<UInt32>()
+    public private(set) var heights = NullableColumn<UInt32>()
+    public private(set) var orientations = NullableColumn<UInt8>()
+    public private(set) var fNumbers = NullableColumn<Float>()
+    public private(set) var focalLengths = NullableColumn<Float>()
+    public private(set) var focalLengths35mmEquivalent = NullableColumn<Float>()
+    public private(set) var isos = NullableColumn<Float>()
+    public private(set) var shutterSpeeds = NullableColumn<Double>()
+    public private(set) var timestamps = NullableColumn<Double>()
+
+    /** Interned camera maker, model, lens and colour space names share one interner. */
+    public private(set) var strings = StringInterner()
+    public private(set) var cameraMakerIDs = NullableColumn<UInt32>()
+    public private(set) var cameraModelIDs = NullableColumn<UInt32>()
+    public private(set) var lensModelIDs = NullableColumn<UInt32>()
+    public private(set) var colorSpaceNameIDs = NullableColumn<UInt32>()
+
+    public init() {
+    }
+
+    /** A catalog of the images in `collection`, with whatever metadata they have loaded. */
+    public convenience init(collection: Collection) {
+        self.init()
+        reserveCapacity(collection.imageCount)
+        for image in collection.imageStore {
+            if let url = image.URL {
+                append(url: url, metadata: image.metadata)
+            }
+        }
+    }
+
+    public var count: Int {
+        return directoryIDs.count
+    }
+
+    public func reserveCapacity(_ capacity: Int) {
+        directoryIDs.reserveCapacity(capacity)
+        nameEnds.reserveCapacity(capacity)
+        nameBytes.reserveCapacity(capacity * 12)
+    }
+
+    // MARK: Adding and updating
+
+    @discardableResult
+    public func append(url: URL, metadata: ImageMetadata?) -> Int {
+        let parent = url.deletingLastPathComponent()
+        let directory = url.isFileURL ? parent.path : parent.absoluteString
+        let (directoryID, inserted) = directories.intern(directory)
+        if inserted {
+            directoryIsFileURL.append(url.isFileURL)
+        }
+
+        directoryIDs.append(directoryID)
+        nameBytes.append(contentsOf: url.lastPathComponent.utf8)
+        nameEnds.append(UInt32(nameBytes.count))
+
+        widths.append(nil)
+        heights.append(nil)
+        orientations.append(nil)
+        fNumbers.append(nil)
+        focalLengths.append(nil)
+        focalLengths35mmEquivalent.append(nil)
+        isos.append(nil)
+        shutterSpeeds.append(nil)
+        timestamps.append(nil)
+        cameraMakerIDs.append(nil)
+        cameraModelIDs.append(nil)
+        lensModelIDs.append(nil)
+        colorSpaceNameIDs.append(nil)
+
+        let index = count - 1
+        if let metadata = metadata {
+            setMetadata(metadata, at: index)
+        }
+        return index
+    }
+
+    public func setMetadata(_ metadata: ImageMetadata?, at index: Int) {
+        widths[index] = metadata.map { UInt32(clamping: Int($0.nativeSize.width)) }
+        heights[index] = metadata.map { UInt32(clamping: Int($0.nativeSize.height)) }
+        orientations[index] = metadata.map { UInt8(truncatingIfNeeded: $0.nativeOrientation.cgImageOrientation.rawValue) }
+        fNumbers[index] = metadata?.fNumber.map(Float.init)
+        focalLengths[index] = metadata?.focalLength.map(Float.init)
+        focalLengths35mmEquivalent[index] = metadata?.focalLength35mmEquivalent.map(Float.init)
+        isos[index] = metadata?.iso.map(Float.init)
+        shutterSpeeds[index] = metadata?.shutterSpeed
+        timestamps[index] = metadata?.timestamp?.timeIntervalSince1970
+        cameraMakerIDs[index] = metadata?.cameraMaker.map { strings.intern($0).id }
+        cameraModelIDs[index] = metadata?.cameraModel.map { strings.intern($0).id }
+        lensModelIDs[index] = metadata?.lensModel.map { strings.intern($0).id }
+        colorSpaceNameIDs[index] = metadata?.colorSpaceName.map { strings.intern($0).id }
+    }
+
+    // MARK: Reading
+
+    public subscript(index: Int) -> Handle {
+        return Handle(catalog: self, index: index)
+    }
+
+    public func name(at index: Int) -> String {
+        let start = index == 0 ? 0 : Int(nameEnds[index - 1])
+        let end = Int(nameEnds[index])
+        return String(decoding: nameBytes[start ..< end], as: UTF8.self)
+    }
+
+    public func directoryPath(at index: Int) -> String {
+        return directories[directoryIDs[index]]
+    }
+
+    public func url(at index: Int) -> URL {
+        let directoryID = directoryIDs[index]
+        let directory = directories[directoryID]
+        if directoryIsFileURL[Int(directoryID)] {
+            return URL(fileURLWithPath: directory, isDirectory: true).appendingPathComponent(name(at: index))
+        }
+        let parent = Foundation.URL(string: directory) ?? Foundation.URL(fileURLWithPath: directory)
+        return parent.appendingPathComponent(name(at: index))
+    }
+
+    public func hasMetadata(at index: Int) -> Bool {
+        return widths.isValid(at: index) && heights.isValid(at: index)
+    }
+
+    /** Reconstruct full metadata for the image at `index`, if its metadata has been loaded. */
+    public func metadata(at index: Int) -> ImageMetadata? {
+        guard let width = widths[index], let height = heights[index] else {
+            return nil
+        }
+        let orientation = orientations[index].flatMap { CGImagePropertyOrientation(rawValue: UInt32($0)) }.map(ImageOrientation.init(cgImageOrientation:))
+
+        return ImageMetadata(
+            nativeSize: CGSize(width: CGFloat(width), height: CGFloat(height)),
+            nativeOrientation: orientation ?? .up,
+            colorSpaceName: colorSpaceNameIDs[index].map { strings[$0] },
+            fNumber: fNumbers[index].map(Double.init),
+            focalLength: focalLengths[index].map(Double.init),
+            focalLength35mmEquivalent: focalLengths35mmEquivalent[index].map(Double.init),
+            iso: isos[index].map(Double.init),
+            shutterSpeed: shutterSpeeds[index],
+            cameraMaker: cameraMakerIDs[index].map { strings[$0] },
+            cameraModel: cameraModelIDs[index].map { strings[$0] },
+            timestamp: timestamps[index].map(Date.init(timeIntervalSince1970:)),
+            lensModel: lensModelIDs[index].map { strings[$0] }
+        )
+    }
+
+    /** Approximate heap footprint of the catalog's columns, in bytes. */
+    public var approximateByteCount: Int {
+        let perImageColumns = directoryIDs.count * 4 + nameEnds.count * 4 + nameBytes.count
+        let metadataColumns = [widths.byteCount, heights.byteCount, orientations.byteCount, fNumbers.byteCount,
+                               focalLengths.byteCount, focalLengths35mmEquivalent.byteCount, isos.byteCount,
+                               shutterSpeeds.byteCount, timestamps.byteCount, cameraMakerIDs.byteCount,
+                               cameraModelIDs.byteCount, lensModelIDs.byteCount, colorSpaceNameIDs.byteCount].reduce(0, +)
+        return perImageColumns + metadataColumns + directories.byteCount + strings.byteCount
+    }
+
+    // MARK: - Handles
+
+    /** A lightweight reference to one image in a catalog. Keeps the catalog alive for as long as the handle is held. */
+    public struct Handle {
+        public let catalog: ImageCatalog
+        public let index: Int
+
+        public var name: String {
+            return catalog.name(at: index)
+        }
+
+        public var directoryPath: String {
+            return catalog.directoryPath(at: index)
+        }
+
+        public var url: URL {
+            return catalog.url(at: index)
+        }
+
+        public var metadata: ImageMetadata? {
+            return catalog.metadata(at: index)
+        }
+
+        /** Make a full `Image` object for this handle, with its metadata filled in if available. */
+        public func makeImage() -> Image {
+            let image = Image(URL: url)
+            if let metadata = metadata {
+                image.updateMetadata(metadata)
+            }
+            return image
+        }
+    }
+}
+
+// MARK: - Column storage
+
+/** A validity bitmap: one bit per row, set when the row has a value. */
+public struct ValidityBitmap {
+    public private(set) var words = ContiguousArray<UInt64>()
+    public private(set) var count = 0
+
+    public init() {
+    }
+
+    public subscript(index: Int) -> Bool {
+        get {
+            return words[index >> 6] & (1 << UInt64(index & 63)) != 0
+        }
+        set {
+            if newValue {
+                words[index >> 6] |= 1 << UInt64(index & 63)
+            } else {
+                words[index >> 6] &= ~(1 << UInt64(index & 63))
+            }
+        }
+    }
+
+    public mutating func append(_ isValid: Bool) {
+        if count & 63 == 0 {
+            words.append(0)
+        }
+        count += 1
+        self[count - 1] = isValid
+    }
+
+    public var validCount: Int {
+        return words.reduce(0) { $0 + $1.nonzeroBitCount }
+    }
+}
+
+/** A fixed width column of optional values, stored as plain values plus a validity bitmap. */
+public struct NullableColumn<T: ExpressibleByIntegerLiteral> {
+    public private(set) var values = ContiguousArray<T>()
+    public private(set) var validity = ValidityBitmap()
+
+    public init() {
+    }
+
+    public var count: Int {
+        return values.count
+    }
+
+    public subscript(index: Int) -> T? {
+        get {
+            return validity[index] ? values[index] : nil
+        }
+        set {
+            values[index] = newValue ?? 0
+            validity[index] = newValue != nil
+        }
+    }
+
+    public func isValid(at index: Int) -> Bool {
+        return validity[index]
+    }
+
+    public mutating func append(_ value: T?) {
+        values.append(value ?? 0)
+        validity.append(value != nil)
+    }
+
+    var byteCount: Int {
+        return values.count * MemoryLayout<T>.stride + validity.words.count * 8
+    }
+}
+
+/** Maps strings which repeat a lot to dense integer identifiers, and back. */
+public struct StringInterner {
+    public private(set) var strings = [String]()
+    private var ids = [String: UInt32]()
+
+    public init() {
+    }
+
+    public var count: Int {
+        return strings.count
+    }
+
+    @discardableResult
+    public mutating func intern(_ string: String) -> (id: UInt32, inserted: Bool) {
+        if let id = ids[string] {
+            return (id, false)
+        }
+        let id = UInt32(strings.count)
+        strings.append(string)
+        ids[string] = id
+        return (id, true)
+    }
+
+    public func id(of string: String) -> UInt32? {
+        return ids[string]
+    }
+
+    public subscript(id: UInt32) -> String {
+        return strings[Int(id)]
+    }
+
+    var byteCount: Int {
+        return strings.reduce(0) { $0 + $1.utf8.count + 2 * MemoryLayout<String>.stride + 4 }
+    }
+}
@@ -0,0 +1,354 @@
+//
+//  ImageFormat.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ The container format of an image file, identified from its first bytes rather than its file extension.
+
+ Only the leading signature is looked at, so a format is cheap to determine: one small read, from a file which is
+ usually about to be read anyway. TIFF based RAW formats which keep the plain TIFF signature (DNG, NEF, ARW and
+ most others) are indistinguishable from TIFF at this level and are all reported as `.tiff(.standard)`.
+
+ */
+public enum ImageFormat: Hashable, CustomStringConvertible {
+    public enum TIFFVariant: Hashable {
+        /** Plain TIFF header: TIFF images, as well as DNG, NEF, ARW, PEF, SRW and many other RAW formats. */
+        case standard
+        /** 64-bit offsets ("II+\0" / "MM\0+"). */
+        case bigTIFF
+        /** Canon CR2: a TIFF header followed by "CR" at offset 8. */
+        case cr2
+        /** Olympus ORF, with its own magic number in place of 42. */
+        case orf
+        /** Panasonic RW2 and Leica RWL, with their own magic number in place of 42. */
+        case rw2
+    }
+
+    case jpeg
+    case png
+    case gif
+    case tiff(TIFFVariant)
+    /** Fujifilm RAF. */
+    case raf
+    /** Sigma / Foveon X3F. */
+    case x3f
+    /** ISO base media file format (HEIF, AVIF, Canon CR3), with the major brand of its "ftyp" box. */
+    case isoBMFF(brand: String)
+    /** Canon CRW (Camera Image File Format). */
+    case ciff
+    /** Minolta MRW. */
+    case mrw
+
+    /** Number of leading bytes `init?(header:)` needs to tell all formats apart. */
+    public static let headerByteCount = 16
+
+    /** Identify a format from the first bytes of a file, or return `nil` if they match no known signature. */
+    public init?(header: Data) {
+        let bytes = [UInt8](header.prefix(ImageFormat.headerByteCount))
+
+        func matches(_ signature: [UInt8], at offset: Int = 0) -> Bool {
+            return bytes.count >= offset + signature.count && Array(bytes[offset ..< (offset + signature.count)]) == signature
+        }
+        func matches(_ signature: String, at offset: Int = 0) -> Bool {
+            return matches(Array(signature.utf8), at: offset)
+        }
+
+        if matches([0xFF, 0xD8, 0xFF]) {
+            self = .jpeg
+        } else if matches([0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A]) {
+            self = .png
+        } else if matches("GIF87a") || matches("GIF89a") {
+            self = .gif
+        } else if matches("II*\0") {
+            self = .tiff(matches("CR", at: 8) ? .cr2 : .standard)
+        } else if matches("MM\0*") {
+            self = .tiff(.standard)
+        } else if matches("II+\0") || matches("MM\0+") {
+            self = .tiff(.bigTIFF)
+        } else if matches("IIRO") || matches("IIRS") || matches("MMOR") {
+            self = .tiff(.orf)
+        } else if matches("IIU\0") {
+            self = .tiff(.rw2)
+        } else if matches("FUJIFILMCCD-RAW") {
+            self = .raf
+        } else if matches("FOVb") {
+            self = .x3f
+        } else if matches("ftyp", at: 4), bytes.count >= 12 {
+            self = .isoBMFF(brand: String(decoding: bytes[8 ..< 12], as: UTF8.self))
+        } else if (matches("II") || matches("MM")) && matches("HEAPCCDR", at: 6) {
+            self = .ciff
+        } else if matches([0x00, 0x4D, 0x52, 0x4D]) {
+            self = .mrw
+        } else {
+            return nil
+        }
+    }
+
+    /** Identify the format of the image in `source`, reading only its first few bytes. */
+    public init?(source: ImageByteSource) throws {
+        try self.init(header: source.bytes(in: 0 ..< min(source.count, ImageFormat.headerByteCount)))
+    }
+
+    /**
+     Whether files of this format hold RAW sensor data, or `nil` if that cannot be told from the signature alone
+     (a TIFF header is shared by TIFF images and most RAW formats).
+     */
+    public var isRAW: Bool? {
+        switch self {
+        case .jpeg, .png, .gif:
+            return false
+        case .tiff(let variant):
+            return variant == .standard || variant == .bigTIFF ? nil : true
+        case .raf, .x3f, .ciff, .mrw:
+            return true
+        case .isoBMFF(let brand):
+            return brand == "crx "
+        }
+    }
+
+    public var description: String {
+        switch self {
+        case .jpeg: return "JPEG"
+        case .png: return "PNG"
+        case .gif: return "GIF"
+        case .tiff(.standard): return "TIFF"
+        case .tiff(.bigTIFF): return "BigTIFF"
+        case .tiff(.cr2): return "CR2"
+        case .tiff(.orf): return "ORF"
+        case .tiff(.rw2): return "RW2"
+        case .raf: return "RAF"
+        case .x3f: return "X3F"
+        case .isoBMFF(let brand): return brand == "crx " ? "CR3" : "ISO-BMFF (\(brand))"
+        case .ciff: return "CIFF"
+        case .mrw: return "MRW"
+        }
+    }
+}
+
+/** The operations a format handler can perform, cheapest first. */
+public struct ImageFormatCapabilities: OptionSet, Hashable {
+    public let rawValue: Int
+
+    public init(rawValue: Int) {
+        self.rawValue = rawValue
+    }
+
+    /** Read dimensions, orientation and capture metadata without decoding pixels. */
+    public static let metadata = ImageFormatCapabilities(rawValue: 1 << 0)
+    /** Extract an embedded, already rendered preview. */
+    public static let embeddedPreview = ImageFormatCapabilities(rawValue: 1 << 1)
+    /** Decode the full resolution image. */
+    public static let fullDecode = ImageFormatCapabilities(rawValue: 1 << 2)
+    /** Decode a region of the full resolution image without decoding the rest. */
+    public static let regionOfInterest = ImageFormatCapabilities(rawValue: 1 << 3)
+
+    public static let all: ImageFormatCapabilities = [.metadata, .embeddedPreview, .fullDecode, .regionOfInterest]
+}
+
+/**
+ Something that can load images of one or more formats. Handlers are registered with an `ImageFormatRegistry`,
+ which picks the most capable handler for each file.
+ */
+public protocol ImageFormatHandler: AnyObject {
+    var name: String { get }
+
+    /** What this handler can do with files of `format`; empty if it cannot read them at all. */
+    func capabilities(for format: ImageFormat) -> ImageFormatCapabilities
+
+    /** Create a loader for the image at `imageURL`, already identified as being of `format`. */
+    func makeLoader(imageURL: URL, format: ImageFormat, thumbnailScheme: ImageLoader.ThumbnailScheme) -> ImageLoaderProtocol
+}
+
+/**
+ Loads everything ImageIO (and Core Image, for full size RAW decoding) can read, with `Image.defaultImageLoaderType`.
+ Sigma X3F is not claimed: ImageIO reads neither its metadata nor its pixels, and fails only after reading the file.
+ */
+public final class ImageIOFormatHandler: ImageFormatHandler {
+    public let name = "ImageIO"
+
+    public init() {
+    }
+
+    public func capabilities(for format: ImageFormat) -> ImageFormatCapabilities {
+        switch format {
+        case .x3f:
+            return []
+        case .png, .gif:
+            return [.metadata, .fullDecode]
+        default:
+            return [.metadata, .embeddedPreview, .fullDecode]
+        }
+    }
+
+    public func makeLoader(imageURL: URL, format: ImageFormat, thumbnailScheme: ImageLoader.ThumbnailScheme) -> ImageLoaderProtocol {
+        return Image.defaultImageLoaderType.init(imageURL: imageURL, thumbnailScheme: thumbnailScheme)
+    }
+}
+
+/**
+ Loads metadata and embedded previews of formats ImageIO cannot read at all, from their natively parsed containers
+ (see `ImageFormat.nativeContainer(of:)`). There being no decoder for the full image, thumbnails always come from the
+ largest preview available, even when it is smaller than requested.
+ */
+public final class NativeContainerFormatHandler: ImageFormatHandler {
+    public let name = "Native container"
+
+    public init() {
+    }
+
+    public func capabilities(for format: ImageFormat) -> ImageFormatCapabilities {
+        switch format {
+        case .x3f:
+            return [.metadata, .embeddedPreview]
+        default:
+            return []
+        }
+    }
+
+    public func makeLoader(imageURL: URL, format: ImageFormat, thumbnailScheme: ImageLoader.ThumbnailScheme) -> ImageLoaderProtocol {
+        return ImageLoader(imageURL: imageURL, thumbnailScheme: .decodeEmbeddedThumbnail)
+    }
+}
+
+/**
+
+ The format handlers available for loading images, consulted by `Image.imageLoader()` once a file's format has been
+ sniffed from its content. A file is given to the handler with the most capabilities for its format, so that a
+ specialised handler registered by a client wins over the general ImageIO one, and a file whose format no handler
+ reads fails at once instead of after an attempted decode.
+
+ */
+public final class ImageFormatRegistry {
+    public static let shared = ImageFormatRegistry(handlers: [ImageIOFormatHandler(), NativeContainerFormatHandler()])
+
+    private var registeredHandlers: [ImageFormatHandler]
+    private let lock = NSLock()
+
+    public init(handlers: [ImageFormatHandler] = []) {
+        self.registeredHandlers = handlers
+    }
+
+    /** Add a handler. Between equally capable handlers, the one registered last is preferred. */
+    public func register(_ handler: ImageFormatHandler) {
+        lock.lock()
+        defer { lock.unlock() }
+        registeredHandlers.append(handler)
+    }
+
+    public func unregister(_ handler: ImageFormatHandler) {
+        lock.lock()
+        defer { lock.unlock() }
+        registeredHandlers.removeAll { $0 === handler }
+    }
+
+    /** Handlers able to read `format` at all, most preferred first. */
+    public func handlers(for format: ImageFormat) -> [ImageFormatHandler] {
+        lock.lock()
+        let handlers = registeredHandlers
+        lock.unlock()
+
+        let candidates = handlers.enumerated().compactMap { i, handler -> (Int, Int, ImageFormatHandler)? in
+            let capabilities = handler.capabilities(for: format)
+            return capabilities.isEmpty ? nil : (capabilities.rawValue.nonzeroBitCount, i, handler)
+        }
+        return candidates.sorted { $0.0 != $1.0 ? $0.0 > $1.0 : $0.1 > $1.1 }.map { $0.2 }
+    }
+
+    /** The preferred handler among those with all of `required` capabilities for `format`. */
+    public func handler(for format: ImageFormat, requiring required: ImageFormatCapabilities = []) -> ImageFormatHandler? {
+        return handlers(for: format).first { $0.capabilities(for: format).isSuperset(of: required) }
+    }
+}
+
+// MARK: - Natively parsed containers
+
+/** An already rendered image, usually a JPEG, stored inside an image file. */
+public struct EmbeddedPreview: Equatable {
+    /** Absolute range of the encoded preview in the file. */
+    public let range: Range<Int>
+    /** Pixel dimensions, if recorded by the container. */
+    public let size: CGSize?
+
+    public init(range: Range<Int>, size: CGSize?) {
+        self.range = range
+        self.size = size
+    }
+
+    public var pixelCount: CGFloat {
+        return size.map { $0.width * $0.height } ?? 0
+    }
+}
+
+/** A container whose embedded previews are located by parsing it directly. */
+public protocol EmbeddedPreviewContainer {
+    /**
+     Embedded previews, smallest first. Their pixels are stored like those of the full image, so the metadata's
+     `nativeOrientation` applies to them.
+     */
+    var previews: [EmbeddedPreview] { get }
+}
+
+public extension EmbeddedPreviewContainer {
+    /**
+     The smallest preview whose displayed size fulfills `maximumSize`, given the orientation of the image, or `nil`
+     if none is large enough.
+     */
+    func cheapestPreview(fulfilling maximumSize: CGSize, orientation: ImageOrientation = .up) -> EmbeddedPreview? {
+        return previews.first { preview in
+            guard let size = preview.size else {
+                return false
+            }
+            let displayedSize = orientation.dimensionsSwapped ? CGSize(width: size.height, height: size.width) : size
+            return displayedSize.isSufficientToFulfill(targetSize: maximumSize)
+        }
+    }
+}
+
+/**
+ A container whose metadata and previews are read by parsing it directly, rather than through ImageIO: formats
+ ImageIO does not read at all, or reads only by decoding more than is needed.
+ */
+public protocol NativeImageContainer: EmbeddedPreviewContainer {
+    func metadata(in source: ImageByteSource) throws -> ImageMetadata
+}
+
+extension ISOBMFFStructure: NativeImageContainer {
+}
+
+public extension ImageFormat {
+    /** The parsed container of `source`, or `nil` if its format is read through ImageIO only. */
+    static func nativeContainer(of source: ImageByteSource) throws -> NativeImageContainer? {
+        switch try ImageFormat(source: source) {
+        case .isoBMFF?:
+            return try ISOBMFFStructure.read(from: source)
+        case .x3f?:
+            return try X3FStructure.read(from: source)
+        case .png?:
+            return try PNGStructure.read(from: source)
+        default:
+            return nil
+        }
+    }
+
+    /**
+     The container to take embedded previews of `source` from, rather than leaving ImageIO to pick one: natively
+     parsed containers, and DNG files, whose metadata ImageIO reads well but whose previews it does not choose by size.
+     */
+    static func previewContainer(of source: ImageByteSource) throws -> EmbeddedPreviewContainer? {
+        if let container = try nativeContainer(of: source) {
+            return container
+        }
+        guard case .tiff(.standard)? = try ImageFormat(source: source), DNGLayout.isDNG(try TIFFStructure.read(from: source)) else {
+            return nil
+        }
+        return try DNGLayout.read(from: source)
+    }
+}
@@ -91,29 +91,67 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
     public let cachedImageURL: URL? = nil // For now, we don't implement a disk cache for images loaded by ImageLoader
     public let thumbnailScheme: ThumbnailScheme
     
+    private let explicitByteSource: ImageByteSource?
+    
+    /**
+     Whether full images of RAW formats with a native `RAWDecoder` are rendered from their sensor data by Carpaccio
+     rather than by Core Image. Native rendering applies the camera's white balance, but no camera colour matrix and
+     only a simple demosaic, so it suits quick previews rather than faithful colour. Off by default.
+     */
+    public var allowsNativeRAWDecoding = false
+    
     public required init(imageURL: URL, thumbnailScheme: ThumbnailScheme) {
         self.imageURL = imageURL
         self.thumbnailScheme = thumbnailScheme
+        self.explicitByteSource = nil
+    }
+    
+    /**
+     Initialize a loader reading from the given byte source, rather than from a file in the shared `ImageByteSourcePool`.
+     The loader's `imageURL` will be that of the byte source.
+     */
+    public init(byteSource: ImageByteSource, thumbnailScheme: ThumbnailScheme) {
+        self.imageURL = byteSource.url
+        self.thumbnailScheme = thumbnailScheme
+        self.explicitByteSource = byteSource
     }
     
     public required init(imageLoader otherLoader: ImageLoaderProtocol, thumbnailScheme: ThumbnailScheme) {
         self.imageURL = otherLoader.imageURL
         self.thumbnailScheme = thumbnailScheme
+        self.explicitByteSource = (otherLoader as? ImageLoader)?.explicitByteSource
+        self.allowsNativeRAWDecoding = (otherLoader as? ImageLoader)?.allowsNativeRAWDecoding ?? false
         if otherLoader.imageMetadataState == .completed, let metadata = try? otherLoader.loadImageMetadata() {
             self.cachedImageMetadata = metadata
             self.imageMetadataState = .completed
         }
     }
     
-    private func imageSource() throws -> CGImageSource {
-        // We intentionally don't store the image source, to not gob up resources, but rather open it anew each time
-        let options = [kCGImageSourceShouldCache: false] as CFDictionary
-        
-        guard let imageSource = CGImageSourceCreateWithURL(imageURL as CFURL, options) else{
-            throw CGImageExtensionError.failedToOpenCGImage(url: imageURL)
+    /**
+     The byte source this loader reads from. Unless one was given at initialization, the file is fetched from the
+     shared pool on each call, rather than retained by the loader: that way a large number of loaders does not keep
+     a large number of files mapped, yet consecutive operations on one image reuse the same mapping and parsed
+     container structure. URLs pointing inside a ZIP or TAR archive are resolved to the archive member's source.
+     */
+    public func byteSource() throws -> ImageByteSource {
+        if let byteSource = explicitByteSource {
+            return byteSource
         }
-        
-        return imageSource
+        return try ImageLoader.byteSource(for: imageURL)
+    }
+
+    /** The pooled byte source for the file at `url`, which may also be a member of an archive. */
+    public static func byteSource(for url: URL) throws -> ImageByteSource {
+        do {
+            return try ImageByteSourcePool.shared.byteSource(for: url)
+        } catch ImageByteSourceError.failedToOpen(_, let errorNumber) where errorNumber == ENOTDIR {
+            // A path through a regular file, as in …/delivery.zip/DCIM/IMG_0001.CR2
+            return try ImageArchive.byteSource(forMemberAt: url)
+        }
+    }
+    
+    private func imageSource() throws -> CGImageSource {
+        return try byteSource().imageSource()
     }
     
     public private(set) var imageMetadataState: ImageMetadataState = .initialized
@@ -168,8 +206,14 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
         if imageMetadataState == .initialized {
             do {
                 imageMetadataState = .loading
-                let imageSource = try self.imageSource()
-                let metadata = try ImageMetadata(imageSource: imageSource)
+                let byteSource = try self.byteSource()
+                let metadata: ImageMetadata
+                // Natively parsed containers give metadata from the few boxes or chunks holding it, without an ImageIO decoder
+                if let container = try? ImageFormat.nativeContainer(of: byteSource), let nativeMetadata = try? container.metadata(in: byteSource) {
+                    metadata = nativeMetadata
+                } else {
+                    metadata = try ImageMetadata(imageSource: byteSource.imageSource())
+                }
                 cachedImageMetadata = metadata
                 imageMetadataState = .completed
             } catch {
@@ -192,14 +236,19 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
         cancelled cancelChecker: CancellationChecker?
     ) throws -> (CGImage, ImageMetadata) {
 
+        let createFromFullImage = thumbnailScheme == .decodeFullImage
+
+        // Read directories and the embedded preview in one go, rather than as ImageIO gets to each of them
+        if !createFromFullImage {
+            try byteSource().prefetchThumbnailRanges()
+        }
+
         let metadata = try loadImageMetadataIfNeeded()
         let source = try imageSource()
         
         // Load thumbnail
         try stopIfCancelled(cancelChecker, "Before loading thumbnail image")
 
-        let createFromFullImage = thumbnailScheme == .decodeFullImage
-
         var options: [String: AnyObject] = {
             var options: [String: AnyObject] = [
                 String(kCGImageSourceCreateThumbnailWithTransform): kCFBooleanTrue,
@@ -221,11 +270,16 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
         }()
         
         let thumbnailImage: CGImage = try {
-            let thumbnailCandidate = CGImageSourceCreateThumbnailAtIndex(source, 0, options as CFDictionary?)
+            let nativePreview = try createFromFullImage ? nil : loadNativePreview(maximumPixelDimensions: maximumSize, metadata: metadata)
+            let nativeFullImage = try? createFromFullImage ? loadNativeRAWImage(maximumPixelDimensions: maximumSize, metadata: metadata) : nil
+            let thumbnailCandidate = nativePreview ?? nativeFullImage ?? CGImageSourceCreateThumbnailAtIndex(source, 0, options as CFDictionary?)
 
             // Retry from full image, if needed, and wasn't already
             guard let thumbnail: CGImage = {
                 if !createFromFullImage && thumbnailScheme.shouldDecodeFullImage(having: thumbnailCandidate, desiredMaximumPixelDimensions: maximumSize, ratio: 1.0) {
+                    if let nativeImage = try? loadNativeRAWImage(maximumPixelDimensions: maximumSize, metadata: metadata) {
+                        return nativeImage
+                    }
                     options[kCGImageSourceCreateThumbnailFromImageAlways as String] = kCFBooleanTrue
                     return CGImageSourceCreateThumbnailAtIndex(source, 0, options as CFDictionary?)
                 }
@@ -255,6 +309,50 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
         return (ImageLoader.cropToNativeProportionsIfNeeded(thumbnailImage: thumbnailImage, metadata: metadata), metadata)
     }
     
+    /**
+     Decode the embedded preview of a natively parsed container or DNG best fitting `maximumSize`: the smallest one
+     large enough, or else the largest one. The preview is oriented for display like ImageIO thumbnails are. Returns
+     `nil` for formats whose previews are found by ImageIO.
+     */
+    private func loadNativePreview(maximumPixelDimensions maximumSize: CGSize?, metadata: ImageMetadata) throws -> CGImage? {
+        let byteSource = try self.byteSource()
+        guard let container = try? ImageFormat.previewContainer(of: byteSource), let largest = container.previews.last else {
+            return nil
+        }
+        let preview = maximumSize.flatMap { container.cheapestPreview(fulfilling: $0, orientation: metadata.nativeOrientation) } ?? largest
+
+        let previewSource = try SubrangeByteSource(parent: byteSource, range: preview.range, url: imageURL).imageSource()
+        var options: [String: AnyObject] = [
+            String(kCGImageSourceCreateThumbnailFromImageAlways): kCFBooleanTrue,
+            String(kCGImageSourceShouldCacheImmediately): kCFBooleanTrue
+        ]
+        if let maximumPixelDimension = maximumSize?.maximumPixelSize(forImageSize: metadata.size) {
+            options[String(kCGImageSourceThumbnailMaxPixelSize)] = NSNumber(value: maximumPixelDimension)
+        }
+        guard let image = CGImageSourceCreateThumbnailAtIndex(previewSource, 0, options as CFDictionary?) else {
+            return nil
+        }
+        return image.oriented(metadata.nativeOrientation) ?? image
+    }
+
+    /**
+     Decode the sensor data of a RAW file with a native `RAWDecoder`, rendered for `maximumSize` and oriented for
+     display. Returns `nil` unless `allowsNativeRAWDecoding` is set, for files without a native decoder, and for sizes
+     above what binning the sensor data provides, which are left to ImageIO.
+     */
+    private func loadNativeRAWImage(maximumPixelDimensions maximumSize: CGSize?, metadata: ImageMetadata) throws -> CGImage? {
+        guard allowsNativeRAWDecoding else {
+            return nil
+        }
+        let maximumPixelDimension = maximumSize?.maximumPixelSize(forImageSize: metadata.size)
+        guard let decoder = try RAWDecoders.decoder(for: byteSource()), decoder.canRender(maximumPixelDimension: maximumPixelDimension),
+              let image = try decoder.decode(maximumPixelDimension: maximumPixelDimension).rgbImage(maximumPixelDimension: maximumPixelDimension) else {
+            return nil
+        }
+        let orientedImage = image.oriented(metadata.nativeOrientation) ?? image
+        return maximumPixelDimension.flatMap { orientedImage.scaled(toMaximumPixelDimension: $0) } ?? orientedImage
+    }
+
     /**
      
      If the proportions of thumbnail image don't match those of the native full size, crop to the same proportions.
@@ -328,7 +426,7 @@ public class ImageLoader: ImageLoaderProtocol, URLBackedImageLoaderProtocol {
     public func loadCIImage(options: ImageLoadingOptions, cancelled: CancellationChecker?) throws -> (CIImage, ImageMetadata) {
         let metadata = try loadImageMetadataIfNeeded()
         try stopIfCancelled(cancelled, "Before loading editable image")
-        let ciImage = try CIImage.loadCIImage(from: imageURL, imageMetadata: metadata, options: options)
+        let ciImage = try CIImage.loadCIImage(from: byteSource(), imageMetadata: metadata, options: options)
         return (ciImage, metadata)
     }
 }
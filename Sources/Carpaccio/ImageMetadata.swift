@@ -25,6 +25,8 @@ public struct ImageMetadata: Codable {
     public let cameraMaker: String?
     public let cameraModel: String?
 
+    public let lensModel: String?
+
     public let colorSpaceName: String?
     
     /** In common tog parlance, this'd be "aperture": f/2.8 etc.*/
@@ -71,6 +73,7 @@ public struct ImageMetadata: Codable {
         case nativeOrientation = "native-orientation"
         case cameraMaker = "camera-maker"
         case cameraModel = "camera-model"
+        case lensModel = "lens-model"
         case colorSpaceName = "color-space"
         case fNumber = "f-number"
         case focalLength = "focal-length"
@@ -89,6 +92,8 @@ public struct ImageMetadata: Codable {
                 return "cameraMaker"
             case .cameraModel:
                 return "cameraModel"
+            case .lensModel:
+                return "lensModel"
             case .colorSpaceName:
                 return "colorSpace"
             case .fNumber:
@@ -119,11 +124,13 @@ public struct ImageMetadata: Codable {
         shutterSpeed: TimeInterval? = nil,
         cameraMaker: String? = nil,
         cameraModel: String? = nil,
-        timestamp: Date? = nil
+        timestamp: Date? = nil,
+        lensModel: String? = nil
     ) {
         self.fNumber = fNumber
         self.cameraMaker = cameraMaker
         self.cameraModel = cameraModel
+        self.lensModel = lensModel
 
         self.colorSpaceName = colorSpaceName
 
@@ -158,7 +165,7 @@ public struct ImageMetadata: Codable {
 
     public init(cgImagePropertiesDictionary properties: [AnyHashable: Any], imageSource: ImageIO.CGImageSource? = nil) throws {
         var fNumber: Double? = nil, focalLength: Double? = nil, focalLength35mm: Double? = nil, iso: Double? = nil, shutterSpeed: Double? = nil
-        var colorSpaceName: String? = nil
+        var colorSpaceName: String? = nil, lensModel: String? = nil
         var width, height, exifWidth, exifHeight: CGFloat?
         var timestamp: Date? = nil
 
@@ -196,6 +203,7 @@ public struct ImageMetadata: Codable {
             }
             
             shutterSpeed = (exif[kCGImagePropertyExifExposureTime as String] as? NSNumber)?.doubleValue
+            lensModel = exif[kCGImagePropertyExifLensModel as String] as? String
 
             // Take note of width and height, for later deciding whether to use them or the top-level values
             if let pixelXDimension = (exif[kCGImagePropertyExifPixelXDimension as String] as? NSNumber)?.doubleValue,
@@ -226,6 +234,10 @@ public struct ImageMetadata: Codable {
             }
         }
 
+        if lensModel == nil, let exifAux = properties[kCGImagePropertyExifAuxDictionary as String] as? [String: Any] {
+            lensModel = exifAux[kCGImagePropertyExifAuxLensModel as String] as? String
+        }
+
         if colorSpaceName == nil {
             if let pictureStyleDictionary = properties["{PictureStyle}"] as? [String: Any],
                 let names = pictureStyleDictionary["PictStyleColorSpace"] as? [Any],
@@ -285,7 +297,8 @@ public struct ImageMetadata: Codable {
             shutterSpeed: shutterSpeed,
             cameraMaker: cameraMaker,
             cameraModel: cameraModel,
-            timestamp: timestamp
+            timestamp: timestamp,
+            lensModel: lensModel
         )
     }
 
@@ -298,7 +311,7 @@ public struct ImageMetadata: Codable {
 
     // See ImageMetadata.timestamp for known caveats about EXIF/TIFF
     // date metadata, as interpreted by this date formatter.
-    private static let EXIFDateFormatter: DateFormatter = {
+    static let EXIFDateFormatter: DateFormatter = {
         let formatter = DateFormatter()
         formatter.dateFormat = "yyyy:MM:dd HH:mm:ss"
         return formatter
@@ -419,6 +432,10 @@ public struct ImageMetadata: Codable {
             result[CodingKeys.cameraModel.dictionaryRepresentationKey] = cameraModel
         }
 
+        if let lensModel = self.lensModel {
+            result[CodingKeys.lensModel.dictionaryRepresentationKey] = lensModel
+        }
+
         if let space = self.colorSpace, let spaceName = space.name {
             result[CodingKeys.colorSpaceName.dictionaryRepresentationKey] = spaceName
         }
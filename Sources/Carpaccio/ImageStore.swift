@@ -0,0 +1,215 @@
+//
+//  ImageStore.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Materialized, random access storage for the images of a collection.
+
+ Images are stored once, contiguously, so every traversal sees the same `Image` objects (and with them, their cached
+ loaders and metadata). Count and indexing are O(1), as are lookups by URL and by image, which are backed by hash maps.
+
+ Note that the URL index is built from image URLs at the time images are added, and kept current by
+ `updateURL(of:to:)`. If images' URLs are changed behind the store's back with `Image.updateURL(_:)`, lookups by URL
+ leave out the changed images (and do not find them under their new URL) until `reindexURLs()` is called; they never
+ fall back to scanning the store.
+
+ */
+public struct ImageStore: RandomAccessCollection {
+    public private(set) var images: ContiguousArray<Image>
+
+    private var indexByURL = [URL: Int]()
+    private var indexByIdentity = [ObjectIdentifier: Int]()
+    /** Further indices of URLs that appear more than once, which is rare enough not to burden `indexByURL` with. */
+    private var duplicateIndicesByURL = [URL: [Int]]()
+
+    public init() {
+        self.images = []
+    }
+
+    public init<S: Sequence>(_ images: S) where S.Element == Image {
+        self.images = ContiguousArray(images)
+        reindex()
+    }
+
+    // MARK: RandomAccessCollection
+
+    public var startIndex: Int {
+        return images.startIndex
+    }
+
+    public var endIndex: Int {
+        return images.endIndex
+    }
+
+    public subscript(position: Int) -> Image {
+        return images[position]
+    }
+
+    // MARK: Lookup
+
+    public func contains(_ image: Image) -> Bool {
+        return index(of: image) != nil
+    }
+
+    public func index(of image: Image) -> Int? {
+        return indexByIdentity[ObjectIdentifier(image)]
+    }
+
+    /** Indices of images with the given URL, in ascending order. A URL not in the index is not present. */
+    public func indices(of url: URL) -> [Int] {
+        guard let first = indexByURL[url] else {
+            return []
+        }
+        // Leave out indexed images whose URL has since changed
+        let indices = [first] + (duplicateIndicesByURL[url] ?? [])
+        return indices.filter { $0 < images.count && images[$0].URL == url }
+    }
+
+    public func firstIndex(of url: URL) -> Int? {
+        return indices(of: url).first
+    }
+
+    // MARK: Mutation
+
+    public mutating func append(_ image: Image) {
+        images.append(image)
+        index(image, at: images.count - 1)
+    }
+
+    public mutating func append<S: Sequence>(contentsOf newImages: S) where S.Element == Image {
+        let start = images.count
+        images.append(contentsOf: newImages)
+        for i in start ..< images.count {
+            index(images[i], at: i)
+        }
+    }
+
+    /**
+     Remove images at the given indices. O(n), as later images shift down, but the indices are updated in place:
+     removed images are dropped from them, and only images after the first removed one are renumbered.
+     */
+    public mutating func remove(at indicesToRemove: IndexSet) {
+        let indicesToRemove = indicesToRemove.filteredIndexSet { $0 >= 0 && $0 < images.count }
+        guard let firstRemoved = indicesToRemove.first else {
+            return
+        }
+        for i in indicesToRemove {
+            unindex(images[i], at: i)
+        }
+
+        var kept = ContiguousArray<Image>()
+        kept.reserveCapacity(images.count - indicesToRemove.count)
+        var movedFrom = [Int]()
+        for (i, image) in images.enumerated() where !indicesToRemove.contains(i) {
+            if i > firstRemoved {
+                movedFrom.append(i)
+            }
+            kept.append(image)
+        }
+        images = kept
+
+        for (offset, previousPosition) in movedFrom.enumerated() {
+            let position = firstRemoved + offset
+            renumber(images[position], from: previousPosition, to: position)
+        }
+    }
+
+    public mutating func replace(at position: Int, with image: Image) {
+        images[position] = image
+        reindex()
+    }
+
+    /** Change the URL of an image in the store, keeping the URL index current. */
+    public mutating func updateURL(of image: Image, to url: URL) {
+        guard let position = index(of: image) else {
+            image.updateURL(url)
+            return
+        }
+        let previousURL = image.URL
+        image.updateURL(url)
+
+        if let previousURL = previousURL, indexByURL[previousURL] == position, duplicateIndicesByURL[previousURL] == nil, indexByURL[url] == nil {
+            indexByURL[previousURL] = nil
+            indexByURL[url] = position
+        } else {
+            // Duplicate URLs are involved: rare enough to just reindex
+            reindex()
+        }
+    }
+
+    /** Rebuild the URL index, after images' URLs have been changed. */
+    public mutating func reindexURLs() {
+        reindex()
+    }
+
+    private mutating func reindex() {
+        indexByURL.removeAll(keepingCapacity: true)
+        indexByIdentity.removeAll(keepingCapacity: true)
+        duplicateIndicesByURL.removeAll()
+        indexByURL.reserveCapacity(images.count)
+        indexByIdentity.reserveCapacity(images.count)
+        for (i, image) in images.enumerated() {
+            index(image, at: i)
+        }
+    }
+
+    private mutating func unindex(_ image: Image, at position: Int) {
+        let identity = ObjectIdentifier(image)
+        if indexByIdentity[identity] == position {
+            indexByIdentity[identity] = nil
+        }
+        guard let url = image.URL else {
+            return
+        }
+        if indexByURL[url] == position {
+            // The next duplicate, if any, becomes the first index of the URL
+            if var duplicates = duplicateIndicesByURL[url], !duplicates.isEmpty {
+                indexByURL[url] = duplicates.removeFirst()
+                duplicateIndicesByURL[url] = duplicates.isEmpty ? nil : duplicates
+            } else {
+                indexByURL[url] = nil
+            }
+        } else if var duplicates = duplicateIndicesByURL[url], let i = duplicates.firstIndex(of: position) {
+            duplicates.remove(at: i)
+            duplicateIndicesByURL[url] = duplicates.isEmpty ? nil : duplicates
+        }
+    }
+
+    /** Move the entries of an image from one position to a lower one; relative order, and so ascending duplicates, are kept. */
+    private mutating func renumber(_ image: Image, from previousPosition: Int, to position: Int) {
+        // An image stored more than once is indexed by its first remaining position
+        let identity = ObjectIdentifier(image)
+        if indexByIdentity[identity] == previousPosition || indexByIdentity[identity] == nil {
+            indexByIdentity[identity] = position
+        }
+        guard let url = image.URL else {
+            return
+        }
+        if indexByURL[url] == previousPosition {
+            indexByURL[url] = position
+        } else if let i = duplicateIndicesByURL[url]?.firstIndex(of: previousPosition) {
+            duplicateIndicesByURL[url]?[i] = position
+        }
+    }
+
+    private mutating func index(_ image: Image, at position: Int) {
+        if indexByIdentity[ObjectIdentifier(image)] == nil {
+            indexByIdentity[ObjectIdentifier(image)] = position
+        }
+        guard let url = image.URL else {
+            return
+        }
+        if indexByURL[url] == nil {
+            indexByURL[url] = position
+        } else {
+            duplicateIndicesByURL[url, default: []].append(position)
+        }
+    }
+}
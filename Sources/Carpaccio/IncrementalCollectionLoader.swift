@@ -0,0 +1,161 @@
+//
+//  IncrementalCollectionLoader.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Loads the images of a directory tree incrementally: each image is reported as soon as it is discovered, and again
+ once a background stage has loaded its metadata.
+
+ Metadata is loaded in discovery order, with up to `metadataConcurrency` images in flight, so a client showing the
+ collection can present the first screenful of a very large folder immediately, and fill in details as they arrive.
+
+ */
+public final class IncrementalCollectionLoader {
+    public enum Event {
+        /** An image was found. Indices are assigned in discovery order, starting from zero. */
+        case discovered(index: Int, image: Image)
+        case metadataLoaded(index: Int, image: Image, metadata: ImageMetadata)
+        case metadataFailed(index: Int, image: Image, error: Swift.Error)
+    }
+
+    public typealias EventHandler = (_ event: Event) -> Void
+    public typealias CompletionHandler = (_ result: Result<AnyCollection<Image>, Swift.Error>) -> Void
+
+    public let directoryURL: URL
+    public let subdirectoryFilter: Collection.URLFilter?
+    public let loadsMetadata: Bool
+
+    private let walker: DirectoryWalker
+    private let discoveryQueue = DispatchQueue(label: "com.sashimiapp.IncrementalCollectionLoader.discovery")
+    private let metadataQueue = OperationQueue()
+    private var images = [Image]()
+    private var isCancelled = false
+
+    public init(
+        contentsOf directoryURL: URL,
+        filteringSubdirectoriesWith subdirectoryFilter: Collection.URLFilter? = nil,
+        loadsMetadata: Bool = true,
+        metadataConcurrency: Int = ProcessInfo.processInfo.activeProcessorCount,
+        walker: DirectoryWalker = DirectoryWalker()
+    ) {
+        self.directoryURL = directoryURL
+        self.subdirectoryFilter = subdirectoryFilter
+        self.loadsMetadata = loadsMetadata
+        self.walker = walker
+        metadataQueue.name = "com.sashimiapp.IncrementalCollectionLoader.metadata"
+        metadataQueue.maxConcurrentOperationCount = max(1, metadataConcurrency)
+    }
+
+    /**
+     Start loading. Events and the completion are delivered on `eventQueue`, events for any one image in the order
+     discovered → metadata loaded / failed. The completion receives all discovered images, in discovery order, once
+     both discovery and metadata loading have finished.
+     */
+    public func start(eventQueue: DispatchQueue = .main, eventHandler: @escaping EventHandler, completion: CompletionHandler? = nil) {
+        DispatchQueue.global(qos: .userInitiated).async {
+            do {
+                try self.walker.walk(self.directoryURL, filteringSubdirectoriesWith: self.subdirectoryFilter) { url in
+                    self.discoveryQueue.async {
+                        self.discovered(url, eventQueue: eventQueue, eventHandler: eventHandler)
+                    }
+                }
+            } catch {
+                eventQueue.async {
+                    completion?(.failure(Image.Error.loadingFailed(underlyingError: error)))
+                }
+                return
+            }
+
+            let images: [Image] = self.discoveryQueue.sync { self.images }
+            self.metadataQueue.waitUntilAllOperationsAreFinished()
+
+            eventQueue.async {
+                completion?(.success(AnyCollection(images)))
+            }
+        }
+    }
+
+    /** Stop reporting new images and skip metadata loads not yet started. The completion is still called. */
+    public func cancel() {
+        discoveryQueue.async {
+            self.isCancelled = true
+        }
+        metadataQueue.cancelAllOperations()
+    }
+
+    // Called on `discoveryQueue`.
+    private func discovered(_ url: URL, eventQueue: DispatchQueue, eventHandler: @escaping EventHandler) {
+        guard !isCancelled else {
+            return
+        }
+
+        let index = images.count
+        let image = Image(URL: url)
+        images.append(image)
+
+        eventQueue.async {
+            eventHandler(.discovered(index: index, image: image))
+        }
+
+        guard loadsMetadata else {
+            return
+        }
+
+        // Operations start in the order added, which makes metadata arrive in discovery order, give or take the
+        // concurrency of the queue
+        metadataQueue.addOperation {
+            do {
+                let metadata = try image.fetchMetadata()
+                eventQueue.async {
+                    eventHandler(.metadataLoaded(index: index, image: image, metadata: metadata))
+                }
+            } catch {
+                eventQueue.async {
+                    eventHandler(.metadataFailed(index: index, image: image, error: error))
+                }
+            }
+        }
+    }
+}
+
+#if compiler(>=5.5) && canImport(_Concurrency)
+@available(macOS 10.15, iOS 13.0, *)
+public extension Collection {
+    /**
+     Stream the images under `directoryURL` as they are discovered, followed by their metadata as it is loaded.
+     Terminating iteration early cancels loading.
+     */
+    class func images(
+        streamingContentsOf directoryURL: Foundation.URL,
+        filteringSubdirectoriesWith subdirectoryFilter: URLFilter? = nil,
+        loadsMetadata: Bool = true
+    ) -> AsyncThrowingStream<IncrementalCollectionLoader.Event, Swift.Error> {
+        return AsyncThrowingStream { continuation in
+            let loader = IncrementalCollectionLoader(contentsOf: directoryURL, filteringSubdirectoriesWith: subdirectoryFilter, loadsMetadata: loadsMetadata)
+            let queue = DispatchQueue(label: "com.sashimiapp.IncrementalCollectionLoader.stream")
+
+            continuation.onTermination = { _ in
+                loader.cancel()
+            }
+
+            loader.start(eventQueue: queue, eventHandler: { event in
+                continuation.yield(event)
+            }, completion: { result in
+                switch result {
+                case .success:
+                    continuation.finish()
+                case .failure(let error):
+                    continuation.finish(throwing: error)
+                }
+            })
+        }
+    }
+}
+#endif
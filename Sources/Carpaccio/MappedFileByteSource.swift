@@ -0,0 +1,151 @@
+//
+//  MappedFileByteSource.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ A byte source over a memory mapped local file.
+
+ The file descriptor is closed as soon as the mapping has been made, so an open source costs address space but no
+ file descriptor. Data returned by `bytes(in:)` points directly into the mapping, and keeps the source alive for as
+ long as it is referenced.
+
+ Instances are normally vended by `ImageByteSourcePool`, rather than created directly.
+
+ */
+public final class MappedFileByteSource: ImageByteSource {
+    public let url: URL
+    public let count: Int
+    public let containerCache = ImageContainerCache()
+
+    /** File size and modification time at the time of mapping, used to detect the file changing underneath us. */
+    public let fileSignature: FileSignature
+
+    private let baseAddress: UnsafeMutableRawPointer?
+
+    public init(fileURL url: URL) throws {
+        guard url.isFileURL else {
+            throw ImageByteSourceError.notAFileURL(url)
+        }
+        self.url = url
+
+        let fd = open(url.path, O_RDONLY)
+        guard fd >= 0 else {
+            throw ImageByteSourceError.failedToOpen(url: url, errno: errno)
+        }
+        defer {
+            close(fd)
+        }
+
+        var fileStat = stat()
+        guard fstat(fd, &fileStat) == 0 else {
+            throw ImageByteSourceError.failedToOpen(url: url, errno: errno)
+        }
+        self.fileSignature = FileSignature(fileStat)
+        FileAttributeCache.shared.store(FileAttributes(fileStat), forPath: url.path)
+        self.count = Int(fileStat.st_size)
+
+        // mmap() refuses zero length mappings, and there is nothing to map anyway
+        guard count > 0 else {
+            self.baseAddress = nil
+            return
+        }
+
+        guard let address = mmap(nil, count, PROT_READ, MAP_PRIVATE, fd, 0),
+              address != UnsafeMutableRawPointer(bitPattern: -1) else {
+            throw ImageByteSourceError.failedToMap(url: url, errno: errno)
+        }
+        self.baseAddress = address
+    }
+
+    deinit {
+        if let address = baseAddress {
+            munmap(address, count)
+        }
+    }
+
+    public var contiguousBytes: Data? {
+        return try? bytes(in: 0 ..< count)
+    }
+
+    public func bytes(in range: Range<Int>) throws -> Data {
+        try checkBounds(range)
+        guard let address = baseAddress, !range.isEmpty else {
+            return Data()
+        }
+        // The deallocator captures `self`, so the mapping outlives every Data handed out from it
+        return Data(bytesNoCopy: address + range.lowerBound, count: range.count, deallocator: .custom({ _, _ in
+            withExtendedLifetime(self) {}
+        }))
+    }
+
+    public func advise(_ hint: ReadAccessHint, range: Range<Int>? = nil) {
+        guard let address = baseAddress else {
+            return
+        }
+        let range = range?.clamped(to: 0 ..< count) ?? 0 ..< count
+        guard !range.isEmpty else {
+            return
+        }
+        hint.apply(to: address + range.lowerBound, length: range.count)
+
+        #if os(Linux)
+        // Releasing the mapping's pages leaves them in the page cache; the file's descriptor can drop them from it
+        if hint == .dontNeed {
+            let fd = open(url.path, O_RDONLY)
+            if fd >= 0 {
+                hint.applyAfterReading(to: fd, range: range)
+                close(fd)
+            }
+        }
+        #endif
+    }
+
+    /** Whether the file at `url` still has the size and modification time it had when mapped. Refreshes the file's cached attributes. */
+    public var isCurrent: Bool {
+        guard let current = FileAttributeCache.shared.refreshAttributes(for: url) else {
+            return false
+        }
+        return current.signature == fileSignature
+    }
+}
+
+/** Identifies a version of a file by its size and modification time. */
+public struct FileSignature: Equatable, Hashable {
+    public let size: Int64
+    public let modificationSeconds: Int
+    public let modificationNanoseconds: Int
+
+    public init(size: Int64, modificationSeconds: Int, modificationNanoseconds: Int) {
+        self.size = size
+        self.modificationSeconds = modificationSeconds
+        self.modificationNanoseconds = modificationNanoseconds
+    }
+
+    public init(_ fileStat: stat) {
+        #if os(Linux)
+        let mtime = fileStat.st_mtim
+        #else
+        let mtime = fileStat.st_mtimespec
+        #endif
+        self.init(size: Int64(fileStat.st_size), modificationSeconds: Int(mtime.tv_sec), modificationNanoseconds: Int(mtime.tv_nsec))
+    }
+
+    public init?(path: String) {
+        var fileStat = stat()
+        guard stat(path, &fileStat) == 0 else {
+            return nil
+        }
+        self.init(fileStat)
+    }
+
+    public var modificationDate: Date {
+        return Date(timeIntervalSince1970: TimeInterval(modificationSeconds) + TimeInterval(modificationNanoseconds) / 1_000_000_000)
+    }
+}
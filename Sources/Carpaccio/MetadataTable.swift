@@ -0,0 +1,462 @@
+//
+//  MetadataTable.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Fast, in-memory queries over the metadata of a large number of images.
+
+ Sorting `Image` objects by `approximateTimestamp` may load metadata from disk inside the comparator, and filtering
+ them means a loop per query over per-image objects. A `MetadataTable` instead loads all metadata up front, in one
+ parallel pass, into the columns of an `ImageCatalog`. After that, no query touches the disk:
+
+ - Predicates are evaluated a column at a time, 64 rows per step, into `RowSet` bitmaps which combine with `&`, `|`
+   and `!`.
+ - Sort permutations are computed once per column and direction, and cached.
+ - Rows can be grouped by day, camera or lens.
+
+ The table must not be modified through its catalog once queries have been made, or cached sort permutations will
+ be stale. Queries are thread safe.
+
+ */
+public final class MetadataTable {
+    public enum Column: Hashable {
+        case width
+        case height
+        case fNumber
+        case focalLength
+        case focalLength35mmEquivalent
+        case iso
+        case shutterSpeed
+        /** The metadata timestamp, in seconds since 1970. */
+        case timestamp
+    }
+
+    public enum Grouping {
+        /** By calendar day of the metadata timestamp in the given time zone, in chronological order. Group names are of the form "2026-10-17". */
+        case day(TimeZone)
+        /** By camera model, in alphabetical order. */
+        case camera
+        /** By lens model, in alphabetical order. */
+        case lens
+    }
+
+    public struct Group {
+        /** `nil` for the group of rows which have no value to group by. That group always comes last. */
+        public let name: String?
+        public let rows: [Int]
+    }
+
+    public let catalog: ImageCatalog
+
+    /** For a table made from a collection, the index in `Collection.imageStore` of the image of each row. */
+    public let collectionIndices: [Int]?
+
+    private var sortPermutations = [SortKey: [Int]]()
+    private let sortQueue = DispatchQueue(label: "com.sashimiapp.MetadataTableSortQueue")
+
+    private struct SortKey: Hashable {
+        let column: Column
+        let ascending: Bool
+    }
+
+    public init(catalog: ImageCatalog) {
+        self.catalog = catalog
+        self.collectionIndices = nil
+    }
+
+    /**
+     Make a table of the images in `collection`. Metadata not already loaded is loaded in parallel, unless
+     `loadingMissingMetadata` is `false`. Images without a URL are left out.
+     */
+    public init(collection: Collection, loadingMissingMetadata: Bool = true) {
+        let images = collection.imageStore
+        var metadata = [ImageMetadata?](repeating: nil, count: images.count)
+
+        metadata.withUnsafeMutableBufferPointer { buffer in
+            let output = buffer
+            DispatchQueue.concurrentPerform(iterations: images.count) { i in
+                let image = images[i]
+                if let loaded = image.metadata {
+                    output[i] = loaded
+                } else if loadingMissingMetadata {
+                    output[i] = try? image.fetchMetadata()
+                }
+            }
+        }
+
+        let catalog = ImageCatalog()
+        catalog.reserveCapacity(images.count)
+        var collectionIndices = [Int]()
+        collectionIndices.reserveCapacity(images.count)
+
+        for (i, image) in images.enumerated() {
+            guard let url = image.URL else {
+                continue
+            }
+            catalog.append(url: url, metadata: metadata[i])
+            collectionIndices.append(i)
+        }
+
+        self.catalog = catalog
+        self.collectionIndices = collectionIndices
+    }
+
+    public var count: Int {
+        return catalog.count
+    }
+
+    // MARK: Filtering
+
+    public var allRows: RowSet {
+        return RowSet(rowCount: count, allSet: true)
+    }
+
+    /** Rows which have a value in `column`. */
+    public func rows(withValueIn column: Column) -> RowSet {
+        switch column {
+        case .width:
+            return RowSet(validity: catalog.widths.validity)
+        case .height:
+            return RowSet(validity: catalog.heights.validity)
+        case .fNumber:
+            return RowSet(validity: catalog.fNumbers.validity)
+        case .focalLength:
+            return RowSet(validity: catalog.focalLengths.validity)
+        case .focalLength35mmEquivalent:
+            return RowSet(validity: catalog.focalLengths35mmEquivalent.validity)
+        case .iso:
+            return RowSet(validity: catalog.isos.validity)
+        case .shutterSpeed:
+            return RowSet(validity: catalog.shutterSpeeds.validity)
+        case .timestamp:
+            return RowSet(validity: catalog.timestamps.validity)
+        }
+    }
+
+    /** Rows whose value in `column` is within `range`. Rows with no value never match. */
+    public func rows(where column: Column, isIn range: ClosedRange<Double>) -> RowSet {
+        switch column {
+        case .width:
+            return MetadataTable.evaluate(catalog.widths) { range.contains(Double($0)) }
+        case .height:
+            return MetadataTable.evaluate(catalog.heights) { range.contains(Double($0)) }
+        case .fNumber:
+            return MetadataTable.evaluate(catalog.fNumbers, singlePrecision(range))
+        case .focalLength:
+            return MetadataTable.evaluate(catalog.focalLengths, singlePrecision(range))
+        case .focalLength35mmEquivalent:
+            return MetadataTable.evaluate(catalog.focalLengths35mmEquivalent, singlePrecision(range))
+        case .iso:
+            return MetadataTable.evaluate(catalog.isos, singlePrecision(range))
+        case .shutterSpeed:
+            return MetadataTable.evaluate(catalog.shutterSpeeds) { range.contains($0) }
+        case .timestamp:
+            return MetadataTable.evaluate(catalog.timestamps) { range.contains($0) }
+        }
+    }
+
+    public func rows(takenBetween start: Date, and end: Date) -> RowSet {
+        return rows(where: .timestamp, isIn: min(start, end).timeIntervalSince1970 ... max(start, end).timeIntervalSince1970)
+    }
+
+    public func rows(withCameraMaker cameraMaker: String) -> RowSet {
+        return rows(in: catalog.cameraMakerIDs, matching: cameraMaker)
+    }
+
+    public func rows(withCameraModel cameraModel: String) -> RowSet {
+        return rows(in: catalog.cameraModelIDs, matching: cameraModel)
+    }
+
+    public func rows(withLensModel lensModel: String) -> RowSet {
+        return rows(in: catalog.lensModelIDs, matching: lensModel)
+    }
+
+    private func rows(in column: NullableColumn<UInt32>, matching string: String) -> RowSet {
+        guard let id = catalog.strings.id(of: string) else {
+            return RowSet(rowCount: count, allSet: false)
+        }
+        return MetadataTable.evaluate(column) { $0 == id }
+    }
+
+    /** Single precision columns are compared at single precision, so that e.g. an f-number of 2.8 matches `2.8 ... 2.8`. */
+    private func singlePrecision(_ range: ClosedRange<Double>) -> (Float) -> Bool {
+        let lower = Float(range.lowerBound), upper = Float(range.upperBound)
+        return { $0 >= lower && $0 <= upper }
+    }
+
+    /** Evaluate `predicate` over a column 64 rows at a time, one bitmap word per step, masked by the column's validity. */
+    private static func evaluate<T: ExpressibleByIntegerLiteral>(_ column: NullableColumn<T>, _ predicate: (T) -> Bool) -> RowSet {
+        let rowCount = column.count
+        var words = ContiguousArray<UInt64>(repeating: 0, count: (rowCount + 63) >> 6)
+        let validity = column.validity.words
+
+        column.values.withUnsafeBufferPointer { values in
+            for w in 0 ..< words.count {
+                let valid = validity[w]
+                if valid == 0 {
+                    continue
+                }
+                let base = w << 6
+                let end = min(64, rowCount - base)
+                var word: UInt64 = 0
+                for bit in 0 ..< end where predicate(values[base + bit]) {
+                    word |= 1 << UInt64(bit)
+                }
+                words[w] = word & valid
+            }
+        }
+        return RowSet(words: words, rowCount: rowCount)
+    }
+
+    // MARK: Sorting
+
+    /**
+     Row indices in order of `column`, rows with equal values in row order, and rows with no value last. The
+     permutation is computed on first use, and cached.
+     */
+    public func sortPermutation(by column: Column, ascending: Bool = true) -> [Int] {
+        let key = SortKey(column: column, ascending: ascending)
+        return sortQueue.sync {
+            if let permutation = sortPermutations[key] {
+                return permutation
+            }
+            let permutation = makeSortPermutation(by: column, ascending: ascending)
+            sortPermutations[key] = permutation
+            return permutation
+        }
+    }
+
+    /** `rows` in the order of `sortPermutation(by:ascending:)`. */
+    public func sorted(_ rows: RowSet, by column: Column, ascending: Bool = true) -> [Int] {
+        return sortPermutation(by: column, ascending: ascending).filter { rows.contains($0) }
+    }
+
+    private func makeSortPermutation(by column: Column, ascending: Bool) -> [Int] {
+        switch column {
+        case .width:
+            return MetadataTable.permutation(of: catalog.widths, ascending: ascending)
+        case .height:
+            return MetadataTable.permutation(of: catalog.heights, ascending: ascending)
+        case .fNumber:
+            return MetadataTable.permutation(of: catalog.fNumbers, ascending: ascending)
+        case .focalLength:
+            return MetadataTable.permutation(of: catalog.focalLengths, ascending: ascending)
+        case .focalLength35mmEquivalent:
+            return MetadataTable.permutation(of: catalog.focalLengths35mmEquivalent, ascending: ascending)
+        case .iso:
+            return MetadataTable.permutation(of: catalog.isos, ascending: ascending)
+        case .shutterSpeed:
+            return MetadataTable.permutation(of: catalog.shutterSpeeds, ascending: ascending)
+        case .timestamp:
+            return MetadataTable.permutation(of: catalog.timestamps, ascending: ascending)
+        }
+    }
+
+    private static func permutation<T: Comparable & ExpressibleByIntegerLiteral>(of column: NullableColumn<T>, ascending: Bool) -> [Int] {
+        let validity = column.validity
+        var valid = [Int](), missing = [Int]()
+        valid.reserveCapacity(column.count)
+        for row in 0 ..< column.count {
+            if validity[row] {
+                valid.append(row)
+            } else {
+                missing.append(row)
+            }
+        }
+
+        column.values.withUnsafeBufferPointer { values in
+            if ascending {
+                valid.sort { values[$0] < values[$1] || (values[$0] == values[$1] && $0 < $1) }
+            } else {
+                valid.sort { values[$0] > values[$1] || (values[$0] == values[$1] && $0 < $1) }
+            }
+        }
+        return valid + missing
+    }
+
+    // MARK: Grouping
+
+    /** Group `rows` (by default, all rows). Row indices within each group are in ascending order. */
+    public func groups(by grouping: Grouping, of rows: RowSet? = nil) -> [Group] {
+        let rows = rows ?? allRows
+
+        switch grouping {
+        case .camera:
+            return stringGroups(of: rows, in: catalog.cameraModelIDs)
+        case .lens:
+            return stringGroups(of: rows, in: catalog.lensModelIDs)
+        case .day(let timeZone):
+            return dayGroups(of: rows, in: timeZone)
+        }
+    }
+
+    private func stringGroups(of rows: RowSet, in column: NullableColumn<UInt32>) -> [Group] {
+        var rowsByID = [UInt32: [Int]]()
+        var ungrouped = [Int]()
+        for row in rows {
+            if let id = column[row] {
+                rowsByID[id, default: []].append(row)
+            } else {
+                ungrouped.append(row)
+            }
+        }
+
+        var groups = rowsByID
+            .map { Group(name: catalog.strings[$0.key], rows: $0.value) }
+            .sorted { $0.name! < $1.name! }
+        if !ungrouped.isEmpty {
+            groups.append(Group(name: nil, rows: ungrouped))
+        }
+        return groups
+    }
+
+    private func dayGroups(of rows: RowSet, in timeZone: TimeZone) -> [Group] {
+        var rowsByDay = [Int: [Int]]()
+        var ungrouped = [Int]()
+
+        // Time zone offsets only change at daylight saving transitions, so look them up once per hour of timestamps
+        // rather than once per row
+        var cachedHour = Int.min, cachedOffset = 0
+
+        for row in rows {
+            guard let timestamp = catalog.timestamps[row] else {
+                ungrouped.append(row)
+                continue
+            }
+            let hour = Int((timestamp / 3600).rounded(.down))
+            if hour != cachedHour {
+                cachedHour = hour
+                cachedOffset = timeZone.secondsFromGMT(for: Date(timeIntervalSince1970: timestamp))
+            }
+            let day = Int(((timestamp + Double(cachedOffset)) / 86400).rounded(.down))
+            rowsByDay[day, default: []].append(row)
+        }
+
+        let formatter = DateFormatter()
+        formatter.locale = Locale(identifier: "en_US_POSIX")
+        formatter.timeZone = TimeZone(secondsFromGMT: 0)
+        formatter.dateFormat = "yyyy-MM-dd"
+
+        var groups = rowsByDay
+            .sorted { $0.key < $1.key }
+            .map { Group(name: formatter.string(from: Date(timeIntervalSince1970: Double($0.key) * 86400)), rows: $0.value) }
+        if !ungrouped.isEmpty {
+            groups.append(Group(name: nil, rows: ungrouped))
+        }
+        return groups
+    }
+}
+
+// MARK: - Row sets
+
+/** A set of rows of a table, as a bitmap. */
+public struct RowSet: Sequence, Equatable {
+    public private(set) var words: ContiguousArray<UInt64>
+    public let rowCount: Int
+
+    public init(rowCount: Int, allSet: Bool) {
+        self.rowCount = rowCount
+        self.words = ContiguousArray(repeating: allSet ? ~0 : 0, count: (rowCount + 63) >> 6)
+        if allSet {
+            clearTrailingBits()
+        }
+    }
+
+    public init(validity: ValidityBitmap) {
+        self.init(words: validity.words, rowCount: validity.count)
+    }
+
+    init(words: ContiguousArray<UInt64>, rowCount: Int) {
+        self.words = words
+        self.rowCount = rowCount
+    }
+
+    public var count: Int {
+        return words.reduce(0) { $0 + $1.nonzeroBitCount }
+    }
+
+    public var isEmpty: Bool {
+        return words.allSatisfy { $0 == 0 }
+    }
+
+    public func contains(_ row: Int) -> Bool {
+        guard row >= 0, row < rowCount else {
+            return false
+        }
+        return words[row >> 6] & (1 << UInt64(row & 63)) != 0
+    }
+
+    public mutating func insert(_ row: Int) {
+        words[row >> 6] |= 1 << UInt64(row & 63)
+    }
+
+    public mutating func remove(_ row: Int) {
+        words[row >> 6] &= ~(1 << UInt64(row & 63))
+    }
+
+    public static func & (lhs: RowSet, rhs: RowSet) -> RowSet {
+        return lhs.combined(with: rhs) { $0 & $1 }
+    }
+
+    public static func | (lhs: RowSet, rhs: RowSet) -> RowSet {
+        return lhs.combined(with: rhs) { $0 | $1 }
+    }
+
+    public static prefix func ! (set: RowSet) -> RowSet {
+        var result = RowSet(words: ContiguousArray(set.words.lazy.map { ~$0 }), rowCount: set.rowCount)
+        result.clearTrailingBits()
+        return result
+    }
+
+    private func combined(with other: RowSet, _ operation: (UInt64, UInt64) -> UInt64) -> RowSet {
+        precondition(rowCount == other.rowCount, "Row sets are from tables of different sizes")
+        var words = self.words
+        for i in words.indices {
+            words[i] = operation(words[i], other.words[i])
+        }
+        return RowSet(words: words, rowCount: rowCount)
+    }
+
+    private mutating func clearTrailingBits() {
+        let remainder = rowCount & 63
+        if remainder != 0 {
+            words[words.count - 1] &= (1 << UInt64(remainder)) - 1
+        }
+    }
+
+    public func makeIterator() -> Iterator {
+        return Iterator(words: words)
+    }
+
+    /** Iterates set rows in ascending order, skipping a whole word of unset rows at a time. */
+    public struct Iterator: IteratorProtocol {
+        private let words: ContiguousArray<UInt64>
+        private var wordIndex = 0
+        private var current: UInt64
+
+        init(words: ContiguousArray<UInt64>) {
+            self.words = words
+            self.current = words.first ?? 0
+        }
+
+        public mutating func next() -> Int? {
+            while current == 0 {
+                wordIndex += 1
+                guard wordIndex < words.count else {
+                    return nil
+                }
+                current = words[wordIndex]
+            }
+            let bit = current.trailingZeroBitCount
+            current &= current - 1
+            return wordIndex << 6 + bit
+        }
+    }
+}
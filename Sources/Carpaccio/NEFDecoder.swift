@@ -0,0 +1,297 @@
+//
+//  NEFDecoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Nikon NEF and NRW files: uncompressed, and Nikon's lossless and lossy Huffman coding.
+
+ Compressed data is coded row by row as Huffman coded differences from the previous pixel of the same colour (the
+ previous row's for the first two columns), with one of six code trees by bit depth and lossless or lossy. Lossy
+ files map the decoded values through a linearization curve, and may switch to a second tree at a split row. Trees,
+ curve, initial predictors and split row are given by the linearization table of the maker note (tag 0x96).
+
+ Huffman symbols are decoded by table lookup and the curve is applied as each pixel is written. A Nikon bit stream
+ can only be decoded from its start, the bit position of the split row not being recorded, so strips are the unit
+ of parallelism: files whose data is in several strips have each decoded on its own thread, each starting from the
+ initial predictors. Uncompressed data is always unpacked strip by strip in parallel.
+
+ */
+public struct NEFDecoder: RAWDecoder {
+    public enum Tag {
+        public static let whiteBalanceLevels: UInt16 = 0x000C
+        public static let blackLevel: UInt16 = 0x003D
+        public static let linearizationTable: UInt16 = 0x0096
+    }
+
+    public enum Compression {
+        public static let none = 1
+        public static let nikon = 34713
+    }
+
+    /** Counts of codes of lengths 1 to 16, then symbols: the low nibble is the difference length, the high one its shift. */
+    static let trees: [(counts: [UInt8], symbols: [UInt8])] = [
+        // 12-bit lossy
+        ([0, 1, 5, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0], [5, 4, 3, 6, 2, 7, 1, 0, 8, 9, 11, 10, 12, 0]),
+        // 12-bit lossy after split
+        ([0, 1, 5, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0], [0x39, 0x5A, 0x38, 0x27, 0x16, 5, 4, 3, 2, 1, 0, 11, 12, 12]),
+        // 12-bit lossless
+        ([0, 1, 4, 2, 3, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0], [5, 4, 6, 3, 7, 2, 8, 1, 9, 0, 10, 11, 12]),
+        // 14-bit lossy
+        ([0, 1, 4, 3, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0, 0], [5, 6, 4, 7, 8, 3, 9, 2, 1, 0, 10, 11, 12, 13, 14]),
+        // 14-bit lossy after split
+        ([0, 1, 5, 1, 1, 1, 1, 1, 1, 1, 2, 0, 0, 0, 0, 0], [8, 0x5C, 0x4B, 0x3A, 0x29, 7, 6, 5, 4, 3, 2, 1, 0, 13, 14]),
+        // 14-bit lossless
+        ([0, 1, 4, 2, 2, 3, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0], [7, 6, 8, 5, 9, 4, 10, 3, 11, 12, 2, 0, 1, 13, 14])
+    ]
+
+    /** The contents of the linearization table. */
+    struct Linearization {
+        var tree: Int
+        /** Initial predictors of the first two columns, for even and odd rows. */
+        var predictors: [Int]
+        var curve: [UInt16]
+        /** Number of curve entries in use: decoded values are clamped below it. */
+        var curveSize: Int
+        /** Row from which the tree after `tree` is used, or 0. */
+        var splitRow: Int
+
+        var whiteLevel: Int {
+            return Int(curve[max(curveSize, 1) - 1])
+        }
+
+        /** Identity curve and the lossless tree, for files without a linearization table. */
+        init(bitsPerSample: Int) {
+            self.tree = bitsPerSample == 14 ? 5 : 2
+            self.predictors = [0, 0, 0, 0]
+            self.curve = (0 ..< 0x10000).map { UInt16($0) }
+            self.curveSize = min(1 << bitsPerSample, 0x10000)
+            self.splitRow = 0
+        }
+
+        init(data: Data, byteOrder: ByteOrder, bitsPerSample: Int) throws {
+            self.init(bitsPerSample: bitsPerSample)
+            guard let version0 = data.uint8(at: 0), let version1 = data.uint8(at: 1) else {
+                throw RAWDecodingError.unsupportedLayout("NEF linearization table is empty")
+            }
+            var offset = version0 == 0x49 || version1 == 0x58 ? 2112 : 2
+            tree = (version0 == 0x46 ? 2 : 0) + (bitsPerSample == 14 ? 3 : 0)
+
+            let predictors = (0 ..< 4).compactMap { data.uint16(at: offset + $0 * 2, byteOrder).map { Int($0) } }
+            guard predictors.count == 4, let count = data.uint16(at: offset + 8, byteOrder).map({ Int($0) }) else {
+                throw RAWDecodingError.unsupportedLayout("NEF linearization table is truncated")
+            }
+            self.predictors = predictors
+            offset += 10
+
+            let step = count > 1 ? curveSize / (count - 1) : 0
+            if version0 == 0x44 && version1 == 0x20 && step > 0 {
+                // Every step'th value is given, the rest are interpolated
+                for i in 0 ..< count {
+                    curve[i * step] = data.uint16(at: offset + i * 2, byteOrder) ?? 0
+                }
+                for i in 0 ..< curveSize where i % step != 0 {
+                    let base = i - i % step
+                    curve[i] = UInt16((Int(curve[base]) * (step - i % step) + Int(curve[base + step]) * (i % step)) / step)
+                }
+                splitRow = data.uint16(at: 562, byteOrder).map { Int($0) } ?? 0
+            } else if version0 != 0x46 && count > 1 && count <= 0x4001 {
+                for i in 0 ..< count {
+                    curve[i] = data.uint16(at: offset + i * 2, byteOrder) ?? 0
+                }
+                curveSize = count
+            }
+            while curveSize > 2 && curve[curveSize - 2] == curve[curveSize - 1] {
+                curveSize -= 1
+            }
+        }
+    }
+
+    public let source: ImageByteSource
+    let rendition: DNGLayout.Rendition
+    let byteOrder: ByteOrder
+    public let cfaPattern: CFAPattern
+    let linearization: Linearization
+    let blackLevel: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource, structure: TIFFStructure) throws {
+        guard let rendition = structure.rawRendition(in: source) else {
+            throw RAWDecodingError.noRAWData
+        }
+        guard rendition.compression == Compression.none || rendition.compression == Compression.nikon else {
+            throw RAWDecodingError.unsupportedCompression(rendition.compression)
+        }
+        guard rendition.bitsPerSample == 12 || rendition.bitsPerSample == 14 || rendition.compression == Compression.none else {
+            throw RAWDecodingError.unsupportedLayout("\(rendition.bitsPerSample) bits per sample")
+        }
+        self.source = source
+        self.rendition = rendition
+        self.byteOrder = structure.byteOrder
+        self.cfaPattern = structure.cfaPattern(of: rendition.ifd, in: source) ?? .rggb
+
+        let makerNote = structure.makerNoteStructure(prefix: "Nikon\0", headerLength: 10, in: source)
+        func makerNoteEntry(_ tag: UInt16) -> TIFFEntry? {
+            return makerNote?.mainIFDs.first?.entry(tag)
+        }
+
+        if rendition.compression == Compression.nikon {
+            guard let makerNote = makerNote, let entry = makerNoteEntry(Tag.linearizationTable) else {
+                throw RAWDecodingError.unsupportedLayout("NEF without a linearization table")
+            }
+            self.linearization = try Linearization(data: source.bytes(in: entry.valueRange), byteOrder: makerNote.byteOrder,
+                                                   bitsPerSample: rendition.bitsPerSample)
+        } else {
+            self.linearization = Linearization(bitsPerSample: min(rendition.bitsPerSample, 16))
+        }
+
+        // Black levels are given per CFA position, in 14-bit units
+        if let makerNote = makerNote, let entry = makerNoteEntry(Tag.blackLevel),
+           let levels = try? makerNote.intValues(of: entry, in: source), !levels.isEmpty {
+            self.blackLevel = levels.meanBlackLevel >> max(0, 14 - rendition.bitsPerSample)
+        } else {
+            self.blackLevel = 0
+        }
+
+        // Red and blue multipliers
+        if let makerNote = makerNote, let entry = makerNoteEntry(Tag.whiteBalanceLevels),
+           let levels = try? makerNote.rationalValues(of: entry, in: source), levels.count >= 2, levels[0] > 0, levels[1] > 0 {
+            self.whiteBalance = [levels[0], 1, levels[1]]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    public var size: CGSize {
+        return rendition.size
+    }
+
+    public func decode() throws -> RAWSensorImage {
+        // Huffman coded data takes at least a bit per pixel: the strips must be able to hold the image before it is allocated
+        let pixelCount = try RAWSensorImage.pixelCount(width: rendition.width, height: rendition.height)
+        guard rendition.tiles.reduce(0.0, { $0 + Double($1.range.count) }) * 8 >= Double(pixelCount) else {
+            throw RAWDecodingError.truncatedData
+        }
+        let image = try RAWSensorImage(width: rendition.width, height: rendition.height, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel, whiteLevel: linearization.whiteLevel, whiteBalance: whiteBalance)
+        let tables = try NEFDecoder.trees[linearization.tree ... min(linearization.tree + 1, NEFDecoder.trees.count - 1)]
+            .map { try HuffmanTable(counts: $0.counts, symbols: $0.symbols) }
+
+        var firstError: Swift.Error? = nil
+        let errorLock = NSLock()
+        DispatchQueue.concurrentPerform(iterations: rendition.tiles.count) { i in
+            do {
+                let strip = rendition.tiles[i]
+                let data = try source.bytes(in: strip.range)
+                if rendition.compression == Compression.nikon && data.count != strip.width * strip.height * 2 {
+                    try decodeHuffmanCoded(data, strip: strip, tables: tables, into: image)
+                } else {
+                    try unpack(data, strip: strip, into: image)
+                }
+            } catch {
+                errorLock.lock()
+                firstError = firstError ?? error
+                errorLock.unlock()
+            }
+        }
+        if let error = firstError {
+            throw error
+        }
+        return image
+    }
+
+    private func decodeHuffmanCoded(_ data: Data, strip: DNGLayout.Tile, tables: [HuffmanTable], into image: RAWSensorImage) throws {
+        let width = strip.width
+        let splitRow = linearization.splitRow
+        var predictors = linearization.predictors
+        var table = splitRow > 0 && strip.y >= splitRow ? tables[tables.count - 1] : tables[0]
+
+        let overrun: Bool = data.withUnsafeBytes { bytes in
+            linearization.curve.withUnsafeBufferPointer { curve in
+                var reader = BitReader(bytes)
+                let limit = min(linearization.curveSize, 0x4000) - 1
+
+                for y in strip.y ..< (strip.y + strip.height) {
+                    if splitRow > 0 && y == splitRow {
+                        table = tables[tables.count - 1]
+                    }
+                    let row = image.row(y)
+                    var even = 0, odd = 0
+                    for x in 0 ..< width {
+                        let symbol = table.decodeSymbol(&reader)
+                        let length = symbol & 15, shift = symbol >> 4
+                        var difference = 0
+                        if length > 0 {
+                            let bits = Int(reader.read(length - shift))
+                            difference = (((bits << 1) + 1) << shift) >> 1
+                            if difference & (1 << (length - 1)) == 0 {
+                                difference -= (1 << length) - (shift == 0 ? 1 : 0)
+                            }
+                        }
+
+                        let value: Int
+                        if x < 2 {
+                            let p = (y & 1) << 1 | x
+                            predictors[p] += difference
+                            value = predictors[p]
+                            if x == 0 {
+                                even = value
+                            } else {
+                                odd = value
+                            }
+                        } else if x & 1 == 0 {
+                            even += difference
+                            value = even
+                        } else {
+                            odd += difference
+                            value = odd
+                        }
+                        // Predictors are 16-bit, and wrap around as such
+                        row[x] = curve[min(max(Int(Int16(truncatingIfNeeded: value)), 0), limit)]
+                    }
+                }
+                return reader.isOverrun
+            }
+        }
+        if overrun {
+            throw RAWDecodingError.truncatedData
+        }
+    }
+
+    /** Uncompressed data: 16 bits per pixel in the file's byte order, or packed most significant bit first. */
+    private func unpack(_ data: Data, strip: DNGLayout.Tile, into image: RAWSensorImage) throws {
+        let pixelCount = strip.width * strip.height
+        let bitsPerSample = rendition.bitsPerSample
+        if data.count >= pixelCount * 2 {
+            data.withUnsafeBytes { bytes in
+                let (high, low) = byteOrder == .bigEndian ? (0, 1) : (1, 0)
+                for y in 0 ..< strip.height {
+                    let row = image.row(strip.y + y)
+                    let start = y * strip.width * 2
+                    for x in 0 ..< strip.width {
+                        row[x] = UInt16(bytes[start + x * 2 + high]) << 8 | UInt16(bytes[start + x * 2 + low])
+                    }
+                }
+            }
+        } else if data.count * 8 >= pixelCount * bitsPerSample {
+            data.withUnsafeBytes { bytes in
+                var reader = BitReader(bytes)
+                for y in 0 ..< strip.height {
+                    let row = image.row(strip.y + y)
+                    for x in 0 ..< strip.width {
+                        row[x] = UInt16(truncatingIfNeeded: reader.read(bitsPerSample))
+                    }
+                }
+            }
+        } else {
+            throw RAWDecodingError.truncatedData
+        }
+    }
+}
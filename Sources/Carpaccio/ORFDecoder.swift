@@ -0,0 +1,222 @@
+//
+//  ORFDecoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Olympus and OM System ORF files: uncompressed 16-bit, and Olympus's adaptive coding.
+
+ Compressed data codes each pixel as a difference from a prediction made from its neighbours of the same colour to
+ the left, above and above left. Differences are split into a low part of a bit width adapted to the recent
+ differences of that colour, and a high part coded by its number of leading zeros, which is decoded with a single
+ count-leading-zeros on the next 12 bits rather than by a table.
+
+ Predictions depend on the row two above, and the stream has no restart points, so the data is decoded sequentially
+ on one thread.
+
+ */
+public struct ORFDecoder: RAWDecoder {
+    public enum Tag {
+        /** Maker note directory of image processing settings. */
+        public static let imageProcessing: UInt16 = 0x2040
+        /** Red and blue levels in 1/256ths of green, in the image processing directory. */
+        public static let whiteBalanceLevels: UInt16 = 0x0100
+        /** Black level of each CFA position, in the image processing directory. */
+        public static let blackLevels: UInt16 = 0x0600
+    }
+
+    /** Bytes ahead of the coded data. */
+    static let compressedDataHeaderLength = 7
+
+    public let source: ImageByteSource
+    let rendition: DNGLayout.Rendition
+    let byteOrder: ByteOrder
+    /** Range of the data, assumed to be laid out contiguously when in several strips. */
+    let dataRange: Range<Int>
+    let isCompressed: Bool
+    public let cfaPattern: CFAPattern
+    let blackLevel: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource, structure: TIFFStructure) throws {
+        guard let rendition = structure.firstRawRendition(in: source), let first = rendition.tiles.first, let last = rendition.tiles.last,
+              first.range.lowerBound < last.range.upperBound else {
+            throw RAWDecodingError.noRAWData
+        }
+        guard rendition.compression == DNGLayout.Compression.none else {
+            throw RAWDecodingError.unsupportedCompression(rendition.compression)
+        }
+        self.source = source
+        self.rendition = rendition
+        self.byteOrder = structure.byteOrder
+        self.dataRange = first.range.lowerBound ..< last.range.upperBound
+
+        // Compression is not recorded as such: coded data is much smaller than 16 or packed 12 bits per pixel
+        let pixelCount = try RAWSensorImage.pixelCount(width: rendition.width, height: rendition.height)
+        let (unpackedByteCount, unpackedOverflow) = pixelCount.multipliedReportingOverflow(by: 2)
+        let (packedNibbleCount, packedOverflow) = pixelCount.multipliedReportingOverflow(by: 3)
+        guard !unpackedOverflow, !packedOverflow else {
+            throw RAWDecodingError.corruptData
+        }
+        if dataRange.count >= unpackedByteCount {
+            self.isCompressed = false
+        } else if dataRange.count * 2 < packedNibbleCount {
+            self.isCompressed = true
+        } else {
+            throw RAWDecodingError.unsupportedLayout("ORF with packed 12-bit data")
+        }
+        self.cfaPattern = structure.cfaPattern(of: rendition.ifd, in: source) ?? structure.exifCFAPattern(in: source) ?? .rggb
+
+        let makerNote = structure.makerNoteStructure(prefix: "OLYMPUS\0", byteOrderOffset: 8, ifdOffset: 12, relativeToMakerNote: true, in: source)
+            ?? structure.makerNoteStructure(prefix: "OM SYSTEM\0", byteOrderOffset: 12, ifdOffset: 16, relativeToMakerNote: true, in: source)
+        let imageProcessing = makerNote.flatMap { ORFDecoder.imageProcessingStructure(in: $0, source: source) }
+        func imageProcessingValues(_ tag: UInt16) -> [Int] {
+            guard let imageProcessing = imageProcessing, let entry = imageProcessing.mainIFDs.first?.entry(tag),
+                  let values = try? imageProcessing.intValues(of: entry, in: source) else {
+                return []
+            }
+            return values
+        }
+
+        let blackLevels = imageProcessingValues(Tag.blackLevels)
+        self.blackLevel = blackLevels.meanBlackLevel
+
+        let levels = imageProcessingValues(Tag.whiteBalanceLevels)
+        if levels.count >= 2, levels[0] > 0, levels[1] > 0 {
+            self.whiteBalance = [Double(levels[0]) / 256, 1, Double(levels[1]) / 256]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    /** The image processing directory, pointed to by the maker note, or for some older cameras held as its value. */
+    private static func imageProcessingStructure(in makerNote: TIFFStructure, source: ImageByteSource) -> TIFFStructure? {
+        guard let entry = makerNote.mainIFDs.first?.entry(Tag.imageProcessing) else {
+            return nil
+        }
+        let offset: Int
+        if entry.type == 7 {
+            offset = entry.valueOffset - makerNote.baseOffset
+        } else if let pointer = try? makerNote.integerValue(of: entry, in: source) {
+            offset = pointer
+        } else {
+            return nil
+        }
+        return try? TIFFStructure.read(from: source, baseOffset: makerNote.baseOffset, byteOrder: makerNote.byteOrder, firstIFDOffset: offset)
+    }
+
+    public var size: CGSize {
+        return rendition.size
+    }
+
+    public func decode() throws -> RAWSensorImage {
+        // 12-bit data, also when stored in 16 bits
+        let image = try RAWSensorImage(width: rendition.width, height: rendition.height, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel, whiteLevel: 4095, whiteBalance: whiteBalance)
+        let data = try source.bytes(in: dataRange)
+        if isCompressed {
+            try decodeCompressed(data, into: image)
+        } else {
+            unpack(data, into: image)
+        }
+        return image
+    }
+
+    private func decodeCompressed(_ data: Data, into image: RAWSensorImage) throws {
+        let width = rendition.width, height = rendition.height
+        guard data.count > ORFDecoder.compressedDataHeaderLength else {
+            throw RAWDecodingError.truncatedData
+        }
+
+        let overrun: Bool = data.withUnsafeBytes { bytes in
+            var reader = BitReader(UnsafeRawBufferPointer(rebasing: bytes[ORFDecoder.compressedDataHeaderLength...]))
+            // Per colour of a row (even and odd columns): last low part, running average difference, run of small values
+            var carries = [Int](repeating: 0, count: 6)
+
+            for y in 0 ..< height {
+                for i in 0 ..< carries.count {
+                    carries[i] = 0
+                }
+                let row = image.row(y)
+                let above = y >= 2 ? image.row(y - 2) : row
+
+                for x in 0 ..< width {
+                    let c = (x & 1) * 3
+                    let i = carries[c + 2] < 3 ? 2 : 0
+                    let significantBits = UInt16.bitWidth - UInt16(truncatingIfNeeded: carries[c]).leadingZeroBitCount
+                    let lowBitCount = max(2 + i, significantBits - i)
+
+                    reader.refill()
+                    let signAndLow = Int(reader.peek(3))
+                    reader.skip(3)
+                    let sign = -((signAndLow >> 2) & 1)
+
+                    // The high part as a count of leading zeros, or if there are 12 or more, given in full
+                    let window = reader.peek(12)
+                    var high: Int
+                    if window == 0 {
+                        reader.skip(12)
+                        high = Int(reader.peek(16 - lowBitCount)) >> 1
+                        reader.skip(16 - lowBitCount)
+                    } else {
+                        high = window.leadingZeroBitCount - (UInt32.bitWidth - 12)
+                        reader.skip(high + 1)
+                    }
+                    carries[c] = high << lowBitCount | Int(reader.peek(lowBitCount))
+                    reader.skip(lowBitCount)
+
+                    let difference = (carries[c] ^ sign) + carries[c + 1]
+                    carries[c + 1] = (difference * 3 + carries[c + 1]) >> 5
+                    carries[c + 2] = carries[c] > 16 ? 0 : carries[c + 2] + 1
+
+                    let prediction: Int
+                    if y < 2 && x < 2 {
+                        prediction = 0
+                    } else if y < 2 {
+                        prediction = Int(row[x - 2])
+                    } else if x < 2 {
+                        prediction = Int(above[x])
+                    } else {
+                        let west = Int(row[x - 2]), north = Int(above[x]), northWest = Int(above[x - 2])
+                        if (west < northWest && northWest < north) || (north < northWest && northWest < west) {
+                            if abs(west - northWest) > 32 || abs(north - northWest) > 32 {
+                                prediction = west + north - northWest
+                            } else {
+                                prediction = (west + north) >> 1
+                            }
+                        } else {
+                            prediction = abs(west - northWest) > abs(north - northWest) ? west : north
+                        }
+                    }
+                    row[x] = UInt16(min(max(prediction + (difference << 2 | signAndLow & 3), 0), 4095))
+                }
+            }
+            return reader.isOverrun
+        }
+        if overrun {
+            throw RAWDecodingError.truncatedData
+        }
+    }
+
+    /** Uncompressed data: 16 bits per pixel in the file's byte order, rows unpacked concurrently. */
+    private func unpack(_ data: Data, into image: RAWSensorImage) {
+        let width = rendition.width
+        data.withUnsafeBytes { (bytes: UnsafeRawBufferPointer) in
+            let (high, low) = byteOrder == .bigEndian ? (0, 1) : (1, 0)
+            DispatchQueue.concurrentPerform(iterations: rendition.height) { y in
+                let row = image.row(y)
+                let start = y * width * 2
+                for x in 0 ..< width {
+                    row[x] = UInt16(bytes[start + x * 2 + high]) << 8 | UInt16(bytes[start + x * 2 + low])
+                }
+            }
+        }
+    }
+}
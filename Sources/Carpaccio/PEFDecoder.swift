@@ -0,0 +1,149 @@
+//
+//  PEFDecoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Pentax and Ricoh PEF files coded with Pentax's Huffman compression.
+
+ Each pixel is coded as in lossless JPEG, a Huffman coded length then that many bits of difference, from the previous
+ pixel of the same colour in its row, or for the first two columns from the same column two rows above. Unlike the
+ fixed trees of Nikon files, the code is given per file in the maker note (tag 0x220), code by code, and decoded with
+ the same table lookup.
+
+ The stream has no restart points, so it is decoded sequentially on one thread.
+
+ */
+public struct PEFDecoder: RAWDecoder {
+    public enum Tag {
+        /** Black level of each CFA position. */
+        public static let blackPoint: UInt16 = 0x0200
+        /** White balance levels of each CFA position, red, green, green and blue. */
+        public static let whitePoint: UInt16 = 0x0201
+        public static let huffmanTable: UInt16 = 0x0220
+    }
+
+    public enum Compression {
+        public static let pentax = 65535
+    }
+
+    public let source: ImageByteSource
+    let rendition: DNGLayout.Rendition
+    /** Range of the coded data, assumed to be laid out contiguously when in several strips. */
+    let dataRange: Range<Int>
+    public let cfaPattern: CFAPattern
+    let table: HuffmanTable
+    let blackLevel: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource, structure: TIFFStructure) throws {
+        guard let rendition = structure.rawRendition(in: source) ?? structure.firstRawRendition(in: source),
+              let first = rendition.tiles.first, let last = rendition.tiles.last, first.range.lowerBound < last.range.upperBound else {
+            throw RAWDecodingError.noRAWData
+        }
+        guard rendition.compression == Compression.pentax else {
+            throw RAWDecodingError.unsupportedCompression(rendition.compression)
+        }
+        guard let makerNote = structure.makerNoteStructure(prefix: "AOC\0", byteOrderOffset: 4, ifdOffset: 6, relativeToMakerNote: false, in: source),
+              let tableEntry = makerNote.mainIFDs.first?.entry(Tag.huffmanTable) else {
+            throw RAWDecodingError.unsupportedLayout("PEF without a Huffman table")
+        }
+        self.source = source
+        self.rendition = rendition
+        self.dataRange = first.range.lowerBound ..< last.range.upperBound
+        self.cfaPattern = structure.cfaPattern(of: rendition.ifd, in: source) ?? structure.exifCFAPattern(in: source) ?? .rggb
+        self.table = try PEFDecoder.huffmanTable(from: source.bytes(in: tableEntry.valueRange), byteOrder: makerNote.byteOrder)
+
+        func makerNoteValues(_ tag: UInt16) -> [Int] {
+            guard let entry = makerNote.mainIFDs.first?.entry(tag), let values = try? makerNote.intValues(of: entry, in: source) else {
+                return []
+            }
+            return values
+        }
+
+        let blackLevels = makerNoteValues(Tag.blackPoint)
+        self.blackLevel = blackLevels.meanBlackLevel
+
+        let levels = makerNoteValues(Tag.whitePoint)
+        if levels.count == 4, levels.allSatisfy({ $0 > 0 }) {
+            let green = Double(levels[1] + levels[2]) / 2
+            self.whiteBalance = [Double(levels[0]) / green, 1, Double(levels[3]) / green]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    /**
+     The code of a file: the number of codes (less 12, modulo 16), 12 bytes not used here, each code in 16 bits of
+     which the low 12 hold it left aligned, then the length of each code. The symbol of each code is its index, the
+     length of the difference it precedes.
+     */
+    static func huffmanTable(from data: Data, byteOrder: ByteOrder) throws -> HuffmanTable {
+        guard let header = data.uint16(at: 0, byteOrder) else {
+            throw RAWDecodingError.invalidHuffmanTable
+        }
+        let count = (Int(header) + 12) & 15
+        let codes = (0 ..< count).compactMap { data.uint16(at: 14 + $0 * 2, byteOrder).map { Int($0) } }
+        let lengths = (0 ..< count).compactMap { data.uint8(at: 14 + count * 2 + $0).map { Int($0) } }
+        guard codes.count == count, lengths.count == count, lengths.allSatisfy({ $0 > 0 && $0 <= 12 }) else {
+            throw RAWDecodingError.invalidHuffmanTable
+        }
+        return try HuffmanTable(codes: zip(codes, lengths).map { ($0 & 0xFFF) >> (12 - $1) }, lengths: lengths, symbols: Array(0 ..< count))
+    }
+
+    public var size: CGSize {
+        return rendition.size
+    }
+
+    public func decode() throws -> RAWSensorImage {
+        let width = rendition.width, height = rendition.height
+        let bitsPerSample = min(max(rendition.bitsPerSample, 8), 16)
+        let image = try RAWSensorImage(width: width, height: height, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel, whiteLevel: (1 << bitsPerSample) - 1, whiteBalance: whiteBalance)
+        let data = try source.bytes(in: dataRange)
+        let table = self.table
+
+        let overrun: Bool = data.withUnsafeBytes { bytes in
+            var reader = BitReader(bytes)
+            var verticalPredictors = [0, 0, 0, 0]
+            for y in 0 ..< height {
+                let row = image.row(y)
+                var even = 0, odd = 0
+                for x in 0 ..< width {
+                    let difference = table.decodeDifference(&reader)
+                    let value: Int
+                    if x < 2 {
+                        let p = (y & 1) << 1 | x
+                        verticalPredictors[p] += difference
+                        value = verticalPredictors[p]
+                        if x == 0 {
+                            even = value
+                        } else {
+                            odd = value
+                        }
+                    } else if x & 1 == 0 {
+                        even += difference
+                        value = even
+                    } else {
+                        odd += difference
+                        value = odd
+                    }
+                    // Predictors are 16-bit, and wrap around as such
+                    row[x] = UInt16(truncatingIfNeeded: value)
+                }
+            }
+            return reader.isOverrun
+        }
+        if overrun {
+            throw RAWDecodingError.truncatedData
+        }
+        return image
+    }
+}
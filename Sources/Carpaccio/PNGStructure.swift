@@ -0,0 +1,202 @@
+//
+//  PNGStructure.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+public enum PNGStructureError: Swift.Error, LocalizedError {
+    case notPNG
+    case noHeader
+
+    public var errorDescription: String? {
+        switch self {
+        case .notPNG:
+            return "Data does not begin with a PNG signature"
+        case .noHeader:
+            return "PNG file has no valid IHDR chunk"
+        }
+    }
+}
+
+/**
+
+ The chunks of a PNG file, as needed for metadata.
+
+ A PNG file is a signature followed by chunks, each a big endian length, a four character type, the data and a CRC.
+ Metadata lives in a handful of chunks: `IHDR` (dimensions, always first), `eXIf` (a TIFF structure holding EXIF),
+ `iTXt` (among other text, XMP) and `iCCP` / `sRGB` (colour space). Only chunk headers are read while walking the
+ file, seeking over the data of all other chunks, plus the little data of the chunks of interest. Walking stops at
+ the first `IDAT` chunk, as metadata chunks precede the image data, unless asked to look past it for files which
+ put them after it.
+
+ */
+public struct PNGStructure {
+    public typealias Fetch = TIFFStructure.Fetch
+
+    public struct Chunk {
+        public let type: String
+        /** Absolute range of the chunk's data, excluding its length, type and CRC. */
+        public let dataRange: Range<Int>
+    }
+
+    public static let signature: [UInt8] = [0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A]
+    static let xmpKeyword = "XML:com.adobe.xmp"
+
+    public let size: CGSize
+    public let bitDepth: Int
+    public let colorType: Int
+    /** The chunks walked, in file order: up to and including the first `IDAT`, or all of them. */
+    public let chunks: [Chunk]
+    /** Range of the TIFF structure of an `eXIf` chunk. */
+    public let exifRange: Range<Int>?
+    /** Range of the uncompressed XMP packet of an `iTXt` chunk. */
+    public let xmpRange: Range<Int>?
+    /** Name of the ICC profile of an `iCCP` chunk; the zlib compressed profile itself is not inflated. */
+    public let iccProfileName: String?
+    /** Whether an `sRGB` chunk declares the image to be in the sRGB colour space. */
+    public let isSRGB: Bool
+
+    private static let maximumChunkCount = 100_000
+
+    public init(count: Int, stopsAtImageData: Bool = true, fetch: Fetch) throws {
+        guard let header = try fetch(0 ..< min(count, 33)), header.hasPrefix(PNGStructure.signature) else {
+            throw PNGStructureError.notPNG
+        }
+        // IHDR must come first: width, height, bit depth, colour type
+        guard header.count == 33, header.fourCC(at: 12) == "IHDR", let width = header.uint32(at: 16, .bigEndian),
+              let height = header.uint32(at: 20, .bigEndian), let bitDepth = header.uint8(at: 24), let colorType = header.uint8(at: 25),
+              width > 0, height > 0 else {
+            throw PNGStructureError.noHeader
+        }
+        self.size = CGSize(width: Int(width), height: Int(height))
+        self.bitDepth = Int(bitDepth)
+        self.colorType = Int(colorType)
+
+        var chunks = [Chunk]()
+        var exifRange: Range<Int>? = nil, xmpRange: Range<Int>? = nil
+        var iccProfileName: String? = nil
+        var isSRGB = false
+
+        var offset = PNGStructure.signature.count
+        while offset + 12 <= count && chunks.count < PNGStructure.maximumChunkCount {
+            guard let chunkHeader = try fetch(offset ..< (offset + 8)), let length = chunkHeader.uint32(at: 0, .bigEndian).map({ Int($0) }),
+                  let type = chunkHeader.fourCC(at: 4), offset + 12 + length <= count else {
+                break
+            }
+            let dataRange = (offset + 8) ..< (offset + 8 + length)
+            chunks.append(Chunk(type: type, dataRange: dataRange))
+
+            switch type {
+            case "eXIf" where exifRange == nil:
+                // Some writers keep the "Exif\0\0" prefix of the JPEG APP1 segment
+                let prefix = try fetch(dataRange.prefix(6))
+                exifRange = prefix?.hasPrefix(Array("Exif\0\0".utf8)) == true ? dataRange.dropFirst(6) : dataRange
+            case "iTXt" where xmpRange == nil:
+                xmpRange = try PNGStructure.xmpRange(inTextChunk: dataRange, fetch: fetch)
+            case "iCCP" where iccProfileName == nil:
+                iccProfileName = try fetch(dataRange.prefix(80)).flatMap { PNGStructure.nullTerminatedString(in: $0) }
+            case "sRGB":
+                isSRGB = true
+            default:
+                break
+            }
+
+            if type == "IEND" || (type == "IDAT" && stopsAtImageData) {
+                break
+            }
+            offset = dataRange.upperBound + 4
+        }
+
+        self.chunks = chunks
+        self.exifRange = exifRange
+        self.xmpRange = xmpRange
+        self.iccProfileName = iccProfileName
+        self.isSRGB = isSRGB
+    }
+
+    /** The structure of a byte source, parsed once and cached in the source's container cache. */
+    public static func read(from source: ImageByteSource) throws -> PNGStructure {
+        return try source.containerCache.value(forKey: "com.sashimiapp.PNG.structure") {
+            try PNGStructure(count: source.count) { range in
+                guard range.lowerBound >= 0, range.upperBound <= source.count else {
+                    return nil
+                }
+                return try source.bytes(in: range)
+            }
+        }
+    }
+
+    /** PNG files have no embedded previews. */
+    public var previews: [EmbeddedPreview] {
+        return []
+    }
+
+    /** The XMP packet, if stored uncompressed. */
+    public func xmpData(in source: ImageByteSource) throws -> Data? {
+        return try xmpRange.map { try source.bytes(in: $0) }
+    }
+
+    /** Metadata from the header and, if present, the `eXIf` chunk. */
+    public func metadata(in source: ImageByteSource) throws -> ImageMetadata {
+        let colorSpaceName = isSRGB ? CGColorSpace.sRGB as String : nil
+        guard let exifRange = exifRange, let structure = try? TIFFStructure.read(from: source, baseOffset: exifRange.lowerBound), !structure.ifds.isEmpty,
+              let exifMetadata = try? ImageMetadata(tiffStructure: structure, nativeSize: size, in: source) else {
+            return ImageMetadata(nativeSize: size, colorSpaceName: colorSpaceName)
+        }
+        return ImageMetadata(
+            nativeSize: exifMetadata.nativeSize,
+            nativeOrientation: exifMetadata.nativeOrientation,
+            colorSpaceName: colorSpaceName,
+            fNumber: exifMetadata.fNumber,
+            focalLength: exifMetadata.focalLength,
+            focalLength35mmEquivalent: exifMetadata.focalLength35mmEquivalent,
+            iso: exifMetadata.iso,
+            shutterSpeed: exifMetadata.shutterSpeed,
+            cameraMaker: exifMetadata.cameraMaker,
+            cameraModel: exifMetadata.cameraModel,
+            timestamp: exifMetadata.timestamp,
+            lensModel: exifMetadata.lensModel
+        )
+    }
+
+    /**
+     The text of an `iTXt` chunk holding XMP: a null terminated keyword, compression flag and method, then null
+     terminated language tag and translated keyword. `nil` for other keywords, and for compressed text.
+     */
+    static func xmpRange(inTextChunk dataRange: Range<Int>, fetch: Fetch) throws -> Range<Int>? {
+        guard let data = try fetch(dataRange.prefix(256)), PNGStructure.nullTerminatedString(in: data) == xmpKeyword else {
+            return nil
+        }
+        var offset = xmpKeyword.utf8.count + 1
+        guard data.uint8(at: offset) == 0 else {
+            return nil
+        }
+        offset += 2
+        // Language tag and translated keyword
+        for _ in 0 ..< 2 {
+            while let byte = data.uint8(at: offset), byte != 0 {
+                offset += 1
+            }
+            guard offset < data.count else {
+                return nil
+            }
+            offset += 1
+        }
+        return (dataRange.lowerBound + offset) ..< dataRange.upperBound
+    }
+
+    static func nullTerminatedString(in data: Data) -> String? {
+        guard let end = data.firstIndex(of: 0) else {
+            return nil
+        }
+        return String(bytes: data[data.startIndex ..< end], encoding: .isoLatin1)
+    }
+}
+
+extension PNGStructure: NativeImageContainer {
+}
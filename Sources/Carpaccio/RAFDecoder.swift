@@ -0,0 +1,546 @@
+//
+//  RAFDecoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Fujifilm RAF files written with lossless compression ("compressed RAF"), from X-Trans and
+ Bayer sensors.
+
+ The frame is split into vertical stripes 768 pixels wide, each coded on its own: stripes are decoded concurrently,
+ each into its columns of the sensor buffer. Within a stripe, rows are coded in groups of six, as lines of pixels
+ of one colour, and each pixel as a difference from a prediction made from its neighbours on its line and the
+ lines above. Differences are coded adaptively: a unary count of high bits, then a number of low bits given by the
+ average size of recent differences in the same local gradient.
+
+ Uncompressed RAF files, and those with lossy compression, are left to ImageIO.
+
+ */
+public struct RAFDecoder: RAWDecoder {
+    /** Tags of the directory of the RAF header, and of the directory of the sensor data container. */
+    public enum Tag {
+        public static let xTransLayout: UInt16 = 0x0131
+        /** Green, red, green and blue levels. */
+        public static let whiteBalanceLevels: UInt16 = 0x2FF0
+
+        public static let rawIFD: UInt16 = 0xF000
+        public static let stripOffset: UInt16 = 0xF007
+        public static let stripByteCount: UInt16 = 0xF008
+        public static let blackLevels: UInt16 = 0xF00A
+    }
+
+    /** Offsets in the RAF header of the offset and length of its directory, and the offset of the sensor data container. */
+    enum HeaderOffset {
+        static let directory = 92
+        static let container = 100
+        static let end = 108
+    }
+
+    /** The header of compressed sensor data. */
+    public struct CompressedHeader {
+        static let length = 16
+        static let signature: UInt16 = 0x4953
+
+        public let isXTrans: Bool
+        public let bitsPerSample: Int
+        public let width: Int
+        public let height: Int
+        /** Width of each stripe but the last. */
+        public let stripeWidth: Int
+        public let stripeCount: Int
+        /** Number of groups of six rows. */
+        public let lineGroupCount: Int
+
+        init(data: Data) throws {
+            guard let signature = data.uint16(at: 0, .bigEndian), signature == CompressedHeader.signature,
+                  let lossless = data.uint8(at: 2), let rawType = data.uint8(at: 3), let bitsPerSample = data.uint8(at: 4),
+                  let height = data.uint16(at: 5, .bigEndian), let roundedWidth = data.uint16(at: 7, .bigEndian),
+                  let width = data.uint16(at: 9, .bigEndian), let stripeWidth = data.uint16(at: 11, .bigEndian),
+                  let stripeCount = data.uint8(at: 13), let lineGroupCount = data.uint16(at: 14, .bigEndian) else {
+                throw RAWDecodingError.unsupportedLayout("RAF data is not compressed")
+            }
+            guard lossless == 1 else {
+                throw RAWDecodingError.unsupportedLayout("RAF with lossy compression")
+            }
+            guard rawType == 0 || rawType == 16, bitsPerSample == 12 || bitsPerSample == 14, stripeWidth == 0x300,
+                  height > 0, height % 6 == 0, Int(lineGroupCount) == Int(height) / 6,
+                  width > 0, width <= roundedWidth, Int(roundedWidth) == Int(stripeCount) * Int(stripeWidth),
+                  Int(roundedWidth) - Int(width) < Int(stripeWidth) else {
+                throw RAWDecodingError.unsupportedLayout("RAF compressed data header is inconsistent")
+            }
+            self.isXTrans = rawType == 16
+            self.bitsPerSample = Int(bitsPerSample)
+            self.width = Int(width)
+            self.height = Int(height)
+            self.stripeWidth = Int(stripeWidth)
+            self.stripeCount = Int(stripeCount)
+            self.lineGroupCount = Int(lineGroupCount)
+        }
+    }
+
+    public let source: ImageByteSource
+    public let header: CompressedHeader
+    public let cfaPattern: CFAPattern
+    /** Range of the coded data of each stripe. */
+    let stripeRanges: [Range<Int>]
+    let blackLevel: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource) throws {
+        let fileHeader = try source.bytes(in: 0 ..< min(HeaderOffset.end, source.count))
+        guard let directoryOffset = fileHeader.uint32(at: HeaderOffset.directory, .bigEndian).map({ Int($0) }),
+              let directoryLength = fileHeader.uint32(at: HeaderOffset.directory + 4, .bigEndian).map({ Int($0) }),
+              let containerOffset = fileHeader.uint32(at: HeaderOffset.container, .bigEndian).map({ Int($0) }) else {
+            throw RAWDecodingError.noRAWData
+        }
+
+        // The sensor data is described by a TIFF structure, its strip being in a directory of Fujifilm's own tags
+        let container = try TIFFStructure.read(from: source, baseOffset: containerOffset)
+        let rawIFD = container.mainIFDs.first?.entry(Tag.rawIFD)
+            .flatMap { try? container.integerValue(of: $0, in: source) }
+            .flatMap { try? TIFFStructure.read(from: source, baseOffset: containerOffset, byteOrder: container.byteOrder, firstIFDOffset: $0) }
+        let ifds = [rawIFD?.mainIFDs.first, container.mainIFDs.first].compactMap { $0 }
+        func integers(_ tag: UInt16) -> [Int] {
+            for ifd in ifds {
+                if let entry = ifd.entry(tag), let values = try? container.intValues(of: entry, in: source) {
+                    return values
+                }
+            }
+            return []
+        }
+        guard let stripOffset = integers(Tag.stripOffset).first, let stripByteCount = integers(Tag.stripByteCount).first else {
+            throw RAWDecodingError.noRAWData
+        }
+        let (dataOffset, overflow) = containerOffset.addingReportingOverflow(stripOffset)
+        guard !overflow, dataOffset < source.count else {
+            throw RAWDecodingError.truncatedData
+        }
+        let dataRange = dataOffset ..< (dataOffset + min(stripByteCount, source.count - dataOffset))
+        guard dataRange.count > CompressedHeader.length else {
+            throw RAWDecodingError.noRAWData
+        }
+
+        let header = try CompressedHeader(data: source.bytes(in: dataRange.lowerBound ..< (dataRange.lowerBound + CompressedHeader.length)))
+        self.source = source
+        self.header = header
+        self.stripeRanges = try RAFDecoder.stripeRanges(in: dataRange, header: header, source: source)
+
+        let blackLevels = integers(Tag.blackLevels)
+        self.blackLevel = blackLevels.meanBlackLevel
+
+        let directory = (try? RAFDecoder.directory(in: source, range: directoryOffset ..< (directoryOffset + directoryLength))) ?? [:]
+        if let layout = directory[Tag.xTransLayout], layout.count == 36,
+           let pattern = CFAPattern(width: 6, height: 6, tiffValues: layout.reversed().map { Int($0 & 3) }) {
+            // Stored from the last position to the first
+            self.cfaPattern = pattern
+        } else {
+            self.cfaPattern = .rggb
+        }
+        if let levels = directory[Tag.whiteBalanceLevels], let green = levels.uint16(at: 0, .bigEndian),
+           let red = levels.uint16(at: 2, .bigEndian), let blue = levels.uint16(at: 6, .bigEndian), green > 0, red > 0, blue > 0 {
+            self.whiteBalance = [Double(red) / Double(green), 1, Double(blue) / Double(green)]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    /** The entries of the RAF header directory: a count, then tag, length and value of each. */
+    static func directory(in source: ImageByteSource, range: Range<Int>) throws -> [UInt16: Data] {
+        let data = try source.bytes(in: range.clamped(to: 0 ..< source.count))
+        guard let count = data.uint32(at: 0, .bigEndian), count <= 255 else {
+            return [:]
+        }
+        var entries = [UInt16: Data]()
+        var offset = 4
+        for _ in 0 ..< count {
+            guard let tag = data.uint16(at: offset, .bigEndian), let length = data.uint16(at: offset + 2, .bigEndian),
+                  let value = data.subdata(from: offset + 4, count: Int(length)) else {
+                break
+            }
+            entries[tag] = value
+            offset += 4 + Int(length)
+        }
+        return entries
+    }
+
+    /** The stripes follow the header and a table of their sizes, padded to a multiple of 16 bytes. */
+    static func stripeRanges(in dataRange: Range<Int>, header: CompressedHeader, source: ImageByteSource) throws -> [Range<Int>] {
+        let tableOffset = dataRange.lowerBound + CompressedHeader.length
+        let tableLength = (4 * header.stripeCount + 15) & ~15
+        let table = try source.bytes(in: tableOffset ..< min(tableOffset + 4 * header.stripeCount, source.count))
+
+        var ranges = [Range<Int>]()
+        var offset = tableOffset + tableLength
+        for i in 0 ..< header.stripeCount {
+            guard let size = table.uint32(at: i * 4, .bigEndian).map({ Int($0) }), offset <= source.count else {
+                throw RAWDecodingError.truncatedData
+            }
+            // Stripes cut short by the end of the file are read as far as they go, and found truncated when decoded
+            ranges.append(offset ..< (offset + min(size, source.count - offset)))
+            offset += size
+        }
+        return ranges
+    }
+
+    public var size: CGSize {
+        return CGSize(width: header.width, height: header.height)
+    }
+
+    public func decode() throws -> RAWSensorImage {
+        let image = try RAWSensorImage(width: header.width, height: header.height, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel, whiteLevel: (1 << header.bitsPerSample) - 1, whiteBalance: whiteBalance)
+        let parameters = Parameters(header)
+
+        var firstError: Swift.Error? = nil
+        let errorLock = NSLock()
+        DispatchQueue.concurrentPerform(iterations: header.stripeCount) { i in
+            do {
+                let data = try source.bytes(in: stripeRanges[i])
+                let (errors, overrun): (Int, Bool) = data.withUnsafeBytes { bytes in
+                    var reader = BitReader(bytes)
+                    let errors = Stripe(parameters).decode(&reader, index: i, into: image)
+                    return (errors, reader.isOverrun)
+                }
+                if overrun {
+                    throw RAWDecodingError.truncatedData
+                }
+                if errors > 0 {
+                    throw RAWDecodingError.corruptData
+                }
+            } catch {
+                errorLock.lock()
+                firstError = firstError ?? error
+                errorLock.unlock()
+            }
+        }
+        if let error = firstError {
+            throw error
+        }
+        return image
+    }
+}
+
+// MARK: - Stripes
+
+extension RAFDecoder {
+    /** Coding parameters shared by all stripes. */
+    struct Parameters {
+        let isXTrans: Bool
+        let stripeWidth: Int
+        let width: Int
+        let lineGroupCount: Int
+        /** Pixels per line: the pixels of a colour in a row of a stripe, for the colour with the most. */
+        let lineWidth: Int
+        let rawBits: Int
+        let maximumValue: Int
+        let totalValues: Int
+        let escapeLength: Int
+        let initialDifference: Int
+        /** Number of differences after which gradient statistics are halved. */
+        let statisticsWindow = 0x40
+        /** Quantization of differences of neighbours, from -maximumValue to maximumValue, into -4 ... 4. */
+        let quantization: [Int8]
+
+        init(_ header: CompressedHeader) {
+            self.isXTrans = header.isXTrans
+            self.stripeWidth = header.stripeWidth
+            self.width = header.width
+            self.lineGroupCount = header.lineGroupCount
+            self.lineWidth = header.isXTrans ? header.stripeWidth * 2 / 3 : header.stripeWidth / 2
+            self.rawBits = header.bitsPerSample
+            self.maximumValue = (1 << header.bitsPerSample) - 1
+            self.totalValues = 1 << header.bitsPerSample
+            self.escapeLength = (header.bitsPerSample == 14 ? 56 : 48) - header.bitsPerSample - 1
+            self.initialDifference = header.bitsPerSample == 14 ? 256 : 64
+
+            let points = [0x12, 0x43, 0x114]
+            let maximumValue = self.maximumValue
+            self.quantization = (-maximumValue ... maximumValue).map { value -> Int8 in
+                switch value {
+                case ...(-points[2]): return -4
+                case ...(-points[1]): return -3
+                case ...(-points[0]): return -2
+                case ..<0: return -1
+                case 0: return 0
+                case ..<points[0]: return 1
+                case ..<points[1]: return 2
+                case ..<points[2]: return 3
+                default: return 4
+                }
+            }
+        }
+    }
+
+    /** Lines of a stripe: two lines of each colour from the previous group of rows, then those of the current one. */
+    enum Line {
+        static let r0 = 0, r1 = 1, r2 = 2, r3 = 3, r4 = 4
+        static let g0 = 5, g1 = 6, g2 = 7, g3 = 8, g4 = 9, g5 = 10, g6 = 11, g7 = 12
+        static let b0 = 13, b1 = 14, b2 = 15, b3 = 16, b4 = 17
+        static let count = 18
+
+        static let red = r2 ... r4, green = g2 ... g7, blue = b2 ... b4
+    }
+
+    /** Which even positions of an X-Trans line are interpolated from the lines above instead of coded. */
+    enum Interpolation {
+        case never
+        case always
+        /** At even positions with this remainder modulo 4. */
+        case remainder(Int)
+
+        @inline(__always)
+        func applies(at position: Int) -> Bool {
+            switch self {
+            case .never:
+                return false
+            case .always:
+                return true
+            case .remainder(let remainder):
+                return position & 3 == remainder
+            }
+        }
+    }
+
+    /** A pair of lines coded together, sample by sample, and the set of gradient statistics they use. */
+    struct LinePair {
+        let lines: (Int, Int)
+        let gradientSet: Int
+        let interpolations: (Interpolation, Interpolation)
+        let extendedLines: (ClosedRange<Int>, ClosedRange<Int>)
+    }
+
+    /** The pairs of lines of a group of rows, in coding order. */
+    static let linePairs = [
+        LinePair(lines: (Line.r2, Line.g2), gradientSet: 0, interpolations: (.always, .never), extendedLines: (Line.red, Line.green)),
+        LinePair(lines: (Line.g3, Line.b2), gradientSet: 1, interpolations: (.never, .always), extendedLines: (Line.green, Line.blue)),
+        LinePair(lines: (Line.r3, Line.g4), gradientSet: 2, interpolations: (.remainder(0), .never), extendedLines: (Line.red, Line.green)),
+        LinePair(lines: (Line.g5, Line.b3), gradientSet: 0, interpolations: (.never, .remainder(2)), extendedLines: (Line.green, Line.blue)),
+        LinePair(lines: (Line.r4, Line.g6), gradientSet: 1, interpolations: (.remainder(2), .never), extendedLines: (Line.red, Line.green)),
+        LinePair(lines: (Line.g7, Line.b4), gradientSet: 2, interpolations: (.never, .remainder(0)), extendedLines: (Line.green, Line.blue))
+    ]
+
+    /**
+     The decoding state of a stripe: its lines, each with a pixel of border on both sides, and the gradient statistics
+     (sum of recent difference sizes and their count) of each of 41 gradients in three sets, for even and for odd
+     positions. Each stripe has its own, so stripes can be decoded concurrently.
+     */
+    final class Stripe {
+        let parameters: Parameters
+        private let stride: Int
+        private let lines: UnsafeMutablePointer<UInt16>
+        private let gradients: UnsafeMutablePointer<Int>
+        private static let gradientCount = 41
+
+        init(_ parameters: Parameters) {
+            let stride = parameters.lineWidth + 2
+            self.parameters = parameters
+            self.stride = stride
+            self.lines = UnsafeMutablePointer<UInt16>.allocate(capacity: Line.count * stride)
+            self.lines.initialize(repeating: 0, count: Line.count * stride)
+
+            let gradientStateCount = 2 * 3 * Stripe.gradientCount
+            let gradients = UnsafeMutablePointer<Int>.allocate(capacity: gradientStateCount * 2)
+            for i in 0 ..< gradientStateCount {
+                (gradients + i * 2).initialize(to: parameters.initialDifference)
+                (gradients + i * 2 + 1).initialize(to: 1)
+            }
+            self.gradients = gradients
+        }
+
+        deinit {
+            lines.deallocate()
+            gradients.deallocate()
+        }
+
+        /** The first pixel of a line, after its left border. */
+        @inline(__always)
+        private func line(_ index: Int) -> UnsafeMutablePointer<UInt16> {
+            return lines + index * stride + 1
+        }
+
+        @inline(__always)
+        private func gradientSet(_ set: Int, odd: Bool) -> UnsafeMutablePointer<Int> {
+            return gradients + ((odd ? 3 : 0) + set) * Stripe.gradientCount * 2
+        }
+
+        /** Decode stripe `index` of the frame from `codes` into its columns of `image`. Returns the number of invalid codes. */
+        func decode(_ codes: inout BitReader, index: Int, into image: RAWSensorImage) -> Int {
+            let x = index * parameters.stripeWidth
+            let width = min(parameters.stripeWidth, parameters.width - x)
+            var errors = 0
+            for group in 0 ..< parameters.lineGroupCount {
+                errors += decodeLineGroup(&codes)
+                copyLineGroup(group, x: x, width: width, into: image)
+                advance()
+            }
+            return errors
+        }
+
+        private func decodeLineGroup(_ codes: inout BitReader) -> Int {
+            let lineWidth = parameters.lineWidth
+            var errors = 0
+            for pair in RAFDecoder.linePairs {
+                let first = line(pair.lines.0), second = line(pair.lines.1)
+                let interpolations: (Interpolation, Interpolation) = parameters.isXTrans ? pair.interpolations : (.never, .never)
+                let evenGradients = gradientSet(pair.gradientSet, odd: false), oddGradients = gradientSet(pair.gradientSet, odd: true)
+
+                // Odd positions are predicted from their right neighbours too, so lag behind the even ones
+                var even = 0, odd = 1
+                while even < lineWidth || odd < lineWidth {
+                    if even < lineWidth {
+                        if interpolations.0.applies(at: even) {
+                            interpolate(first, at: even)
+                        } else {
+                            errors += decodeSample(&codes, line: first, at: even, gradients: evenGradients)
+                        }
+                        if interpolations.1.applies(at: even) {
+                            interpolate(second, at: even)
+                        } else {
+                            errors += decodeSample(&codes, line: second, at: even, gradients: evenGradients)
+                        }
+                        even += 2
+                    }
+                    if even > 8 {
+                        errors += decodeSample(&codes, line: first, at: odd, gradients: oddGradients)
+                        errors += decodeSample(&codes, line: second, at: odd, gradients: oddGradients)
+                        odd += 2
+                    }
+                }
+                extend(pair.extendedLines.0)
+                extend(pair.extendedLines.1)
+            }
+            return errors
+        }
+
+        /** Four times the prediction of an even position from the line above (b, its neighbours c and d) and the one above that (f). */
+        @inline(__always)
+        private static func evenPrediction(b: Int, c: Int, d: Int, f: Int) -> Int {
+            let cb = abs(c - b), fb = abs(f - b), db = abs(d - b)
+            if cb > fb && cb > db {
+                return f + d + 2 * b
+            }
+            if db > cb && db > fb {
+                return f + c + 2 * b
+            }
+            return d + c + 2 * b
+        }
+
+        @inline(__always)
+        private func interpolate(_ line: UnsafeMutablePointer<UInt16>, at position: Int) {
+            let pixel = line + position
+            let lineWidth = parameters.lineWidth
+            let prediction = Stripe.evenPrediction(b: Int(pixel[-2 - lineWidth]), c: Int(pixel[-3 - lineWidth]),
+                                                   d: Int(pixel[-1 - lineWidth]), f: Int(pixel[-4 - 2 * lineWidth]))
+            pixel[0] = UInt16(prediction >> 2)
+        }
+
+        /** Decode the pixel at `position` of `line`. Returns 1 if its code was invalid, otherwise 0. */
+        @inline(__always)
+        private func decodeSample(_ codes: inout BitReader, line: UnsafeMutablePointer<UInt16>, at position: Int,
+                                  gradients: UnsafeMutablePointer<Int>) -> Int {
+            let pixel = line + position
+            let lineWidth = parameters.lineWidth, maximumValue = parameters.maximumValue
+            let b = Int(pixel[-2 - lineWidth]), c = Int(pixel[-3 - lineWidth]), d = Int(pixel[-1 - lineWidth])
+
+            let grad: Int
+            let prediction: Int
+            if position & 1 == 0 {
+                let f = Int(pixel[-4 - 2 * lineWidth])
+                grad = 9 * Int(parameters.quantization[maximumValue + b - f]) + Int(parameters.quantization[maximumValue + c - b])
+                prediction = Stripe.evenPrediction(b: b, c: c, d: d, f: f) >> 2
+            } else {
+                let a = Int(pixel[-1]), g = Int(pixel[1])
+                grad = 9 * Int(parameters.quantization[maximumValue + b - c]) + Int(parameters.quantization[maximumValue + c - a])
+                prediction = (b > c && b > d) || (b < c && b < d) ? (g + a + 2 * b) >> 2 : (a + g) >> 1
+            }
+
+            // Low bits enough for the average difference size of this gradient
+            let statistics = gradients + abs(grad) * 2
+            var lowBitCount = 0
+            if statistics[1] < statistics[0] {
+                while lowBitCount <= 14 {
+                    lowBitCount += 1
+                    if statistics[1] << lowBitCount >= statistics[0] {
+                        break
+                    }
+                }
+            }
+            // A unary count of the high bits of the code, then its low bits, or if the count is the escape length or
+            // more, the code less one in full
+            let highBits = codes.readZeroRun()
+            let code: Int
+            if highBits < parameters.escapeLength {
+                code = (highBits << lowBitCount) + Int(codes.read(lowBitCount))
+            } else {
+                code = Int(codes.read(parameters.rawBits)) + 1
+            }
+            let invalid = code < 0 || code >= parameters.totalValues ? 1 : 0
+            let difference = code & 1 == 0 ? code / 2 : -1 - code / 2
+
+            statistics[0] += abs(difference)
+            if statistics[1] == parameters.statisticsWindow {
+                statistics[0] >>= 1
+                statistics[1] >>= 1
+            }
+            statistics[1] += 1
+
+            var value = grad < 0 ? prediction - difference : prediction + difference
+            if value < 0 {
+                value += parameters.totalValues
+            } else if value > maximumValue {
+                value -= parameters.totalValues
+            }
+            pixel[0] = UInt16(min(max(value, 0), maximumValue))
+            return invalid
+        }
+
+        /** Set the borders of the lines in `range` from the pixels at the ends of the lines above them. */
+        private func extend(_ range: ClosedRange<Int>) {
+            let lineWidth = parameters.lineWidth
+            for i in range {
+                line(i)[-1] = line(i - 1)[0]
+                line(i)[lineWidth] = line(i - 1)[lineWidth - 1]
+            }
+        }
+
+        /** Copy the six rows of a group of lines into their columns of `image`, each pixel from the line of its colour. */
+        private func copyLineGroup(_ group: Int, x: Int, width: Int, into image: RAWSensorImage) {
+            let cfaPattern = image.cfaPattern
+            for rowInGroup in 0 ..< 6 {
+                let y = group * 6 + rowInGroup
+                let row = image.row(y) + x
+                let red = line(Line.r2 + (rowInGroup >> 1)), green = line(Line.g2 + rowInGroup), blue = line(Line.b2 + (rowInGroup >> 1))
+                for column in 0 ..< width {
+                    // X-Trans lines hold two of each three pixels of a row, Bayer lines every other one
+                    let index = parameters.isXTrans ? (((column * 2 / 3) & ~1) | ((column % 3) & 1)) + ((column % 3) >> 1) : column >> 1
+                    switch cfaPattern.color(x: x + column, y: y) {
+                    case .red:
+                        row[column] = red[index]
+                    case .green:
+                        row[column] = green[index]
+                    case .blue:
+                        row[column] = blue[index]
+                    }
+                }
+            }
+        }
+
+        /** Move the last two lines of each colour up, and clear the current ones, bordered by the lines above them. */
+        private func advance() {
+            for (destination, origin) in [(Line.r0, Line.r3), (Line.r1, Line.r4), (Line.g0, Line.g6), (Line.g1, Line.g7), (Line.b0, Line.b3), (Line.b1, Line.b4)] {
+                (line(destination) - 1).assign(from: line(origin) - 1, count: stride)
+            }
+            for range in [Line.red, Line.green, Line.blue] {
+                (line(range.lowerBound) - 1).assign(repeating: 0, count: range.count * stride)
+                extend(range.lowerBound ... range.lowerBound)
+            }
+        }
+    }
+}
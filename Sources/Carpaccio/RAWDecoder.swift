@@ -0,0 +1,200 @@
+//
+//  RAWDecoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+public enum RAWDecodingError: Swift.Error, LocalizedError {
+    case noRAWData
+    case unsupportedCompression(Int)
+    case unsupportedLayout(String)
+    case invalidHuffmanTable
+    case truncatedData
+    case corruptData
+
+    public var errorDescription: String? {
+        switch self {
+        case .noRAWData:
+            return "File has no RAW sensor data"
+        case .unsupportedCompression(let compression):
+            return "Unsupported RAW data compression \(compression)"
+        case .unsupportedLayout(let description):
+            return "Unsupported RAW data layout: \(description)"
+        case .invalidHuffmanTable:
+            return "Invalid Huffman table"
+        case .truncatedData:
+            return "RAW data ends before the image does"
+        case .corruptData:
+            return "RAW data is corrupt"
+        }
+    }
+}
+
+/**
+ Decodes the sensor data of a RAW file natively, without ImageIO or Core Image. Decoders are made for a particular
+ file by `RAWDecoders.decoder(for:)`, having read its structure, and may decode it several times.
+ */
+public protocol RAWDecoder {
+    /** Width and height of the sensor data. */
+    var size: CGSize { get }
+    var cfaPattern: CFAPattern { get }
+
+    func decode() throws -> RAWSensorImage
+
+    /**
+     Decode the sensor data for an image of at most `maximumPixelDimension`, at a reduced resolution where the format
+     allows decoding one with less work.
+     */
+    func decode(maximumPixelDimension: Int?) throws -> RAWSensorImage
+}
+
+public extension RAWDecoder {
+    func decode(maximumPixelDimension: Int?) throws -> RAWSensorImage {
+        return try decode()
+    }
+
+    /** Whether the decoded data can be rendered for display at `maximumPixelDimension` by binning, known before decoding. */
+    func canRender(maximumPixelDimension: Int?) -> Bool {
+        return RAWSensorImage.canRender(size: size, cfaPattern: cfaPattern, maximumPixelDimension: maximumPixelDimension)
+    }
+}
+
+public enum RAWDecoders {
+    /**
+     The native decoder for `source`, or `nil` if there is none for its format or camera maker. Throws if the file is
+     of a supported kind, but its structure could not be read.
+     */
+    public static func decoder(for source: ImageByteSource) throws -> RAWDecoder? {
+        switch try ImageFormat(source: source) {
+        case .tiff(.standard)?:
+            let structure = try TIFFStructure.read(from: source)
+            guard !DNGLayout.isDNG(structure), let make = structure.make(in: source)?.uppercased() else {
+                return nil
+            }
+            if make.hasPrefix("NIKON") {
+                return try NEFDecoder(source: source, structure: structure)
+            }
+            if make.hasPrefix("PENTAX") || make.hasPrefix("RICOH") {
+                return try PEFDecoder(source: source, structure: structure)
+            }
+            return nil
+        case .tiff(.orf)?:
+            return try ORFDecoder(source: source, structure: TIFFStructure.read(from: source))
+        case .tiff(.rw2)?:
+            return try RW2Decoder(source: source, structure: TIFFStructure.read(from: source))
+        case .raf?:
+            return try RAFDecoder(source: source)
+        case .isoBMFF(brand: "crx ")?:
+            return try CR3Decoder(source: source, structure: ISOBMFFStructure.read(from: source))
+        default:
+            return nil
+        }
+    }
+}
+
+// MARK: - Reading RAW data directories
+
+extension TIFFStructure {
+    func make(in source: ImageByteSource) -> String? {
+        return mainIFDs.first?.entry(Tag.make).flatMap { try? stringValue(of: $0, in: source) }
+    }
+
+    /** The directory of the full size sensor data: the largest image stored as a colour filter array. */
+    func rawRendition(in source: ImageByteSource) -> DNGLayout.Rendition? {
+        return ifds.filter { $0.kind != .exif }
+            .compactMap { try? DNGLayout.rendition(of: $0, in: self, source: source) }
+            .filter { $0.photometricInterpretation == DNGLayout.PhotometricInterpretation.colorFilterArray && !$0.tiles.isEmpty }
+            .max { Double($0.width) * Double($0.height) < Double($1.width) * Double($1.height) }
+    }
+
+    /**
+     The directory of the sensor data of formats which keep it in IFD0, not always saying that it is stored as a colour
+     filter array (ORF, PEF).
+     */
+    func firstRawRendition(in source: ImageByteSource) -> DNGLayout.Rendition? {
+        return mainIFDs.first.flatMap { try? DNGLayout.rendition(of: $0, in: self, source: source) }.flatMap { $0.tiles.isEmpty ? nil : $0 }
+    }
+
+    /** The colour filter array pattern given by the `CFARepeatPatternDim` and `CFAPattern` tags of a directory. */
+    func cfaPattern(of ifd: TIFFIFD, in source: ImageByteSource) -> CFAPattern? {
+        guard let dimensionsEntry = ifd.entry(Tag.cfaRepeatPatternDim), let patternEntry = ifd.entry(Tag.cfaPattern),
+              let dimensions = try? intValues(of: dimensionsEntry, in: source), dimensions.count == 2,
+              let pattern = try? intValues(of: patternEntry, in: source) else {
+            return nil
+        }
+        // CFARepeatPatternDim is rows, then columns
+        return CFAPattern(width: dimensions[1], height: dimensions[0], tiffValues: pattern)
+    }
+
+    /**
+     The colour filter array pattern given by the Exif `CFAPattern` tag: columns and rows as 16-bit values, then the
+     colour of each position. Some cameras write the dimensions in the other byte order than the file's.
+     */
+    func exifCFAPattern(in source: ImageByteSource) -> CFAPattern? {
+        guard let entry = exifIFD?.entry(Tag.exifCFAPattern), let data = try? source.bytes(in: entry.valueRange), data.count > 4 else {
+            return nil
+        }
+        for order in [byteOrder, byteOrder == .bigEndian ? ByteOrder.littleEndian : .bigEndian] {
+            if let columns = data.uint16(at: 0, order), let rows = data.uint16(at: 2, order), Int(columns) * Int(rows) == data.count - 4 {
+                return CFAPattern(width: Int(columns), height: Int(rows), tiffValues: data.dropFirst(4).map { Int($0) })
+            }
+        }
+        return nil
+    }
+
+    /**
+     The TIFF structure of the maker note of a file, for maker notes which hold one after a header of `headerLength`
+     bytes beginning with `prefix` (Nikon: "Nikon\0", then a version and the TIFF header at byte 10).
+     */
+    func makerNoteStructure(prefix: String, headerLength: Int, in source: ImageByteSource) -> TIFFStructure? {
+        guard let entry = exifIFD?.entry(Tag.makerNote), entry.byteCount > headerLength,
+              let header = try? source.bytes(in: entry.valueOffset ..< (entry.valueOffset + headerLength)), header.hasPrefix(Array(prefix.utf8)) else {
+            return nil
+        }
+        return try? TIFFStructure.read(from: source, baseOffset: entry.valueOffset + headerLength)
+    }
+
+    /**
+     The directory structure of a maker note without a TIFF header of its own: one beginning with `prefix`, with a
+     byte order mark at `byteOrderOffset` (the file's byte order applying where there is none) and its directory at
+     `ifdOffset`. Offsets within are relative to the maker note if `relativeToMakerNote`, otherwise to the file
+     (Pentax: "AOC\0", byte order at 4, directory at 6, relative to the file; Olympus: "OLYMPUS\0", byte order at 8,
+     directory at 12, relative to the maker note).
+     */
+    func makerNoteStructure(prefix: String, byteOrderOffset: Int, ifdOffset: Int, relativeToMakerNote: Bool, in source: ImageByteSource) -> TIFFStructure? {
+        guard let entry = exifIFD?.entry(Tag.makerNote), entry.byteCount > ifdOffset,
+              let header = try? source.bytes(in: entry.valueOffset ..< (entry.valueOffset + ifdOffset)), header.hasPrefix(Array(prefix.utf8)) else {
+            return nil
+        }
+        let makerNoteByteOrder: ByteOrder
+        if header.hasPrefix([0x49, 0x49], at: byteOrderOffset) {
+            makerNoteByteOrder = .littleEndian
+        } else if header.hasPrefix([0x4D, 0x4D], at: byteOrderOffset) {
+            makerNoteByteOrder = .bigEndian
+        } else {
+            makerNoteByteOrder = byteOrder
+        }
+        let base = relativeToMakerNote ? entry.valueOffset : baseOffset
+        return try? TIFFStructure.read(from: source, baseOffset: base, byteOrder: makerNoteByteOrder, firstIFDOffset: entry.valueOffset + ifdOffset - base)
+    }
+}
+
+// MARK: - Black levels
+
+extension Array where Element == Int {
+    /**
+     The mean of per channel black levels, rounded down, or 0 for none. Quotients and remainders are summed apart, so
+     that the levels of a damaged file cannot overflow the sum.
+     */
+    var meanBlackLevel: Int {
+        guard !isEmpty else {
+            return 0
+        }
+        return reduce(0) { $0 + $1 / count } + reduce(0) { $0 + $1 % count } / count
+    }
+}
@@ -0,0 +1,310 @@
+//
+//  RAWSensorImage.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/** The colour filter array layout of a sensor: the colour of each position of a pattern repeated across it. */
+public struct CFAPattern: Equatable {
+    public enum Color: UInt8 {
+        case red = 0
+        case green = 1
+        case blue = 2
+    }
+
+    public let width: Int
+    public let height: Int
+    /** Colour of each position of the pattern, row by row. */
+    public let colors: [Color]
+    /**
+     Side of the smallest square blocks, laid out from the top left corner, which all hold each colour at least once:
+     2 for Bayer patterns, 3 for X-Trans.
+     */
+    public let cellSize: Int
+
+    public init?(width: Int, height: Int, colors: [Color]) {
+        let (cellCount, overflow) = width.multipliedReportingOverflow(by: height)
+        guard width > 0, height > 0, !overflow, colors.count == cellCount else {
+            return nil
+        }
+        self.width = width
+        self.height = height
+        self.colors = colors
+
+        // Blocks of a given size start at the same positions of the pattern again after `width` and `height` blocks
+        guard let cellSize = (1 ... max(width, height)).first(where: { size in
+            (0 ..< height).allSatisfy { blockY in
+                (0 ..< width).allSatisfy { blockX in
+                    var seen = Set<Color>()
+                    for y in (blockY * size) ..< ((blockY + 1) * size) {
+                        for x in (blockX * size) ..< ((blockX + 1) * size) {
+                            seen.insert(colors[(y % height) * width + x % width])
+                        }
+                    }
+                    return seen.count == 3
+                }
+            }
+        }) else {
+            return nil
+        }
+        self.cellSize = cellSize
+    }
+
+    /** A pattern from the values of the TIFF / EP `CFAPattern` tag: 0 for red, 1 for green, 2 for blue. */
+    public init?(width: Int, height: Int, tiffValues: [Int]) {
+        let colors = tiffValues.compactMap { UInt8(exactly: $0).flatMap(Color.init(rawValue:)) }
+        guard colors.count == tiffValues.count else {
+            return nil
+        }
+        self.init(width: width, height: height, colors: colors)
+    }
+
+    public static let rggb = CFAPattern(width: 2, height: 2, colors: [.red, .green, .green, .blue])!
+    public static let bggr = CFAPattern(width: 2, height: 2, colors: [.blue, .green, .green, .red])!
+    public static let grbg = CFAPattern(width: 2, height: 2, colors: [.green, .red, .blue, .green])!
+    public static let gbrg = CFAPattern(width: 2, height: 2, colors: [.green, .blue, .red, .green])!
+
+    public func color(x: Int, y: Int) -> Color {
+        return colors[(y % height) * width + x % width]
+    }
+}
+
+/**
+
+ The sensor data of a RAW file, as decoded by a `RAWDecoder`: one value per pixel, before demosaicing.
+
+ Pixels are kept in a single buffer allocated up front, which decoders write rows or blocks of from several threads
+ at once; no two threads may write the same pixel.
+
+ */
+public final class RAWSensorImage {
+    public let width: Int
+    public let height: Int
+    public let cfaPattern: CFAPattern
+    public let blackLevel: Int
+    public let whiteLevel: Int
+    /** Multipliers for red, green and blue, green being 1. */
+    public let whiteBalance: [Double]
+    /** Pixel values, row by row. */
+    public let pixels: UnsafeMutableBufferPointer<UInt16>
+
+    /** Allocate an image of `width` by `height` pixels, all zero. Throws if the dimensions give no valid pixel count. */
+    public init(width: Int, height: Int, cfaPattern: CFAPattern, blackLevel: Int = 0, whiteLevel: Int, whiteBalance: [Double] = [1, 1, 1]) throws {
+        let pixelCount = try RAWSensorImage.pixelCount(width: width, height: height)
+        self.width = width
+        self.height = height
+        self.cfaPattern = cfaPattern
+        self.blackLevel = blackLevel
+        self.whiteLevel = whiteLevel
+        self.whiteBalance = whiteBalance.count == 3 ? whiteBalance : [1, 1, 1]
+        self.pixels = UnsafeMutableBufferPointer<UInt16>.allocate(capacity: pixelCount)
+        self.pixels.initialize(repeating: 0)
+    }
+
+    /**
+     The number of pixels of a sensor of `width` by `height`, for decoders to check against the size of their data
+     before allocating an image. Throws `RAWDecodingError.corruptData` for dimensions which are not positive, or
+     whose product overflows.
+     */
+    public static func pixelCount(width: Int, height: Int) throws -> Int {
+        let (pixelCount, overflow) = width.multipliedReportingOverflow(by: height)
+        guard width > 0, height > 0, !overflow else {
+            throw RAWDecodingError.corruptData
+        }
+        return pixelCount
+    }
+
+    deinit {
+        pixels.deallocate()
+    }
+
+    /** The first pixel of row `y`, for decoders to write the row through. */
+    public func row(_ y: Int) -> UnsafeMutablePointer<UInt16> {
+        return pixels.baseAddress! + y * width
+    }
+
+    public subscript(x: Int, y: Int) -> UInt16 {
+        return pixels[y * width + x]
+    }
+
+    // MARK: Rendering
+
+    /**
+     Render the sensor data for display, no larger than needed for `maximumPixelDimension` (the longer side): binned
+     when that is at most the number of CFA cells across, half the sensor resolution for Bayer sensors, otherwise
+     demosaiced at full resolution. With no `maximumPixelDimension`, full resolution.
+     */
+    public func rgbImage(maximumPixelDimension: Int?) -> CGImage? {
+        let cells = max(width, height) / cfaPattern.cellSize
+        if let maximum = maximumPixelDimension, maximum > 0, maximum <= cells {
+            return binnedImage(factor: cells / maximum)
+        }
+        return demosaicedImage()
+    }
+
+    /**
+     Whether `rgbImage(maximumPixelDimension:)` renders sensor data of a given size and pattern by binning, before
+     decoding it. Larger sizes need the full resolution demosaic.
+     */
+    public static func canRender(size: CGSize, cfaPattern: CFAPattern, maximumPixelDimension: Int?) -> Bool {
+        guard let maximum = maximumPixelDimension, maximum > 0 else {
+            return false
+        }
+        return maximum <= Int(max(size.width, size.height)) / cfaPattern.cellSize
+    }
+
+    /**
+     Demosaic by binning: each output pixel averages the red, green and blue pixels of a block of
+     `cfaPattern.cellSize * factor` pixels square, giving half resolution for Bayer sensors at `factor` 1. Rows of
+     output are rendered concurrently.
+
+     Values are black subtracted, scaled to the white level, white balanced and mapped through the sRGB tone curve.
+     No camera colour matrix is applied: this is for previews, not for editing.
+     */
+    public func binnedImage(factor: Int = 1) -> CGImage? {
+        let block = cfaPattern.cellSize * max(1, factor)
+        let patternColors = cfaPattern.colors.map { Int($0.rawValue) }
+        let patternWidth = cfaPattern.width, patternHeight = cfaPattern.height
+        let tone = ToneMapper(self)
+
+        return RAWSensorImage.makeImage(width: width / block, height: height / block) { outputY, outputRow in
+            for outputX in 0 ..< (self.width / block) {
+                var sums: (UInt32, UInt32, UInt32) = (0, 0, 0), counts: (UInt32, UInt32, UInt32) = (0, 0, 0)
+                for y in (outputY * block) ..< ((outputY + 1) * block) {
+                    let row = self.row(y)
+                    let colorRow = (y % patternHeight) * patternWidth
+                    for x in (outputX * block) ..< ((outputX + 1) * block) {
+                        let value = UInt32(row[x])
+                        switch patternColors[colorRow + x % patternWidth] {
+                        case 0:
+                            sums.0 += value
+                            counts.0 += 1
+                        case 1:
+                            sums.1 += value
+                            counts.1 += 1
+                        default:
+                            sums.2 += value
+                            counts.2 += 1
+                        }
+                    }
+                }
+                let pixel = outputRow + outputX * 4
+                pixel[0] = tone(Float(sums.0) / Float(max(counts.0, 1)), 0)
+                pixel[1] = tone(Float(sums.1) / Float(max(counts.1, 1)), 1)
+                pixel[2] = tone(Float(sums.2) / Float(max(counts.2, 1)), 2)
+                pixel[3] = 255
+            }
+        }
+    }
+
+    /**
+     Demosaic at full resolution: the missing colours of each pixel are the averages of the pixels of those colours
+     among its eight neighbours, which for Bayer sensors is bilinear interpolation. Rows are rendered concurrently;
+     interior pixels read their neighbours at fixed offsets, without bounds checks. Returns `nil` for patterns where
+     some pixel has no neighbour of some colour.
+     */
+    public func demosaicedImage() -> CGImage? {
+        let width = self.width, height = self.height
+        let patternWidth = cfaPattern.width, patternHeight = cfaPattern.height
+        let positionCount = patternWidth * patternHeight
+
+        // For each position of the pattern and each colour, the neighbours of that colour
+        var neighbours = [[(dx: Int, dy: Int)]](repeating: [], count: positionCount * 3)
+        for py in 0 ..< patternHeight {
+            for px in 0 ..< patternWidth {
+                let own = Int(cfaPattern.color(x: px, y: py).rawValue)
+                neighbours[(py * patternWidth + px) * 3 + own] = [(0, 0)]
+                for dy in -1 ... 1 {
+                    for dx in -1 ... 1 where dx != 0 || dy != 0 {
+                        let color = Int(cfaPattern.color(x: px + dx + patternWidth, y: py + dy + patternHeight).rawValue)
+                        if color != own {
+                            neighbours[(py * patternWidth + px) * 3 + color].append((dx, dy))
+                        }
+                    }
+                }
+            }
+        }
+        guard !neighbours.contains(where: { $0.isEmpty }) else {
+            return nil
+        }
+        let offsets = neighbours.map { $0.map { $0.dy * width + $0.dx } }
+        let reciprocals = neighbours.map { 1 / Float($0.count) }
+        let tone = ToneMapper(self)
+
+        return RAWSensorImage.makeImage(width: width, height: height) { y, outputRow in
+            let row = self.row(y)
+            let patternRow = (y % patternHeight) * patternWidth
+            let isInteriorRow = y > 0 && y < height - 1
+            for x in 0 ..< width {
+                let position = (patternRow + x % patternWidth) * 3
+                let pixel = outputRow + x * 4
+                for channel in 0 ..< 3 {
+                    var sum: UInt32 = 0
+                    if isInteriorRow && x > 0 && x < width - 1 {
+                        for offset in offsets[position + channel] {
+                            sum += UInt32(row[x + offset])
+                        }
+                    } else {
+                        for (dx, dy) in neighbours[position + channel] {
+                            sum += UInt32(self[min(max(x + dx, 0), width - 1), min(max(y + dy, 0), height - 1)])
+                        }
+                    }
+                    pixel[channel] = tone(Float(sum) * reciprocals[position + channel], channel)
+                }
+                pixel[3] = 255
+            }
+        }
+    }
+
+    /** Maps sensor values of a channel to 8-bit sRGB: black subtraction, white level, white balance and tone curve. */
+    private struct ToneMapper {
+        let black: Float
+        let scales: [Float]
+
+        init(_ image: RAWSensorImage) {
+            let scale = 1.0 / Float(max(1, image.whiteLevel - image.blackLevel))
+            self.black = Float(image.blackLevel)
+            self.scales = image.whiteBalance.map { Float($0) * scale * Float(RAWSensorImage.toneCurve.count - 1) }
+        }
+
+        @inline(__always)
+        func callAsFunction(_ value: Float, _ channel: Int) -> UInt8 {
+            let level = (value - black) * scales[channel]
+            return RAWSensorImage.toneCurve[Int(min(max(level, 0), Float(RAWSensorImage.toneCurve.count - 1)))]
+        }
+    }
+
+    /** An 8-bit sRGB image, its rows rendered concurrently by `renderRow` (given the row and its first byte). */
+    private static func makeImage(width: Int, height: Int, renderRow: (Int, UnsafeMutablePointer<UInt8>) -> Void) -> CGImage? {
+        guard width > 0, height > 0, let colorSpace = CGColorSpace(name: CGColorSpace.sRGB) else {
+            return nil
+        }
+        let bytesPerRow = width * 4
+        var bitmap = Data(count: bytesPerRow * height)
+        bitmap.withUnsafeMutableBytes { (output: UnsafeMutableRawBufferPointer) in
+            let output = output.bindMemory(to: UInt8.self)
+            DispatchQueue.concurrentPerform(iterations: height) { y in
+                renderRow(y, output.baseAddress! + y * bytesPerRow)
+            }
+        }
+
+        guard let provider = CGDataProvider(data: bitmap as CFData) else {
+            return nil
+        }
+        return CGImage(width: width, height: height, bitsPerComponent: 8, bitsPerPixel: 32, bytesPerRow: bytesPerRow,
+                       space: colorSpace, bitmapInfo: CGBitmapInfo(rawValue: CGImageAlphaInfo.noneSkipLast.rawValue),
+                       provider: provider, decode: nil, shouldInterpolate: true, intent: .defaultIntent)
+    }
+
+    /** The sRGB transfer function, from linear values in 4096 steps to 8-bit output. */
+    static let toneCurve: [UInt8] = (0 ..< 4096).map { i in
+        let linear = Double(i) / 4095
+        let encoded = linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1 / 2.4) - 0.055
+        return UInt8(min(max(encoded * 255 + 0.5, 0), 255))
+    }
+}
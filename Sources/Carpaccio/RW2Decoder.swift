@@ -0,0 +1,283 @@
+//
+//  RW2Decoder.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+/**
+
+ Decodes the sensor data of Panasonic RW2 and Leica RWL files.
+
+ Panasonic packs the data into blocks of 0x4000 bytes, stored rotated: the block's bytes from a split offset onwards
+ come first in the file. Each block holds 1024 packets of 16 bytes, and each packet a fixed number of pixels coded
+ without reference to any other packet, so blocks are unpacked concurrently, each straight into its part of the
+ sensor buffer.
+
+ - Raw format 1 to 4 ("v4") packs 14 pixels per packet with an adaptive scheme of 8-bit deltas and shifts. A packet
+   is read as a 128-bit little endian integer from the top down, kept in two 64-bit registers.
+ - Raw format 5 ("v5") packs 10 12-bit or 9 14-bit pixels per packet, least significant bit first. All pixels of a
+   packet are extracted at once with SIMD byte shuffles, shifts and masks.
+
+ Later formats (6 and 7, of the S and GH6 series onwards) are not supported.
+
+ */
+public struct RW2Decoder: RAWDecoder {
+    public enum Tag {
+        public static let sensorWidth: UInt16 = 0x0002
+        public static let sensorHeight: UInt16 = 0x0003
+        public static let cfaPattern: UInt16 = 0x0009
+        public static let bitsPerSample: UInt16 = 0x000A
+        public static let linearityLimitRed: UInt16 = 0x000E
+        public static let blackLevelRed: UInt16 = 0x001C
+        public static let blackLevelGreen: UInt16 = 0x001D
+        public static let blackLevelBlue: UInt16 = 0x001E
+        public static let whiteBalanceRedLevel: UInt16 = 0x0024
+        public static let whiteBalanceGreenLevel: UInt16 = 0x0025
+        public static let whiteBalanceBlueLevel: UInt16 = 0x0026
+        public static let rawFormat: UInt16 = 0x002D
+        public static let rawDataOffset: UInt16 = 0x0118
+    }
+
+    static let blockSize = 0x4000
+    static let bytesPerPacket = 16
+    static let packetsPerBlock = blockSize / bytesPerPacket
+
+    public let source: ImageByteSource
+    public let width: Int
+    public let height: Int
+    public let rawFormat: Int
+    public let bitsPerSample: Int
+    public let cfaPattern: CFAPattern
+    /** Range of the packed data, from its start to the end of the file. */
+    let dataRange: Range<Int>
+    let blackLevel: Int
+    let whiteLevel: Int
+    let whiteBalance: [Double]
+
+    public init(source: ImageByteSource, structure: TIFFStructure) throws {
+        guard let ifd0 = structure.mainIFDs.first else {
+            throw RAWDecodingError.noRAWData
+        }
+        func integer(_ tag: UInt16) -> Int? {
+            return ifd0.entry(tag).flatMap { try? structure.integerValue(of: $0, in: source) }
+        }
+
+        guard let width = integer(Tag.sensorWidth), let height = integer(Tag.sensorHeight), width > 0, height > 0,
+              let offset = integer(Tag.rawDataOffset) ?? integer(TIFFStructure.Tag.stripOffsets), offset < source.count else {
+            throw RAWDecodingError.noRAWData
+        }
+        self.source = source
+        self.width = width
+        self.height = height
+        self.rawFormat = integer(Tag.rawFormat) ?? 4
+        self.bitsPerSample = integer(Tag.bitsPerSample) ?? 12
+        self.dataRange = offset ..< source.count
+
+        switch rawFormat {
+        case 1 ... 4:
+            guard width % 14 == 0 else {
+                throw RAWDecodingError.unsupportedLayout("RW2 width \(width) is not a whole number of packets")
+            }
+        case 5:
+            guard bitsPerSample == 12 || bitsPerSample == 14, width % (128 / bitsPerSample) == 0 else {
+                throw RAWDecodingError.unsupportedLayout("RW2 raw format 5 with \(bitsPerSample) bits per sample, width \(width)")
+            }
+        default:
+            throw RAWDecodingError.unsupportedCompression(rawFormat)
+        }
+
+        switch integer(Tag.cfaPattern) {
+        case 2?:
+            self.cfaPattern = .grbg
+        case 3?:
+            self.cfaPattern = .gbrg
+        case 4?:
+            self.cfaPattern = .bggr
+        default:
+            self.cfaPattern = .rggb
+        }
+
+        let blackLevels = [Tag.blackLevelRed, Tag.blackLevelGreen, Tag.blackLevelBlue].compactMap { integer($0) }
+        self.blackLevel = blackLevels.meanBlackLevel
+        self.whiteLevel = integer(Tag.linearityLimitRed) ?? (1 << bitsPerSample) - 1
+
+        if let red = integer(Tag.whiteBalanceRedLevel), let green = integer(Tag.whiteBalanceGreenLevel), let blue = integer(Tag.whiteBalanceBlueLevel),
+           red > 0, green > 0, blue > 0 {
+            self.whiteBalance = [Double(red) / Double(green), 1, Double(blue) / Double(green)]
+        } else {
+            self.whiteBalance = [1, 1, 1]
+        }
+    }
+
+    public var size: CGSize {
+        return CGSize(width: width, height: height)
+    }
+
+    /** Byte offset at which each block is split: its bytes from there on come first in the file. */
+    var splitOffset: Int {
+        return rawFormat == 5 ? 0x1FF8 : 0x2008
+    }
+
+    var pixelsPerPacket: Int {
+        return rawFormat == 5 ? 128 / bitsPerSample : 14
+    }
+
+    public func decode() throws -> RAWSensorImage {
+        // Check that the data holds every packet before allocating the image
+        let pixelsPerPacket = self.pixelsPerPacket
+        let packetCount = try RAWSensorImage.pixelCount(width: width, height: height) / pixelsPerPacket
+        let (byteCount, overflow) = packetCount.multipliedReportingOverflow(by: RW2Decoder.bytesPerPacket)
+        guard !overflow, dataRange.count >= byteCount else {
+            throw RAWDecodingError.truncatedData
+        }
+        let blockCount = (packetCount + RW2Decoder.packetsPerBlock - 1) / RW2Decoder.packetsPerBlock
+
+        let image = try RAWSensorImage(width: width, height: height, cfaPattern: cfaPattern,
+                                       blackLevel: blackLevel, whiteLevel: whiteLevel, whiteBalance: whiteBalance)
+
+        let data = try source.bytes(in: dataRange)
+        let layout = rawFormat == 5 ? RW2Decoder.PacketLayout(bitsPerSample: bitsPerSample) : nil
+        let splitOffset = self.splitOffset
+
+        data.withUnsafeBytes { (bytes: UnsafeRawBufferPointer) in
+            DispatchQueue.concurrentPerform(iterations: blockCount) { blockIndex in
+                var block = [UInt8](repeating: 0, count: RW2Decoder.blockSize)
+                RW2Decoder.unrotate(block: blockIndex, of: bytes, splitOffset: splitOffset, into: &block)
+
+                let firstPacket = blockIndex * RW2Decoder.packetsPerBlock
+                let packets = min(RW2Decoder.packetsPerBlock, packetCount - firstPacket)
+                block.withUnsafeBytes { block in
+                    for i in 0 ..< packets {
+                        let packet = UnsafeRawBufferPointer(rebasing: block[(i * RW2Decoder.bytesPerPacket) ..< ((i + 1) * RW2Decoder.bytesPerPacket)])
+                        let output = image.pixels.baseAddress! + (firstPacket + i) * pixelsPerPacket
+                        if let layout = layout {
+                            RW2Decoder.unpackPacket(packet, layout: layout, into: output)
+                        } else {
+                            RW2Decoder.decodeAdaptivePacket(packet, into: output)
+                        }
+                    }
+                }
+            }
+        }
+        return image
+    }
+
+    /** Copy a block into `block` in the order it is coded in, undoing the rotation at `splitOffset`. */
+    static func unrotate(block index: Int, of bytes: UnsafeRawBufferPointer, splitOffset: Int, into block: inout [UInt8]) {
+        let start = index * blockSize
+        let available = min(blockSize, bytes.count - start)
+        let head = min(available, blockSize - splitOffset)
+        for i in 0 ..< head {
+            block[splitOffset + i] = bytes[start + i]
+        }
+        for i in 0 ..< (available - head) {
+            block[i] = bytes[start + head + i]
+        }
+    }
+
+    // MARK: Raw formats 1 to 4
+
+    /**
+     Decode a packet of 14 pixels, two interleaved colours each coded as a first value followed by 8-bit deltas,
+     scaled by a shift given every third pixel.
+     */
+    @inline(__always)
+    static func decodeAdaptivePacket(_ packet: UnsafeRawBufferPointer, into output: UnsafeMutablePointer<UInt16>) {
+        var low = UInt64(littleEndian: packet.load(fromByteOffset: 0, as: UInt64.self))
+        var high = UInt64(littleEndian: packet.load(fromByteOffset: 8, as: UInt64.self))
+
+        @inline(__always)
+        func bits(_ count: Int) -> Int {
+            let value = Int(high >> UInt64(64 - count))
+            high = high << UInt64(count) | low >> UInt64(64 - count)
+            low <<= UInt64(count)
+            return value
+        }
+
+        var predictions = (0, 0), nonzero = (0, 0)
+        var shift = 0
+        for i in 0 ..< 14 {
+            if i % 3 == 2 {
+                shift = 4 >> (3 - bits(2))
+            }
+            var prediction = i & 1 == 0 ? predictions.0 : predictions.1
+            let first = i & 1 == 0 ? nonzero.0 : nonzero.1
+            if first != 0 {
+                let delta = bits(8)
+                if delta != 0 {
+                    prediction -= 0x80 << shift
+                    if prediction < 0 || shift == 4 {
+                        prediction &= (1 << shift) - 1
+                    }
+                    prediction += delta << shift
+                }
+            } else {
+                let value = bits(8)
+                if i & 1 == 0 {
+                    nonzero.0 = value
+                } else {
+                    nonzero.1 = value
+                }
+                if value != 0 || i > 11 {
+                    prediction = value << 4 | bits(4)
+                }
+            }
+            if i & 1 == 0 {
+                predictions.0 = prediction
+            } else {
+                predictions.1 = prediction
+            }
+            output[i] = UInt16(clamping: prediction)
+        }
+    }
+
+    // MARK: Raw format 5
+
+    /** Where each pixel of a packet lies: the three bytes spanning it, and its shift within them. */
+    struct PacketLayout {
+        let pixelsPerPacket: Int
+        let firstBytes: SIMD16<UInt8>
+        let secondBytes: SIMD16<UInt8>
+        let thirdBytes: SIMD16<UInt8>
+        let shifts: SIMD16<UInt32>
+        let mask: SIMD16<UInt32>
+
+        init(bitsPerSample: Int) {
+            var firstBytes = SIMD16<UInt8>(), secondBytes = SIMD16<UInt8>(), thirdBytes = SIMD16<UInt8>()
+            var shifts = SIMD16<UInt32>()
+            self.pixelsPerPacket = 128 / bitsPerSample
+            for pixel in 0 ..< pixelsPerPacket {
+                let bit = pixel * bitsPerSample
+                firstBytes[pixel] = UInt8(bit / 8)
+                secondBytes[pixel] = UInt8(min(bit / 8 + 1, 15))
+                thirdBytes[pixel] = UInt8(min(bit / 8 + 2, 15))
+                shifts[pixel] = UInt32(bit % 8)
+            }
+            self.firstBytes = firstBytes
+            self.secondBytes = secondBytes
+            self.thirdBytes = thirdBytes
+            self.shifts = shifts
+            self.mask = SIMD16(repeating: UInt32(1 << bitsPerSample - 1))
+        }
+    }
+
+    /** Extract the pixels of a packet, least significant bits first, all at once. */
+    @inline(__always)
+    static func unpackPacket(_ packet: UnsafeRawBufferPointer, layout: PacketLayout, into output: UnsafeMutablePointer<UInt16>) {
+        var bytes = SIMD16<UInt8>()
+        withUnsafeMutableBytes(of: &bytes) { $0.copyMemory(from: packet) }
+
+        let windows = SIMD16<UInt32>(truncatingIfNeeded: bytes[layout.firstBytes])
+            | SIMD16<UInt32>(truncatingIfNeeded: bytes[layout.secondBytes]) &<< 8
+            | SIMD16<UInt32>(truncatingIfNeeded: bytes[layout.thirdBytes]) &<< 16
+        let values = SIMD16<UInt16>(truncatingIfNeeded: (windows &>> layout.shifts) & layout.mask)
+        for pixel in 0 ..< layout.pixelsPerPacket {
+            output[pixel] = values[pixel]
+        }
+    }
+}
@@ -0,0 +1,112 @@
+//
+//  ReadAccessHint.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ Hints about how a file is about to be read, passed on to the kernel.
+
+ On Linux these map directly to `posix_fadvise`. Darwin has no `posix_fadvise`, so the nearest equivalents are used:
+ read-ahead, read advisories and cache bypass via `fcntl` for file descriptors, and `madvise` for memory mappings.
+
+ Hints are applied with `apply(to:range:)` before reading. `.dontNeed` is the exception on Linux, where the page cache
+ can only be told to drop data once it has been read: readers also call `applyAfterReading(to:range:)` when done.
+
+ */
+public enum ReadAccessHint {
+    /** No particular expectations. */
+    case normal
+
+    /** The range will be read front to back: read ahead aggressively. */
+    case sequential
+
+    /** The range will be needed soon: start reading it in now. */
+    case willNeed
+
+    /**
+     The range will not be needed again. Used by cold archive scans, so that they do not push more useful data out
+     of the page cache. Only descriptor reads can honour this: pages of a memory mapping go through the cache.
+     */
+    case dontNeed
+
+    /** How much of a range `.sequential` starts reading in straight away on Darwin. */
+    static let sequentialAdvisoryLength = 1024 * 1024
+
+    /** Apply the hint to an open file descriptor, before reading `range` through it. */
+    public func apply(to fd: Int32, range: Range<Int>) {
+        #if os(Linux)
+        let advice: Int32
+        switch self {
+        case .normal:
+            advice = POSIX_FADV_NORMAL
+        case .sequential:
+            advice = POSIX_FADV_SEQUENTIAL
+        case .willNeed:
+            advice = POSIX_FADV_WILLNEED
+        case .dontNeed:
+            // Dropping the range now would drop nothing that is about to be read; see applyAfterReading(to:range:)
+            return
+        }
+        _ = posix_fadvise(fd, off_t(range.lowerBound), off_t(range.count), advice)
+        #else
+        switch self {
+        case .normal:
+            // The defaults: read ahead on misses, through the cache
+            _ = fcntl(fd, F_RDAHEAD, 1)
+            _ = fcntl(fd, F_NOCACHE, 0)
+        case .sequential:
+            // Read ahead on misses, and start on the beginning of the range now rather than on the first one
+            _ = fcntl(fd, F_RDAHEAD, 1)
+            var advisory = radvisory(ra_offset: off_t(range.lowerBound), ra_count: Int32(clamping: min(range.count, ReadAccessHint.sequentialAdvisoryLength)))
+            _ = fcntl(fd, F_RDADVISE, &advisory)
+        case .willNeed:
+            var advisory = radvisory(ra_offset: off_t(range.lowerBound), ra_count: Int32(clamping: range.count))
+            _ = fcntl(fd, F_RDADVISE, &advisory)
+        case .dontNeed:
+            // Reads made from here on bypass the cache, so there is nothing to drop afterwards
+            _ = fcntl(fd, F_NOCACHE, 1)
+        }
+        #endif
+    }
+
+    /**
+     Apply what is left of the hint once `range` has been read through `fd`: on Linux, `.dontNeed` drops the range
+     from the page cache. Nothing is left to do for other hints, or on Darwin.
+     */
+    public func applyAfterReading(to fd: Int32, range: Range<Int>) {
+        #if os(Linux)
+        if self == .dontNeed {
+            _ = posix_fadvise(fd, off_t(range.lowerBound), off_t(range.count), POSIX_FADV_DONTNEED)
+        }
+        #endif
+    }
+
+    /**
+     Apply the hint to a memory mapped region. `.dontNeed` releases the mapping's pages, but does not drop the file
+     from the page cache, which `MappedFileByteSource` does separately where it can.
+     */
+    public func apply(to address: UnsafeMutableRawPointer, length: Int) {
+        let pageSize = Int(getpagesize())
+        let pageAlignedAddress = UnsafeMutableRawPointer(bitPattern: (Int(bitPattern: address) / pageSize) * pageSize)!
+        let alignedLength = length + pageAlignedAddress.distance(to: address)
+
+        let advice: Int32
+        switch self {
+        case .normal:
+            advice = MADV_NORMAL
+        case .sequential:
+            advice = MADV_SEQUENTIAL
+        case .willNeed:
+            advice = MADV_WILLNEED
+        case .dontNeed:
+            advice = MADV_DONTNEED
+        }
+        _ = madvise(pageAlignedAddress, alignedLength, advice)
+    }
+}
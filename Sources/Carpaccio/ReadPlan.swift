@@ -0,0 +1,201 @@
+//
+//  ReadPlan.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+
+/**
+
+ The byte ranges one operation needs from a file, grouped into as few reads as possible.
+
+ Ranges closer to each other than `gapThreshold` bytes are served by a single read spanning both, the bytes in
+ between being read and discarded: on storage where each read costs a seek or a round trip, reading a few extra
+ kilobytes is far cheaper than a second read. Each `Read` is meant to be issued as one vectored operation, such as a
+ `preadv` scattering the wanted ranges into their own buffers, or one HTTP request.
+
+ */
+public struct ReadPlan: Equatable {
+    public struct Read: Equatable {
+        /** The contiguous range read from storage. */
+        public let span: Range<Int>
+        /** The wanted ranges within `span`, sorted and disjoint. */
+        public let ranges: [Range<Int>]
+
+        /** Ranges within `span` which are read only to be discarded. */
+        public var gaps: [Range<Int>] {
+            var gaps = [Range<Int>]()
+            var position = span.lowerBound
+            for range in ranges {
+                if range.lowerBound > position {
+                    gaps.append(position ..< range.lowerBound)
+                }
+                position = range.upperBound
+            }
+            return gaps
+        }
+    }
+
+    public let reads: [Read]
+    public let gapThreshold: Int
+
+    /** Plan reads for `ranges`, which may overlap and need not be sorted. Empty ranges are ignored. */
+    public init(_ ranges: [Range<Int>], gapThreshold: Int) {
+        self.gapThreshold = max(0, gapThreshold)
+
+        var reads = [Read]()
+        var span: Range<Int>? = nil
+        var spanRanges = [Range<Int>]()
+
+        for range in ReadPlan.merged(ranges) {
+            if let current = span, range.lowerBound - current.upperBound <= self.gapThreshold {
+                span = current.lowerBound ..< range.upperBound
+            } else {
+                if let current = span {
+                    reads.append(Read(span: current, ranges: spanRanges))
+                }
+                span = range
+                spanRanges.removeAll()
+            }
+            spanRanges.append(range)
+        }
+        if let current = span {
+            reads.append(Read(span: current, ranges: spanRanges))
+        }
+        self.reads = reads
+    }
+
+    /** The wanted ranges, merged where they overlap or touch. */
+    public var ranges: [Range<Int>] {
+        return reads.flatMap { $0.ranges }
+    }
+
+    /** Bytes read in total, gaps included. */
+    public var byteCount: Int {
+        return reads.reduce(0) { $0 + $1.span.count }
+    }
+
+    /** Merge overlapping and adjacent ranges, dropping empty ones, in ascending order. */
+    public static func merged(_ ranges: [Range<Int>]) -> [Range<Int>] {
+        var result = [Range<Int>]()
+        for range in ranges.filter({ !$0.isEmpty }).sorted(by: { $0.lowerBound < $1.lowerBound }) {
+            if let last = result.last, range.lowerBound <= last.upperBound {
+                result[result.count - 1] = last.lowerBound ..< max(last.upperBound, range.upperBound)
+            } else {
+                result.append(range)
+            }
+        }
+        return result
+    }
+
+    /**
+     Given the data of each read's span, in order, return the bytes of each of `requested`. Returns `nil` if any of
+     `requested` does not lie within one span, or a span's data is short.
+     */
+    public func slice(_ spanData: [Data], into requested: [Range<Int>]) -> [Data]? {
+        guard spanData.count == reads.count else {
+            return nil
+        }
+        var result = [Data]()
+        result.reserveCapacity(requested.count)
+        for range in requested {
+            guard let i = reads.firstIndex(where: { $0.span.lowerBound <= range.lowerBound && range.upperBound <= $0.span.upperBound }),
+                  range.upperBound - reads[i].span.lowerBound <= spanData[i].count else {
+                return nil
+            }
+            let data = spanData[i]
+            let start = data.startIndex + (range.lowerBound - reads[i].span.lowerBound)
+            result.append(data[start ..< (start + range.count)])
+        }
+        return result
+    }
+}
+
+// MARK: - Planning reads from container structure
+
+public extension TIFFStructure {
+    /**
+     Ranges of directory values stored outside of the directories themselves, which loading metadata reads. Maker
+     notes are left out, as they can be large and metadata is not read from them.
+     */
+    func metadataValueRanges(maximumValueByteCount: Int = 64 * 1024) -> [Range<Int>] {
+        return ifds.flatMap { $0.entries }
+            .filter { $0.tag != TIFFStructure.Tag.makerNote && $0.byteCount > 4 && $0.byteCount <= maximumValueByteCount }
+            .map { $0.valueRange }
+    }
+
+    /**
+     Ranges needed to load the metadata and the largest embedded preview of a TIFF based file, once its directories
+     have been read: `metadataValueRanges`, plus the preview. Finding the preview reads its offset and length values
+     with `fetch`.
+     */
+    func metadataAndPreviewRanges(maximumValueByteCount: Int = 64 * 1024, fetch: Fetch) -> [Range<Int>] {
+        var ranges = metadataValueRanges(maximumValueByteCount: maximumValueByteCount)
+        if let previewRange = PartialFileAnalysis.largestPreviewRange(in: self, fetch: fetch) {
+            ranges.append(previewRange)
+        }
+        return ranges
+    }
+}
+
+public extension ImageByteSource {
+    /**
+     Before loading a thumbnail, read in the ranges it will need in as few reads as `gapThreshold` allows, rather than
+     having the decoder fault them in one at a time.
+
+     Block cached sources fetch the directories a level at a time, then the directory values and the preview with a
+     single vectored prefetch (see `RangeReadableByteSource.prefetchMetadataAndPreview()`). Memory mapped and other
+     in-memory sources are told to read ranges ahead (`ReadAccessHint.willNeed`) before they are parsed: each level of
+     directories is advised before it is walked, the values once all directories are known, and the preview once
+     their values tell where it is. A structure already parsed and cached in the source is advised from directly.
+
+     Does nothing for files which are not TIFF based, whose metadata and preview are both in the header anyway.
+     */
+    func prefetchThumbnailRanges(gapThreshold: Int = 256 * 1024, maximumRoundCount: Int = 8) {
+        guard case .tiff? = try? ImageFormat(source: self) else {
+            return
+        }
+        if let blockCachedSource = self as? RangeReadableByteSource {
+            try? blockCachedSource.prefetchMetadataAndPreview()
+            return
+        }
+
+        let count = self.count
+        var advised = [Range<Int>]()
+        func adviseAhead(_ ranges: [Range<Int>]) {
+            for read in ReadPlan(ranges.filter { $0.lowerBound >= 0 && $0.upperBound <= count }, gapThreshold: gapThreshold).reads {
+                self.advise(.willNeed, range: read.span)
+                advised.append(read.span)
+            }
+        }
+
+        var structure = TIFFStructure.cached(in: self)
+        if structure == nil {
+            adviseAhead([0 ..< min(count, 64 * 1024)])
+            for _ in 0 ..< maximumRoundCount {
+                let parsed = try? TIFFStructure(fetch: { range in
+                    advised.contains { $0.lowerBound <= range.lowerBound && range.upperBound <= $0.upperBound } ? try self.bytes(in: range) : nil
+                })
+                guard let level = parsed, !level.unresolvedRanges.isEmpty else {
+                    structure = parsed.map { TIFFStructure.cache($0, in: self) }
+                    break
+                }
+                adviseAhead(level.unresolvedRanges)
+            }
+        }
+        guard let directories = structure, !directories.ifds.isEmpty else {
+            return
+        }
+
+        adviseAhead(directories.metadataValueRanges())
+        let previewRange = PartialFileAnalysis.largestPreviewRange(in: directories) { range in
+            range.lowerBound >= 0 && range.upperBound <= count ? try self.bytes(in: range) : nil
+        }
+        if let previewRange = previewRange {
+            adviseAhead([previewRange])
+        }
+    }
+}
@@ -0,0 +1,456 @@
+//
+//  TIFFStructure.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+
+public enum TIFFStructureError: Swift.Error, LocalizedError {
+    case notTIFF
+    case unsupportedVariant(magic: UInt16)
+
+    public var errorDescription: String? {
+        switch self {
+        case .notTIFF:
+            return "Data does not begin with a TIFF header"
+        case .unsupportedVariant(let magic):
+            return "Unsupported TIFF variant with magic number \(String(magic, radix: 16))"
+        }
+    }
+}
+
+/** A directory entry. */
+public struct TIFFEntry {
+    public let tag: UInt16
+    public let type: UInt16
+    public let count: Int
+
+    /** Absolute offset of the entry's value. For values of four bytes or less, this lies within the entry itself. */
+    public let valueOffset: Int
+
+    public var byteCount: Int {
+        return count * TIFFEntry.size(ofType: type)
+    }
+
+    public var valueRange: Range<Int> {
+        return valueOffset ..< (valueOffset + byteCount)
+    }
+
+    public static func size(ofType type: UInt16) -> Int {
+        switch type {
+        case 1, 2, 6, 7: // BYTE, ASCII, SBYTE, UNDEFINED
+            return 1
+        case 3, 8: // SHORT, SSHORT
+            return 2
+        case 4, 9, 11, 13: // LONG, SLONG, FLOAT, IFD
+            return 4
+        case 5, 10, 12, 16: // RATIONAL, SRATIONAL, DOUBLE, LONG8
+            return 8
+        default:
+            return 1
+        }
+    }
+}
+
+/** An image file directory. */
+public struct TIFFIFD {
+    public enum Kind: Equatable {
+        /** The n'th directory in the main IFD chain. */
+        case main(Int)
+        /** A directory referenced by the `SubIFDs` tag of the directory at the given offset. */
+        case sub(parentOffset: Int)
+        case exif
+    }
+
+    /** Absolute offset of the directory. */
+    public let offset: Int
+    public let kind: Kind
+    public let entries: [TIFFEntry]
+    public let nextIFDOffset: Int?
+
+    public func entry(_ tag: UInt16) -> TIFFEntry? {
+        return entries.first { $0.tag == tag }
+    }
+}
+
+/**
+
+ The directory layout of a TIFF based file: the main IFD chain, SubIFDs and the EXIF IFD.
+
+ Most RAW formats (ARW, CR2, DNG, NEF, ORF, PEF, RW2…) are TIFF containers, so this is the structure metadata
+ parsing, preview extraction and RAW decoding all begin from.
+
+ The structure can be walked over incomplete data: the `fetch` function returns `nil` for ranges not (yet)
+ available, and whatever could not be reached is reported in `unresolvedRanges`. That allows planning reads
+ one round at a time, as done by `BatchedFileReader`.
+
+ */
+public struct TIFFStructure {
+    public typealias Fetch = (_ range: Range<Int>) throws -> Data?
+
+    public enum Tag {
+        public static let newSubfileType: UInt16 = 254
+        public static let imageWidth: UInt16 = 256
+        public static let imageLength: UInt16 = 257
+        public static let bitsPerSample: UInt16 = 258
+        public static let compression: UInt16 = 259
+        public static let photometricInterpretation: UInt16 = 262
+        public static let make: UInt16 = 271
+        public static let model: UInt16 = 272
+        public static let stripOffsets: UInt16 = 273
+        public static let orientation: UInt16 = 274
+        public static let samplesPerPixel: UInt16 = 277
+        public static let rowsPerStrip: UInt16 = 278
+        public static let stripByteCounts: UInt16 = 279
+        public static let dateTime: UInt16 = 306
+        public static let tileWidth: UInt16 = 322
+        public static let tileLength: UInt16 = 323
+        public static let tileOffsets: UInt16 = 324
+        public static let tileByteCounts: UInt16 = 325
+        public static let subIFDs: UInt16 = 330
+        public static let jpegInterchangeFormat: UInt16 = 513
+        public static let jpegInterchangeFormatLength: UInt16 = 514
+        public static let cfaRepeatPatternDim: UInt16 = 33421
+        public static let cfaPattern: UInt16 = 33422
+        public static let exifIFD: UInt16 = 34665
+        public static let exposureTime: UInt16 = 33434
+        public static let fNumber: UInt16 = 33437
+        public static let isoSpeedRatings: UInt16 = 34855
+        public static let dateTimeOriginal: UInt16 = 36867
+        public static let focalLength: UInt16 = 37386
+        public static let makerNote: UInt16 = 37500
+        public static let pixelXDimension: UInt16 = 40962
+        public static let pixelYDimension: UInt16 = 40963
+        public static let exifCFAPattern: UInt16 = 41730
+        public static let focalLengthIn35mmFilm: UInt16 = 41989
+        public static let lensModel: UInt16 = 42036
+        public static let dngVersion: UInt16 = 50706
+    }
+
+    /** Absolute offset of the TIFF header; directory offsets are relative to this. */
+    public let baseOffset: Int
+    public let byteOrder: ByteOrder
+    public let magic: UInt16
+    public let ifds: [TIFFIFD]
+    public let unresolvedRanges: [Range<Int>]
+
+    private static let maximumIFDCount = 256
+    private static let maximumEntryCount = 4096
+
+    public init(baseOffset: Int = 0, fetch: Fetch) throws {
+        self.baseOffset = baseOffset
+
+        guard baseOffset >= 0, baseOffset <= Int.max - 8 else {
+            throw TIFFStructureError.notTIFF
+        }
+        guard let header = try fetch(baseOffset ..< (baseOffset + 8)) else {
+            self.byteOrder = .littleEndian
+            self.magic = 0
+            self.ifds = []
+            self.unresolvedRanges = [baseOffset ..< (baseOffset + 8)]
+            return
+        }
+
+        let byteOrder: ByteOrder
+        if header.hasPrefix([0x49, 0x49]) {
+            byteOrder = .littleEndian
+        } else if header.hasPrefix([0x4D, 0x4D]) {
+            byteOrder = .bigEndian
+        } else {
+            throw TIFFStructureError.notTIFF
+        }
+
+        guard let magic = header.uint16(at: 2, byteOrder), let firstIFDOffset = header.uint32(at: 4, byteOrder) else {
+            throw TIFFStructureError.notTIFF
+        }
+        // 0x2A: TIFF, 0x55: Panasonic RW2, "RO"/"RS": Olympus ORF. BigTIFF (0x2B) is not supported.
+        guard [0x2A, 0x55, 0x4F52, 0x5352].contains(magic) else {
+            throw TIFFStructureError.unsupportedVariant(magic: magic)
+        }
+
+        self.byteOrder = byteOrder
+        self.magic = magic
+
+        let directories = try TIFFStructure.readIFDs(from: Int(firstIFDOffset), baseOffset: baseOffset, byteOrder: byteOrder, fetch: fetch)
+        self.ifds = directories.ifds
+        self.unresolvedRanges = directories.unresolvedRanges
+    }
+
+    /**
+     The structure of directories without a TIFF header, such as those of many maker notes, which give their byte
+     order and the offset of their first directory by other means. Offsets are relative to `baseOffset`.
+     */
+    public init(baseOffset: Int, byteOrder: ByteOrder, firstIFDOffset: Int, fetch: Fetch) throws {
+        self.baseOffset = baseOffset
+        self.byteOrder = byteOrder
+        self.magic = 0
+
+        let directories = try TIFFStructure.readIFDs(from: firstIFDOffset, baseOffset: baseOffset, byteOrder: byteOrder, fetch: fetch)
+        self.ifds = directories.ifds
+        self.unresolvedRanges = directories.unresolvedRanges
+    }
+
+    private static func readIFDs(from firstIFDOffset: Int, baseOffset: Int, byteOrder: ByteOrder, fetch: Fetch) throws -> (ifds: [TIFFIFD], unresolvedRanges: [Range<Int>]) {
+        var ifds = [TIFFIFD]()
+        var unresolved = [Range<Int>]()
+        var pending: [(offset: Int, kind: TIFFIFD.Kind)] = firstIFDOffset > 0 ? [(firstIFDOffset, .main(0))] : []
+        var visited = Set<Int>()
+
+        while !pending.isEmpty && ifds.count < maximumIFDCount {
+            let (relativeOffset, kind) = pending.removeFirst()
+            guard visited.insert(relativeOffset).inserted else {
+                continue
+            }
+
+            // Leave room for the largest directory, so that none of its offsets below can overflow
+            let (offset, overflow) = baseOffset.addingReportingOverflow(relativeOffset)
+            guard !overflow, offset >= 0, offset <= Int.max - (2 + maximumEntryCount * 12 + 4) else {
+                continue
+            }
+            guard let countData = try fetch(offset ..< (offset + 2)) else {
+                unresolved.append(offset ..< (offset + 2))
+                continue
+            }
+            guard let entryCount = countData.uint16(at: 0, byteOrder).map(Int.init), entryCount <= maximumEntryCount else {
+                continue
+            }
+
+            let directoryRange = (offset + 2) ..< (offset + 2 + entryCount * 12 + 4)
+            guard let directory = try fetch(directoryRange) else {
+                unresolved.append(directoryRange)
+                continue
+            }
+
+            var entries = [TIFFEntry]()
+            entries.reserveCapacity(entryCount)
+
+            for i in 0 ..< entryCount {
+                let entryOffset = i * 12
+                guard let tag = directory.uint16(at: entryOffset, byteOrder),
+                      let type = directory.uint16(at: entryOffset + 2, byteOrder),
+                      let count = directory.uint32(at: entryOffset + 4, byteOrder),
+                      let valueOrOffset = directory.uint32(at: entryOffset + 8, byteOrder) else {
+                    break
+                }
+                let byteCount = Int(count) * TIFFEntry.size(ofType: type)
+                var valueOffset = directoryRange.lowerBound + entryOffset + 8
+                if byteCount > 4 {
+                    let (offset, overflow) = baseOffset.addingReportingOverflow(Int(valueOrOffset))
+                    guard !overflow, offset >= 0, offset <= Int.max - byteCount else {
+                        continue
+                    }
+                    valueOffset = offset
+                }
+                entries.append(TIFFEntry(tag: tag, type: type, count: Int(count), valueOffset: valueOffset))
+            }
+
+            let next = directory.uint32(at: entryCount * 12, byteOrder).map(Int.init) ?? 0
+            let ifd = TIFFIFD(offset: offset, kind: kind, entries: entries, nextIFDOffset: next > 0 ? next : nil)
+            ifds.append(ifd)
+
+            if case .main(let index) = kind, let next = ifd.nextIFDOffset {
+                pending.append((next, .main(index + 1)))
+            }
+
+            for (tag, childKind) in [(Tag.subIFDs, TIFFIFD.Kind.sub(parentOffset: offset)), (Tag.exifIFD, TIFFIFD.Kind.exif)] {
+                guard let entry = ifd.entry(tag) else {
+                    continue
+                }
+                guard let offsets = try integerValues(of: entry, byteOrder: byteOrder, fetch: fetch) else {
+                    unresolved.append(entry.valueRange)
+                    continue
+                }
+                pending.append(contentsOf: offsets.compactMap { Int(exactly: $0) }.filter { $0 > 0 }.map { ($0, childKind) })
+            }
+        }
+
+        return (ifds, unresolved)
+    }
+
+    /**
+     The TIFF structure of a byte source, parsed once and cached in the source's container cache.
+     */
+    public static func read(from source: ImageByteSource, baseOffset: Int = 0) throws -> TIFFStructure {
+        return try source.containerCache.value(forKey: cacheKey(baseOffset: baseOffset)) {
+            try TIFFStructure(baseOffset: baseOffset, fetch: fetch(from: source))
+        }
+    }
+
+    /** The structure of a byte source if it has already been parsed, without reading anything. */
+    static func cached(in source: ImageByteSource, baseOffset: Int = 0) -> TIFFStructure? {
+        return source.containerCache.cachedValue(forKey: cacheKey(baseOffset: baseOffset))
+    }
+
+    /** Keep a structure parsed some other way, such as level by level, as the structure of `source`. */
+    @discardableResult
+    static func cache(_ structure: TIFFStructure, in source: ImageByteSource) -> TIFFStructure {
+        return (try? source.containerCache.value(forKey: cacheKey(baseOffset: structure.baseOffset)) { structure }) ?? structure
+    }
+
+    private static func cacheKey(baseOffset: Int) -> String {
+        return "com.sashimiapp.TIFF.structure.\(baseOffset)"
+    }
+
+    /** The structure of headerless directories in a byte source, starting from the one at `firstIFDOffset`. */
+    public static func read(from source: ImageByteSource, baseOffset: Int, byteOrder: ByteOrder, firstIFDOffset: Int) throws -> TIFFStructure {
+        return try TIFFStructure(baseOffset: baseOffset, byteOrder: byteOrder, firstIFDOffset: firstIFDOffset, fetch: fetch(from: source))
+    }
+
+    private static func fetch(from source: ImageByteSource) -> Fetch {
+        return { range in
+            guard range.lowerBound >= 0, range.upperBound <= source.count else {
+                return nil
+            }
+            return try source.bytes(in: range)
+        }
+    }
+
+    public var mainIFDs: [TIFFIFD] {
+        return ifds.filter {
+            if case .main = $0.kind {
+                return true
+            }
+            return false
+        }
+    }
+
+    public var exifIFD: TIFFIFD? {
+        return ifds.first { $0.kind == .exif }
+    }
+
+    public func subIFDs(of ifd: TIFFIFD) -> [TIFFIFD] {
+        return ifds.filter { $0.kind == .sub(parentOffset: ifd.offset) }
+    }
+
+    // MARK: Entry values
+
+    public static func integerValues(of entry: TIFFEntry, byteOrder: ByteOrder, fetch: Fetch) throws -> [UInt64]? {
+        guard let data = try fetch(entry.valueRange) else {
+            return nil
+        }
+        let size = TIFFEntry.size(ofType: entry.type)
+        return (0 ..< entry.count).compactMap { i -> UInt64? in
+            switch entry.type {
+            case 1, 6, 7:
+                return data.uint8(at: i).map(UInt64.init)
+            case 3, 8:
+                return data.uint16(at: i * size, byteOrder).map(UInt64.init)
+            case 4, 9, 13:
+                return data.uint32(at: i * size, byteOrder).map(UInt64.init)
+            case 16:
+                return data.uint64(at: i * size, byteOrder)
+            default:
+                return nil
+            }
+        }
+    }
+
+    public func integerValues(of entry: TIFFEntry, in source: ImageByteSource) throws -> [UInt64] {
+        return try TIFFStructure.integerValues(of: entry, byteOrder: byteOrder) { try source.bytes(in: $0) } ?? []
+    }
+
+    /** Values of an integer entry as `Int`. LONG8 values which do not fit, found only in damaged files, are dropped. */
+    public func intValues(of entry: TIFFEntry, in source: ImageByteSource) throws -> [Int] {
+        return try integerValues(of: entry, in: source).compactMap { Int(exactly: $0) }
+    }
+
+    public func integerValue(of entry: TIFFEntry, in source: ImageByteSource) throws -> Int? {
+        return try integerValues(of: entry, in: source).first.flatMap { Int(exactly: $0) }
+    }
+
+    /** Values of a RATIONAL or SRATIONAL entry, as doubles. */
+    public func rationalValues(of entry: TIFFEntry, in source: ImageByteSource) throws -> [Double] {
+        guard entry.type == 5 || entry.type == 10 else {
+            return try integerValues(of: entry, in: source).map(Double.init)
+        }
+        let data = try source.bytes(in: entry.valueRange)
+        return (0 ..< entry.count).compactMap { i -> Double? in
+            guard let numerator = data.uint32(at: i * 8, byteOrder), let denominator = data.uint32(at: i * 8 + 4, byteOrder), denominator != 0 else {
+                return nil
+            }
+            if entry.type == 10 {
+                return Double(Int32(bitPattern: numerator)) / Double(Int32(bitPattern: denominator))
+            }
+            return Double(numerator) / Double(denominator)
+        }
+    }
+
+    public func stringValue(of entry: TIFFEntry, in source: ImageByteSource) throws -> String? {
+        let data = try source.bytes(in: entry.valueRange)
+        let bytes = data.prefix { $0 != 0 }
+        return String(bytes: bytes, encoding: .utf8)?.trimmingCharacters(in: .whitespaces)
+    }
+}
+
+// MARK: - Metadata
+
+extension ImageMetadata {
+    /**
+     Metadata read directly from the tags of a TIFF based file, without ImageIO. This only needs the directories and
+     their values to be available, not image data, so it works on partially written or partially read files.
+
+     The size is that given by the EXIF pixel dimensions if present, otherwise that of the largest image in the file,
+     which for RAW files may include masked border pixels not part of the final image.
+
+     Containers which keep the EXIF directory in a TIFF structure of its own, such as the CMT boxes of Canon CR3, pass
+     it as `exifStructure`. A `nativeSize` or `nativeOrientation` known from the container takes precedence over tags.
+     */
+    public init(tiffStructure structure: TIFFStructure, exifStructure: TIFFStructure? = nil,
+                nativeSize: CGSize? = nil, nativeOrientation: ImageOrientation? = nil, in source: ImageByteSource) throws {
+        typealias Tag = TIFFStructure.Tag
+        typealias Directory = (structure: TIFFStructure, ifd: TIFFIFD?)
+
+        func integer(_ tag: UInt16, in directory: Directory) -> Int? {
+            return directory.ifd?.entry(tag).flatMap { try? directory.structure.integerValue(of: $0, in: source) }
+        }
+        func rational(_ tag: UInt16, in directory: Directory) -> Double? {
+            return directory.ifd?.entry(tag).flatMap { try? directory.structure.rationalValues(of: $0, in: source).first }
+        }
+        func string(_ tag: UInt16, in directory: Directory) -> String? {
+            return directory.ifd?.entry(tag).flatMap { try? directory.structure.stringValue(of: $0, in: source) }.flatMap { $0.isEmpty ? nil : $0 }
+        }
+
+        let ifd0: Directory = (structure, structure.mainIFDs.first)
+        let exif: Directory = exifStructure.map { ($0, $0.mainIFDs.first) } ?? (structure, structure.exifIFD)
+
+        var width = integer(Tag.pixelXDimension, in: exif) ?? 0
+        var height = integer(Tag.pixelYDimension, in: exif) ?? 0
+        if let nativeSize = nativeSize {
+            width = Int(nativeSize.width)
+            height = Int(nativeSize.height)
+        } else if width == 0 || height == 0 {
+            for ifd in structure.ifds where ifd.kind != .exif {
+                // Dimensions are untrusted: compared as areas in floating point, which cannot overflow
+                if let w = integer(Tag.imageWidth, in: (structure, ifd)), let h = integer(Tag.imageLength, in: (structure, ifd)), w > 0, h > 0,
+                   Double(w) * Double(h) > Double(width) * Double(height) {
+                    width = w
+                    height = h
+                }
+            }
+        }
+        guard width > 0, height > 0 else {
+            throw Image.Error.invalidImageSize
+        }
+
+        let orientation = nativeOrientation ?? integer(Tag.orientation, in: ifd0).flatMap { try? ImageOrientation(tiffOrientation: UInt32($0)) }
+        let dateString = string(Tag.dateTimeOriginal, in: exif) ?? string(Tag.dateTime, in: ifd0)
+
+        self.init(
+            nativeSize: CGSize(width: width, height: height),
+            nativeOrientation: orientation ?? .up,
+            fNumber: rational(Tag.fNumber, in: exif),
+            focalLength: rational(Tag.focalLength, in: exif),
+            focalLength35mmEquivalent: integer(Tag.focalLengthIn35mmFilm, in: exif).map(Double.init),
+            iso: integer(Tag.isoSpeedRatings, in: exif).map(Double.init),
+            shutterSpeed: rational(Tag.exposureTime, in: exif),
+            cameraMaker: string(Tag.make, in: ifd0),
+            cameraModel: string(Tag.model, in: ifd0),
+            timestamp: dateString.flatMap { ImageMetadata.EXIFDateFormatter.date(from: $0) },
+            lensModel: string(Tag.lensModel, in: exif)
+        )
+    }
+}
@@ -0,0 +1,550 @@
+//
+//  TetheredIngest.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import ImageIO
+
+public enum TetheredIngestError: Swift.Error, LocalizedError {
+    case fileRemoved(URL)
+    case fileIncomplete(URL)
+
+    public var errorDescription: String? {
+        switch self {
+        case .fileRemoved(let url):
+            return "\(url.lastPathComponent) was removed before it was completely written"
+        case .fileIncomplete(let url):
+            return "\(url.lastPathComponent) stopped growing before it was completely written"
+        }
+    }
+}
+
+/**
+
+ What can be read from a file which may still be being written.
+
+ JPEG files have their metadata available once the start of scan marker has been written, and are complete when they
+ end with an end of image marker. TIFF based RAW files have their metadata available once all their directories and
+ directory values can be reached, and are complete once every strip, tile and preview they reference lies within the
+ file. In both, the embedded preview (the EXIF thumbnail of a JPEG, the largest JPEG preview of a RAW file) can be
+ read as soon as its bytes are in the file.
+
+ */
+public struct PartialFileAnalysis {
+    public enum Container {
+        case jpeg
+        case tiff(TIFFStructure)
+        case unknown
+    }
+
+    public let container: Container
+    public let byteCount: Int
+    public let isMetadataAvailable: Bool
+    /** Range of the embedded JPEG preview, whether or not it has been written yet. */
+    public let previewRange: Range<Int>?
+    /** Whether all the data the file's structure refers to is present. `nil` for formats whose structure is not understood. */
+    public let isStructurallyComplete: Bool?
+
+    public var isPreviewAvailable: Bool {
+        guard let range = previewRange else {
+            return false
+        }
+        return range.upperBound <= byteCount
+    }
+
+    /** Where the scan of a JPEG's marker segments stopped, and the EXIF header found before it. */
+    fileprivate struct JPEGScan {
+        var offset: Int
+        var exifBaseOffset: Int?
+        var headersComplete: Bool
+    }
+
+    private let jpegScan: JPEGScan?
+    /** The end of the furthest data a TIFF structure refers to, once all of its extents can be read. */
+    private let dataEnd: Int?
+
+    /** Length of the end of a JPEG searched for its end of image marker, past any padding. */
+    private static let jpegTrailerLength = 4096
+
+    public init(data: Data) {
+        self.init(byteCount: data.count, fetch: PartialFileAnalysis.fetch(from: data))
+    }
+
+    /**
+     Analyse the first `byteCount` bytes of a file, read with `fetch`.
+
+     Given `previous`, the analysis of an earlier state of the same file, only what it left unsettled is read again:
+     the scan of a JPEG's marker segments continues from where it stopped, and a TIFF structure whose directories could
+     all be read is kept, its extent compared against the file's new length.
+     */
+    public init(byteCount: Int, fetch: TIFFStructure.Fetch, resumingFrom previous: PartialFileAnalysis? = nil) {
+        self.byteCount = byteCount
+        // A file which shrank is being written again, and nothing read from it before holds
+        let previous = previous.flatMap { $0.byteCount <= byteCount ? $0 : nil }
+
+        if let previous = previous, previous.isMetadataAvailable, case .tiff = previous.container {
+            container = previous.container
+            isMetadataAvailable = true
+            previewRange = previous.previewRange
+            jpegScan = nil
+            dataEnd = previous.dataEnd
+            isStructurallyComplete = previous.dataEnd.map { $0 <= byteCount } ?? false
+            return
+        }
+
+        if PartialFileAnalysis.bytes(in: 0 ..< 2, fetch: fetch) == Data([0xFF, 0xD8]) {
+            let scan: JPEGScan
+            if let previousScan = previous?.jpegScan, previousScan.headersComplete {
+                scan = previousScan
+                previewRange = previous?.previewRange
+            } else {
+                scan = PartialFileAnalysis.scanJPEGHeaders(resuming: previous?.jpegScan ?? JPEGScan(offset: 2, exifBaseOffset: nil, headersComplete: false), fetch: fetch)
+                previewRange = scan.exifBaseOffset.flatMap { baseOffset in
+                    (try? TIFFStructure(baseOffset: baseOffset, fetch: fetch)).flatMap {
+                        PartialFileAnalysis.thumbnailRange(in: $0, fetch: fetch)
+                    }
+                }
+            }
+            container = .jpeg
+            jpegScan = scan
+            dataEnd = nil
+            isMetadataAvailable = scan.headersComplete
+
+            let trailerRange = max(0, byteCount - PartialFileAnalysis.jpegTrailerLength) ..< byteCount
+            let trailer = PartialFileAnalysis.bytes(in: trailerRange, fetch: fetch) ?? Data()
+            // Allow for padding after the end of image marker
+            let paddingLength = trailer.reversed().prefix { $0 == 0 }.count
+            let trimmed = trailer.dropLast(paddingLength)
+            isStructurallyComplete = byteCount - paddingLength >= 4 && trimmed.suffix(2).elementsEqual([0xFF, 0xD9])
+            return
+        }
+
+        jpegScan = nil
+        guard let structure = try? TIFFStructure(fetch: fetch), !structure.ifds.isEmpty else {
+            container = .unknown
+            isMetadataAvailable = false
+            previewRange = nil
+            dataEnd = nil
+            isStructurallyComplete = nil
+            return
+        }
+
+        container = .tiff(structure)
+        isMetadataAvailable = structure.unresolvedRanges.isEmpty
+        previewRange = PartialFileAnalysis.largestPreviewRange(in: structure, fetch: fetch)
+        dataEnd = PartialFileAnalysis.dataEnd(of: structure, fetch: fetch)
+        isStructurallyComplete = structure.unresolvedRanges.isEmpty && dataEnd.map { $0 <= byteCount } ?? false
+    }
+
+    /** Length of a JPEG's headers, up to its start of scan, once they have all been written. */
+    var jpegHeaderLength: Int? {
+        guard let scan = jpegScan, scan.headersComplete else {
+            return nil
+        }
+        return scan.offset
+    }
+
+    private static func fetch(from data: Data) -> TIFFStructure.Fetch {
+        return { range in
+            guard range.lowerBound >= 0, range.upperBound <= data.count else {
+                return nil
+            }
+            return data.subdata(from: range.lowerBound, count: range.count)
+        }
+    }
+
+    private static func bytes(in range: Range<Int>, fetch: TIFFStructure.Fetch) -> Data? {
+        guard let data = try? fetch(range), data.count == range.count else {
+            return nil
+        }
+        return data
+    }
+
+    /**
+     Walk JPEG marker segments on from where `scan` stopped, up to the start of scan or the first segment whose header
+     has not been written yet.
+     */
+    private static func scanJPEGHeaders(resuming scan: JPEGScan, fetch: TIFFStructure.Fetch) -> JPEGScan {
+        var scan = scan
+
+        while let marker = bytes(in: scan.offset ..< (scan.offset + 2), fetch: fetch), marker.uint8(at: 0) == 0xFF, let code = marker.uint8(at: 1) {
+            switch code {
+            case 0xFF:
+                // Fill byte
+                scan.offset += 1
+                continue
+            case 0x01, 0xD0 ... 0xD8:
+                scan.offset += 2
+                continue
+            case 0xDA:
+                scan.headersComplete = true
+                return scan
+            default:
+                break
+            }
+            guard let length = bytes(in: (scan.offset + 2) ..< (scan.offset + 4), fetch: fetch)?.uint16(at: 0, .bigEndian).map(Int.init), length >= 2 else {
+                break
+            }
+            if code == 0xE1 {
+                // Resume here once the signature has been written
+                guard let signature = bytes(in: (scan.offset + 4) ..< (scan.offset + 10), fetch: fetch) else {
+                    break
+                }
+                if signature.hasPrefix(Array("Exif".utf8) + [0, 0]) {
+                    scan.exifBaseOffset = scan.offset + 10
+                }
+            }
+            scan.offset += 2 + length
+        }
+        return scan
+    }
+
+    private static func integers(_ tag: UInt16, in ifd: TIFFIFD, of structure: TIFFStructure, fetch: TIFFStructure.Fetch) -> [Int] {
+        guard let entry = ifd.entry(tag), let values = try? TIFFStructure.integerValues(of: entry, byteOrder: structure.byteOrder, fetch: fetch) else {
+            return []
+        }
+        return values.map { Int(clamping: $0) }
+    }
+
+    /** The range of `length` bytes at `offset` from the structure's base, or `nil` if its end overflows. */
+    private static func byteRange(at offset: Int, length: Int, in structure: TIFFStructure) -> Range<Int>? {
+        let (start, startOverflow) = structure.baseOffset.addingReportingOverflow(offset)
+        let (end, endOverflow) = start.addingReportingOverflow(length)
+        guard !startOverflow, !endOverflow else {
+            return nil
+        }
+        return start ..< end
+    }
+
+    /** The EXIF thumbnail, in IFD1 of an EXIF block. */
+    static func thumbnailRange(in structure: TIFFStructure, fetch: TIFFStructure.Fetch) -> Range<Int>? {
+        let candidates = structure.mainIFDs.dropFirst().compactMap { jpegInterchangeRange(in: $0, of: structure, fetch: fetch) }
+        return candidates.max { $0.count < $1.count }
+    }
+
+    private static func jpegInterchangeRange(in ifd: TIFFIFD, of structure: TIFFStructure, fetch: TIFFStructure.Fetch) -> Range<Int>? {
+        guard let offset = integers(TIFFStructure.Tag.jpegInterchangeFormat, in: ifd, of: structure, fetch: fetch).first,
+              let length = integers(TIFFStructure.Tag.jpegInterchangeFormatLength, in: ifd, of: structure, fetch: fetch).first,
+              offset > 0, length > 0 else {
+            return nil
+        }
+        return byteRange(at: offset, length: length, in: structure)
+    }
+
+    /** The largest JPEG in a TIFF based file: an interchange format JPEG, or a single strip baseline JPEG image. */
+    static func largestPreviewRange(in structure: TIFFStructure, fetch: TIFFStructure.Fetch) -> Range<Int>? {
+        var candidates = [Range<Int>]()
+        for ifd in structure.ifds where ifd.kind != .exif {
+            if let range = jpegInterchangeRange(in: ifd, of: structure, fetch: fetch) {
+                candidates.append(range)
+            }
+            let compression = integers(TIFFStructure.Tag.compression, in: ifd, of: structure, fetch: fetch).first
+            let bitsPerSample = integers(TIFFStructure.Tag.bitsPerSample, in: ifd, of: structure, fetch: fetch).first
+            let offsets = integers(TIFFStructure.Tag.stripOffsets, in: ifd, of: structure, fetch: fetch)
+            let counts = integers(TIFFStructure.Tag.stripByteCounts, in: ifd, of: structure, fetch: fetch)
+            // Compression 7 with more than 8 bits per sample is lossless JPEG RAW data, not a preview
+            if compression == 6 || compression == 7, bitsPerSample == 8, offsets.count == 1, counts.count == 1,
+               let range = byteRange(at: offsets[0], length: counts[0], in: structure) {
+                candidates.append(range)
+            }
+        }
+        return candidates.max { $0.count < $1.count }
+    }
+
+    /** The end of the furthest strip, tile or JPEG the structure refers to, or `nil` if any of their extents cannot be read yet or overflow. */
+    private static func dataEnd(of structure: TIFFStructure, fetch: TIFFStructure.Fetch) -> Int? {
+        typealias Tag = TIFFStructure.Tag
+        var end = 0
+        for ifd in structure.ifds where ifd.kind != .exif {
+            for (offsetTag, countTag) in [(Tag.stripOffsets, Tag.stripByteCounts), (Tag.tileOffsets, Tag.tileByteCounts), (Tag.jpegInterchangeFormat, Tag.jpegInterchangeFormatLength)] {
+                guard ifd.entry(offsetTag) != nil else {
+                    continue
+                }
+                let offsets = integers(offsetTag, in: ifd, of: structure, fetch: fetch)
+                let counts = integers(countTag, in: ifd, of: structure, fetch: fetch)
+                guard !offsets.isEmpty, offsets.count == counts.count else {
+                    return nil
+                }
+                for (offset, count) in zip(offsets, counts) {
+                    guard let range = byteRange(at: offset, length: count, in: structure) else {
+                        return nil
+                    }
+                    end = max(end, range.upperBound)
+                }
+            }
+        }
+        return end
+    }
+}
+
+/**
+
+ Ingests image files as they are written into a folder, as when shooting tethered, reporting each file's metadata
+ and embedded preview as soon as their bytes are on disk, well before the camera software has finished writing it.
+
+ Each file being ingested is watched for writes with a dispatch source. On every write, the analysis of the file
+ (see `PartialFileAnalysis`) is resumed from where the previous one left off, so only the headers and directories
+ still unsettled are read; image data is never read before it is needed. A file is complete once its structure is
+ complete and it has not grown for `settleInterval`; for formats whose structure is not understood, once it has not
+ grown for `settleInterval`. There is no write-close notification on Darwin, so that settling stands in for one.
+
+ Files are read on a queue of the ingest's own, but images are only updated on the event queue, just before the
+ event about them is handled.
+
+ */
+public final class TetheredIngest {
+    public enum Event {
+        /** Preliminary metadata, read from the partially written file. Also set as the image's metadata. */
+        case metadataAvailable(image: Image, metadata: ImageMetadata)
+        /** The embedded preview, decoded. */
+        case previewAvailable(image: Image, preview: CGImage)
+        /** The file is completely written, and the image's full metadata loaded. */
+        case completed(image: Image, metadata: ImageMetadata)
+        case failed(image: Image, error: Swift.Error)
+    }
+
+    public typealias EventHandler = (_ event: Event) -> Void
+
+    public let settleInterval: TimeInterval
+    /** How long a file may go without growing before it is given up as incomplete. */
+    public let timeout: TimeInterval
+    /** If given, previews are scaled down to at most this many pixels on their long side. */
+    public let previewMaximumPixelSize: Int?
+
+    private let queue = DispatchQueue(label: "com.sashimiapp.TetheredIngestQueue")
+    private var trackers = [ObjectIdentifier: FileTracker]()
+
+    public init(settleInterval: TimeInterval = 0.2, timeout: TimeInterval = 60, previewMaximumPixelSize: Int? = nil) {
+        self.settleInterval = settleInterval
+        self.timeout = timeout
+        self.previewMaximumPixelSize = previewMaximumPixelSize
+    }
+
+    /** Ingest the file of `image`, which may still be being written. Events are delivered on `eventQueue`. */
+    public func ingest(_ image: Image, eventQueue: DispatchQueue = .main, eventHandler: @escaping EventHandler) {
+        queue.async {
+            guard self.trackers[ObjectIdentifier(image)] == nil, let url = image.URL else {
+                return
+            }
+            let fd = open(url.path, O_RDONLY)
+            guard fd >= 0 else {
+                let error = ImageByteSourceError.failedToOpen(url: url, errno: errno)
+                eventQueue.async {
+                    eventHandler(.failed(image: image, error: error))
+                }
+                return
+            }
+
+            let tracker = FileTracker(image: image, url: url, fd: fd, eventQueue: eventQueue, eventHandler: eventHandler)
+            self.trackers[ObjectIdentifier(image)] = tracker
+
+            let source = DispatchSource.makeFileSystemObjectSource(fileDescriptor: fd, eventMask: [.write, .extend, .delete, .rename], queue: self.queue)
+            source.setEventHandler { [weak self, weak tracker] in
+                guard let self = self, let tracker = tracker else {
+                    return
+                }
+                self.evaluate(tracker)
+            }
+            source.setCancelHandler {
+                close(fd)
+            }
+            tracker.source = source
+            source.resume()
+
+            self.evaluate(tracker)
+        }
+    }
+
+    /**
+     Watch `collection`'s folder, ingesting images as they are added to it. Keep the returned watcher for as long as
+     ingesting should continue. The folder is watched with FSEvents on macOS, and with a kqueue source elsewhere, so
+     new files are noticed within tens of milliseconds either way.
+     */
+    public func watch(_ collection: Collection, eventQueue: DispatchQueue = .main, eventHandler: @escaping EventHandler) throws -> CollectionWatcher {
+        let watcher = try CollectionWatcher(collection: collection, latency: 0.02)
+        try watcher.start(queue: eventQueue) { [weak self] changes in
+            for image in changes.added {
+                self?.ingest(image, eventQueue: eventQueue, eventHandler: eventHandler)
+            }
+        }
+        return watcher
+    }
+
+    public func cancelAll() {
+        queue.async {
+            for tracker in self.trackers.values {
+                tracker.stop()
+            }
+            self.trackers.removeAll()
+        }
+    }
+
+    // MARK: Tracking
+
+    private final class FileTracker {
+        let image: Image
+        let url: URL
+        let fd: Int32
+        let eventQueue: DispatchQueue
+        let eventHandler: EventHandler
+
+        var source: DispatchSourceFileSystemObject?
+        var settleTimer: DispatchSourceTimer?
+        var byteCount = 0
+        var analysis: PartialFileAnalysis?
+        var lastGrowth = Date()
+        var hasReportedMetadata = false
+        var hasReportedPreview = false
+
+        init(image: Image, url: URL, fd: Int32, eventQueue: DispatchQueue, eventHandler: @escaping EventHandler) {
+            self.image = image
+            self.url = url
+            self.fd = fd
+            self.eventQueue = eventQueue
+            self.eventHandler = eventHandler
+        }
+
+        /** Send `event`, first applying `update` to the image on the event queue. */
+        func send(_ event: Event, updatingImage update: (() -> Void)? = nil) {
+            let handler = eventHandler
+            eventQueue.async {
+                update?()
+                handler(event)
+            }
+        }
+
+        func stop() {
+            settleTimer?.cancel()
+            settleTimer = nil
+            // Closes the file
+            source?.cancel()
+            source = nil
+        }
+    }
+
+    // Called on `queue`.
+    private func evaluate(_ tracker: FileTracker) {
+        var fileStat = stat()
+        guard fstat(tracker.fd, &fileStat) == 0, fileStat.st_nlink > 0 else {
+            finish(tracker, with: .failed(image: tracker.image, error: TetheredIngestError.fileRemoved(tracker.url)))
+            return
+        }
+
+        let size = Int(fileStat.st_size)
+        if size != tracker.byteCount {
+            tracker.lastGrowth = Date()
+        }
+        tracker.byteCount = size
+
+        let fd = tracker.fd
+        let analysis = PartialFileAnalysis(byteCount: size, fetch: { range in
+            guard range.lowerBound >= 0, range.upperBound <= size else {
+                return nil
+            }
+            return BatchedFileReader.pread(fd, range: range).data
+        }, resumingFrom: tracker.analysis)
+        tracker.analysis = analysis
+
+        let image = tracker.image
+        if !tracker.hasReportedMetadata, analysis.isMetadataAvailable, let metadata = preliminaryMetadata(from: analysis, of: tracker) {
+            tracker.hasReportedMetadata = true
+            tracker.send(.metadataAvailable(image: image, metadata: metadata)) {
+                image.updateMetadata(metadata)
+            }
+        }
+
+        if !tracker.hasReportedPreview, analysis.isPreviewAvailable, let range = analysis.previewRange,
+           let previewData = BatchedFileReader.pread(fd, range: range).data, previewData.count == range.count, let preview = decodePreview(previewData) {
+            tracker.hasReportedPreview = true
+            tracker.send(.previewAvailable(image: image, preview: preview))
+        }
+
+        let quietTime = Date().timeIntervalSince(tracker.lastGrowth)
+        if quietTime >= settleInterval && analysis.isStructurallyComplete ?? true {
+            complete(tracker)
+        } else if quietTime >= timeout {
+            finish(tracker, with: .failed(image: tracker.image, error: TetheredIngestError.fileIncomplete(tracker.url)))
+        } else {
+            // Writes trigger evaluation too; this catches the file settling
+            let timer = DispatchSource.makeTimerSource(queue: queue)
+            timer.schedule(deadline: .now() + settleInterval)
+            timer.setEventHandler { [weak self, weak tracker] in
+                guard let self = self, let tracker = tracker else {
+                    return
+                }
+                self.evaluate(tracker)
+            }
+            tracker.settleTimer?.cancel()
+            tracker.settleTimer = timer
+            timer.resume()
+        }
+    }
+
+    private func complete(_ tracker: FileTracker) {
+        let image = tracker.image
+        // Anything read while the file was being written is stale
+        ImageByteSourcePool.shared.invalidate(tracker.url)
+        FileAttributeCache.shared.refreshAttributes(for: tracker.url)
+
+        do {
+            // Loaded from the file already open here, leaving the image to the event queue
+            let metadata = try ImageLoader(byteSource: byteSource(for: tracker), thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata()
+            finish(tracker, with: .completed(image: image, metadata: metadata)) {
+                image.fileContentsDidChange()
+                image.updateMetadata(metadata)
+            }
+        } catch {
+            finish(tracker, with: .failed(image: image, error: error)) {
+                image.fileContentsDidChange()
+            }
+        }
+    }
+
+    private func finish(_ tracker: FileTracker, with event: Event, updatingImage update: (() -> Void)? = nil) {
+        tracker.stop()
+        trackers[ObjectIdentifier(tracker.image)] = nil
+        tracker.send(event, updatingImage: update)
+    }
+
+    /** The file as far as it has been written, read through the tracker's descriptor. */
+    private func byteSource(for tracker: FileTracker) -> ImageByteSource {
+        return RangeReadableByteSource(url: tracker.url, count: tracker.byteCount, readRange: BatchedFileReader.preadReader(for: tracker.fd, url: tracker.url))
+    }
+
+    private func preliminaryMetadata(from analysis: PartialFileAnalysis, of tracker: FileTracker) -> ImageMetadata? {
+        switch analysis.container {
+        case .tiff(let structure):
+            return try? ImageMetadata(tiffStructure: structure, in: byteSource(for: tracker))
+        case .jpeg:
+            // The headers are enough for ImageIO's properties; the scan data need not be read
+            guard let headerLength = analysis.jpegHeaderLength,
+                  let header = BatchedFileReader.pread(tracker.fd, range: 0 ..< headerLength).data,
+                  let source = CGImageSourceCreateWithData(header as CFData, [kCGImageSourceShouldCache: false] as CFDictionary) else {
+                return nil
+            }
+            return try? ImageMetadata(imageSource: source)
+        case .unknown:
+            return nil
+        }
+    }
+
+    private func decodePreview(_ data: Data) -> CGImage? {
+        guard let source = CGImageSourceCreateWithData(data as CFData, nil) else {
+            return nil
+        }
+        guard let maximumPixelSize = previewMaximumPixelSize else {
+            return CGImageSourceCreateImageAtIndex(source, 0, [kCGImageSourceShouldCacheImmediately: true] as CFDictionary)
+        }
+        let options: [CFString: Any] = [
+            kCGImageSourceCreateThumbnailFromImageAlways: true,
+            kCGImageSourceThumbnailMaxPixelSize: maximumPixelSize,
+            kCGImageSourceShouldCacheImmediately: true
+        ]
+        return CGImageSourceCreateThumbnailAtIndex(source, 0, options as CFDictionary)
+    }
+}
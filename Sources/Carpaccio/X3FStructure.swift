@@ -0,0 +1,242 @@
+//
+//  X3FStructure.swift
+//  Carpaccio
+//
+//  Created by Matias Piipari on 17/10/2026.
+//  Copyright © 2026 Matias Piipari & Co. All rights reserved.
+//
+
+import Foundation
+import CoreGraphics
+import ImageIO
+
+public enum X3FStructureError: Swift.Error, LocalizedError {
+    case notX3F
+    case noDirectory
+
+    public var errorDescription: String? {
+        switch self {
+        case .notX3F:
+            return "Data does not begin with an X3F header"
+        case .noDirectory:
+            return "X3F file has no valid section directory"
+        }
+    }
+}
+
+/**
+
+ The layout of a Sigma / Foveon X3F file, as needed for metadata and previews.
+
+ An X3F file begins with a "FOVb" header giving the image dimensions and rotation, and ends with the offset of a
+ "SECd" directory listing its sections: a "SECp" property list of camera settings, "SECi" image sections (the
+ Foveon RAW data, and an embedded JPEG preview) and "SECc" calibration data. Only the header, the directory, the
+ property list and the image section headers are read; all integers are little endian.
+
+ */
+public struct X3FStructure {
+    public typealias Fetch = TIFFStructure.Fetch
+
+    public struct Section {
+        public let type: String
+        public let range: Range<Int>
+    }
+
+    public struct ImageSection {
+        public let type: Int
+        public let format: Int
+        public let size: CGSize
+        /** Absolute range of the image data, following the section header. */
+        public let dataRange: Range<Int>
+
+        /** Processed for preview (type 2), and JPEG compressed (format 18). */
+        public var isJPEGPreview: Bool {
+            return type == 2 && format == 18
+        }
+    }
+
+    public let version: UInt32
+    /** Image dimensions given by the header, if any (not given by version 4 headers). */
+    public let headerSize: CGSize?
+    /** Clockwise rotation for display, in degrees. */
+    public let rotation: Int
+    public let sections: [Section]
+    public let imageSections: [ImageSection]
+    /** The property list: camera make and model, exposure settings, capture time. */
+    public let properties: [String: String]
+
+    private static let maximumSectionCount = 1024
+    private static let maximumPropertyListSize = 1024 * 1024
+
+    public init(count: Int, fetch: Fetch) throws {
+        guard let header = try fetch(0 ..< min(count, 40)), header.hasPrefix(Array("FOVb".utf8)),
+              let version = header.uint32(at: 4, .littleEndian) else {
+            throw X3FStructureError.notX3F
+        }
+        self.version = version
+
+        if version < 0x0004_0000, let columns = header.uint32(at: 28, .littleEndian), let rows = header.uint32(at: 32, .littleEndian), columns > 0, rows > 0 {
+            self.headerSize = CGSize(width: Int(columns), height: Int(rows))
+            self.rotation = header.uint32(at: 36, .littleEndian).map { Int($0) % 360 } ?? 0
+        } else {
+            self.headerSize = nil
+            self.rotation = 0
+        }
+
+        // The last four bytes of the file give the offset of the directory
+        guard count >= 4, let trailer = try fetch((count - 4) ..< count), let directoryOffset = trailer.uint32(at: 0, .littleEndian).map({ Int($0) }),
+              directoryOffset + 12 <= count, let directoryHeader = try fetch(directoryOffset ..< (directoryOffset + 12)),
+              directoryHeader.hasPrefix(Array("SECd".utf8)), let entryCount = directoryHeader.uint32(at: 8, .littleEndian).map({ Int($0) }),
+              entryCount <= X3FStructure.maximumSectionCount, directoryOffset + 12 + entryCount * 12 <= count,
+              let directory = try fetch((directoryOffset + 12) ..< (directoryOffset + 12 + entryCount * 12)) else {
+            throw X3FStructureError.noDirectory
+        }
+
+        var sections = [Section]()
+        for i in 0 ..< entryCount {
+            guard let offset = directory.uint32(at: i * 12, .littleEndian).map({ Int($0) }),
+                  let length = directory.uint32(at: i * 12 + 4, .littleEndian).map({ Int($0) }),
+                  let type = directory.fourCC(at: i * 12 + 8), offset + length <= count else {
+                continue
+            }
+            sections.append(Section(type: type, range: offset ..< (offset + length)))
+        }
+        self.sections = sections
+
+        var imageSections = [ImageSection]()
+        for section in sections where section.type == "IMAG" || section.type == "IMA2" {
+            guard section.range.count >= 28, let data = try fetch(section.range.prefix(28)), data.hasPrefix(Array("SECi".utf8)),
+                  let type = data.uint32(at: 8, .littleEndian), let format = data.uint32(at: 12, .littleEndian),
+                  let columns = data.uint32(at: 16, .littleEndian), let rows = data.uint32(at: 20, .littleEndian) else {
+                continue
+            }
+            imageSections.append(ImageSection(type: Int(type), format: Int(format), size: CGSize(width: Int(columns), height: Int(rows)),
+                                              dataRange: (section.range.lowerBound + 28) ..< section.range.upperBound))
+        }
+        self.imageSections = imageSections
+
+        if let propertyList = sections.first(where: { $0.type == "PROP" }), propertyList.range.count <= X3FStructure.maximumPropertyListSize,
+           let data = try fetch(propertyList.range) {
+            self.properties = X3FStructure.properties(in: data)
+        } else {
+            self.properties = [:]
+        }
+    }
+
+    /** The structure of a byte source, parsed once and cached in the source's container cache. */
+    public static func read(from source: ImageByteSource) throws -> X3FStructure {
+        return try source.containerCache.value(forKey: "com.sashimiapp.X3F.structure") {
+            try X3FStructure(count: source.count) { range in
+                guard range.lowerBound >= 0, range.upperBound <= source.count else {
+                    return nil
+                }
+                return try source.bytes(in: range)
+            }
+        }
+    }
+
+    /** The embedded JPEG previews, smallest first. */
+    public var previews: [EmbeddedPreview] {
+        return imageSections.filter { $0.isJPEGPreview }
+            .map { EmbeddedPreview(range: $0.dataRange, size: $0.size) }
+            .sorted { $0.pixelCount < $1.pixelCount }
+    }
+
+    /** The largest JPEG preview, as bytes of `source` itself: memory mapped sources are not copied. */
+    public func previewBytes(in source: ImageByteSource) throws -> Data? {
+        guard let preview = previews.last else {
+            return nil
+        }
+        return try source.bytes(in: preview.range)
+    }
+
+    /**
+     Metadata from the property list. Files without one fall back to the EXIF metadata of the embedded JPEG preview
+     for camera and exposure details.
+     */
+    public func metadata(in source: ImageByteSource) throws -> ImageMetadata {
+        let rawSize = imageSections.filter { !$0.isJPEGPreview }.map { $0.size }.max { $0.width * $0.height < $1.width * $1.height }
+        guard let size = headerSize ?? rawSize ?? previews.last?.size else {
+            throw Image.Error.invalidImageSize
+        }
+
+        let previewMetadata: ImageMetadata? = {
+            guard properties.isEmpty, let preview = previews.last,
+                  let imageSource = try? SubrangeByteSource(parent: source, range: preview.range, url: source.url).imageSource() else {
+                return nil
+            }
+            return try? ImageMetadata(imageSource: imageSource)
+        }()
+
+        func string(_ name: String) -> String? {
+            return properties[name].flatMap { $0.isEmpty ? nil : $0 }
+        }
+        func number(_ name: String) -> Double? {
+            return string(name).flatMap { Double($0) }
+        }
+
+        let orientation: ImageOrientation
+        switch rotation {
+        case 90:
+            orientation = .right
+        case 180:
+            orientation = .down
+        case 270:
+            orientation = .left
+        default:
+            orientation = .up
+        }
+
+        return ImageMetadata(
+            nativeSize: size,
+            nativeOrientation: orientation,
+            fNumber: number("APERTURE") ?? previewMetadata?.fNumber,
+            focalLength: number("FLENGTH") ?? previewMetadata?.focalLength,
+            focalLength35mmEquivalent: number("FLEQ35MM") ?? previewMetadata?.focalLength35mmEquivalent,
+            iso: number("ISO") ?? previewMetadata?.iso,
+            shutterSpeed: number("EXPTIME").map { $0 / 1_000_000 } ?? previewMetadata?.shutterSpeed,
+            cameraMaker: string("CAMMANUF") ?? previewMetadata?.cameraMaker,
+            cameraModel: string("CAMMODEL") ?? previewMetadata?.cameraModel,
+            timestamp: number("TIME").map { Date(timeIntervalSince1970: $0) } ?? previewMetadata?.timestamp,
+            lensModel: previewMetadata?.lensModel
+        )
+    }
+
+    /**
+     Name/value pairs of a "SECp" section: a header, pairs of character offsets to names and values, then the
+     characters themselves as null terminated UTF-16 strings.
+     */
+    static func properties(in data: Data) -> [String: String] {
+        guard data.hasPrefix(Array("SECp".utf8)), let entryCount = data.uint32(at: 8, .littleEndian).map({ Int($0) }),
+              let characterFormat = data.uint32(at: 12, .littleEndian), characterFormat == 0 else {
+            return [:]
+        }
+        let charactersStart = 24 + entryCount * 8
+        guard charactersStart <= data.count else {
+            return [:]
+        }
+
+        func string(atCharacter index: Int) -> String? {
+            var units = [UInt16]()
+            var offset = charactersStart + index * 2
+            while let unit = data.uint16(at: offset, .littleEndian), unit != 0 {
+                units.append(unit)
+                offset += 2
+            }
+            return String(decoding: units, as: UTF16.self)
+        }
+
+        var properties = [String: String]()
+        for i in 0 ..< entryCount {
+            guard let nameOffset = data.uint32(at: 24 + i * 8, .littleEndian), let valueOffset = data.uint32(at: 28 + i * 8, .littleEndian),
+                  let name = string(atCharacter: Int(nameOffset)), let value = string(atCharacter: Int(valueOffset)) else {
+                continue
+            }
+            properties[name] = value
+        }
+        return properties
+    }
+}
+
+extension X3FStructure: NativeImageContainer {
+}
@@ -7,6 +7,8 @@
 //
 
 import XCTest
+import CommonCrypto
+import Compression
 @testable import Carpaccio
 
 class CarpaccioTests: XCTestCase {
@@ -141,10 +143,12 @@ class CarpaccioTests: XCTestCase {
         }
     }
     
-    func testFailingMetadataThrowsError() {
-        guard let url = Bundle.module.url(forResource: "DP2M1726", withExtension: "X3F") else {
-            XCTAssert(false)
-            return
+    func testFailingMetadataThrowsError() throws {
+        // An X3F header with no section directory: neither the X3F parser nor ImageIO can read it
+        let url = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString + ".X3F")
+        try (Data("FOVb".utf8) + Data(count: 4092)).write(to: url)
+        defer {
+            try? FileManager.default.removeItem(at: url)
         }
         
         let loader = ImageLoader(imageURL: url, thumbnailScheme: .decodeFullImageIfEmbeddedThumbnailMissing)
@@ -233,4 +237,2173 @@ class CarpaccioTests: XCTestCase {
         XCTAssertEqual(map[image2], "dog")
         XCTAssertEqual(map[image3], "walrus")
     }
+
+    func testByteSourcePoolReusesMapping() throws {
+        let url = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let pool = ImageByteSourcePool(maximumOpenFileCount: 2)
+
+        let source1 = try pool.byteSource(for: url)
+        let source2 = try pool.byteSource(for: url)
+        XCTAssert(source1 === source2)
+        XCTAssert(try source1.imageSource() === source2.imageSource())
+
+        let header = try source1.bytes(in: 0 ..< 2)
+        XCTAssertEqual([UInt8](header), [0xFF, 0xD8])
+        XCTAssertThrowsError(try source1.bytes(in: 0 ..< (source1.count + 1)))
+    }
+
+    func testInMemoryAndRangeReadableByteSourcesLoadMetadata() throws {
+        let url = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let data = try Data(contentsOf: url)
+
+        let inMemoryLoader = ImageLoader(byteSource: InMemoryByteSource(data: data, url: url), thumbnailScheme: .decodeEmbeddedThumbnail)
+        XCTAssertEqual(try inMemoryLoader.loadImageMetadata().cameraModel, "iPhone 5")
+
+        var readCount = 0
+        let rangeSource = RangeReadableByteSource(url: url, count: data.count, blockSize: 4096) { range in
+            readCount += 1
+            return data.subdata(in: range)
+        }
+        let rangeLoader = ImageLoader(byteSource: rangeSource, thumbnailScheme: .decodeEmbeddedThumbnail)
+        let metadata = try rangeLoader.loadImageMetadata()
+        XCTAssertEqual(metadata.nativeSize.width, 3264.0)
+        XCTAssertGreaterThan(readCount, 0)
+        XCTAssertEqual(try rangeSource.bytes(in: 4090 ..< 4100), data.subdata(in: 4090 ..< 4100))
+    }
+
+    func testBatchedReaderFollowsTIFFStructure() throws {
+        let urls = ["DSC00583", "DSC00588", "DSC00593"].map { Bundle.module.url(forResource: $0, withExtension: "ARW")! }
+
+        for backend in [BatchedFileReader.Backend.dispatchIO, .pread(threadCount: 2)] {
+            let reader = BatchedFileReader(backend: backend, queueDepth: 4, headerLength: 4096, blockSize: 4096)
+            let results = reader.readAndWait(urls)
+            XCTAssertEqual(results.count, urls.count)
+
+            for result in results {
+                let source = try result.get()
+                let planned = try TIFFStructure(fetch: { source.cachedBytes(in: $0) })
+                XCTAssertTrue(planned.unresolvedRanges.isEmpty)
+                XCTAssertNotNil(planned.exifIFD)
+
+                let image = Image(URL: source.url)
+                XCTAssertEqual(try image.fetchMetadata(from: source).cameraModel, "ILCE-7RM2")
+            }
+        }
+    }
+
+    func testPhysicalOrderSchedulerVisitsEveryFileOnce() throws {
+        let resourcesDir = Bundle.module.resourceURL!
+        let urls = try Collection.imageURLs(at: resourcesDir)
+        let scheduler = PhysicalOrderScheduler(ordering: .physicalOffset, maximumConcurrencyPerDevice: 1)
+
+        XCTAssertEqual(Set(scheduler.ordered(urls)), Set(urls))
+
+        var visited = [URL]()
+        scheduler.perform(urls) { url in
+            visited.append(url)
+        }
+        XCTAssertEqual(visited, scheduler.ordered(urls))
+    }
+
+    func testDirectoryWalkerMatchesExtensionsCaseInsensitively() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory() + "/\(UUID().uuidString)")
+        let skippedDir = tempDir.appendingPathComponent("Skipped")
+        let nestedDir = tempDir.appendingPathComponent("A").appendingPathComponent("B")
+        try FileManager.default.createDirectory(at: skippedDir, withIntermediateDirectories: true, attributes: [:])
+        try FileManager.default.createDirectory(at: nestedDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        for url in [tempDir.appendingPathComponent("1.JPG"),
+                    tempDir.appendingPathComponent("2.txt"),
+                    tempDir.appendingPathComponent("noextension"),
+                    nestedDir.appendingPathComponent("3.Arw"),
+                    skippedDir.appendingPathComponent("4.dng")] {
+            try Data().write(to: url)
+        }
+
+        let urls = try Collection.imageURLs(at: tempDir) { $0.lastPathComponent != "Skipped" }
+        XCTAssertEqual(urls.map { $0.lastPathComponent }, ["1.JPG", "3.Arw"])
+    }
+
+    func testIncrementalLoadingReportsImagesInDiscoveryOrder() {
+        let resourcesDir = Bundle.module.resourceURL!
+        let finished = expectation(description: "Loading finished")
+        var discovered = [Int]()
+        var metadataEvents = 0
+
+        Collection.loadIncrementally(contentsOfURL: resourcesDir, eventHandler: { event in
+            switch event {
+            case .discovered(let index, _):
+                discovered.append(index)
+            case .metadataLoaded, .metadataFailed:
+                metadataEvents += 1
+            }
+        }, completion: { result in
+            let images = try! result.get()
+            XCTAssertEqual(discovered, Array(0 ..< images.count))
+            XCTAssertEqual(metadataEvents, images.count)
+            XCTAssertGreaterThan(images.count, 0)
+            finished.fulfill()
+        })
+
+        wait(for: [finished], timeout: 60.0)
+    }
+
+    func testCollectionImagesHaveStableIdentity() throws {
+        let resourcesDir = Bundle.module.resourceURL!
+        let imgColl = try Collection(contentsOf: resourcesDir)
+
+        XCTAssertEqual(Array(imgColl.images), Array(imgColl.images))
+        XCTAssertEqual(imgColl.imageCount, imgColl.imageStore.count)
+
+        let image = imgColl.imageStore[0]
+        XCTAssertTrue(imgColl.contains(image: image))
+        XCTAssertFalse(imgColl.contains(image: Image(URL: image.URL!)))
+        XCTAssertTrue(imgColl.images(forURLs: [image.URL!]).first === image)
+
+        // Lookups by URL never scan the store: an image whose URL changed behind its back is found by neither URL
+        // until reindexing, and a URL that was never indexed is simply not present
+        let originalURL = image.URL!
+        let movedURL = originalURL.deletingLastPathComponent().appendingPathComponent("Keepers").appendingPathComponent(image.name)
+        image.updateURL(movedURL)
+        XCTAssertFalse(imgColl.images(forURLs: [originalURL, movedURL]).contains { $0 === image })
+        imgColl.imageURLsDidChange()
+        XCTAssertTrue(imgColl.images(forURLs: [movedURL]).first === image)
+        XCTAssertTrue(imgColl.images(forURLs: [originalURL]).isEmpty)
+    }
+
+    func testImageStoreRemovalRenumbersLookups() {
+        let urls = (0 ..< 6).map { URL(fileURLWithPath: "/tmp/store/\($0 % 4).jpg") }
+        let images = urls.map { Image(URL: $0) }
+        var store = ImageStore(images)
+        XCTAssertEqual(store.indices(of: urls[1]), [1, 5])
+
+        // Removing images renumbers those after them, and promotes the next duplicate of a removed URL
+        store.remove(at: IndexSet([0, 1, 3]))
+        XCTAssertEqual(store.map { $0.URL! }, [urls[2], urls[4], urls[5]])
+        XCTAssertEqual(store.indices(of: urls[0]), [1])
+        XCTAssertEqual(store.indices(of: urls[1]), [2])
+        XCTAssertEqual(store.indices(of: urls[3]), [])
+        XCTAssertEqual(store.index(of: images[5]), 2)
+        XCTAssertNil(store.index(of: images[1]))
+    }
+
+    func testImageCatalogRoundTripsMetadata() throws {
+        let url = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let metadata = try Image(URL: url).fetchMetadata()
+
+        let catalog = ImageCatalog()
+        catalog.append(url: url, metadata: metadata)
+        catalog.append(url: url.deletingLastPathComponent().appendingPathComponent("other.jpg"), metadata: nil)
+
+        XCTAssertEqual(catalog.count, 2)
+        XCTAssertEqual(catalog.directories.count, 1)
+        XCTAssertEqual(catalog[0].url, url)
+        XCTAssertEqual(catalog[1].name, "other.jpg")
+        XCTAssertNil(catalog[1].metadata)
+
+        let restored = try XCTUnwrap(catalog[0].metadata)
+        XCTAssertEqual(restored.nativeSize, metadata.nativeSize)
+        XCTAssertEqual(restored.nativeOrientation, metadata.nativeOrientation)
+        XCTAssertEqual(restored.cameraModel, metadata.cameraModel)
+        XCTAssertEqual(restored.timestamp, metadata.timestamp)
+        XCTAssertEqual(restored.fNumber!, metadata.fNumber!, accuracy: 0.0001)
+        XCTAssertEqual(restored.iso, metadata.iso)
+    }
+
+    func testMetadataTableFiltersSortsAndGroups() throws {
+        let resourcesDir = Bundle.module.resourceURL!
+        let imgColl = try Collection(contentsOf: resourcesDir)
+        let table = MetadataTable(collection: imgColl)
+        XCTAssertEqual(table.count, imgColl.imageCount)
+
+        let rowsByName = Dictionary(uniqueKeysWithValues: (0 ..< table.count).map { (table.catalog.name(at: $0), $0) })
+        let iphoneRow = try XCTUnwrap(rowsByName["iphone5.jpg"])
+        let sonyRows = table.rows(withCameraModel: "ILCE-7RM2")
+        for name in ["DSC00583.ARW", "DSC00588.ARW", "DSC00593.ARW"] {
+            XCTAssertTrue(sonyRows.contains(try XCTUnwrap(rowsByName[name])))
+        }
+
+        let lowISORows = table.rows(where: .iso, isIn: 0 ... 50)
+        XCTAssertTrue(lowISORows.contains(iphoneRow))
+        XCTAssertFalse((sonyRows & lowISORows).contains(iphoneRow))
+        XCTAssertTrue((!sonyRows).contains(iphoneRow))
+        XCTAssertTrue(table.rows(where: .fNumber, isIn: 2.4 ... 2.4).contains(iphoneRow))
+
+        let byTimestamp = table.sortPermutation(by: .timestamp)
+        XCTAssertEqual(Set(byTimestamp), Set(0 ..< table.count))
+        let timestamps = byTimestamp.compactMap { table.catalog.timestamps[$0] }
+        XCTAssertEqual(timestamps, timestamps.sorted())
+        XCTAssertEqual(table.sortPermutation(by: .timestamp, ascending: false).prefix(timestamps.count).compactMap { table.catalog.timestamps[$0] }, timestamps.reversed())
+
+        let cameraGroups = table.groups(by: .camera)
+        XCTAssertEqual(cameraGroups.reduce(0) { $0 + $1.rows.count }, table.count)
+        XCTAssertEqual(cameraGroups.first { $0.name == "ILCE-7RM2" }?.rows.count, sonyRows.count)
+
+        let dayGroups = table.groups(by: .day(TimeZone(secondsFromGMT: 0)!), of: table.rows(withValueIn: .timestamp))
+        XCTAssertEqual(dayGroups.reduce(0) { $0 + $1.rows.count }, timestamps.count)
+        XCTAssertEqual(dayGroups.map { $0.name! }, dayGroups.map { $0.name! }.sorted())
+    }
+
+    func testDirectoryWalkerCachesFileAttributes() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString).standardizedFileURL
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        let url = tempDir.appendingPathComponent("1.jpg")
+        try Data(count: 10).write(to: url)
+        let modificationDate = Date(timeIntervalSince1970: 1_500_000_000)
+        try FileManager.default.setAttributes([.modificationDate: modificationDate], ofItemAtPath: url.path)
+
+        let cache = FileAttributeCache()
+        try DirectoryWalker(attributeCache: cache).walk(tempDir) { _ in }
+
+        let attributes = try XCTUnwrap(cache.cachedAttributes(for: url))
+        XCTAssertEqual(attributes.size, 10)
+        XCTAssertEqual(attributes.modificationDate, modificationDate)
+        XCTAssertEqual(attributes.inode, FileAttributes(path: url.path)?.inode)
+        XCTAssertEqual(Image(URL: url).fileTimestamp, modificationDate)
+    }
+
+    func testCollectionWatcherAppliesChangesIncrementally() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString).standardizedFileURL
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        let firstURL = tempDir.appendingPathComponent("1.jpg")
+        try Data(count: 1).write(to: firstURL)
+        let imgColl = try Collection(contentsOf: tempDir)
+        let first = try XCTUnwrap(imgColl.imageStore.first)
+
+        let watcher = try CollectionWatcher(collection: imgColl, mode: .polling(interval: 0.05))
+        try watcher.start()
+        defer {
+            watcher.stop()
+        }
+
+        let secondURL = tempDir.appendingPathComponent("2.JPG")
+        try Data(count: 1).write(to: secondURL)
+        expectation(for: NSPredicate { _, _ in imgColl.imageCount == 2 }, evaluatedWith: nil)
+        waitForExpectations(timeout: 5)
+
+        let renamedURL = tempDir.appendingPathComponent("renamed.jpg")
+        try FileManager.default.moveItem(at: firstURL, to: renamedURL)
+        expectation(for: NSPredicate { _, _ in first.URL == renamedURL }, evaluatedWith: nil)
+        waitForExpectations(timeout: 5)
+        XCTAssertEqual(imgColl.imageCount, 2)
+        XCTAssertTrue(imgColl.images(forURLs: [renamedURL]).first === first)
+
+        try FileManager.default.removeItem(at: secondURL)
+        expectation(for: NSPredicate { _, _ in imgColl.imageCount == 1 }, evaluatedWith: nil)
+        waitForExpectations(timeout: 5)
+        XCTAssertTrue(imgColl.imageStore.first === first)
+    }
+
+    func testPartialFileAnalysisDetectsIncompleteFiles() throws {
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let jpegData = try Data(contentsOf: jpegURL)
+        let completeJPEG = PartialFileAnalysis(data: jpegData)
+        XCTAssertEqual(completeJPEG.isStructurallyComplete, true)
+        XCTAssertTrue(completeJPEG.isMetadataAvailable)
+        let truncatedJPEG = PartialFileAnalysis(data: jpegData.prefix(jpegData.count / 2))
+        XCTAssertEqual(truncatedJPEG.isStructurallyComplete, false)
+        XCTAssertTrue(truncatedJPEG.isMetadataAvailable)
+
+        let rawURL = Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!
+        let rawData = try Data(contentsOf: rawURL)
+        let completeRAW = PartialFileAnalysis(data: rawData)
+        XCTAssertEqual(completeRAW.isStructurallyComplete, true)
+        XCTAssertTrue(completeRAW.isMetadataAvailable)
+        XCTAssertTrue(completeRAW.isPreviewAvailable)
+        XCTAssertEqual(PartialFileAnalysis(data: rawData.prefix(rawData.count / 2)).isStructurallyComplete, false)
+        XCTAssertFalse(PartialFileAnalysis(data: rawData.prefix(16)).isMetadataAvailable)
+
+        // Resumed write by write, the analysis of a growing file ends where one of the whole file does
+        for (data, complete) in [(jpegData, completeJPEG), (rawData, completeRAW)] {
+            var analysis: PartialFileAnalysis?
+            for length in Array(stride(from: 1024, to: data.count, by: data.count / 7)) + [data.count] {
+                let written = data.prefix(length)
+                analysis = PartialFileAnalysis(byteCount: length, fetch: { range in
+                    range.upperBound <= written.count ? written.subdata(from: range.lowerBound, count: range.count) : nil
+                }, resumingFrom: analysis)
+            }
+            XCTAssertEqual(analysis?.isStructurallyComplete, complete.isStructurallyComplete)
+            XCTAssertEqual(analysis?.isMetadataAvailable, complete.isMetadataAvailable)
+            XCTAssertEqual(analysis?.previewRange, complete.previewRange)
+        }
+
+        let source = InMemoryByteSource(data: rawData, url: rawURL)
+        let metadata = try ImageMetadata(tiffStructure: TIFFStructure.read(from: source), in: source)
+        XCTAssertEqual(metadata.cameraModel, "ILCE-7RM2")
+        XCTAssertNotNil(metadata.timestamp)
+    }
+
+    func testCardImporterCopiesHashesAndParsesInOnePass() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString)
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        let sourceURLs = [Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!,
+                          Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!]
+        let importer = CardImporter(chunkSize: 64 * 1024, maximumBufferedFileCount: 1)
+        let results = importer.importFilesAndWait(sourceURLs, to: tempDir)
+        XCTAssertEqual(results.count, 2)
+
+        for (sourceURL, result) in zip(sourceURLs, results) {
+            let importedFile = try result.get()
+            let sourceData = try Data(contentsOf: sourceURL)
+            XCTAssertEqual(try Data(contentsOf: importedFile.destinationURL), sourceData)
+
+            var digest = [UInt8](repeating: 0, count: Int(CC_SHA256_DIGEST_LENGTH))
+            sourceData.withUnsafeBytes { _ = CC_SHA256($0.baseAddress, CC_LONG($0.count), &digest) }
+            XCTAssertEqual(importedFile.sha256, digest.map { String(format: "%02x", $0) }.joined())
+
+            XCTAssertNotNil(importedFile.metadata)
+            XCTAssertNotNil(importedFile.preview)
+            XCTAssertEqual(importedFile.image.metadata?.nativeSize, importedFile.metadata?.nativeSize)
+        }
+
+        // Never overwrites
+        XCTAssertThrowsError(try importer.importFilesAndWait([sourceURLs[0]], to: tempDir)[0].get())
+        XCTAssertEqual(try FileManager.default.contentsOfDirectory(atPath: tempDir.path).sorted(), ["DSC00583.ARW", "iphone5.jpg"])
+    }
+
+    func testHTTPRangeReaderReadsOnlyMetadataAndPreview() throws {
+        let directory = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!.deletingLastPathComponent()
+        let server = try LocalHTTPServer(directory: directory)
+        defer {
+            server.stop()
+        }
+
+        for name in ["iphone5.jpg", "DSC00583.ARW"] {
+            let localURL = directory.appendingPathComponent(name)
+            let fileSize = try Data(contentsOf: localURL).count
+            let reader = HTTPRangeReader(blockSize: 16 * 1024)
+
+            let preview = try reader.loadPreview(of: server.url(forPath: name), maximumPixelDimensions: CGSize(width: 256, height: 256))
+            XCTAssertNotNil(preview.image)
+            XCTAssertLessThanOrEqual(max(preview.image?.width ?? 0, preview.image?.height ?? 0), 256)
+            XCTAssertEqual(preview.metadata?.cameraModel, try ImageLoader(imageURL: localURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata().cameraModel)
+            XCTAssertLessThan(reader.bytesTransferred, fileSize / 4, "\(name): \(reader.bytesTransferred) of \(fileSize) bytes transferred")
+
+            // Arbitrary reads through the block cache match the file
+            let source = try reader.byteSource(for: server.url(forPath: name))
+            XCTAssertEqual(source.count, fileSize)
+            let range = (fileSize / 3) ..< (fileSize / 3 + 100_000)
+            XCTAssertEqual(try source.bytes(in: range), try Data(contentsOf: localURL)[range])
+        }
+
+        XCTAssertThrowsError(try HTTPRangeReader().byteSource(for: server.url(forPath: "missing.jpg")))
+
+        // A file sent whole in answer to a range request is not transferred again
+        let rawURL = directory.appendingPathComponent("DSC00583.ARW")
+        let rawData = try Data(contentsOf: rawURL)
+        let wholeFileServer = try LocalHTTPServer(directory: directory, supportsRanges: false)
+        defer {
+            wholeFileServer.stop()
+        }
+        let reader = HTTPRangeReader(blockSize: 16 * 1024)
+        let source = try reader.byteSource(for: wholeFileServer.url(forPath: "DSC00583.ARW"))
+        XCTAssertEqual(source.count, rawData.count)
+        let ranges = [100_000 ..< 120_000, 2_000_000 ..< 2_100_000]
+        try source.prefetch(ranges)
+        XCTAssertEqual(try source.bytes(in: ranges[1]), rawData[ranges[1]])
+        XCTAssertEqual(reader.requestCount, 1)
+        XCTAssertEqual(reader.bytesTransferred, rawData.count)
+    }
+
+    func testReadPlanCoalescesNearbyRangesIntoVectoredReads() throws {
+        let plan = ReadPlan([900 ..< 1000, 0 ..< 100, 50 ..< 150, 160 ..< 200, 0 ..< 0], gapThreshold: 16)
+        XCTAssertEqual(plan.reads.map { $0.span }, [0 ..< 200, 900 ..< 1000])
+        XCTAssertEqual(plan.reads[0].ranges, [0 ..< 150, 160 ..< 200])
+        XCTAssertEqual(plan.reads[0].gaps, [150 ..< 160])
+        XCTAssertEqual(plan.byteCount, 300)
+
+        let rawURL = Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!
+        let rawData = try Data(contentsOf: rawURL)
+        let ranges = [4096 ..< 8192, 12288 ..< 16384, 1_000_000 ..< 1_100_000]
+
+        // Local files: one preadv per read of the plan, through a descriptor kept open between calls
+        let reader = BatchedFileReader.preadvReader(for: rawURL, gapThreshold: 8192)
+        XCTAssertEqual(try reader(ranges), ranges.map { rawData[$0] })
+        XCTAssertEqual(try reader(Array(ranges.reversed().prefix(1))), [rawData[ranges[2]]])
+
+        // Mapped files are advised a level of directories at a time, leaving the structure parsed; JPEGs are left alone
+        let mappedRAW = try MappedFileByteSource(fileURL: rawURL)
+        mappedRAW.prefetchThumbnailRanges()
+        XCTAssertEqual(TIFFStructure.cached(in: mappedRAW)?.ifds.count, try TIFFStructure(fetch: { rawData.subdata(from: $0.lowerBound, count: $0.count) }).ifds.count)
+        let mappedJPEG = try MappedFileByteSource(fileURL: Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!)
+        mappedJPEG.prefetchThumbnailRanges()
+        XCTAssertNil(TIFFStructure.cached(in: mappedJPEG))
+
+        // Remote files: one multi-range request for all, or with servers ignoring those, one request per range
+        let directory = rawURL.deletingLastPathComponent()
+        for supportsMultipleRanges in [true, false] {
+            let server = try LocalHTTPServer(directory: directory, supportsMultipleRanges: supportsMultipleRanges)
+            defer {
+                server.stop()
+            }
+            let reader = HTTPRangeReader(blockSize: 4096, gapThreshold: 0)
+            let source = try reader.byteSource(for: server.url(forPath: "DSC00583.ARW"))
+            let requestCount = reader.requestCount
+
+            try source.prefetch(ranges)
+            XCTAssertEqual(reader.requestCount - requestCount, 1)
+            for range in ranges {
+                XCTAssertEqual(source.cachedBytes(in: range), rawData[range])
+            }
+
+            if !supportsMultipleRanges {
+                let ranges = [20480 ..< 24576, 2_000_000 ..< 2_004_096]
+                try source.prefetch(ranges)
+                XCTAssertEqual(reader.requestCount - requestCount, 3)
+                XCTAssertEqual(source.cachedBytes(in: ranges[1]), rawData[ranges[1]])
+            }
+        }
+    }
+
+    func testCollectionLoadsImagesFromZIPAndTARArchives() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString)
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let rawURL = Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!
+        let files: [(path: String, data: Data)] = [("./DCIM/100MSDCF/DSC00583.ARW", try Data(contentsOf: rawURL)),
+                                                   ("DCIM/iphone5.jpg", try Data(contentsOf: jpegURL)),
+                                                   ("notes.txt", Data("Not an image".utf8))]
+
+        let zipURL = tempDir.appendingPathComponent("delivery.zip")
+        try ArchiveFixture.zip(files, deflating: ["./DCIM/100MSDCF/DSC00583.ARW"]).write(to: zipURL)
+        let tarURL = tempDir.appendingPathComponent("backup.tar")
+        try ArchiveFixture.tar(files).write(to: tarURL)
+
+        for archiveURL in [zipURL, tarURL] {
+            let urls = try Collection.imageURLs(at: archiveURL)
+            XCTAssertEqual(urls.map { $0.path }, [archiveURL.path + "/DCIM/100MSDCF/DSC00583.ARW", archiveURL.path + "/DCIM/iphone5.jpg"])
+
+            let collection = try Collection(contentsOf: archiveURL)
+            XCTAssertEqual(collection.imageCount, 2)
+            for (image, originalURL) in zip(collection.images, [rawURL, jpegURL]) {
+                let metadata = try image.fetchMetadata()
+                let originalMetadata = try ImageLoader(imageURL: originalURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata()
+                XCTAssertEqual(metadata.cameraModel, originalMetadata.cameraModel)
+                XCTAssertEqual(metadata.nativeSize, originalMetadata.nativeSize)
+                XCTAssertNotNil(image.fileTimestamp)
+                XCTAssertNoThrow(try image.fetchThumbnail(presentedHeight: 100, colorSpace: nil, cancelled: nil))
+            }
+        }
+
+        // Stored members are windows onto the mapped archive; deflated ones inflate only as far as they are read
+        let archive = try ImageArchive.open(at: zipURL)
+        let jpegSource = try archive.byteSource(forMemberAt: "DCIM/iphone5.jpg")
+        XCTAssertTrue(jpegSource is SubrangeByteSource)
+        XCTAssertEqual(try jpegSource.allBytes(), files[1].data)
+
+        let rawSource = try XCTUnwrap(try ImageArchive.byteSource(forMemberAt: zipURL.appendingPathComponent("DCIM/100MSDCF/DSC00583.ARW")) as? InflatingByteSource)
+        XCTAssertEqual(try rawSource.bytes(in: 0 ..< 1024), files[0].data[0 ..< 1024])
+        XCTAssertLessThan(rawSource.inflatedByteCount, files[0].data.count / 4)
+        XCTAssertEqual(try rawSource.allBytes(), files[0].data)
+        XCTAssertThrowsError(try InflatingByteSource(parent: rawSource.parent, compressedRange: rawSource.compressedRange, count: Int.max, url: rawSource.url))
+
+        XCTAssertEqual(archive.member(at: "notes.txt")?.isImage, false)
+        XCTAssertThrowsError(try archive.byteSource(forMemberAt: "DCIM/missing.jpg"))
+    }
+
+    func testTARArchiveIgnoresMalformedPAXRecords() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString)
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        // An mtime beyond any file timestamp, then a record whose length ends it before its key
+        let paxRecords = Data("15 mtime=1e300\n1 path=x\n".utf8)
+        let tarURL = tempDir.appendingPathComponent("backup.tar")
+        try ArchiveFixture.tar([("PaxHeaders/a.jpg", paxRecords), ("a.jpg", Data(count: 10))], typeFlags: ["PaxHeaders/a.jpg": "x"]).write(to: tarURL)
+
+        let archive = try ImageArchive.open(at: tarURL)
+        XCTAssertEqual(archive.members.map { $0.path }, ["a.jpg"])
+        XCTAssertEqual(archive.member(at: "a.jpg")?.modificationDate, Date(timeIntervalSince1970: 1e300))
+
+        let cache = FileAttributeCache()
+        let urls = archive.imageURLs(attributeCache: cache)
+        XCTAssertEqual(urls.map { $0.lastPathComponent }, ["a.jpg"])
+        let attributes = try XCTUnwrap(cache.cachedAttributes(for: urls[0]))
+        XCTAssertEqual(attributes.modificationDate, FileAttributes(path: tarURL.path)?.modificationDate)
+    }
+
+    func testImageFormatIsSniffedFromContentAndDispatchedToAHandler() throws {
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let rawURL = Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!
+        let x3fURL = Bundle.module.url(forResource: "DP2M1726", withExtension: "X3F")!
+
+        XCTAssertEqual(try ImageFormat(source: ImageLoader.byteSource(for: jpegURL)), .jpeg)
+        XCTAssertEqual(try ImageFormat(source: ImageLoader.byteSource(for: rawURL)), .tiff(.standard))
+        XCTAssertEqual(try ImageFormat(source: ImageLoader.byteSource(for: x3fURL)), .x3f)
+        XCTAssertEqual(ImageFormat(header: Data("II*\0\u{10}\0\0\0CR\u{02}\0".utf8)), .tiff(.cr2))
+        XCTAssertEqual(ImageFormat(header: Data("FUJIFILMCCD-RAW 0201".utf8)), .raf)
+        XCTAssertEqual(ImageFormat(header: Data([0, 0, 0, 0x18]) + Data("ftypcrx ".utf8)), .isoBMFF(brand: "crx "))
+        XCTAssertNil(ImageFormat(header: Data("Not an image".utf8)))
+
+        // Metadata fetched from a source at hand tells the format too, without the file being sniffed again
+        let batchedImage = Image(URL: rawURL)
+        _ = try batchedImage.fetchMetadata(from: InMemoryByteSource(data: Data(contentsOf: rawURL), url: rawURL))
+        XCTAssertEqual(batchedImage.format, .tiff(.standard))
+        XCTAssertEqual(batchedImage.metadataState, .completed)
+
+        // Mislabelled and extensionless files are loaded according to their content
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString)
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+        let mislabelledURL = tempDir.appendingPathComponent("mislabelled.ARW")
+        let extensionlessURL = tempDir.appendingPathComponent("extensionless")
+        try FileManager.default.copyItem(at: jpegURL, to: mislabelledURL)
+        try FileManager.default.copyItem(at: jpegURL, to: extensionlessURL)
+
+        let images = Array(try Collection.loadImages(at: [mislabelledURL, extensionlessURL]))
+        XCTAssertEqual(images.count, 2)
+        for image in images {
+            XCTAssertEqual(try image.fetchMetadata().nativeSize, try Image(URL: jpegURL).fetchMetadata().nativeSize)
+            XCTAssertEqual(image.format, .jpeg)
+            XCTAssertFalse(image.isRAW)
+        }
+
+        // ImageIO does not claim X3F, so without another handler it fails without an attempted decode
+        XCTAssertNil(ImageFormatRegistry(handlers: [ImageIOFormatHandler()]).handler(for: .x3f))
+        XCTAssertEqual(ImageFormatRegistry.shared.handler(for: .x3f)?.name, "Native container")
+        XCTAssertTrue(Image(URL: x3fURL).isRAW)
+
+        // The most capable handler wins, and the last registered one between equals
+        final class StubHandler: ImageFormatHandler {
+            let name: String
+            let claimed: [ImageFormat: ImageFormatCapabilities]
+            init(name: String, claimed: [ImageFormat: ImageFormatCapabilities]) {
+                self.name = name
+                self.claimed = claimed
+            }
+            func capabilities(for format: ImageFormat) -> ImageFormatCapabilities {
+                return claimed[format] ?? []
+            }
+            func makeLoader(imageURL: URL, format: ImageFormat, thumbnailScheme: ImageLoader.ThumbnailScheme) -> ImageLoaderProtocol {
+                return ImageLoader(imageURL: imageURL, thumbnailScheme: thumbnailScheme)
+            }
+        }
+        let registry = ImageFormatRegistry(handlers: [ImageIOFormatHandler()])
+        let previewOnly = StubHandler(name: "Preview only", claimed: [.jpeg: [.metadata], .x3f: [.metadata, .embeddedPreview]])
+        let regions = StubHandler(name: "Regions", claimed: [.jpeg: .all])
+        registry.register(previewOnly)
+        registry.register(regions)
+
+        XCTAssertEqual(registry.handlers(for: .jpeg).map { $0.name }, ["Regions", "ImageIO", "Preview only"])
+        XCTAssertEqual(registry.handler(for: .x3f)?.name, "Preview only")
+        XCTAssertNil(registry.handler(for: .x3f, requiring: .fullDecode))
+        registry.unregister(regions)
+        XCTAssertEqual(registry.handler(for: .jpeg, requiring: .embeddedPreview)?.name, "ImageIO")
+    }
+
+    func testISOBMFFStructureReadsCR3AndHEIFMetadataAndPreviews() throws {
+        let tempDir = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString)
+        try FileManager.default.createDirectory(at: tempDir, withIntermediateDirectories: true, attributes: [:])
+        defer {
+            try? FileManager.default.removeItem(at: tempDir)
+        }
+
+        // The TIFF structure of an ARW stands in for the Exif of both files
+        let rawURL = Bundle.module.url(forResource: "DSC00583", withExtension: "ARW")!
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let tiff = try Data(contentsOf: rawURL)
+        let jpeg = try Data(contentsOf: jpegURL)
+        let rawMetadata = try ImageLoader(imageURL: rawURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata()
+        let jpegSize = try ImageLoader(imageURL: jpegURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata().nativeSize
+
+        let cr3URL = tempDir.appendingPathComponent("IMG_0001.CR3")
+        try BoxFixture.cr3(tiff: tiff, preview: jpeg, previewSize: jpegSize, rawSize: CGSize(width: 6000, height: 4000)).write(to: cr3URL)
+        let heicURL = tempDir.appendingPathComponent("IMG_0002.HEIC")
+        try BoxFixture.heif(tiff: tiff, size: CGSize(width: 4032, height: 3024), rotation: 3).write(to: heicURL)
+
+        let cr3Source = try ImageLoader.byteSource(for: cr3URL)
+        XCTAssertEqual(try ImageFormat(source: cr3Source), .isoBMFF(brand: "crx "))
+        let cr3 = try ISOBMFFStructure.read(from: cr3Source)
+        XCTAssertTrue(cr3.isCR3)
+        XCTAssertEqual(cr3.previews.map { $0.size }, [CGSize(width: 160, height: 120), jpegSize])
+        XCTAssertEqual(try cr3.previews.map { try cr3Source.bytes(in: $0.range) }, [jpeg, jpeg])
+
+        // ImageIO cannot read the synthetic file, so metadata and thumbnail both come from the parsed boxes
+        let cr3Image = Image(URL: cr3URL)
+        XCTAssertTrue(cr3Image.isRAW)
+        let cr3Metadata = try cr3Image.fetchMetadata()
+        XCTAssertEqual(cr3Metadata.nativeSize, CGSize(width: 6000, height: 4000))
+        XCTAssertEqual(cr3Metadata.cameraModel, rawMetadata.cameraModel)
+        XCTAssertEqual(cr3Metadata.fNumber, rawMetadata.fNumber)
+        XCTAssertNoThrow(try cr3Image.fetchThumbnail(presentedHeight: 100, colorSpace: nil, cancelled: nil))
+
+        let heif = try ISOBMFFStructure.read(from: ImageLoader.byteSource(for: heicURL))
+        XCTAssertEqual(heif.majorBrand, "heic")
+        XCTAssertEqual(heif.rotation, 3)
+        XCTAssertTrue(heif.previews.isEmpty)
+        let heifMetadata = try ImageLoader(imageURL: heicURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata()
+        XCTAssertEqual(heifMetadata.nativeSize, CGSize(width: 4032, height: 3024))
+        XCTAssertEqual(heifMetadata.nativeOrientation, .right)
+        XCTAssertEqual(heifMetadata.cameraMaker, rawMetadata.cameraMaker)
+        XCTAssertEqual(heifMetadata.timestamp, rawMetadata.timestamp)
+
+        // A 64-bit box size reaching past the end of the file ends the box list rather than overflowing
+        let truncated = BoxFixture.box("free", Data()) + uint32(1, .bigEndian) + Data("mdat".utf8) + Data([0x7F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF])
+        let boxes = try ISOBMFFStructure.boxes(in: 0 ..< truncated.count) { truncated.subdata(from: $0.lowerBound, count: $0.count) }
+        XCTAssertEqual(boxes.map { $0.type }, ["free"])
+    }
+
+    func testX3FStructureReadsPropertiesAndPreviewWithoutDecoding() throws {
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let jpeg = try Data(contentsOf: jpegURL)
+        let jpegSize = try ImageLoader(imageURL: jpegURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata().nativeSize
+
+        let url = URL(fileURLWithPath: NSTemporaryDirectory()).appendingPathComponent(UUID().uuidString + ".X3F")
+        let properties = [("CAMMANUF", "SIGMA"), ("CAMMODEL", "SIGMA DP2 Merrill"), ("APERTURE", "5.6"), ("EXPTIME", "4000"),
+                          ("ISO", "200"), ("FLENGTH", "30"), ("FLEQ35MM", "45"), ("TIME", "1350000000")]
+        try X3FFixture.x3f(preview: jpeg, previewSize: jpegSize, size: CGSize(width: 4704, height: 3136), rotation: 90, properties: properties).write(to: url)
+        defer {
+            try? FileManager.default.removeItem(at: url)
+        }
+
+        let source = try ImageLoader.byteSource(for: url)
+        let structure = try X3FStructure.read(from: source)
+        XCTAssertEqual(structure.properties["CAMMODEL"], "SIGMA DP2 Merrill")
+        XCTAssertEqual(structure.previews.map { $0.size }, [jpegSize])
+        XCTAssertEqual(try structure.previewBytes(in: source), jpeg)
+
+        let image = Image(URL: url)
+        let metadata = try image.fetchMetadata()
+        XCTAssertEqual(metadata.nativeSize, CGSize(width: 4704, height: 3136))
+        XCTAssertEqual(metadata.nativeOrientation, .right)
+        XCTAssertEqual(metadata.cameraMaker, "SIGMA")
+        XCTAssertEqual(metadata.fNumber, 5.6)
+        XCTAssertEqual(metadata.shutterSpeed, 0.004)
+        XCTAssertEqual(metadata.iso, 200)
+        XCTAssertEqual(metadata.timestamp, Date(timeIntervalSince1970: 1_350_000_000))
+
+        // Portrait: the preview is turned like the image, even if it is smaller than asked for
+        let thumbnail = try image.fetchThumbnail(presentedHeight: 10_000, colorSpace: nil, cancelled: nil)
+        XCTAssertGreaterThan(thumbnail.size.height, thumbnail.size.width)
+
+        // The fixture from a real camera
+        let sigmaURL = Bundle.module.url(forResource: "DP2M1726", withExtension: "X3F")!
+        let sigmaStructure = try X3FStructure.read(from: ImageLoader.byteSource(for: sigmaURL))
+        XCTAssertFalse(sigmaStructure.previews.isEmpty)
+        let sigmaMetadata = try Image(URL: sigmaURL).fetchMetadata()
+        XCTAssertGreaterThan(sigmaMetadata.nativeSize.width, 0)
+        XCTAssertNotNil(sigmaMetadata.cameraModel)
+    }
+
+    func testDNGLayoutListsRenditionsAndPicksCheapestSufficientPreview() throws {
+        let jpegURL = Bundle.module.url(forResource: "iphone5", withExtension: "jpg")!
+        let jpeg = try Data(contentsOf: jpegURL)
+        let jpegSize = try ImageLoader(imageURL: jpegURL, thumbnailScheme: .decodeEmbeddedThumbnail).loadImageMetadata().nativeSize
+        let raw = Data((0 ..< 512).map { UInt8($0 % 251) })
+
+        // IFD0: small JPEG thumbnail; SubIFDs: tiled 16x16 CFA data, and a large JPEG preview
+        let dng = TIFFFixture.tiff(blobs: [jpeg, raw]) { ifdOffsets, blobOffsets -> [[TIFFFixture.Entry]] in
+            func jpegRendition(width: Int, height: Int) -> [TIFFFixture.Entry] {
+                return [.init(254, 4, [1]), .init(256, 4, [width]), .init(257, 4, [height]), .init(258, 3, [8, 8, 8]), .init(259, 3, [7]),
+                        .init(262, 3, [6]), .init(273, 4, [blobOffsets[0]]), .init(277, 3, [3]), .init(279, 4, [jpeg.count])]
+            }
+            let ifd0 = jpegRendition(width: 160, height: 120) + [.init(330, 4, [ifdOffsets[1], ifdOffsets[2]]), .init(50706, 1, [1, 4, 0, 0])]
+            let rawIFD: [TIFFFixture.Entry] = [.init(254, 4, [0]), .init(256, 4, [16]), .init(257, 4, [16]), .init(258, 3, [16]), .init(259, 3, [1]),
+                                               .init(262, 3, [32803]), .init(277, 3, [1]), .init(322, 3, [8]), .init(323, 3, [8]),
+                                               .init(324, 4, (0 ..< 4).map { blobOffsets[1] + $0 * 128 }), .init(325, 4, [128, 128, 128, 128])]
+            return [ifd0, rawIFD, jpegRendition(width: Int(jpegSize.width), height: Int(jpegSize.height))]
+        }
+        let source = InMemoryByteSource(data: dng, url: URL(fileURLWithPath: "/tmp/synthetic.dng"))
+
+        XCTAssertEqual(try ImageFormat.previewContainer(of: source)?.previews.count, 2)
+        let layout = try DNGLayout.read(from: source)
+        XCTAssertEqual(layout.version, [1, 4, 0, 0])
+        XCTAssertEqual(layout.renditions.count, 3)
+        XCTAssertEqual(layout.renditions.filter { $0.isReducedResolution }.count, 2)
+
+        let rawRendition = try XCTUnwrap(layout.raw)
+        XCTAssertEqual(rawRendition.tileSize, CGSize(width: 8, height: 8))
+        XCTAssertEqual(rawRendition.tiles.map { [$0.x, $0.y] }, [[0, 0], [8, 0], [0, 8], [8, 8]])
+        XCTAssertNil(rawRendition.standaloneJPEGRange)
+
+        var tileBytes = [Int: Data]()
+        let lock = NSLock()
+        try layout.forEachTile(of: rawRendition, in: source) { tile, data in
+            lock.lock()
+            tileBytes[tile.y * 16 + tile.x] = data
+            lock.unlock()
+        }
+        XCTAssertEqual(tileBytes[8 * 16 + 8], raw[384 ..< 512])
+
+        XCTAssertEqual(layout.previews.map { $0.size }, [CGSize(width: 160, height: 120), jpegSize])
+        XCTAssertEqual(layout.cheapestPreview(fulfilling: CGSize(constrainHeight: 100))?.size, CGSize(width: 160, height: 120))
+        XCTAssertEqual(layout.cheapestPreview(fulfilling: CGSize(constrainHeight: 1000))?.size, jpegSize)
+        XCTAssertNil(layout.cheapestPreview(fulfilling: CGSize(constrainHeight: 100_000)))
+
+        // The hdrmerge fixture keeps its floating point RAW data in tiles
+        let hdrURL = Bundle.module.url(forResource: "hdrmerge-bayer-fp16-w-pred-deflate", withExtension: "dng")!
+        let hdrLayout = try DNGLayout.read(from: ImageLoader.byteSource(for: hdrURL))
+        let hdrRaw = try XCTUnwrap(hdrLayout.raw)
+        XCTAssertEqual(hdrRaw.compression, DNGLayout.Compression.deflate)
+        XCTAssertEqual(hdrRaw.tiles.reduce(0) { $0 + $1.width * $1.height }, hdrRaw.width * hdrRaw.height)
+    }
+
+    func testPNGStructureReadsMetadataChunksWithoutDecoding() throws {
+        let exif = TIFFFixture.tiff(blobs: []) { _, _ in
+            [[.init(271, 2, Array("Apple\0".utf8).map { Int($0) }), .init(274, 3, [6])]]
+        }
+        let xmp = Data("<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"/>".utf8)
+        let png = PNGFixture.png(width: 2880, height: 1800, chunks: [
+            ("sRGB", Data([0])),
+            ("iTXt", Data("XML:com.adobe.xmp\0\0\0\0\0".utf8) + xmp),
+            ("eXIf", exif),
+            ("IDAT", Data(count: 64)),
+            ("tEXt", Data("Comment\0after image data".utf8))
+        ])
+        let source = InMemoryByteSource(data: png, url: URL(fileURLWithPath: "/tmp/screenshot.png"))
+
+        XCTAssertTrue(try ImageFormat.nativeContainer(of: source) is PNGStructure)
+        let structure = try PNGStructure.read(from: source)
+        XCTAssertEqual(structure.chunks.map { $0.type }, ["IHDR", "sRGB", "iTXt", "eXIf", "IDAT"])
+        XCTAssertEqual(try structure.xmpData(in: source), xmp)
+        XCTAssertTrue(structure.previews.isEmpty)
+
+        let metadata = try structure.metadata(in: source)
+        XCTAssertEqual(metadata.nativeSize, CGSize(width: 2880, height: 1800))
+        XCTAssertEqual(metadata.nativeOrientation, .right)
+        XCTAssertEqual(metadata.cameraMaker, "Apple")
+        XCTAssertEqual(metadata.colorSpaceName, CGColorSpace.sRGB as String)
+
+        let fullStructure = try PNGStructure(count: png.count, stopsAtImageData: false) { png.subdata(from: $0.lowerBound, count: $0.count) }
+        XCTAssertEqual(fullStructure.chunks.map { $0.type }.suffix(2), ["tEXt", "IEND"])
+
+        XCTAssertThrowsError(try PNGStructure(count: 8, fetch: { png.subdata(from: $0.lowerBound, count: $0.count) }))
+    }
+
+    func testNEFDecoderDecodesLosslessHuffmanCodedData() throws {
+        try assertNEFDecoderDecodesHuffmanCodedData(linearizationVersion: 0x46, tree: 2)
+    }
+
+    func testNEFDecoderDecodesLossyHuffmanCodedData() throws {
+        for tree in NEFDecoder.trees {
+            XCTAssertEqual(tree.counts.reduce(0) { $0 + Int($1) }, tree.symbols.count)
+            XCTAssertNoThrow(try HuffmanTable(counts: tree.counts, symbols: tree.symbols))
+        }
+        // A version 0x44 0x10 table with no curve selects the 12-bit lossy tree, whose symbols have no shift
+        try assertNEFDecoderDecodesHuffmanCodedData(linearizationVersion: 0x44, tree: 0)
+    }
+
+    private func assertNEFDecoderDecodesHuffmanCodedData(linearizationVersion: UInt8, tree treeIndex: Int) throws {
+        let width = 8, height = 4
+        let pixels = (0 ..< width * height).map { i in (i % width * 397 + i / width * 1021 + 100) % 4096 }
+
+        // Code each pixel as its difference from the previous one of the same colour, with the given 12-bit tree
+        let tree = NEFDecoder.trees[treeIndex]
+        var codes = [Int: (code: Int, length: Int)]()
+        var code = 0, k = 0
+        for length in 1 ... 16 {
+            for _ in 0 ..< Int(tree.counts[length - 1]) {
+                codes[Int(tree.symbols[k])] = (code, length)
+                code += 1
+                k += 1
+            }
+            code <<= 1
+        }
+        var bits = [Bool]()
+        func put(_ value: Int, _ length: Int) {
+            for i in stride(from: length - 1, through: 0, by: -1) {
+                bits.append((value >> i) & 1 == 1)
+            }
+        }
+        var verticalPredictors = [2048, 2048, 2048, 2048]
+        for y in 0 ..< height {
+            var horizontalPredictors = [0, 0]
+            for x in 0 ..< width {
+                let value = pixels[y * width + x]
+                let difference = value - (x < 2 ? verticalPredictors[(y & 1) * 2 + x] : horizontalPredictors[x & 1])
+                let length = difference == 0 ? 0 : Int.bitWidth - abs(difference).leadingZeroBitCount
+                put(codes[length]!.code, codes[length]!.length)
+                put(difference >= 0 ? difference : difference + (1 << length) - 1, length)
+                if x < 2 {
+                    verticalPredictors[(y & 1) * 2 + x] = value
+                }
+                horizontalPredictors[x & 1] = value
+            }
+        }
+        let bitstream = Data(stride(from: 0, to: bits.count, by: 8).map { start in
+            (0 ..< 8).reduce(UInt8(0)) { byte, i in byte << 1 | (start + i < bits.count && bits[start + i] ? 1 : 0) }
+        })
+
+        func nef(_ bitstream: Data) -> Data {
+            // Big endian maker note TIFF: white balance levels 2 and 1.5, and a linearization table without a curve
+            let linearization = Data([linearizationVersion, linearizationVersion == 0x46 ? 0x30 : 0x10]) + uint16(2048, .bigEndian) + uint16(2048, .bigEndian) + uint16(2048, .bigEndian) + uint16(2048, .bigEndian) + uint16(0, .bigEndian)
+            let makerNote = Data("Nikon\0".utf8) + Data([2, 0x10, 0, 0]) + Data("MM\0*".utf8) + uint32(8, .bigEndian) + uint16(2, .bigEndian)
+                + uint16(0x0C, .bigEndian) + uint16(5, .bigEndian) + uint32(2, .bigEndian) + uint32(38, .bigEndian)
+                + uint16(0x96, .bigEndian) + uint16(7, .bigEndian) + uint32(linearization.count, .bigEndian) + uint32(54, .bigEndian) + uint32(0, .bigEndian)
+                + uint32(2, .bigEndian) + uint32(1, .bigEndian) + uint32(3, .bigEndian) + uint32(2, .bigEndian) + linearization
+
+            return TIFFFixture.tiff(blobs: [bitstream]) { ifdOffsets, blobOffsets -> [[TIFFFixture.Entry]] in
+                let ifd0: [TIFFFixture.Entry] = [.init(271, 2, Array("NIKON CORPORATION\0".utf8).map { Int($0) }),
+                                                 .init(330, 4, [ifdOffsets[1]]), .init(34665, 4, [ifdOffsets[2]])]
+                let rawIFD: [TIFFFixture.Entry] = [.init(254, 4, [0]), .init(256, 4, [width]), .init(257, 4, [height]), .init(258, 3, [12]),
+                                                   .init(259, 3, [34713]), .init(262, 3, [32803]), .init(273, 4, [blobOffsets[0]]),
+                                                   .init(277, 3, [1]), .init(278, 4, [height]), .init(279, 4, [bitstream.count]),
+                                                   .init(33421, 3, [2, 2]), .init(33422, 1, [1, 2, 0, 1])]
+                let exifIFD: [TIFFFixture.Entry] = [.init(37500, 7, Array(makerNote).map { Int($0) })]
+                return [ifd0, rawIFD, exifIFD]
+            }
+        }
+
+        let source = InMemoryByteSource(data: nef(bitstream), url: URL(fileURLWithPath: "/tmp/synthetic.nef"))
+        let decoder = try XCTUnwrap(RAWDecoders.decoder(for: source) as? NEFDecoder)
+        XCTAssertEqual(decoder.size, CGSize(width: width, height: height))
+
+        let image = try decoder.decode()
+        XCTAssertEqual(Array(image.pixels), pixels.map { UInt16($0) })
+        XCTAssertEqual(image.cfaPattern, CFAPattern.gbrg)
+        XCTAssertEqual(image.whiteLevel, 4095)
+        XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+
+        let rendered = try XCTUnwrap(image.rgbImage(maximumPixelDimension: 4))
+        XCTAssertEqual(rendered.size, CGSize(width: 4, height: 2))
+        XCTAssertEqual(image.rgbImage(maximumPixelDimension: 8)?.size, CGSize(width: width, height: height))
+
+        let truncatedSource = InMemoryByteSource(data: nef(bitstream.prefix(bitstream.count / 2)), url: URL(fileURLWithPath: "/tmp/truncated.nef"))
+        XCTAssertThrowsError(try RAWDecoders.decoder(for: truncatedSource)?.decode())
+    }
+
+    func testRW2DecoderUnpacksBlocksOfBothRawFormats() throws {
+        let width = 70, height = 2
+        let pixels = (0 ..< width * height).map { i in 1000 + (i * 37) % 200 }
+
+        // Bits of a 128-bit little endian packet, laid out most (raw format 4) or least (raw format 5) significant first
+        func packet(_ bits: [Bool], mostSignificantFirst: Bool) -> [UInt8] {
+            return (0 ..< 16).map { k in
+                (0 ..< 8).reduce(UInt8(0)) { byte, b in
+                    let index = mostSignificantFirst ? (15 - k) * 8 + (7 - b) : k * 8 + b
+                    return byte | (index < bits.count && bits[index] ? 1 << b : 0)
+                }
+            }
+        }
+        func put(_ value: Int, _ length: Int, mostSignificantFirst: Bool, into bits: inout [Bool]) {
+            for i in 0 ..< length {
+                bits.append((value >> (mostSignificantFirst ? length - 1 - i : i)) & 1 == 1)
+            }
+        }
+
+        // Raw format 4: two first values, then deltas at shift 0
+        var adaptivePackets = [UInt8]()
+        for first in stride(from: 0, to: pixels.count, by: 14) {
+            var bits = [Bool]()
+            for i in 0 ..< 14 {
+                let value = pixels[first + i]
+                if i % 3 == 2 {
+                    put(0, 2, mostSignificantFirst: true, into: &bits)
+                }
+                if i < 2 {
+                    put(value >> 4, 8, mostSignificantFirst: true, into: &bits)
+                    put(value & 15, 4, mostSignificantFirst: true, into: &bits)
+                } else {
+                    put(value - pixels[first + i - 2] + 128, 8, mostSignificantFirst: true, into: &bits)
+                }
+            }
+            adaptivePackets += packet(bits, mostSignificantFirst: true)
+        }
+
+        // Raw format 5: ten 12-bit values per packet
+        var packedPackets = [UInt8]()
+        for first in stride(from: 0, to: pixels.count, by: 10) {
+            var bits = [Bool]()
+            for value in pixels[first ..< (first + 10)] {
+                put(value, 12, mostSignificantFirst: false, into: &bits)
+            }
+            packedPackets += packet(bits, mostSignificantFirst: false)
+        }
+
+        func rw2(rawFormat: Int, packets: [UInt8]) -> Data {
+            // Blocks are stored with their bytes from the split offset on first
+            let splitOffset = rawFormat == 5 ? 0x1FF8 : 0x2008
+            let block = packets + [UInt8](repeating: 0, count: 0x4000 - packets.count)
+            let stored = Data(block[splitOffset...] + block[..<splitOffset])
+
+            var file = TIFFFixture.tiff(blobs: [stored]) { _, blobOffsets -> [[TIFFFixture.Entry]] in
+                [[.init(0x02, 3, [width]), .init(0x03, 3, [height]), .init(0x09, 3, [4]), .init(0x0A, 3, [12]),
+                  .init(0x1C, 3, [144]), .init(0x1D, 3, [144]), .init(0x1E, 3, [144]), .init(0x24, 3, [512]),
+                  .init(0x25, 3, [256]), .init(0x26, 3, [384]), .init(0x2D, 3, [rawFormat]),
+                  .init(271, 2, Array("Panasonic\0".utf8).map { Int($0) }), .init(0x118, 4, [blobOffsets[0]])]]
+            }
+            file[2] = 0x55
+            return file
+        }
+
+        for (rawFormat, packets) in [(4, adaptivePackets), (5, packedPackets)] {
+            let source = InMemoryByteSource(data: rw2(rawFormat: rawFormat, packets: packets), url: URL(fileURLWithPath: "/tmp/synthetic.rw2"))
+            let decoder = try XCTUnwrap(RAWDecoders.decoder(for: source) as? RW2Decoder)
+            XCTAssertEqual(decoder.rawFormat, rawFormat)
+            // Only binned sizes are rendered natively, full resolution is left to Core Image
+            XCTAssertTrue(decoder.canRender(maximumPixelDimension: width / 2))
+            XCTAssertFalse(decoder.canRender(maximumPixelDimension: width))
+            XCTAssertFalse(decoder.canRender(maximumPixelDimension: nil))
+
+            let image = try decoder.decode()
+            XCTAssertEqual(Array(image.pixels), pixels.map { UInt16($0) }, "Raw format \(rawFormat)")
+            XCTAssertEqual(image.cfaPattern, CFAPattern.bggr)
+            XCTAssertEqual(image.blackLevel, 144)
+            XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+            XCTAssertEqual(image.demosaicedImage()?.size, CGSize(width: width, height: height))
+        }
+    }
+
+    func testORFAndPEFDecodersDecodeTheirEntropyCoding() throws {
+        let width = 32, height = 8
+        var bits = [Bool]()
+        func put(_ value: Int, _ length: Int) {
+            for i in stride(from: length - 1, through: 0, by: -1) {
+                bits.append((value >> i) & 1 == 1)
+            }
+        }
+        func bitstream() -> Data {
+            defer { bits = [] }
+            return Data(stride(from: 0, to: bits.count, by: 8).map { start in
+                (0 ..< 8).reduce(UInt8(0)) { byte, i in byte << 1 | (start + i < bits.count && bits[start + i] ? 1 : 0) }
+            })
+        }
+
+        // Olympus: a smooth image, apart from a first pixel large enough for its high bits to be given in full
+        var olympusPixels = (0 ..< width * height).map { i in 500 + (i % width) * 3 + (i / width) * 2 + (i * 7) % 5 }
+        olympusPixels[0] = 4000
+        for y in 0 ..< height {
+            var carries = [Int](repeating: 0, count: 6)
+            for x in 0 ..< width {
+                func pixel(_ x: Int, _ y: Int) -> Int {
+                    return olympusPixels[y * width + x]
+                }
+                let c = (x & 1) * 3
+                let i = carries[c + 2] < 3 ? 2 : 0
+                let lowBitCount = max(2 + i, 16 - UInt16(truncatingIfNeeded: carries[c]).leadingZeroBitCount - i)
+
+                let prediction: Int
+                if y < 2 && x < 2 {
+                    prediction = 0
+                } else if y < 2 {
+                    prediction = pixel(x - 2, y)
+                } else if x < 2 {
+                    prediction = pixel(x, y - 2)
+                } else {
+                    let west = pixel(x - 2, y), north = pixel(x, y - 2), northWest = pixel(x - 2, y - 2)
+                    if (west < northWest && northWest < north) || (north < northWest && northWest < west) {
+                        prediction = abs(west - northWest) > 32 || abs(north - northWest) > 32 ? west + north - northWest : (west + north) >> 1
+                    } else {
+                        prediction = abs(west - northWest) > abs(north - northWest) ? west : north
+                    }
+                }
+                let residual = pixel(x, y) - prediction
+                let difference = residual >> 2
+                let sign = difference - carries[c + 1] < 0 ? -1 : 0
+                let carry = (difference - carries[c + 1]) ^ sign
+                let high = carry >> lowBitCount
+
+                put((sign & 1) << 2 | residual & 3, 3)
+                if high < 12 {
+                    put(1, high + 1)
+                } else {
+                    put(0, 12)
+                    put(high << 1, 16 - lowBitCount)
+                }
+                put(carry & ((1 << lowBitCount) - 1), lowBitCount)
+
+                carries[c] = carry
+                carries[c + 1] = (difference * 3 + carries[c + 1]) >> 5
+                carries[c + 2] = carry > 16 ? 0 : carries[c + 2] + 1
+            }
+        }
+        let olympusData = Data(count: 7) + bitstream()
+        let uncompressedData = olympusPixels.reduce(Data()) { $0 + uint16($1, .littleEndian) }
+
+        func orf(_ data: Data) -> Data {
+            // Little endian maker note with offsets from its start: white balance 2 and 1.5, black level 64
+            var makerNote = Data("OLYMPUS\0II".utf8) + uint16(3, .littleEndian)
+            makerNote += uint16(1, .littleEndian) + uint16(0x2040, .littleEndian) + uint16(13, .littleEndian)
+            makerNote += uint32(1, .littleEndian) + uint32(30, .littleEndian) + uint32(0, .littleEndian)
+            makerNote += uint16(2, .littleEndian) + uint16(0x0100, .littleEndian) + uint16(3, .littleEndian)
+            makerNote += uint32(2, .littleEndian) + uint16(512, .littleEndian) + uint16(384, .littleEndian)
+            makerNote += uint16(0x0600, .littleEndian) + uint16(3, .littleEndian) + uint32(4, .littleEndian)
+            makerNote += uint32(60, .littleEndian) + uint32(0, .littleEndian)
+            makerNote += [64, 64, 64, 64].reduce(Data()) { $0 + uint16($1, .littleEndian) }
+
+            var file = TIFFFixture.tiff(blobs: [data]) { ifdOffsets, blobOffsets -> [[TIFFFixture.Entry]] in
+                [[.init(256, 4, [width]), .init(257, 4, [height]), .init(258, 3, [16]), .init(259, 3, [1]),
+                  .init(271, 2, Array("OLYMPUS CORPORATION\0".utf8).map { Int($0) }), .init(273, 4, [blobOffsets[0]]),
+                  .init(278, 4, [height]), .init(279, 4, [data.count]), .init(34665, 4, [ifdOffsets[1]])],
+                 [.init(37500, 7, Array(makerNote).map { Int($0) })]]
+            }
+            file[2] = 0x52
+            file[3] = 0x4F
+            return file
+        }
+
+        for data in [olympusData, uncompressedData] {
+            let source = InMemoryByteSource(data: orf(data), url: URL(fileURLWithPath: "/tmp/synthetic.orf"))
+            let decoder = try XCTUnwrap(RAWDecoders.decoder(for: source) as? ORFDecoder)
+            XCTAssertEqual(decoder.isCompressed, data == olympusData)
+
+            let image = try decoder.decode()
+            XCTAssertEqual(Array(image.pixels), olympusPixels.map { UInt16($0) })
+            XCTAssertEqual(image.cfaPattern, CFAPattern.rggb)
+            XCTAssertEqual(image.blackLevel, 64)
+            XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+        }
+
+        // Pentax: a per file code of 13 lengths, coding differences of 0 to 12 bits
+        let lengths = [3, 3, 3, 3, 3, 3, 4, 4, 5, 5, 6, 6, 6]
+        var codes = [Int]()
+        var code = 0
+        for (k, length) in lengths.enumerated() {
+            if k > 0 && length > lengths[k - 1] {
+                code <<= length - lengths[k - 1]
+            }
+            codes.append(code)
+            code += 1
+        }
+        let pentaxPixels = (0 ..< width * height).map { i in (i * 131 + (i / width) * 977) % 4096 }
+        var verticalPredictors = [0, 0, 0, 0]
+        for y in 0 ..< height {
+            var horizontalPredictors = [0, 0]
+            for x in 0 ..< width {
+                let value = pentaxPixels[y * width + x]
+                let difference = value - (x < 2 ? verticalPredictors[(y & 1) * 2 + x] : horizontalPredictors[x & 1])
+                let length = difference == 0 ? 0 : Int.bitWidth - abs(difference).leadingZeroBitCount
+                put(codes[length], lengths[length])
+                put(difference >= 0 ? difference : difference + (1 << length) - 1, length)
+                if x < 2 {
+                    verticalPredictors[(y & 1) * 2 + x] = value
+                }
+                horizontalPredictors[x & 1] = value
+            }
+        }
+        let pentaxData = bitstream()
+
+        func pef(_ data: Data) -> Data {
+            // Big endian maker note with offsets from the start of the file: levels, then the code
+            let levels = [128, 128, 128, 128, 600, 300, 300, 450].reduce(Data()) { $0 + uint16($1, .bigEndian) }
+            var table = uint16(1, .bigEndian) + Data(count: 12)
+            table += zip(codes, lengths).reduce(Data()) { $0 + uint16($1.0 << (12 - $1.1), .bigEndian) }
+            table += Data(lengths.map { UInt8($0) })
+
+            return TIFFFixture.tiff(blobs: [data, levels + table]) { ifdOffsets, blobOffsets -> [[TIFFFixture.Entry]] in
+                var makerNote = Data("AOC\0MM".utf8) + uint16(3, .bigEndian)
+                for (tag, type, count, offset) in [(0x0200, 3, 4, 0), (0x0201, 3, 4, 8), (0x0220, 7, table.count, 16)] {
+                    makerNote += uint16(tag, .bigEndian) + uint16(type, .bigEndian)
+                    makerNote += uint32(count, .bigEndian) + uint32(blobOffsets[1] + offset, .bigEndian)
+                }
+                makerNote += uint32(0, .bigEndian)
+                return [[.init(256, 4, [width]), .init(257, 4, [height]), .init(258, 3, [12]), .init(259, 3, [65535]), .init(262, 3, [32803]),
+                         .init(271, 2, Array("PENTAX Corporation\0".utf8).map { Int($0) }), .init(273, 4, [blobOffsets[0]]),
+                         .init(278, 4, [height]), .init(279, 4, [data.count]), .init(34665, 4, [ifdOffsets[1]])],
+                        [.init(37500, 7, Array(makerNote).map { Int($0) }), .init(41730, 7, [2, 0, 2, 0, 2, 1, 1, 0])]]
+            }
+        }
+
+        let source = InMemoryByteSource(data: pef(pentaxData), url: URL(fileURLWithPath: "/tmp/synthetic.pef"))
+        let image = try XCTUnwrap(RAWDecoders.decoder(for: source) as? PEFDecoder).decode()
+        XCTAssertEqual(Array(image.pixels), pentaxPixels.map { UInt16($0) })
+        XCTAssertEqual(image.cfaPattern, CFAPattern.bggr)
+        XCTAssertEqual(image.blackLevel, 128)
+        XCTAssertEqual(image.whiteLevel, 4095)
+        XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+
+        let truncatedSource = InMemoryByteSource(data: pef(pentaxData.prefix(pentaxData.count / 2)), url: URL(fileURLWithPath: "/tmp/truncated.pef"))
+        XCTAssertThrowsError(try RAWDecoders.decoder(for: truncatedSource)?.decode())
+    }
+
+    func testRAFDecoderDecodesCompressedStripesInParallel() throws {
+        let width = 1200, height = 12
+        // 12-bit X-Trans data in two stripes, the second one narrower
+        var compressedHeader = uint16(0x4953, .bigEndian) + Data([1, 16, 12])
+        compressedHeader += uint16(height, .bigEndian) + uint16(1536, .bigEndian) + uint16(width, .bigEndian) + uint16(0x300, .bigEndian)
+        compressedHeader += Data([2]) + uint16(height / 6, .bigEndian)
+        let header = try RAFDecoder.CompressedHeader(data: compressedHeader)
+        let rows = ["GGRGGB", "GGBGGR", "BRGRBG", "GGBGGR", "GGRGGB", "RBGBRG"]
+        let colors = rows.joined().map { ["R": 0, "G": 1, "B": 2][$0]! }
+        let cfaPattern = try XCTUnwrap(CFAPattern(width: 6, height: 6, tiffValues: colors))
+
+        // A gradient with some texture, and now and then a jump large enough for its code to be escaped
+        let pixels: [[Int]] = (0 ..< height).map { y in
+            (0 ..< width).map { x -> Int in
+                let jump = (x * 31 + y * 17) % 211 == 0 ? 1800 : 0
+                return (1000 + 3 * x + 50 * y + x * y * 7919 % 53 + jump) % 4096
+            }
+        }
+        let stripes: [Data] = (0 ..< header.stripeCount).map { i in
+            let x = i * header.stripeWidth
+            return RAFStripeEncoder.encode(pixels, x: x, width: min(header.stripeWidth, width - x), stripeWidth: header.stripeWidth,
+                                           bitsPerSample: 12, cfaPattern: cfaPattern)
+        }
+
+        var data = compressedHeader + uint32(stripes[0].count, .bigEndian) + uint32(stripes[1].count, .bigEndian) + Data(count: 8)
+        data += stripes[0]
+        data += stripes[1]
+        let container = TIFFFixture.tiff(blobs: [data]) { ifdOffsets, blobOffsets -> [[TIFFFixture.Entry]] in
+            [[.init(0xF000, 4, [ifdOffsets[1]])],
+             [.init(0xF001, 4, [width]), .init(0xF002, 4, [height]), .init(0xF003, 4, [12]),
+              .init(0xF007, 4, [blobOffsets[0]]), .init(0xF008, 4, [data.count]), .init(0xF00A, 4, [1000, 1024, 1048])]]
+        }
+
+        // The X-Trans layout is stored from its last position to its first; white balance levels are green, red, green, blue
+        var directory = uint32(2, .bigEndian) + uint16(0x0131, .bigEndian) + uint16(36, .bigEndian) + Data(colors.reversed().map { UInt8($0) })
+        directory += uint16(0x2FF0, .bigEndian) + uint16(8, .bigEndian) + uint16(300, .bigEndian) + uint16(600, .bigEndian) + uint16(300, .bigEndian) + uint16(450, .bigEndian)
+        let directoryOffset = 160, containerOffset = directoryOffset + directory.count
+        var file = Data("FUJIFILMCCD-RAW 0201FF383501".utf8) + Data(count: 92 - 28)
+        file += uint32(directoryOffset, .bigEndian) + uint32(directory.count, .bigEndian) + uint32(containerOffset, .bigEndian) + uint32(container.count, .bigEndian)
+        file += Data(count: directoryOffset - file.count)
+        file += directory
+        file += container
+
+        let source = InMemoryByteSource(data: file, url: URL(fileURLWithPath: "/tmp/synthetic.raf"))
+        let decoder = try XCTUnwrap(RAWDecoders.decoder(for: source) as? RAFDecoder)
+        XCTAssertEqual(decoder.size, CGSize(width: width, height: height))
+        XCTAssertEqual(decoder.cfaPattern, cfaPattern)
+        XCTAssertTrue(decoder.header.isXTrans)
+
+        let image = try decoder.decode()
+        XCTAssertEqual(Array(image.pixels), pixels.joined().map { UInt16($0) })
+        XCTAssertEqual(image.blackLevel, 1024)
+        XCTAssertEqual(image.whiteLevel, 4095)
+        XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+
+        let truncatedSource = InMemoryByteSource(data: file.prefix(file.count - stripes[1].count / 2), url: URL(fileURLWithPath: "/tmp/truncated.raf"))
+        XCTAssertThrowsError(try RAWDecoders.decoder(for: truncatedSource)?.decode())
+
+        // Ending before the sensor data starts
+        let headerOnlySource = InMemoryByteSource(data: file.prefix(file.count - data.count), url: URL(fileURLWithPath: "/tmp/truncated.raf"))
+        XCTAssertThrowsError(try RAFDecoder(source: headerOnlySource)) { error in
+            guard case RAWDecodingError.truncatedData = error else {
+                return XCTFail("Unexpected error \(error)")
+            }
+        }
+    }
+
+    func testCR3DecoderDecodesSubbandsInParallelAndAtReducedLevels() throws {
+        // The inverse wavelet transform undoes a forward 5/3 transform, of columns then rows, at each level
+        func lift(_ x: [Int32]) -> (low: [Int32], high: [Int32]) {
+            let n = x.count
+            let high = (0 ..< n / 2).map { k in x[2 * k + 1] - ((x[2 * k] + x[2 * k + 2 < n ? 2 * k + 2 : 2 * k]) >> 1) }
+            let low = (0 ..< (n + 1) / 2).map { k in
+                high.isEmpty ? x[2 * k] : x[2 * k] + ((high[max(k - 1, 0)] + high[min(k, high.count - 1)] + 2) >> 2)
+            }
+            return (low, high)
+        }
+        func transposed(_ rows: [[Int32]]) -> [[Int32]] {
+            return (0 ..< rows[0].count).map { column in rows.map { $0[column] } }
+        }
+        func coefficients(_ rows: [[Int32]]) -> CR3Decoder.Coefficients {
+            var coefficients = CR3Decoder.Coefficients(width: rows[0].count, height: rows.count)
+            coefficients.values = Array(rows.joined())
+            return coefficients
+        }
+
+        var state: UInt64 = 7
+        let plane: [[Int32]] = (0 ..< 17).map { _ in
+            (0 ..< 23).map { _ in
+                state = state &* 6364136223846793005 &+ 1442695040888963407
+                return Int32(state >> 33) % 16384 - 8192
+            }
+        }
+        /** The subbands of a plane, the low pass one first as in files, and the plane at each level down to `levels`. */
+        func forwardTransform(_ plane: [[Int32]], levels: Int) -> (subbands: [[[Int32]]], levelPlanes: [[[Int32]]]) {
+            var levelPlanes = [plane]
+            var details = [[[[Int32]]]]()
+            for _ in 0 ..< levels {
+                let columns = transposed(levelPlanes[levelPlanes.count - 1]).map(lift)
+                let low = transposed(columns.map { $0.low }).map(lift), high = transposed(columns.map { $0.high }).map(lift)
+                levelPlanes.append(low.map { $0.low })
+                details.append([low.map { $0.high }, high.map { $0.low }, high.map { $0.high }])
+            }
+            return ([levelPlanes[levels]] + details.reversed().joined(), levelPlanes)
+        }
+
+        let (planeSubbands, levelPlanes) = forwardTransform(plane, levels: 3)
+        let subbands = planeSubbands.map(coefficients)
+        let sizes = CR3Decoder.levelSizes(width: 23, height: 17, levels: 3)
+        for (i, subband) in subbands.enumerated() {
+            let size = CR3Decoder.subbandSize(i, sizes: sizes, levels: 3)
+            XCTAssertEqual([size.width, size.height], [subband.width, subband.height])
+        }
+        for skippedLevels in 0 ... 3 {
+            let reconstructed = CR3Decoder.reconstruct(subbands, sizes: sizes, levels: 3, skippedLevels: skippedLevels)
+            XCTAssertEqual(reconstructed.values, Array(levelPlanes[skippedLevels].joined()))
+        }
+        // Quantization values step by a sixth of a doubling, 6 leaving coefficients as they are
+        XCTAssertEqual([0, 4, 6, 10, 13, 18, 36, 37, 42].map { CR3Decoder.quantizationStep($0) }, [0, 1, 1, 2, 2, 5, 40, 45, 80])
+
+        // Files whose subbands are coded from chosen planes, quantized with a step of 1
+        let tiff = TIFFFixture.tiff(blobs: []) { _, _ -> [[TIFFFixture.Entry]] in
+            [[.init(271, 2, Array("Canon\0".utf8).map { Int($0) })]]
+        }
+        func cr3(width: Int, height: Int, tileWidth: Int, levels: Int, isPredictive: Bool, subbands: [Data]) -> Data {
+            let tileCount = (width / 2 + tileWidth / 2 - 1) / (tileWidth / 2), subbandCount = 3 * levels + 1
+            var sampleHeader = Data(), data = Data()
+            for tile in 0 ..< tileCount {
+                let planes = (0 ..< 4).map { plane in subbands[((tile * 4 + plane) * subbandCount) ..< ((tile * 4 + plane + 1) * subbandCount)] }
+                // Each subband followed by two bytes of padding
+                sampleHeader += uint16(0xFF01, .bigEndian) + uint16(8, .bigEndian) + uint32(planes.joined().map { $0.count + 2 }.reduce(0, +), .bigEndian)
+                sampleHeader += uint16(tile, .bigEndian) + uint16(0, .bigEndian)
+                for (plane, planeSubbands) in planes.enumerated() {
+                    sampleHeader += uint16(0xFF02, .bigEndian) + uint16(8, .bigEndian) + uint32(planeSubbands.map { $0.count + 2 }.reduce(0, +), .bigEndian)
+                    sampleHeader += Data([UInt8(plane << 4), 0, 0, 0])
+                    for (index, subband) in planeSubbands.enumerated() {
+                        let bits = index << 28 | (isPredictive ? 1 << 27 : 0) | 6 << 19 | 2
+                        sampleHeader += uint16(0xFF03, .bigEndian) + uint16(8, .bigEndian) + uint32(subband.count + 2, .bigEndian) + uint32(bits, .bigEndian)
+                        data += subband
+                        data += Data(count: 2)
+                    }
+                }
+            }
+
+            // 14 bits, four planes in a GRBG layout
+            var parameters = uint16(0x100, .bigEndian) + uint16(0, .bigEndian) + uint32(width, .bigEndian) + uint32(height, .bigEndian)
+            parameters += uint32(tileWidth, .bigEndian) + uint32(height, .bigEndian)
+            parameters += Data([14, 0x41, UInt8(levels), tileCount > 1 ? 0x80 : 0]) + uint32(sampleHeader.count, .bigEndian)
+
+            // 8 masked columns on the left; white balance levels red, green, green and blue
+            let sensorInfo = [34, width, height, 0, 0, 8, 0, width - 1, height - 1] + Array(repeating: 0, count: 8)
+            var colorData = [Int](repeating: 0, count: 1816)
+            colorData.replaceSubrange(0x47 ..< 0x4B, with: [600, 300, 300, 450])
+            let makerNote = TIFFFixture.tiff(blobs: []) { _, _ -> [[TIFFFixture.Entry]] in
+                [[.init(0xE0, 3, sensorInfo), .init(0x4001, 3, colorData)]]
+            }
+            return BoxFixture.cr3(tiff: tiff, makerNote: makerNote, preview: Data([0xFF, 0xD8, 0xFF, 0xD9]), previewSize: CGSize(width: 160, height: 120),
+                                  rawSize: CGSize(width: width, height: height), raw: (parameters, sampleHeader + data))
+        }
+
+        // Lossless in two tiles, predicted line by line; three wavelet levels in one tile
+        for (width, height, tileWidth, levels, isPredictive) in [(40, 12, 24, 0, true), (46, 34, 46, 3, false)] {
+            let tileCount = (width / 2 + tileWidth / 2 - 1) / (tileWidth / 2), subbandCount = tileCount * 4 * (3 * levels + 1)
+
+            // A plane for each position of the 2×2 cells: flat over the masked columns, then sloping, with some spikes
+            let planes: [[[Int32]]] = (0 ..< 4).map { position in
+                (0 ..< height / 2).map { y in
+                    (0 ..< width / 2).map { x -> Int32 in
+                        let spike: Int32 = (x * 13 + y * 7 + position) % 37 == 0 ? 3000 : 0
+                        return x < 6 ? 0 : Int32(x * 40 + y * 25 - 600) + spike
+                    }
+                }
+            }
+            var subbands = [Data]()
+            for tile in 0 ..< tileCount {
+                let columns = (tile * tileWidth / 2) ..< min((tile + 1) * tileWidth / 2, width / 2)
+                for plane in planes {
+                    let tileSubbands = forwardTransform(plane.map { Array($0[columns]) }, levels: levels).subbands
+                    subbands += tileSubbands.map { CRXLineEncoder.encode($0, isPredictive: isPredictive) }
+                }
+            }
+            let file = cr3(width: width, height: height, tileWidth: tileWidth, levels: levels, isPredictive: isPredictive, subbands: subbands)
+
+            // Samples are coded relative to the middle of the 14-bit range. The black level is the average of the
+            // masked columns, leaving out one column of each plane at both sides.
+            let planesByLevel = planes.map { forwardTransform($0, levels: levels).levelPlanes }
+            let expected: [(pixels: [UInt16], width: Int, blackLevel: Int)] = (0 ... levels).map { skippedLevels in
+                let planeWidth = planesByLevel[0][skippedLevels][0].count, planeHeight = planesByLevel[0][skippedLevels].count
+                var pixels = [UInt16](repeating: 0, count: 4 * planeWidth * planeHeight)
+                var maskedSum = 0, maskedCount = 0
+                for (position, levelPlanes) in planesByLevel.enumerated() {
+                    for (y, row) in levelPlanes[skippedLevels].enumerated() {
+                        for (x, value) in row.enumerated() {
+                            let sample = min(max(8192 + Int(value), 0), 16383)
+                            pixels[(2 * y + position / 2) * 2 * planeWidth + 2 * x + position % 2] = UInt16(sample)
+                            if x >= 1 && x < (4 >> skippedLevels) - 1 {
+                                maskedSum += sample
+                                maskedCount += 1
+                            }
+                        }
+                    }
+                }
+                return (pixels, 2 * planeWidth, maskedCount > 0 ? maskedSum / maskedCount : 0)
+            }
+
+            let source = InMemoryByteSource(data: file, url: URL(fileURLWithPath: "/tmp/synthetic.cr3"))
+            let decoder = try XCTUnwrap(RAWDecoders.decoder(for: source) as? CR3Decoder)
+            XCTAssertEqual(decoder.size, CGSize(width: width, height: height))
+            XCTAssertEqual(decoder.cfaPattern, CFAPattern.grbg)
+
+            for skippedLevels in 0 ... levels {
+                let image = try decoder.decode(skippingLevels: skippedLevels)
+                XCTAssertEqual(image.width, 2 * ((width / 2 + (1 << skippedLevels) - 1) >> skippedLevels))
+                XCTAssertEqual(image.height, 2 * ((height / 2 + (1 << skippedLevels) - 1) >> skippedLevels))
+                XCTAssertEqual(Array(image.pixels), expected[skippedLevels].pixels)
+                XCTAssertEqual(image.blackLevel, expected[skippedLevels].blackLevel)
+                XCTAssertEqual(image.whiteLevel, 16383)
+                XCTAssertEqual(image.whiteBalance, [2, 1, 1.5])
+            }
+
+            // Decoded at half size at most for a quarter of the width: only at 1/2 size from wavelets, otherwise full
+            let reduced = try decoder.decode(maximumPixelDimension: width / 4)
+            XCTAssertEqual(reduced.width, expected[min(levels, 1)].width)
+            XCTAssertEqual(Array(reduced.pixels), expected[min(levels, 1)].pixels)
+
+            let truncatedSource = InMemoryByteSource(data: file.prefix(file.count - subbands[subbandCount - 1].count / 2 - 3), url: URL(fileURLWithPath: "/tmp/truncated.cr3"))
+            XCTAssertThrowsError(try RAWDecoders.decoder(for: truncatedSource)?.decode())
+        }
+    }
+}
+
+/** The low 16 bits of `value` as bytes in `byteOrder`, for writing fixtures. */
+private func uint16(_ value: Int, _ byteOrder: ByteOrder) -> Data {
+    let bytes = [UInt8(value & 0xFF), UInt8((value >> 8) & 0xFF)]
+    return Data(byteOrder == .littleEndian ? bytes : bytes.reversed())
+}
+
+/** The low 32 bits of `value` as bytes in `byteOrder`, for writing fixtures. */
+private func uint32(_ value: Int, _ byteOrder: ByteOrder) -> Data {
+    let halves = [uint16(value & 0xFFFF, byteOrder), uint16(value >> 16, byteOrder)]
+    return byteOrder == .littleEndian ? halves[0] + halves[1] : halves[1] + halves[0]
+}
+
+/**
+ Codes a stripe of 12 or 14-bit X-Trans compressed Fujifilm data from its pixels, written from the format's
+ description independently of `RAFDecoder`: each group of six rows is split into lines of one colour, and each sample
+ of a line coded as its difference from a prediction, with low bits as many as the recent differences of its gradient
+ need.
+ */
+private enum RAFStripeEncoder {
+    /** First and second line, gradient set, and where each line is interpolated: -1 never, 4 always, else at that remainder modulo 4. */
+    private static let linePairs = [(2, 7, 0, 4, -1), (8, 15, 1, -1, 4), (3, 9, 2, 0, -1), (10, 16, 0, -1, 2), (4, 11, 1, 2, -1), (12, 17, 2, -1, 0)]
+
+    static func encode(_ pixels: [[Int]], x: Int, width: Int, stripeWidth: Int, bitsPerSample: Int, cfaPattern: CFAPattern) -> Data {
+        let lineWidth = stripeWidth * 2 / 3
+        let valueCount = 1 << bitsPerSample
+        let escapeLength = (bitsPerSample == 14 ? 56 : 48) - bitsPerSample - 1
+        // Lines 0-4 are red, 5-12 green and 13-17 blue, the first two of each from the previous group; each has a border pixel at both ends
+        var lines = [[Int]](repeating: [Int](repeating: 0, count: lineWidth + 2), count: 18)
+        var statistics = [[(sum: Int, count: Int)]](repeating: [(sum: Int, count: Int)](repeating: (bitsPerSample == 14 ? 256 : 64, 1), count: 41), count: 6)
+        var bits = [Bool]()
+
+        func put(_ value: Int, _ length: Int) {
+            for i in stride(from: length - 1, through: 0, by: -1) {
+                bits.append((value >> i) & 1 == 1)
+            }
+        }
+        func quantized(_ difference: Int) -> Int {
+            let magnitude = [0, 0x12, 0x43, 0x114].lastIndex { abs(difference) >= $0 }! + (difference == 0 ? 0 : 1)
+            return difference < 0 ? -magnitude : magnitude
+        }
+        func extend(_ line: Int) {
+            lines[line][0] = lines[line - 1][1]
+            lines[line][lineWidth + 1] = lines[line - 1][lineWidth]
+        }
+        func colourLines(of line: Int) -> ClosedRange<Int> {
+            return line < 5 ? 2 ... 4 : (line < 13 ? 7 ... 12 : 15 ... 17)
+        }
+
+        for group in 0 ..< pixels.count / 6 {
+            // Pixels of each row go to the line of their colour: two of each three columns of the stripe, pairs of rows sharing red and blue lines
+            var targets = [[Int?]](repeating: [Int?](repeating: nil, count: lineWidth), count: 18)
+            for row in 0 ..< 6 {
+                let y = group * 6 + row
+                for column in 0 ..< width {
+                    let line: Int
+                    switch cfaPattern.color(x: x + column, y: y) {
+                    case .red: line = 2 + row / 2
+                    case .green: line = 7 + row
+                    case .blue: line = 15 + row / 2
+                    }
+                    targets[line][column / 3 * 2 + (column % 3 == 0 ? 0 : 1)] = pixels[y][x + column]
+                }
+            }
+
+            func encodeSample(_ line: Int, at position: Int, gradientSet: Int, interpolation: Int?) {
+                // Neighbours in the line above (b, with c to its left and d to its right), two lines above (f), and on this line (a left, g right)
+                let p = position + 1
+                let b = lines[line - 1][p], c = lines[line - 1][p - 1], d = lines[line - 1][p + 1]
+                let evenPrediction = { (f: Int) -> Int in
+                    if abs(c - b) > abs(f - b) && abs(c - b) > abs(d - b) {
+                        return (f + d + 2 * b) >> 2
+                    }
+                    if abs(d - b) > abs(c - b) && abs(d - b) > abs(f - b) {
+                        return (f + c + 2 * b) >> 2
+                    }
+                    return (d + c + 2 * b) >> 2
+                }
+                if let interpolation = interpolation, interpolation == 4 || position % 4 == interpolation {
+                    lines[line][p] = evenPrediction(lines[line - 2][p])
+                    return
+                }
+
+                let gradient: Int, prediction: Int
+                if position % 2 == 0 {
+                    let f = lines[line - 2][p]
+                    gradient = 9 * quantized(b - f) + quantized(c - b)
+                    prediction = evenPrediction(f)
+                } else {
+                    let a = lines[line][p - 1], g = lines[line][p + 1]
+                    gradient = 9 * quantized(b - c) + quantized(c - a)
+                    prediction = (b > c && b > d) || (b < c && b < d) ? (g + a + 2 * b) >> 2 : (a + g) >> 1
+                }
+                let value = targets[line][position] ?? prediction
+                // The difference is subtracted for negative gradients, and wraps around the range of values
+                let difference = ((value - prediction) * (gradient < 0 ? -1 : 1) + valueCount * 3 / 2) % valueCount - valueCount / 2
+                let code = difference >= 0 ? 2 * difference : -2 * difference - 1
+
+                let set = gradientSet + (position % 2) * 3
+                var lowBitCount = 0
+                while statistics[set][abs(gradient)].count << lowBitCount < statistics[set][abs(gradient)].sum && lowBitCount < 15 {
+                    lowBitCount += 1
+                }
+                if code >> lowBitCount < escapeLength {
+                    put(1, (code >> lowBitCount) + 1)
+                    put(code & ((1 << lowBitCount) - 1), lowBitCount)
+                } else {
+                    put(1, escapeLength + 1)
+                    put(code - 1, bitsPerSample)
+                }
+                statistics[set][abs(gradient)].sum += abs(difference)
+                if statistics[set][abs(gradient)].count == 0x40 {
+                    statistics[set][abs(gradient)].sum >>= 1
+                    statistics[set][abs(gradient)].count >>= 1
+                }
+                statistics[set][abs(gradient)].count += 1
+                lines[line][p] = value
+            }
+
+            for (first, second, gradientSet, firstInterpolation, secondInterpolation) in linePairs {
+                // Odd positions are predicted from the even ones to their right too, so follow them once they are four samples ahead
+                var even = 0, odd = 1
+                while even < lineWidth || odd < lineWidth {
+                    if even < lineWidth {
+                        encodeSample(first, at: even, gradientSet: gradientSet, interpolation: firstInterpolation)
+                        encodeSample(second, at: even, gradientSet: gradientSet, interpolation: secondInterpolation)
+                        even += 2
+                    }
+                    if even > 8 {
+                        encodeSample(first, at: odd, gradientSet: gradientSet, interpolation: nil)
+                        encodeSample(second, at: odd, gradientSet: gradientSet, interpolation: nil)
+                        odd += 2
+                    }
+                }
+                colourLines(of: first).forEach(extend)
+                colourLines(of: second).forEach(extend)
+            }
+
+            for (destination, origin) in [(0, 3), (1, 4), (5, 11), (6, 12), (13, 16), (14, 17)] {
+                lines[destination] = lines[origin]
+            }
+            for colour in [2 ... 4, 7 ... 12, 15 ... 17] {
+                for line in colour {
+                    lines[line] = [Int](repeating: 0, count: lineWidth + 2)
+                }
+                extend(colour.lowerBound)
+            }
+        }
+
+        return Data(stride(from: 0, to: bits.count, by: 8).map { start in
+            (0 ..< 8).reduce(UInt8(0)) { byte, i in byte << 1 | (start + i < bits.count && bits[start + i] ? 1 : 0) }
+        })
+    }
+}
+
+/**
+ Codes the lines of a CR3 subband, written from the format's description independently of `CR3Decoder`: each sample a
+ Golomb-Rice code with an adaptive parameter, and runs of samples equal to the one to their left (in predictive
+ subbands, where samples are coded as differences from a prediction) or of zeros (otherwise) run length coded.
+ */
+private final class CRXLineEncoder {
+    private static let runLengthBits = [0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15]
+
+    private let width: Int
+    private let isPredictive: Bool
+    // The lines have a border sample on both sides
+    private var previous: [Int]
+    private var current: [Int]
+    /** The parameter after each sample of the previous line, for non predictive subbands. */
+    private var parameters: [Int]
+    private var parameter = 0
+    private var runParameter = 0
+    private var lineCount = 0
+    private var bits = [Bool]()
+
+    static func encode(_ rows: [[Int32]], isPredictive: Bool) -> Data {
+        let encoder = CRXLineEncoder(width: rows[0].count, isPredictive: isPredictive)
+        for row in rows {
+            encoder.encodeLine(row.map { Int($0) })
+        }
+        return Data(stride(from: 0, to: encoder.bits.count, by: 8).map { start in
+            (0 ..< 8).reduce(UInt8(0)) { byte, i in byte << 1 | (start + i < encoder.bits.count && encoder.bits[start + i] ? 1 : 0) }
+        })
+    }
+
+    private init(width: Int, isPredictive: Bool) {
+        self.width = width
+        self.isPredictive = isPredictive
+        self.previous = [Int](repeating: 0, count: width + 2)
+        self.current = [Int](repeating: 0, count: width + 2)
+        self.parameters = [Int](repeating: 0, count: width + 1)
+    }
+
+    private func put(_ value: Int, _ length: Int) {
+        for i in stride(from: length - 1, through: 0, by: -1) {
+            bits.append((value >> i) & 1 == 1)
+        }
+    }
+
+    /** 0, -1, 1, -2 ... as 0, 1, 2, 3 ... */
+    private static func unsigned(_ value: Int) -> Int {
+        return value >= 0 ? 2 * value : -2 * value - 1
+    }
+
+    private static func adapted(_ parameter: Int, to code: Int) -> Int {
+        var adapted = parameter
+        if code < (1 << parameter) / 2 {
+            adapted -= 1
+        }
+        if code >> parameter > 2 {
+            adapted += 1
+        }
+        if code >> parameter > 5 {
+            adapted += 1
+        }
+        return adapted
+    }
+
+    /** A unary count of the high bits of `code`, then the parameter's number of low bits, or 21 bits after 41 zeros. */
+    private func putCode(_ code: Int) {
+        if code >> parameter >= 41 {
+            put(1, 42)
+            put(code, 21)
+        } else {
+            put(1, (code >> parameter) + 1)
+            put(code & ((1 << parameter) - 1), parameter)
+        }
+    }
+
+    /** Write `code`, then adapt the parameter to `context`, by default the code. */
+    private func write(_ code: Int, context: Int? = nil) {
+        putCode(code)
+        parameter = min(CRXLineEncoder.adapted(parameter, to: context ?? code), 15)
+    }
+
+    /** Write `code`, then adapt the parameter to it and raise it towards `above`, that of the sample above to the right. */
+    private func write(_ code: Int, above: Int) {
+        putCode(code)
+        parameter = CRXLineEncoder.adapted(parameter, to: code)
+        if above - parameter <= 1 {
+            parameter = min(parameter, 15)
+        } else {
+            parameter += 1
+        }
+    }
+
+    /**
+     Write a run of `length` out of at most `remaining` samples: a zero bit for none, otherwise a one bit and one more for
+     each step of a length growing with the run parameter, then a zero bit and the remainder. Runs to the end of the
+     line end without either, the last step allowed to go past it.
+     */
+    private func writeRun(_ length: Int, remaining: Int) {
+        guard length > 0 else {
+            put(0, 1)
+            return
+        }
+        put(1, 1)
+        var written = 1
+        while written < length && (length == remaining || written + (1 << CRXLineEncoder.runLengthBits[runParameter]) <= length) {
+            put(1, 1)
+            written += 1 << CRXLineEncoder.runLengthBits[runParameter]
+            if written > remaining {
+                return
+            }
+            runParameter = min(runParameter + 1, 31)
+            if written == remaining {
+                return
+            }
+        }
+        put(0, 1)
+        if written < remaining {
+            put(length - written, CRXLineEncoder.runLengthBits[runParameter])
+            runParameter = max(runParameter - 1, 0)
+        }
+    }
+
+    /** The number of samples from `start` equal to `value`, at most `limit`. */
+    private static func run(of value: Int, in samples: [Int], from start: Int, limit: Int) -> Int {
+        var length = 0
+        while length < limit && samples[start + length] == value {
+            length += 1
+        }
+        return length
+    }
+
+    private func encodeLine(_ samples: [Int]) {
+        (previous, current) = (current, previous)
+        switch (isPredictive, lineCount == 0) {
+        case (true, true):
+            encodePredictiveTopLine(samples)
+        case (true, false):
+            encodePredictiveLine(samples)
+        case (false, true):
+            encodeNonPredictiveTopLine(samples)
+        case (false, false):
+            encodeNonPredictiveLine(samples)
+        }
+        lineCount += 1
+    }
+
+    private func encodePredictiveTopLine(_ samples: [Int]) {
+        // Predicted from the sample to the left, with runs of zeros after a zero
+        current[0] = 0
+        var p = 0
+        while p < width {
+            if current[p] == 0 && width - p > 1 {
+                let length = CRXLineEncoder.run(of: 0, in: samples, from: p, limit: width - p)
+                writeRun(length, remaining: width - p)
+                for i in 0 ..< length {
+                    current[p + 1 + i] = 0
+                }
+                p += length
+                if p == width {
+                    break
+                }
+            }
+            write(CRXLineEncoder.unsigned(samples[p] - current[p]))
+            current[p + 1] = samples[p]
+            p += 1
+        }
+        current[width + 1] = current[width] + 1
+    }
+
+    private func encodePredictiveLine(_ samples: [Int]) {
+        // Runs of the sample to the left where it equals the two above; the sample ending a run predicted from the one above
+        current[0] = previous[1]
+        var p = 0
+        while p < width {
+            var median = true
+            if width - p > 1 && current[p] == previous[p + 1] && current[p] == previous[p + 2] {
+                let length = CRXLineEncoder.run(of: current[p], in: samples, from: p, limit: width - p)
+                writeRun(length, remaining: width - p)
+                for i in 0 ..< length {
+                    current[p + 1 + i] = current[p]
+                }
+                p += length
+                if p == width {
+                    break
+                }
+                median = false
+            }
+            encodePredictedSample(samples[p], at: p, median: median, lookAhead: p < width - 1 || !median)
+            p += 1
+        }
+        current[width + 1] = current[width] + 1
+    }
+
+    private func encodePredictedSample(_ sample: Int, at p: Int, median: Bool, lookAhead: Bool) {
+        let left = current[p], above = previous[p + 1], aboveLeft = previous[p]
+        var prediction = above
+        if median {
+            // The median edge detector of LOCO-I: the smaller or larger of left and above at an edge, otherwise the gradient
+            let gradient = above - aboveLeft
+            if (aboveLeft < left) == (gradient < 0) {
+                prediction = left + gradient
+            } else {
+                prediction = (left < above) == (gradient < 0) ? left : above
+            }
+        }
+        let code = CRXLineEncoder.unsigned(sample - prediction)
+        write(code, context: lookAhead ? (code + abs((previous[p + 2] - previous[p + 1]) << 1)) >> 1 : code)
+        current[p + 1] = sample
+    }
+
+    private func encodeNonPredictiveTopLine(_ samples: [Int]) {
+        // Runs of zeros after a zero, the sample ending a run being coded one less
+        previous[0] = 0
+        current[0] = 0
+        var p = 0
+        while p < width {
+            var code = CRXLineEncoder.unsigned(samples[p])
+            if current[p] == 0 && width - p > 1 {
+                let length = CRXLineEncoder.run(of: 0, in: samples, from: p, limit: width - p)
+                writeRun(length, remaining: width - p)
+                for i in 0 ..< length {
+                    parameters[p + i] = 0
+                    current[p + 1 + i] = 0
+                }
+                p += length
+                if p == width {
+                    break
+                }
+                code = CRXLineEncoder.unsigned(samples[p]) - 1
+            }
+            write(code)
+            current[p + 1] = samples[p]
+            parameters[p] = parameter
+            p += 1
+        }
+        current[width + 1] = 0
+    }
+
+    private func encodeNonPredictiveLine(_ samples: [Int]) {
+        // Runs of zeros where the samples to the left, above and above right are all zero
+        var p = 0
+        while p < width {
+            if p == width - 1 {
+                write(CRXLineEncoder.unsigned(samples[p]))
+            } else if previous[p + 2] != 0 || previous[p + 1] != 0 || current[p] != 0 {
+                write(CRXLineEncoder.unsigned(samples[p]), above: parameters[p + 1])
+            } else {
+                let length = CRXLineEncoder.run(of: 0, in: samples, from: p, limit: width - p)
+                writeRun(length, remaining: width - p)
+                for i in 0 ..< length {
+                    current[p + 1 + i] = 0
+                    parameters[p + i] = 0
+                }
+                p += length
+                if p >= width {
+                    break
+                }
+                if p == width - 1 {
+                    write(CRXLineEncoder.unsigned(samples[p]) - 1)
+                } else {
+                    write(CRXLineEncoder.unsigned(samples[p]) - 1, above: parameters[p + 1])
+                }
+            }
+            current[p + 1] = samples[p]
+            parameters[p] = parameter
+            p += 1
+        }
+    }
+}
+
+/** Writes little endian TIFF files from directory entries, for reading back in tests. */
+private enum TIFFFixture {
+    struct Entry {
+        let tag: Int
+        let type: Int
+        let values: [Int]
+
+        init(_ tag: Int, _ type: Int, _ values: [Int]) {
+            self.tag = tag
+            self.type = type
+            self.values = values
+        }
+
+        var valueSize: Int {
+            return type == 3 ? 2 : (type == 4 ? 4 : 1)
+        }
+
+        var valueBytes: Data {
+            var data = Data()
+            for value in values {
+                data += Data((0 ..< valueSize).map { UInt8((value >> ($0 * 8)) & 0xFF) })
+            }
+            return data
+        }
+    }
+
+    /**
+     Lay out a header, the directories one after another (the first one being IFD0, the others unchained), their
+     out of line values, then `blobs`. `makeIFDs` is given the offsets of the directories and of the blobs.
+     */
+    static func tiff(blobs: [Data], _ makeIFDs: (_ ifdOffsets: [Int], _ blobOffsets: [Int]) -> [[Entry]]) -> Data {
+        func layout(_ ifds: [[Entry]]) -> (ifdOffsets: [Int], valuesOffset: Int, blobOffsets: [Int]) {
+            var offset = 8
+            var ifdOffsets = [Int]()
+            for ifd in ifds {
+                ifdOffsets.append(offset)
+                offset += 2 + 12 * ifd.count + 4
+            }
+            let valuesOffset = offset
+            offset += ifds.joined().map { $0.valueBytes.count > 4 ? $0.valueBytes.count : 0 }.reduce(0, +)
+            var blobOffsets = [Int]()
+            for blob in blobs {
+                blobOffsets.append(offset)
+                offset += blob.count
+            }
+            return (ifdOffsets, valuesOffset, blobOffsets)
+        }
+
+        let sizing = layout(makeIFDs(Array(repeating: 0, count: 16), Array(repeating: 0, count: blobs.count)))
+        let ifds = makeIFDs(sizing.ifdOffsets, sizing.blobOffsets)
+
+        var file = Data("II*\0".utf8) + uint32(8, .littleEndian)
+        var values = Data()
+        for ifd in ifds {
+            file += uint16(ifd.count, .littleEndian)
+            for entry in ifd.sorted(by: { $0.tag < $1.tag }) {
+                file += uint16(entry.tag, .littleEndian) + uint16(entry.type, .littleEndian) + uint32(entry.values.count, .littleEndian)
+                let bytes = entry.valueBytes
+                if bytes.count > 4 {
+                    file += uint32(sizing.valuesOffset + values.count, .littleEndian)
+                    values += bytes
+                } else {
+                    file += bytes + Data(count: 4 - bytes.count)
+                }
+            }
+            file += uint32(0, .littleEndian)
+        }
+        return file + values + blobs.reduce(Data(), +)
+    }
+}
+
+/** Writes a minimal X3F file: header, JPEG preview and property list sections, and the section directory. */
+private enum X3FFixture {
+    static func x3f(preview: Data, previewSize: CGSize, size: CGSize, rotation: Int, properties: [(String, String)]) -> Data {
+        var file = Data("FOVb".utf8) + uint32(0x0002_0003, .littleEndian) + Data(count: 20) + uint32(Int(size.width), .littleEndian) + uint32(Int(size.height), .littleEndian) + uint32(rotation, .littleEndian)
+        file += Data(count: 256 - file.count)
+
+        let previewOffset = file.count
+        file += Data("SECi".utf8) + uint32(0x0002_0000, .littleEndian) + uint32(2, .littleEndian) + uint32(18, .littleEndian)
+            + uint32(Int(previewSize.width), .littleEndian) + uint32(Int(previewSize.height), .littleEndian) + uint32(0, .littleEndian) + preview
+        let previewLength = file.count - previewOffset
+
+        var characters = Data()
+        var entries = Data()
+        for (name, value) in properties {
+            entries += uint32(characters.count / 2, .littleEndian)
+            characters += (name + "\0").data(using: .utf16LittleEndian)!
+            entries += uint32(characters.count / 2, .littleEndian)
+            characters += (value + "\0").data(using: .utf16LittleEndian)!
+        }
+        let propertyOffset = file.count
+        file += Data("SECp".utf8) + uint32(0x0002_0000, .littleEndian) + uint32(properties.count, .littleEndian) + uint32(0, .littleEndian) + uint32(0, .littleEndian) + uint32(characters.count / 2, .littleEndian) + entries + characters
+        let propertyLength = file.count - propertyOffset
+
+        let directoryOffset = file.count
+        file += Data("SECd".utf8) + uint32(0x0002_0000, .littleEndian) + uint32(2, .littleEndian)
+        file += uint32(previewOffset, .littleEndian) + uint32(previewLength, .littleEndian) + Data("IMA2".utf8)
+        file += uint32(propertyOffset, .littleEndian) + uint32(propertyLength, .littleEndian) + Data("PROP".utf8)
+        return file + uint32(directoryOffset, .littleEndian)
+    }
+}
+
+/** Writes minimal ISO base media files, laid out like Canon CR3 and HEIF files, for reading back in tests. */
+private enum BoxFixture {
+    static func box(_ type: String, _ payload: Data) -> Data {
+        return uint32(8 + payload.count, .bigEndian) + Data(type.utf8) + payload
+    }
+
+    static func fullBox(_ type: String, version: UInt8 = 0, flags: UInt8 = 0, _ payload: Data) -> Data {
+        return box(type, Data([version, 0, 0, flags]) + payload)
+    }
+
+    static func uuidBox(_ uuid: [UInt8], _ payload: Data) -> Data {
+        return box("uuid", Data(uuid) + payload)
+    }
+
+    /**
+     A CR3 file with a RAW track of `rawSize`. With `raw`, the track's sample entry has a `CMP1` box of coding
+     parameters and its one sample is held in `mdat`.
+     */
+    static func cr3(tiff: Data, makerNote: Data? = nil, preview: Data, previewSize: CGSize, rawSize: CGSize, raw: (parameters: Data, sample: Data)? = nil) -> Data {
+        let canonUUID: [UInt8] = [0x85, 0xC0, 0xB6, 0x87, 0x82, 0x0F, 0x11, 0xE0, 0x81, 0x11, 0xF4, 0xCE, 0x46, 0x2B, 0x6A, 0x48]
+        let previewUUID: [UInt8] = [0xEA, 0xF4, 0x2B, 0x5E, 0x1C, 0x98, 0x4B, 0x88, 0xB9, 0xFB, 0xB7, 0xDC, 0x40, 0x6E, 0x4D, 0x16]
+
+        func file(sampleOffset: Int) -> Data {
+            let thumbnail = box("THMB", uint32(0, .bigEndian) + uint16(160, .bigEndian) + uint16(120, .bigEndian) + uint32(preview.count, .bigEndian) + uint32(0, .bigEndian) + preview)
+            var sampleEntry = Data(count: raw == nil ? 78 : 82)
+            sampleEntry.replaceSubrange(24 ..< 28, with: uint16(Int(rawSize.width), .bigEndian) + uint16(Int(rawSize.height), .bigEndian))
+            var sampleTable = fullBox("stsd", uint32(1, .bigEndian) + box("CRAW", sampleEntry + (raw.map { box("CMP1", $0.parameters) } ?? Data())))
+            if let raw = raw {
+                sampleTable += fullBox("stco", uint32(1, .bigEndian) + uint32(sampleOffset, .bigEndian))
+                sampleTable += fullBox("stsz", uint32(0, .bigEndian) + uint32(1, .bigEndian) + uint32(raw.sample.count, .bigEndian))
+            }
+            let track = box("trak", box("mdia", box("minf", box("stbl", sampleTable))))
+            var metadata = box("CMT1", tiff)
+            if let makerNote = makerNote {
+                metadata += box("CMT3", makerNote)
+            }
+            let moov = box("moov", uuidBox(canonUUID, metadata + thumbnail) + track)
+
+            let prvw = box("PRVW", uint32(0, .bigEndian) + uint16(1, .bigEndian) + uint16(Int(previewSize.width), .bigEndian) + uint16(Int(previewSize.height), .bigEndian) + uint16(1, .bigEndian) + uint32(preview.count, .bigEndian) + preview)
+            var file = box("ftyp", Data("crx ".utf8) + uint32(1, .bigEndian) + Data("crx isom".utf8)) + moov
+            file += uuidBox(previewUUID, Data(count: 8) + prvw)
+            file += box("mdat", raw?.sample ?? Data())
+            return file
+        }
+
+        // The sample is at the end of the file, whose layout does not depend on where that is
+        let sampleCount = raw?.sample.count ?? 0
+        return file(sampleOffset: file(sampleOffset: 0).count - sampleCount)
+    }
+
+    static func heif(tiff: Data, size: CGSize, rotation: UInt8) -> Data {
+        let ftyp = box("ftyp", Data("heic".utf8) + uint32(0, .bigEndian) + Data("mif1heic".utf8))
+
+        func meta(exifOffset: Int) -> Data {
+            let items = fullBox("iinf", uint16(2, .bigEndian)
+                + fullBox("infe", version: 2, uint16(1, .bigEndian) + uint16(0, .bigEndian) + Data("hvc1".utf8) + Data([0]))
+                + fullBox("infe", version: 2, uint16(2, .bigEndian) + uint16(0, .bigEndian) + Data("Exif".utf8) + Data([0])))
+            let locations = fullBox("iloc", Data([0x44, 0x00]) + uint16(1, .bigEndian) + uint16(2, .bigEndian) + uint16(0, .bigEndian) + uint16(1, .bigEndian) + uint32(exifOffset, .bigEndian) + uint32(4 + tiff.count, .bigEndian))
+            let properties = box("iprp", box("ipco", fullBox("ispe", uint32(Int(size.width), .bigEndian) + uint32(Int(size.height), .bigEndian)) + box("irot", Data([rotation])))
+                + fullBox("ipma", uint32(1, .bigEndian) + uint16(1, .bigEndian) + Data([2, 0x81, 0x82])))
+            return fullBox("meta", fullBox("pitm", uint16(1, .bigEndian)) + items + locations + properties)
+        }
+
+        let exifOffset = ftyp.count + meta(exifOffset: 0).count + 8
+        return ftyp + meta(exifOffset: exifOffset) + box("mdat", uint32(0, .bigEndian) + tiff)
+    }
+}
+
+/** Writes minimal ZIP and TAR archives, for reading back in tests. */
+private enum ArchiveFixture {
+    /** `typeFlags` gives the type of headers other than regular files, such as "x" for pax extended headers, by path. */
+    static func tar(_ files: [(path: String, data: Data)], typeFlags: [String: String] = [:]) -> Data {
+        var archive = Data()
+        for file in files {
+            var header = [UInt8](repeating: 0, count: 512)
+            func put(_ string: String, at offset: Int) {
+                header.replaceSubrange(offset ..< (offset + string.utf8.count), with: Array(string.utf8))
+            }
+            put(file.path, at: 0)
+            put("0000644\0", at: 100)
+            put(octal(file.data.count, width: 11), at: 124)
+            put(octal(Int(Date().timeIntervalSince1970), width: 11), at: 136)
+            put("        ", at: 148)
+            put(typeFlags[file.path] ?? "0", at: 156)
+            put("ustar\000", at: 257)
+            put(octal(header.reduce(0) { $0 + Int($1) }, width: 6) + "\0 ", at: 148)
+
+            archive.append(contentsOf: header)
+            archive.append(file.data)
+            archive.append(Data(count: (512 - file.data.count % 512) % 512))
+        }
+        archive.append(Data(count: 1024))
+        return archive
+    }
+
+    private static func octal(_ value: Int, width: Int) -> String {
+        let digits = String(value, radix: 8)
+        return String(repeating: "0", count: max(0, width - digits.count)) + digits
+    }
+
+    static func zip(_ files: [(path: String, data: Data)], deflating deflatedPaths: Set<String>) -> Data {
+        var archive = Data()
+        var directory = Data()
+
+        func append16(_ value: Int, to data: inout Data) {
+            data.append(contentsOf: [UInt8(value & 0xFF), UInt8((value >> 8) & 0xFF)])
+        }
+        func append32(_ value: Int, to data: inout Data) {
+            append16(value & 0xFFFF, to: &data)
+            append16((value >> 16) & 0xFFFF, to: &data)
+        }
+
+        for file in files {
+            let isDeflated = deflatedPaths.contains(file.path)
+            let contents = isDeflated ? deflate(file.data) : file.data
+            let name = Data(file.path.utf8)
+            let headerOffset = archive.count
+
+            // Local header and central directory entry share most fields; the CRC is not checked on reading
+            var common = Data()
+            append16(20, to: &common)
+            append16(0x0800, to: &common)
+            append16(isDeflated ? 8 : 0, to: &common)
+            append32(0, to: &common) // DOS time and date
+            append32(0, to: &common) // CRC-32
+            append32(contents.count, to: &common)
+            append32(file.data.count, to: &common)
+            append16(name.count, to: &common)
+            append16(0, to: &common)
+
+            append32(0x04034b50, to: &archive)
+            archive.append(common)
+            archive.append(name)
+            archive.append(contents)
+
+            append32(0x02014b50, to: &directory)
+            append16(20, to: &directory)
+            directory.append(common)
+            append16(0, to: &directory) // comment length
+            append32(0, to: &directory) // disk number and internal attributes
+            append32(0, to: &directory) // external attributes
+            append32(headerOffset, to: &directory)
+            directory.append(name)
+        }
+
+        let directoryOffset = archive.count
+        archive.append(directory)
+        append32(0x06054b50, to: &archive)
+        append32(0, to: &archive)
+        append16(files.count, to: &archive)
+        append16(files.count, to: &archive)
+        append32(directory.count, to: &archive)
+        append32(directoryOffset, to: &archive)
+        append16(0, to: &archive)
+        return archive
+    }
+
+    private static func deflate(_ data: Data) -> Data {
+        let capacity = data.count + 1024
+        var output = [UInt8](repeating: 0, count: capacity)
+        let count = data.withUnsafeBytes { input in
+            compression_encode_buffer(&output, capacity, input.bindMemory(to: UInt8.self).baseAddress!, data.count, nil, COMPRESSION_ZLIB)
+        }
+        return Data(output[0 ..< count])
+    }
+}
+
+/** A minimal HTTP/1.1 server on the loopback interface, serving files with support for range requests. */
+private final class LocalHTTPServer {
+    let directory: URL
+    /** If `false`, multi-range requests are answered with the whole file, as S3 does. */
+    let supportsMultipleRanges: Bool
+    /** If `false`, every request is answered with the whole file. */
+    let supportsRanges: Bool
+    private(set) var port: UInt16 = 0
+    private let listeningSocket: Int32
+
+    init(directory: URL, supportsMultipleRanges: Bool = true, supportsRanges: Bool = true) throws {
+        self.directory = directory
+        self.supportsMultipleRanges = supportsMultipleRanges
+        self.supportsRanges = supportsRanges
+        listeningSocket = socket(AF_INET, SOCK_STREAM, 0)
+        guard listeningSocket >= 0 else {
+            throw POSIXError(POSIXErrorCode(rawValue: errno) ?? .EIO)
+        }
+
+        var address = sockaddr_in()
+        address.sin_len = UInt8(MemoryLayout<sockaddr_in>.size)
+        address.sin_family = sa_family_t(AF_INET)
+        address.sin_port = 0
+        address.sin_addr.s_addr = inet_addr("127.0.0.1")
+        var length = socklen_t(MemoryLayout<sockaddr_in>.size)
+        let bound = withUnsafeMutablePointer(to: &address) {
+            $0.withMemoryRebound(to: sockaddr.self, capacity: 1) {
+                bind(listeningSocket, $0, length) == 0 && listen(listeningSocket, 16) == 0 && getsockname(listeningSocket, $0, &length) == 0
+            }
+        }
+        guard bound else {
+            close(listeningSocket)
+            throw POSIXError(POSIXErrorCode(rawValue: errno) ?? .EIO)
+        }
+        port = UInt16(bigEndian: address.sin_port)
+
+        let listeningSocket = self.listeningSocket
+        DispatchQueue.global().async { [weak self] in
+            while true {
+                let connection = accept(listeningSocket, nil, nil)
+                guard connection >= 0, let self = self else {
+                    break
+                }
+                DispatchQueue.global().async {
+                    self.serve(connection)
+                }
+            }
+        }
+    }
+
+    func url(forPath path: String) -> URL {
+        return URL(string: "http://127.0.0.1:\(port)/\(path)")!
+    }
+
+    func stop() {
+        shutdown(listeningSocket, SHUT_RDWR)
+        close(listeningSocket)
+    }
+
+    private func serve(_ connection: Int32) {
+        defer {
+            close(connection)
+        }
+        var buffer = Data()
+        var chunk = [UInt8](repeating: 0, count: 4096)
+
+        while true {
+            let headerEnd: Range<Data.Index>
+            if let end = buffer.range(of: Data("\r\n\r\n".utf8)) {
+                headerEnd = end
+            } else {
+                let n = read(connection, &chunk, chunk.count)
+                guard n > 0 else {
+                    return
+                }
+                buffer.append(contentsOf: chunk[0 ..< n])
+                continue
+            }
+
+            let lines = String(decoding: buffer[buffer.startIndex ..< headerEnd.lowerBound], as: UTF8.self).components(separatedBy: "\r\n")
+            buffer.removeSubrange(buffer.startIndex ..< headerEnd.upperBound)
+            let requestLine = lines[0].split(separator: " ")
+            guard requestLine.count >= 2 else {
+                return
+            }
+            let rangeHeader = lines.dropFirst().first { $0.lowercased().hasPrefix("range:") }
+            let path = String(requestLine[1].dropFirst()).removingPercentEncoding ?? ""
+            guard let body = try? Data(contentsOf: directory.appendingPathComponent(path)) else {
+                send("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n", body: Data(), to: connection)
+                continue
+            }
+
+            let specs = (rangeHeader?.split(separator: "=").last?.split(separator: ",") ?? []).map {
+                $0.split(separator: "-", omittingEmptySubsequences: false).map { Int($0.trimmingCharacters(in: .whitespaces)) }
+            }
+            guard supportsRanges, !specs.isEmpty, specs.allSatisfy({ $0.count == 2 && $0[0] != nil }) else {
+                send("HTTP/1.1 200 OK\r\nContent-Length: \(body.count)\r\nAccept-Ranges: bytes\r\n\r\n", body: body, to: connection)
+                continue
+            }
+            guard specs.allSatisfy({ $0[0]! < body.count }) else {
+                send("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */\(body.count)\r\nContent-Length: 0\r\n\r\n", body: Data(), to: connection)
+                continue
+            }
+            let ranges = specs.map { $0[0]! ... min(body.count - 1, $0[1] ?? body.count - 1) }
+            if ranges.count > 1 {
+                guard supportsMultipleRanges else {
+                    send("HTTP/1.1 200 OK\r\nContent-Length: \(body.count)\r\n\r\n", body: body, to: connection)
+                    continue
+                }
+                var multipart = Data()
+                for range in ranges {
+                    multipart += Data("--BOUNDARY\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes \(range.lowerBound)-\(range.upperBound)/\(body.count)\r\n\r\n".utf8)
+                    multipart += body.subdata(in: range.lowerBound ..< (range.upperBound + 1)) + Data("\r\n".utf8)
+                }
+                multipart += Data("--BOUNDARY--\r\n".utf8)
+                send("HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=BOUNDARY\r\nContent-Length: \(multipart.count)\r\n\r\n", body: multipart, to: connection)
+                continue
+            }
+            let first = ranges[0].lowerBound
+            let last = ranges[0].upperBound
+            let part = body.subdata(in: first ..< (last + 1))
+            send("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes \(first)-\(last)/\(body.count)\r\nContent-Length: \(part.count)\r\n\r\n", body: part, to: connection)
+        }
+    }
+
+    private func send(_ header: String, body: Data, to connection: Int32) {
+        let response = Data(header.utf8) + body
+        response.withUnsafeBytes { (buffer: UnsafeRawBufferPointer) in
+            var written = 0
+            while written < buffer.count {
+                let n = write(connection, buffer.baseAddress! + written, buffer.count - written)
+                guard n > 0 else {
+                    return
+                }
+                written += n
+            }
+        }
+    }
+}
+
+/** Writes PNG files from chunk types and data, with an IHDR first and an IEND last. CRCs are left zeroed. */
+private enum PNGFixture {
+    static func chunk(_ type: String, _ data: Data) -> Data {
+        return uint32(data.count, .bigEndian) + Data(type.utf8) + data + uint32(0, .bigEndian)
+    }
+
+    static func png(width: Int, height: Int, chunks: [(String, Data)]) -> Data {
+        var file = Data(PNGStructure.signature)
+        file += chunk("IHDR", uint32(width, .bigEndian) + uint32(height, .bigEndian) + Data([8, 6, 0, 0, 0]))
+        for (type, data) in chunks {
+            file += chunk(type, data)
+        }
+        return file + chunk("IEND", Data())
+    }
 }